@@ -8,7 +8,8 @@ public class ComputeShaders : ModuleRules
 	{
 		PCHUsage = PCHUsageMode.UseExplicitOrSharedPCHs;
 		
-		PublicDependencyModuleNames.AddRange(new[] { "Core", "CoreUObject", "Engine" });
-		PrivateDependencyModuleNames.AddRange(new[] { "RenderCore", "RHI" });
+		// Public headers include RHI.h
+		PublicDependencyModuleNames.AddRange(new[] { "Core", "CoreUObject", "Engine", "RenderCore", "RHI" });
+		PrivateDependencyModuleNames.AddRange(new[] { "Json", "ImageWrapper" });
 	}
 }
@@ -0,0 +1,449 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "CoherentNoise.h"
+
+#include "SIMDHelpers.h"
+#include "Async/ParallelFor.h"
+
+
+// Every function here has a scalar and a 4 wide version that do the same operations in the same order,
+// and both mirror CoherentNoise.ush. Change all three together
+namespace
+{
+	using SIMDHelpers::VectorFloorExact;
+	using SIMDHelpers::VectorSqrtExact;
+
+	// Simplex skew factors, (sqrt(3) - 1) / 2 and (3 - sqrt(3)) / 6
+	const float SimplexF2 = 0.36602540378f;
+	const float SimplexG2 = 0.21132486540f;
+	const float SimplexG2x2 = 0.42264973081f;
+
+	// Scale each basis to roughly [-1, 1]
+	const float PerlinScale = 0.66666667f;
+	const float SimplexScale = 44.f;
+
+	// Exact for any float, FMath::FloorToInt loses precision on large values. Floors -0 to +0 like VectorFloorExact
+	FORCEINLINE int32 FloorToInt(const float X)
+	{
+		return static_cast<int32>(FMath::FloorToFloat(X));
+	}
+
+	FORCEINLINE uint32 Hash2(const int32 X, const int32 Y, const uint32 Seed)
+	{
+		return CoherentNoise::Hash(static_cast<uint32>(X) + CoherentNoise::Hash(static_cast<uint32>(Y) + Seed));
+	}
+
+	FORCEINLINE float Fade(const float T)
+	{
+		return T * T * T * (T * (T * 6.f - 15.f) + 10.f);
+	}
+
+	FORCEINLINE float Lerp(const float A, const float B, const float T)
+	{
+		return A + (B - A) * T;
+	}
+
+	// One of (+-1, +-2), (+-2, +-1), dotted with the offset
+	FORCEINLINE float GradientDot(const uint32 Hash, const float X, const float Y)
+	{
+		const float SignX = static_cast<float>(Hash & 1);
+		const float Long = static_cast<float>((Hash >> 1) & 1);
+		const float SignY = static_cast<float>((Hash >> 2) & 1);
+		return (1.f - 2.f * SignX) * (1.f + Long) * X + (1.f - 2.f * SignY) * (2.f - Long) * Y;
+	}
+
+	float White(const float X, const float Y, const uint32 Seed)
+	{
+		const uint32 Hash = Hash2(FloorToInt(X), FloorToInt(Y), Seed);
+		return static_cast<float>(Hash >> 8) * (1.f / 8388608.f) - 1.f;
+	}
+
+	float Perlin(const float X, const float Y, const uint32 Seed)
+	{
+		const int32 CellX = FloorToInt(X);
+		const int32 CellY = FloorToInt(Y);
+		const float FracX = X - static_cast<float>(CellX);
+		const float FracY = Y - static_cast<float>(CellY);
+
+		const float N00 = GradientDot(Hash2(CellX, CellY, Seed), FracX, FracY);
+		const float N10 = GradientDot(Hash2(CellX + 1, CellY, Seed), FracX - 1.f, FracY);
+		const float N01 = GradientDot(Hash2(CellX, CellY + 1, Seed), FracX, FracY - 1.f);
+		const float N11 = GradientDot(Hash2(CellX + 1, CellY + 1, Seed), FracX - 1.f, FracY - 1.f);
+
+		const float U = Fade(FracX);
+		const float V = Fade(FracY);
+		return Lerp(Lerp(N00, N10, U), Lerp(N01, N11, U), V) * PerlinScale;
+	}
+
+	FORCEINLINE float SimplexCorner(const float X, const float Y, const uint32 Hash)
+	{
+		float T = FMath::Max(0.5f - X * X - Y * Y, 0.f);
+		T *= T;
+		return T * T * GradientDot(Hash, X, Y);
+	}
+
+	float Simplex(const float X, const float Y, const uint32 Seed)
+	{
+		const float Skew = (X + Y) * SimplexF2;
+		const int32 CellX = FloorToInt(X + Skew);
+		const int32 CellY = FloorToInt(Y + Skew);
+		const float I = static_cast<float>(CellX);
+		const float J = static_cast<float>(CellY);
+		const float Unskew = (I + J) * SimplexG2;
+		const float X0 = X - (I - Unskew);
+		const float Y0 = Y - (J - Unskew);
+
+		// Which of the two triangles in the cell
+		const float I1 = X0 > Y0 ? 1.f : 0.f;
+		const float J1 = 1.f - I1;
+
+		const float N0 = SimplexCorner(X0, Y0, Hash2(CellX, CellY, Seed));
+		const float N1 = SimplexCorner(X0 - I1 + SimplexG2, Y0 - J1 + SimplexG2, Hash2(CellX + static_cast<int32>(I1), CellY + static_cast<int32>(J1), Seed));
+		const float N2 = SimplexCorner(X0 - 1.f + SimplexG2x2, Y0 - 1.f + SimplexG2x2, Hash2(CellX + 1, CellY + 1, Seed));
+		return (N0 + N1 + N2) * SimplexScale;
+	}
+
+	float Worley(const float X, const float Y, const uint32 Seed)
+	{
+		const int32 CellX = FloorToInt(X);
+		const int32 CellY = FloorToInt(Y);
+		const float FracX = X - static_cast<float>(CellX);
+		const float FracY = Y - static_cast<float>(CellY);
+
+		float Closest = 8.f;
+		for (int32 OffsetY = -1; OffsetY <= 1; OffsetY++)
+		{
+			for (int32 OffsetX = -1; OffsetX <= 1; OffsetX++)
+			{
+				// Feature point from the low and high halves of the hash
+				const uint32 Hash = Hash2(CellX + OffsetX, CellY + OffsetY, Seed);
+				const float DeltaX = static_cast<float>(OffsetX) + static_cast<float>(Hash & 0xFFFF) * (1.f / 65536.f) - FracX;
+				const float DeltaY = static_cast<float>(OffsetY) + static_cast<float>(Hash >> 16) * (1.f / 65536.f) - FracY;
+				Closest = FMath::Min(Closest, DeltaX * DeltaX + DeltaY * DeltaY);
+			}
+		}
+		return FMath::Sqrt(Closest) * 2.f - 1.f;
+	}
+
+	float Basis(const ECoherentNoiseType Type, const float X, const float Y, const uint32 Seed)
+	{
+		switch (Type)
+		{
+		case ECoherentNoiseType::Perlin:
+			return Perlin(X, Y, Seed);
+		case ECoherentNoiseType::Simplex:
+			return Simplex(X, Y, Seed);
+		case ECoherentNoiseType::Worley:
+			return Worley(X, Y, Seed);
+		default:
+			return White(X, Y, Seed);
+		}
+	}
+
+	// 4 wide versions
+
+	FORCEINLINE VectorRegisterInt VectorIntSetUnsigned(const uint32 Value)
+	{
+		return VectorIntSet1(static_cast<int32>(Value));
+	}
+
+	FORCEINLINE VectorRegisterInt Hash4(const VectorRegisterInt& Value)
+	{
+		VectorRegisterInt State = VectorIntAdd(VectorIntMultiply(Value, VectorIntSetUnsigned(747796405u)), VectorIntSetUnsigned(2891336453u));
+		State = VectorIntXor(State, VectorShiftRightImmLogical(State, 16));
+		State = VectorIntMultiply(State, VectorIntSetUnsigned(0x7feb352du));
+		State = VectorIntXor(State, VectorShiftRightImmLogical(State, 15));
+		State = VectorIntMultiply(State, VectorIntSetUnsigned(0x846ca68bu));
+		return VectorIntXor(State, VectorShiftRightImmLogical(State, 16));
+	}
+
+	FORCEINLINE VectorRegisterInt Hash2x4(const VectorRegisterInt& X, const VectorRegisterInt& Y, const VectorRegisterInt& Seed)
+	{
+		return Hash4(VectorIntAdd(X, Hash4(VectorIntAdd(Y, Seed))));
+	}
+
+	// Low bit of (Hash >> Shift) as 0 or 1
+	FORCEINLINE VectorRegister HashBit4(const VectorRegisterInt& Hash, const int32 Shift)
+	{
+		return VectorIntToFloat(VectorIntAnd(VectorShiftRightImmLogical(Hash, Shift), VectorIntSet1(1)));
+	}
+
+	FORCEINLINE VectorRegister Fade4(const VectorRegister& T)
+	{
+		const VectorRegister Inner = VectorAdd(VectorMultiply(T, VectorSubtract(VectorMultiply(T, VectorSetFloat1(6.f)), VectorSetFloat1(15.f))), VectorSetFloat1(10.f));
+		return VectorMultiply(VectorMultiply(VectorMultiply(T, T), T), Inner);
+	}
+
+	FORCEINLINE VectorRegister Lerp4(const VectorRegister& A, const VectorRegister& B, const VectorRegister& T)
+	{
+		return VectorAdd(A, VectorMultiply(VectorSubtract(B, A), T));
+	}
+
+	FORCEINLINE VectorRegister GradientDot4(const VectorRegisterInt& Hash, const VectorRegister& X, const VectorRegister& Y)
+	{
+		const VectorRegister One = VectorOne();
+		const VectorRegister Two = VectorSetFloat1(2.f);
+		const VectorRegister SignX = HashBit4(Hash, 0);
+		const VectorRegister Long = HashBit4(Hash, 1);
+		const VectorRegister SignY = HashBit4(Hash, 2);
+		const VectorRegister GradientX = VectorMultiply(VectorSubtract(One, VectorMultiply(Two, SignX)), VectorAdd(One, Long));
+		const VectorRegister GradientY = VectorMultiply(VectorSubtract(One, VectorMultiply(Two, SignY)), VectorSubtract(Two, Long));
+		return VectorAdd(VectorMultiply(GradientX, X), VectorMultiply(GradientY, Y));
+	}
+
+	VectorRegister White4(const VectorRegister& X, const VectorRegister& Y, const VectorRegisterInt& Seed)
+	{
+		const VectorRegisterInt Hash = Hash2x4(VectorFloatToInt(VectorFloorExact(X)), VectorFloatToInt(VectorFloorExact(Y)), Seed);
+		return VectorSubtract(VectorMultiply(VectorIntToFloat(VectorShiftRightImmLogical(Hash, 8)), VectorSetFloat1(1.f / 8388608.f)), VectorOne());
+	}
+
+	VectorRegister Perlin4(const VectorRegister& X, const VectorRegister& Y, const VectorRegisterInt& Seed)
+	{
+		const VectorRegister One = VectorOne();
+		const VectorRegisterInt IntOne = VectorIntSet1(1);
+		const VectorRegister FloorX = VectorFloorExact(X);
+		const VectorRegister FloorY = VectorFloorExact(Y);
+		const VectorRegisterInt CellX = VectorFloatToInt(FloorX);
+		const VectorRegisterInt CellY = VectorFloatToInt(FloorY);
+		const VectorRegisterInt CellX1 = VectorIntAdd(CellX, IntOne);
+		const VectorRegisterInt CellY1 = VectorIntAdd(CellY, IntOne);
+		const VectorRegister FracX = VectorSubtract(X, FloorX);
+		const VectorRegister FracY = VectorSubtract(Y, FloorY);
+		const VectorRegister FracX1 = VectorSubtract(FracX, One);
+		const VectorRegister FracY1 = VectorSubtract(FracY, One);
+
+		const VectorRegister N00 = GradientDot4(Hash2x4(CellX, CellY, Seed), FracX, FracY);
+		const VectorRegister N10 = GradientDot4(Hash2x4(CellX1, CellY, Seed), FracX1, FracY);
+		const VectorRegister N01 = GradientDot4(Hash2x4(CellX, CellY1, Seed), FracX, FracY1);
+		const VectorRegister N11 = GradientDot4(Hash2x4(CellX1, CellY1, Seed), FracX1, FracY1);
+
+		const VectorRegister U = Fade4(FracX);
+		const VectorRegister V = Fade4(FracY);
+		return VectorMultiply(Lerp4(Lerp4(N00, N10, U), Lerp4(N01, N11, U), V), VectorSetFloat1(PerlinScale));
+	}
+
+	FORCEINLINE VectorRegister SimplexCorner4(const VectorRegister& X, const VectorRegister& Y, const VectorRegisterInt& Hash)
+	{
+		VectorRegister T = VectorMax(VectorSubtract(VectorSubtract(VectorSetFloat1(0.5f), VectorMultiply(X, X)), VectorMultiply(Y, Y)), VectorZero());
+		T = VectorMultiply(T, T);
+		return VectorMultiply(VectorMultiply(T, T), GradientDot4(Hash, X, Y));
+	}
+
+	VectorRegister Simplex4(const VectorRegister& X, const VectorRegister& Y, const VectorRegisterInt& Seed)
+	{
+		const VectorRegister One = VectorOne();
+		const VectorRegister G2 = VectorSetFloat1(SimplexG2);
+		const VectorRegister G2x2 = VectorSetFloat1(SimplexG2x2);
+
+		const VectorRegister Skew = VectorMultiply(VectorAdd(X, Y), VectorSetFloat1(SimplexF2));
+		const VectorRegister I = VectorFloorExact(VectorAdd(X, Skew));
+		const VectorRegister J = VectorFloorExact(VectorAdd(Y, Skew));
+		const VectorRegisterInt CellX = VectorFloatToInt(I);
+		const VectorRegisterInt CellY = VectorFloatToInt(J);
+		const VectorRegister Unskew = VectorMultiply(VectorAdd(I, J), G2);
+		const VectorRegister X0 = VectorSubtract(X, VectorSubtract(I, Unskew));
+		const VectorRegister Y0 = VectorSubtract(Y, VectorSubtract(J, Unskew));
+
+		const VectorRegister I1 = VectorBitwiseAnd(VectorCompareGT(X0, Y0), One);
+		const VectorRegister J1 = VectorSubtract(One, I1);
+
+		const VectorRegister N0 = SimplexCorner4(X0, Y0, Hash2x4(CellX, CellY, Seed));
+		const VectorRegister N1 = SimplexCorner4(
+			VectorAdd(VectorSubtract(X0, I1), G2),
+			VectorAdd(VectorSubtract(Y0, J1), G2),
+			Hash2x4(VectorIntAdd(CellX, VectorFloatToInt(I1)), VectorIntAdd(CellY, VectorFloatToInt(J1)), Seed)
+		);
+		const VectorRegister N2 = SimplexCorner4(
+			VectorAdd(VectorSubtract(X0, One), G2x2),
+			VectorAdd(VectorSubtract(Y0, One), G2x2),
+			Hash2x4(VectorIntAdd(CellX, VectorIntSet1(1)), VectorIntAdd(CellY, VectorIntSet1(1)), Seed)
+		);
+		return VectorMultiply(VectorAdd(VectorAdd(N0, N1), N2), VectorSetFloat1(SimplexScale));
+	}
+
+	VectorRegister Worley4(const VectorRegister& X, const VectorRegister& Y, const VectorRegisterInt& Seed)
+	{
+		const VectorRegister FloorX = VectorFloorExact(X);
+		const VectorRegister FloorY = VectorFloorExact(Y);
+		const VectorRegisterInt CellX = VectorFloatToInt(FloorX);
+		const VectorRegisterInt CellY = VectorFloatToInt(FloorY);
+		const VectorRegister FracX = VectorSubtract(X, FloorX);
+		const VectorRegister FracY = VectorSubtract(Y, FloorY);
+		const VectorRegister PointScale = VectorSetFloat1(1.f / 65536.f);
+		const VectorRegisterInt LowMask = VectorIntSet1(0xFFFF);
+
+		VectorRegister Closest = VectorSetFloat1(8.f);
+		for (int32 OffsetY = -1; OffsetY <= 1; OffsetY++)
+		{
+			for (int32 OffsetX = -1; OffsetX <= 1; OffsetX++)
+			{
+				const VectorRegisterInt Hash = Hash2x4(VectorIntAdd(CellX, VectorIntSet1(OffsetX)), VectorIntAdd(CellY, VectorIntSet1(OffsetY)), Seed);
+				const VectorRegister PointX = VectorMultiply(VectorIntToFloat(VectorIntAnd(Hash, LowMask)), PointScale);
+				const VectorRegister PointY = VectorMultiply(VectorIntToFloat(VectorShiftRightImmLogical(Hash, 16)), PointScale);
+				const VectorRegister DeltaX = VectorSubtract(VectorAdd(VectorSetFloat1(static_cast<float>(OffsetX)), PointX), FracX);
+				const VectorRegister DeltaY = VectorSubtract(VectorAdd(VectorSetFloat1(static_cast<float>(OffsetY)), PointY), FracY);
+				Closest = VectorMin(Closest, VectorAdd(VectorMultiply(DeltaX, DeltaX), VectorMultiply(DeltaY, DeltaY)));
+			}
+		}
+		return VectorSubtract(VectorMultiply(VectorSqrtExact(Closest), VectorSetFloat1(2.f)), VectorOne());
+	}
+
+	VectorRegister Basis4(const ECoherentNoiseType Type, const VectorRegister& X, const VectorRegister& Y, const VectorRegisterInt& Seed)
+	{
+		switch (Type)
+		{
+		case ECoherentNoiseType::Perlin:
+			return Perlin4(X, Y, Seed);
+		case ECoherentNoiseType::Simplex:
+			return Simplex4(X, Y, Seed);
+		case ECoherentNoiseType::Worley:
+			return Worley4(X, Y, Seed);
+		default:
+			return White4(X, Y, Seed);
+		}
+	}
+
+	// Mirrors EvaluateNoise in CoherentNoise.ush
+	VectorRegister Evaluate4(const FCoherentNoiseSettings& Settings, const uint32 Seed, const VectorRegister& X, const VectorRegister& Y)
+	{
+		const int32 NumOctaves = Settings.GetNumOctaves();
+		const VectorRegister One = VectorOne();
+		const VectorRegister Two = VectorSetFloat1(2.f);
+		float Frequency = Settings.Frequency;
+		float Amplitude = 1.f;
+		float AmplitudeSum = 0.f;
+		VectorRegister Sum = VectorZero();
+		for (int32 Octave = 0; Octave < NumOctaves; Octave++)
+		{
+			const VectorRegister OctaveFrequency = VectorSetFloat1(Frequency);
+			const VectorRegisterInt OctaveSeed = VectorIntSetUnsigned(CoherentNoise::Hash(Seed + Octave));
+			VectorRegister Value = Basis4(Settings.Type, VectorMultiply(X, OctaveFrequency), VectorMultiply(Y, OctaveFrequency), OctaveSeed);
+			if (Settings.Fractal == ECoherentNoiseFractal::Ridged)
+			{
+				Value = VectorSubtract(One, VectorAbs(Value));
+				Value = VectorSubtract(VectorMultiply(VectorMultiply(Value, Value), Two), One);
+			}
+			Sum = VectorAdd(Sum, VectorMultiply(Value, VectorSetFloat1(Amplitude)));
+			AmplitudeSum += Amplitude;
+			Frequency *= Settings.Lacunarity;
+			Amplitude *= Settings.Gain;
+		}
+
+		const VectorRegister Half = VectorSetFloat1(0.5f);
+		const VectorRegister Value = VectorAdd(VectorMultiply(VectorDivide(Sum, VectorSetFloat1(AmplitudeSum)), Half), Half);
+		return VectorMin(VectorMax(Value, VectorZero()), One);
+	}
+}
+
+uint32 CoherentNoise::Hash(const uint32 Value)
+{
+	uint32 State = Value * 747796405u + 2891336453u;
+	State ^= State >> 16;
+	State *= 0x7feb352du;
+	State ^= State >> 15;
+	State *= 0x846ca68bu;
+	return State ^ (State >> 16);
+}
+
+uint32 CoherentNoise::GetSeed(const uint32 Seed, const uint32 TimeStamp)
+{
+	return Hash(Seed ^ Hash(TimeStamp));
+}
+
+EPixelFormat CoherentNoise::GetPixelFormat(const ECoherentNoiseFormat Format)
+{
+	switch (Format)
+	{
+	case ECoherentNoiseFormat::R8:
+		return PF_G8;
+	case ECoherentNoiseFormat::R16F:
+		return PF_R16F;
+	case ECoherentNoiseFormat::R32F:
+		return PF_R32_FLOAT;
+	default:
+		return PF_Unknown;
+	}
+}
+
+float CoherentNoise::GetFormatTolerance(const EPixelFormat Format)
+{
+	switch (Format)
+	{
+	case PF_G8:
+		// Rounded to the nearest of 255 steps
+		return GPUTolerance + 0.5f / 255.f;
+	case PF_R16F:
+		// 11 significant bits, half a step just below 1 is the largest rounding in [0, 1]
+		return GPUTolerance + 1.f / 4096.f;
+	default:
+		return GPUTolerance;
+	}
+}
+
+float CoherentNoise::Evaluate(const FCoherentNoiseSettings& Settings, const uint32 Seed, const FVector2D& Position)
+{
+	const int32 NumOctaves = Settings.GetNumOctaves();
+	float Frequency = Settings.Frequency;
+	float Amplitude = 1.f;
+	float AmplitudeSum = 0.f;
+	float Sum = 0.f;
+	for (int32 Octave = 0; Octave < NumOctaves; Octave++)
+	{
+		float Value = Basis(Settings.Type, Position.X * Frequency, Position.Y * Frequency, Hash(Seed + Octave));
+		if (Settings.Fractal == ECoherentNoiseFractal::Ridged)
+		{
+			Value = 1.f - FMath::Abs(Value);
+			Value = Value * Value * 2.f - 1.f;
+		}
+		Sum += Value * Amplitude;
+		AmplitudeSum += Amplitude;
+		Frequency *= Settings.Lacunarity;
+		Amplitude *= Settings.Gain;
+	}
+
+	return FMath::Min(FMath::Max((Sum / AmplitudeSum) * 0.5f + 0.5f, 0.f), 1.f);
+}
+
+void CoherentNoise::EvaluateBatch(const FCoherentNoiseSettings& Settings, const uint32 Seed, const TArrayView<const FVector2D> Positions, const TArrayView<float> OutValues)
+{
+	check(OutValues.Num() >= Positions.Num());
+
+	const int32 NumPositions = Positions.Num();
+	int32 i = 0;
+	for (; i + 4 <= NumPositions; i += 4)
+	{
+		const VectorRegister X = MakeVectorRegister(Positions[i].X, Positions[i + 1].X, Positions[i + 2].X, Positions[i + 3].X);
+		const VectorRegister Y = MakeVectorRegister(Positions[i].Y, Positions[i + 1].Y, Positions[i + 2].Y, Positions[i + 3].Y);
+		VectorStore(Evaluate4(Settings, Seed, X, Y), &OutValues[i]);
+	}
+	for (; i < NumPositions; i++)
+	{
+		OutValues[i] = Evaluate(Settings, Seed, Positions[i]);
+	}
+}
+
+void CoherentNoise::EvaluateRegion(const FCoherentNoiseSettings& Settings, const uint32 Seed, const FIntPoint& RegionOffset, const FIntPoint& Size, TArray<float>& OutValues)
+{
+	OutValues.SetNumUninitialized(Size.X * Size.Y);
+
+	ParallelFor(Size.Y, [&Settings, Seed, &RegionOffset, &Size, &OutValues](const int32 Row)
+	{
+		const int32 Y = RegionOffset.Y + Row;
+		const VectorRegister PositionY = VectorSetFloat1(GetTexelPosition(0, Y).Y);
+		float* RowValues = &OutValues[Row * Size.X];
+
+		int32 Column = 0;
+		for (; Column + 4 <= Size.X; Column += 4)
+		{
+			const int32 X = RegionOffset.X + Column;
+			const VectorRegister PositionX = MakeVectorRegister(
+				GetTexelPosition(X, Y).X, GetTexelPosition(X + 1, Y).X, GetTexelPosition(X + 2, Y).X, GetTexelPosition(X + 3, Y).X
+			);
+			VectorStore(Evaluate4(Settings, Seed, PositionX, PositionY), RowValues + Column);
+		}
+		for (; Column < Size.X; Column++)
+		{
+			RowValues[Column] = Evaluate(Settings, Seed, GetTexelPosition(RegionOffset.X + Column, Y));
+		}
+	});
+}
@@ -0,0 +1,75 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "ComputePipeline.h"
+
+#include "ComputeShaderStats.h"
+#include "RenderGraphUtils.h"
+#include "ShaderHelpers.h"
+
+
+FComputePipeline& FComputePipeline::AddStage(const TCHAR* Name, FAddStagePasses&& AddPasses, const FIntPoint& Size, const EPixelFormat Format)
+{
+	check(AddPasses);
+	Stages.Add({ Name, MoveTemp(AddPasses), Size, Format });
+	return *this;
+}
+
+void FComputePipeline::AddPasses(FRDGBuilder& GraphBuilder, const FRDGTextureRef Input, const FRDGTextureRef Target) const
+{
+	check(IsInRenderingThread());
+	check(Target && Target != Input);
+
+	if (Stages.Num() == 0)
+	{
+		check(Input);
+		AddCopyTexturePass(GraphBuilder, Input, Target, FRHICopyTextureInfo());
+		return;
+	}
+
+	const bool bWriteTarget = IsUAVCompatible(Target->GetRHI());
+
+	FRDGTextureRef StageInput = Input;
+	FIntPoint Size = Input ? Input->Desc.Extent : Target->Desc.Extent;
+	EPixelFormat Format = Input ? Input->Desc.Format : Target->Desc.Format;
+	for (int32 Index = 0; Index < Stages.Num(); Index++)
+	{
+		const FStage& Stage = Stages[Index];
+		Size = Stage.Size != FIntPoint::ZeroValue ? Stage.Size : Size;
+		Format = Stage.Format != PF_Unknown ? Stage.Format : Format;
+
+		FRDGTextureRef Output;
+		if (Index == Stages.Num() - 1 && bWriteTarget)
+		{
+			checkf(Size == Target->Desc.Extent && Format == Target->Desc.Format, TEXT("The last stage (%s) has to match the target"), Stage.Name);
+			Output = Target;
+		}
+		else
+		{
+			// Only lives until the next stage has read it, the graph reuses the memory after that. Stages write through a
+			// typed UAV, so a format that can't be stored to that way is written as half float and converted at the end
+			const EPixelFormat OutputFormat = IsTypedUAVStoreFormat(Format) ? Format : PF_FloatRGBA;
+			const FRDGTextureDesc Desc = FRDGTextureDesc::Create2D(Size, OutputFormat, FClearValueBinding::Black, TexCreate_ShaderResource | TexCreate_UAV);
+			Output = GraphBuilder.CreateTexture(Desc, Stage.Name);
+			INC_DWORD_STAT_BY(STAT_ComputeShaders_TransientTextureBytes, Size.X * Size.Y * GPixelFormats[OutputFormat].BlockBytes);
+		}
+
+		{
+			RDG_EVENT_SCOPE(GraphBuilder, "%s", Stage.Name);
+			Stage.AddPasses(GraphBuilder, StageInput, Output);
+		}
+		StageInput = Output;
+	}
+
+	if (StageInput != Target)
+	{
+		checkf(Size == Target->Desc.Extent && Format == Target->Desc.Format, TEXT("The last stage (%s) has to match the target"), Stages.Last().Name);
+		if (StageInput->Desc.Format == Target->Desc.Format)
+		{
+			AddCopyTexturePass(GraphBuilder, StageInput, Target, FRHICopyTextureInfo());
+		}
+		else
+		{
+			AddConvertTexturePass(GraphBuilder, StageInput, Target);
+		}
+	}
+}
@@ -0,0 +1,344 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "ComputeReadback.h"
+
+#include "ComputeShaderStats.h"
+#include "RenderGraphUtils.h"
+#include "RHIGPUReadback.h"
+#include "Async/Async.h"
+
+
+DECLARE_CYCLE_STAT(TEXT("ComputeReadback Tick (RT)"), STAT_ComputeReadback_Tick, STATGROUP_ComputeShaders);
+DECLARE_CYCLE_STAT(TEXT("ComputeReadback Enqueue (RT)"), STAT_ComputeReadback_Enqueue, STATGROUP_ComputeShaders);
+DECLARE_GPU_STAT_NAMED(ComputeReadback, TEXT("Compute Readback"));
+
+FComputeReadbackManager* FComputeReadbackManager::Instance = nullptr;
+
+bool FComputeTextureReadbackData::ToLinearColors(TArray<FLinearColor>& OutColors) const
+{
+	const int32 NumPixels = Size.X * Size.Y;
+	if (NumPixels <= 0 || Data.Num() < NumPixels * GPixelFormats[Format].BlockBytes)
+	{
+		return false;
+	}
+
+	OutColors.SetNumUninitialized(NumPixels);
+	switch (Format)
+	{
+	case PF_B8G8R8A8:
+		{
+			const FColor* Pixels = reinterpret_cast<const FColor*>(Data.GetData());
+			for (int32 i = 0; i < NumPixels; i++)
+			{
+				OutColors[i] = Pixels[i].ReinterpretAsLinear();
+			}
+		}
+		return true;
+	case PF_FloatRGBA:
+		{
+			const FFloat16Color* Pixels = reinterpret_cast<const FFloat16Color*>(Data.GetData());
+			for (int32 i = 0; i < NumPixels; i++)
+			{
+				OutColors[i] = FLinearColor(Pixels[i]);
+			}
+		}
+		return true;
+	case PF_A32B32G32R32F:
+		FMemory::Memcpy(OutColors.GetData(), Data.GetData(), NumPixels * sizeof(FLinearColor));
+		return true;
+	case PF_FloatR11G11B10:
+		{
+			// Each channel is a half float without the sign and the low mantissa bits
+			auto UnpackChannel = [](const uint32 Bits, const int32 MantissaShift)
+			{
+				FFloat16 Half;
+				Half.Encoded = static_cast<uint16>(Bits << MantissaShift);
+				return Half.GetFloat();
+			};
+			const uint32* Pixels = reinterpret_cast<const uint32*>(Data.GetData());
+			for (int32 i = 0; i < NumPixels; i++)
+			{
+				const uint32 Packed = Pixels[i];
+				OutColors[i] = FLinearColor(UnpackChannel(Packed & 0x7FF, 4), UnpackChannel((Packed >> 11) & 0x7FF, 4), UnpackChannel(Packed >> 22, 5), 1.f);
+			}
+		}
+		return true;
+	case PF_R32_FLOAT:
+		{
+			const float* Pixels = reinterpret_cast<const float*>(Data.GetData());
+			for (int32 i = 0; i < NumPixels; i++)
+			{
+				OutColors[i] = FLinearColor(Pixels[i], 0.f, 0.f, 1.f);
+			}
+		}
+		return true;
+	case PF_R16F:
+		{
+			const FFloat16* Pixels = reinterpret_cast<const FFloat16*>(Data.GetData());
+			for (int32 i = 0; i < NumPixels; i++)
+			{
+				OutColors[i] = FLinearColor(Pixels[i].GetFloat(), 0.f, 0.f, 1.f);
+			}
+		}
+		return true;
+	case PF_G8:
+		{
+			for (int32 i = 0; i < NumPixels; i++)
+			{
+				OutColors[i] = FLinearColor(Data[i] / 255.f, 0.f, 0.f, 1.f);
+			}
+		}
+		return true;
+	default:
+		OutColors.Reset();
+		return false;
+	}
+}
+
+FComputeReadbackManager& FComputeReadbackManager::Get()
+{
+	check(IsInRenderingThread());
+
+	if (Instance == nullptr)
+	{
+		Instance = new FComputeReadbackManager();
+	}
+	return *Instance;
+}
+
+void FComputeReadbackManager::Shutdown()
+{
+	ENQUEUE_RENDER_COMMAND(ShutdownComputeReadbackManager)([](FRHICommandListImmediate& RHICmdList)
+	{
+		delete Instance;
+		Instance = nullptr;
+	});
+}
+
+FComputeReadbackManager::FComputeReadbackManager():
+	TickHelper(new FRenderTickHelper(false))
+{
+	TickHelper->TickImplementation.BindRaw(this, &FComputeReadbackManager::Tick_RenderThread);
+
+	// Already on the render thread, no need to go through GameThread_Register
+	TickHelper->Register();
+}
+
+FComputeReadbackManager::~FComputeReadbackManager()
+{
+	// Pending readbacks are dropped with us
+	for (const TUniquePtr<FPendingBufferReadback>& Pending : PendingBuffers)
+	{
+		DEC_MEMORY_STAT_BY(STAT_ComputeShaders_ReadbackMemory, Pending->NumBytes);
+	}
+	for (const TUniquePtr<FPendingTextureReadback>& Pending : PendingTextures)
+	{
+		DEC_MEMORY_STAT_BY(STAT_ComputeShaders_ReadbackMemory, Pending->GetNumBytes());
+	}
+
+	TickHelper->TickImplementation.Unbind();
+	TickHelper->Unregister();
+}
+
+TUniquePtr<FRHIGPUBufferReadback> FComputeReadbackManager::AllocateBufferStaging()
+{
+	if (FreeBufferStaging.Num() > 0)
+	{
+		return FreeBufferStaging.Pop(false);
+	}
+	return MakeUnique<FRHIGPUBufferReadback>(TEXT("ComputeBufferReadback"));
+}
+
+TUniquePtr<FRHIGPUTextureReadback> FComputeReadbackManager::AllocateTextureStaging()
+{
+	if (FreeTextureStaging.Num() > 0)
+	{
+		return FreeTextureStaging.Pop(false);
+	}
+	return MakeUnique<FRHIGPUTextureReadback>(TEXT("ComputeTextureReadback"));
+}
+
+BEGIN_SHADER_PARAMETER_STRUCT(FAsyncReadbackBufferParameters, )
+	RDG_BUFFER_ACCESS(Buffer, ERHIAccess::CopySrc)
+END_SHADER_PARAMETER_STRUCT()
+
+BEGIN_SHADER_PARAMETER_STRUCT(FAsyncReadbackTextureParameters, )
+	RDG_TEXTURE_ACCESS(Texture, ERHIAccess::CopySrc)
+END_SHADER_PARAMETER_STRUCT()
+
+TFuture<TArray<uint8>> FComputeReadbackManager::EnqueueBufferReadback(FRDGBuilder& GraphBuilder, const FRDGBufferRef Buffer, const uint32 NumBytes)
+{
+	TSharedRef<TPromise<TArray<uint8>>, ESPMode::ThreadSafe> Promise = MakeShared<TPromise<TArray<uint8>>, ESPMode::ThreadSafe>();
+	TFuture<TArray<uint8>> Future = Promise->GetFuture();
+
+	EnqueueBufferReadback(GraphBuilder, Buffer, NumBytes, [Promise](TArray<uint8>&& Data)
+	{
+		Promise->SetValue(MoveTemp(Data));
+	});
+	return Future;
+}
+
+void FComputeReadbackManager::EnqueueBufferReadback(FRDGBuilder& GraphBuilder, const FRDGBufferRef Buffer, uint32 NumBytes, FBufferReadbackCallback&& OnComplete)
+{
+	check(IsInRenderingThread());
+	check(Buffer);
+	SCOPE_CYCLE_COUNTER(STAT_ComputeReadback_Enqueue);
+	RDG_GPU_STAT_SCOPE(GraphBuilder, ComputeReadback);
+
+	if (NumBytes == 0)
+	{
+		NumBytes = Buffer->Desc.GetTotalNumBytes();
+	}
+
+	TUniquePtr<FPendingBufferReadback> Pending = MakeUnique<FPendingBufferReadback>();
+	Pending->Staging = AllocateBufferStaging();
+	Pending->NumBytes = NumBytes;
+	Pending->OnComplete = MoveTemp(OnComplete);
+	INC_MEMORY_STAT_BY(STAT_ComputeShaders_ReadbackMemory, NumBytes);
+
+	FAsyncReadbackBufferParameters* PassParameters = GraphBuilder.AllocParameters<FAsyncReadbackBufferParameters>();
+	PassParameters->Buffer = Buffer;
+
+	// The pending entry outlives the graph, it's only released once the copy has completed
+	FPendingBufferReadback* PendingPtr = Pending.Get();
+	GraphBuilder.AddPass(
+		RDG_EVENT_NAME("AsyncBufferReadback(%s)", Buffer->Name),
+		PassParameters,
+		ERDGPassFlags::Readback,
+	[PendingPtr, Buffer](FRHICommandListImmediate& RHICmdList)
+	{
+		// Only queues a copy into the staging buffer, nothing waits on the GPU here
+		PendingPtr->Staging->EnqueueCopy(RHICmdList, Buffer->GetRHIVertexBuffer(), PendingPtr->NumBytes);
+		PendingPtr->bCopyQueued = true;
+	});
+
+	PendingBuffers.Add(MoveTemp(Pending));
+}
+
+TFuture<FComputeTextureReadbackData> FComputeReadbackManager::EnqueueTextureReadback(FRDGBuilder& GraphBuilder, const FRDGTextureRef Texture)
+{
+	TSharedRef<TPromise<FComputeTextureReadbackData>, ESPMode::ThreadSafe> Promise = MakeShared<TPromise<FComputeTextureReadbackData>, ESPMode::ThreadSafe>();
+	TFuture<FComputeTextureReadbackData> Future = Promise->GetFuture();
+
+	EnqueueTextureReadback(GraphBuilder, Texture, [Promise](FComputeTextureReadbackData&& Data)
+	{
+		Promise->SetValue(MoveTemp(Data));
+	});
+	return Future;
+}
+
+void FComputeReadbackManager::EnqueueTextureReadback(FRDGBuilder& GraphBuilder, const FRDGTextureRef Texture, FTextureReadbackCallback&& OnComplete)
+{
+	check(IsInRenderingThread());
+	check(Texture);
+	SCOPE_CYCLE_COUNTER(STAT_ComputeReadback_Enqueue);
+	RDG_GPU_STAT_SCOPE(GraphBuilder, ComputeReadback);
+
+	TUniquePtr<FPendingTextureReadback> Pending = MakeUnique<FPendingTextureReadback>();
+	Pending->Staging = AllocateTextureStaging();
+	Pending->Size = Texture->Desc.Extent;
+	Pending->Format = Texture->Desc.Format;
+	Pending->OnComplete = MoveTemp(OnComplete);
+	INC_MEMORY_STAT_BY(STAT_ComputeShaders_ReadbackMemory, Pending->GetNumBytes());
+
+	FAsyncReadbackTextureParameters* PassParameters = GraphBuilder.AllocParameters<FAsyncReadbackTextureParameters>();
+	PassParameters->Texture = Texture;
+
+	FPendingTextureReadback* PendingPtr = Pending.Get();
+	GraphBuilder.AddPass(
+		RDG_EVENT_NAME("AsyncTextureReadback(%s)", Texture->Name),
+		PassParameters,
+		ERDGPassFlags::Readback,
+	[PendingPtr, Texture](FRHICommandListImmediate& RHICmdList)
+	{
+		PendingPtr->Staging->EnqueueCopy(RHICmdList, Texture->GetRHI(), FResolveRect(0, 0, PendingPtr->Size.X, PendingPtr->Size.Y));
+		PendingPtr->bCopyQueued = true;
+	});
+
+	PendingTextures.Add(MoveTemp(Pending));
+}
+
+void FComputeReadbackManager::Tick_RenderThread(FRHICommandListImmediate& RHICmdList)
+{
+	check(IsInRenderingThread());
+	SCOPE_CYCLE_COUNTER(STAT_ComputeReadback_Tick);
+	CSV_SCOPED_TIMING_STAT(ComputeShaders, ComputeReadbackTick);
+
+	// Buffers
+	for (int32 Index = 0; Index < PendingBuffers.Num();)
+	{
+		FPendingBufferReadback& Pending = *PendingBuffers[Index];
+		if (!Pending.bCopyQueued || !Pending.Staging->IsReady())
+		{
+			Index++;
+			continue;
+		}
+
+		TArray<uint8> Data;
+		Data.SetNumUninitialized(Pending.NumBytes);
+		const void* SrcPtr = Pending.Staging->Lock(Pending.NumBytes);
+		FMemory::Memcpy(Data.GetData(), SrcPtr, Pending.NumBytes);
+		Pending.Staging->Unlock();
+		DEC_MEMORY_STAT_BY(STAT_ComputeShaders_ReadbackMemory, Pending.NumBytes);
+
+		AsyncTask(ENamedThreads::GameThread, [OnComplete = MoveTemp(Pending.OnComplete), Data = MoveTemp(Data)]() mutable
+		{
+			OnComplete(MoveTemp(Data));
+		});
+
+		if (FreeBufferStaging.Num() < MaxRetainedStaging)
+		{
+			FreeBufferStaging.Add(MoveTemp(Pending.Staging));
+		}
+		PendingBuffers.RemoveAt(Index, 1, false);
+	}
+
+	// Textures
+	for (int32 Index = 0; Index < PendingTextures.Num();)
+	{
+		FPendingTextureReadback& Pending = *PendingTextures[Index];
+		if (!Pending.bCopyQueued || !Pending.Staging->IsReady())
+		{
+			Index++;
+			continue;
+		}
+
+		FComputeTextureReadbackData Result;
+		Result.Size = Pending.Size;
+		Result.Format = Pending.Format;
+
+		// Staging rows can be padded, copy them out tightly packed
+		const int32 BytesPerPixel = GPixelFormats[Pending.Format].BlockBytes;
+		const int32 RowBytes = Pending.Size.X * BytesPerPixel;
+		Result.Data.SetNumUninitialized(RowBytes * Pending.Size.Y);
+
+		void* SrcPtr = nullptr;
+		int32 RowPitchInPixels = 0;
+		Pending.Staging->LockTexture(RHICmdList, SrcPtr, RowPitchInPixels);
+		if (SrcPtr)
+		{
+			const int32 SrcPitchBytes = FMath::Max(RowPitchInPixels, Pending.Size.X) * BytesPerPixel;
+			for (int32 Row = 0; Row < Pending.Size.Y; Row++)
+			{
+				FMemory::Memcpy(Result.Data.GetData() + Row * RowBytes, static_cast<const uint8*>(SrcPtr) + Row * SrcPitchBytes, RowBytes);
+			}
+		}
+		else
+		{
+			Result.Data.Reset();
+		}
+		Pending.Staging->Unlock();
+		DEC_MEMORY_STAT_BY(STAT_ComputeShaders_ReadbackMemory, Pending.GetNumBytes());
+
+		AsyncTask(ENamedThreads::GameThread, [OnComplete = MoveTemp(Pending.OnComplete), Result = MoveTemp(Result)]() mutable
+		{
+			OnComplete(MoveTemp(Result));
+		});
+
+		if (FreeTextureStaging.Num() < MaxRetainedStaging)
+		{
+			FreeTextureStaging.Add(MoveTemp(Pending.Staging));
+		}
+		PendingTextures.RemoveAt(Index, 1, false);
+	}
+}
@@ -0,0 +1,361 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "ComputeScheduler.h"
+
+#include "RenderGraphBuilder.h"
+#include "HAL/IConsoleManager.h"
+
+
+static TAutoConsoleVariable<float> CVarComputeSchedulerBudgetMs(
+	TEXT("ComputeScheduler.BudgetMs"),
+	4.f,
+	TEXT("Estimated GPU milliseconds of compute jobs per frame, lower priority jobs are deferred past it. 0 for no budget."),
+	ECVF_RenderThreadSafe
+);
+
+static TAutoConsoleVariable<int32> CVarComputeSchedulerMaxDeferredFrames(
+	TEXT("ComputeScheduler.MaxDeferredFrames"),
+	8,
+	TEXT("Frames in a row a job can be deferred before it runs regardless of the budget."),
+	ECVF_RenderThreadSafe
+);
+
+DECLARE_CYCLE_STAT(TEXT("ComputeScheduler Tick (RT)"), STAT_ComputeScheduler_Tick, STATGROUP_ComputeShaders);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Compute Jobs Run"), STAT_ComputeScheduler_JobsRun, STATGROUP_ComputeShaders);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Compute Jobs Deferred"), STAT_ComputeScheduler_JobsDeferred, STATGROUP_ComputeShaders);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Compute Jobs Skipped (Unchanged)"), STAT_ComputeScheduler_JobsSkipped, STATGROUP_ComputeShaders);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("Compute Scheduled GPU Ms"), STAT_ComputeScheduler_ScheduledMs, STATGROUP_ComputeShaders);
+
+namespace
+{
+	// How far each measurement moves the learned cost, smooths out frame to frame noise
+	const float CostLearningRate = 0.25f;
+
+	// Frame times jitter, without some slack a job at half the frame rate would keep slipping a frame
+	const double RateSlackSeconds = 0.001;
+
+	void AddTimestampPass(FRDGBuilder& GraphBuilder, FRenderQueryRHIRef Query)
+	{
+		GraphBuilder.AddPass(RDG_EVENT_NAME("ComputeSchedulerTimestamp"), ERDGPassFlags::Compute | ERDGPassFlags::NeverCull, [Query](FRHICommandListImmediate& RHICmdList)
+		{
+			RHICmdList.EndRenderQuery(Query);
+		});
+	}
+}
+
+FComputeScheduler* FComputeScheduler::Instance = nullptr;
+
+FComputeScheduler& FComputeScheduler::Get()
+{
+	check(IsInRenderingThread());
+
+	if (Instance == nullptr)
+	{
+		Instance = new FComputeScheduler();
+	}
+	return *Instance;
+}
+
+void FComputeScheduler::Shutdown()
+{
+	ENQUEUE_RENDER_COMMAND(ShutdownComputeScheduler)([](FRHICommandListImmediate& RHICmdList)
+	{
+		delete Instance;
+		Instance = nullptr;
+	});
+}
+
+FComputeScheduler::FComputeScheduler():
+	TickHelper(new FRenderTickHelper(false))
+{
+	TickHelper->TickImplementation.BindRaw(this, &FComputeScheduler::Tick_RenderThread);
+
+	// Already on the render thread
+	TickHelper->Register();
+}
+
+FComputeScheduler::~FComputeScheduler()
+{
+	TickHelper->TickImplementation.Unbind();
+	TickHelper->Unregister();
+}
+
+FComputeJobHandle FComputeScheduler::RegisterJob(FComputeJob&& Job)
+{
+	check(IsInRenderingThread());
+	check(Job.Prepare && Job.AddPasses);
+
+	FComputeJobHandle Handle;
+	Handle.Id = NextJobId++;
+
+	FJobState& State = Jobs.Add(Handle.Id);
+	State.CostMs = Job.Desc.EstimatedCostMs;
+	State.Job = MoveTemp(Job);
+	return Handle;
+}
+
+void FComputeScheduler::UnregisterJob(FComputeJobHandle& Handle)
+{
+	check(IsInRenderingThread());
+
+	if (Instance && Handle.IsValid())
+	{
+		// Queries still in flight are dropped when they come back
+		Instance->Jobs.Remove(Handle.Id);
+	}
+	Handle = FComputeJobHandle();
+}
+
+void FComputeScheduler::SetPriority(const FComputeJobHandle Handle, const EComputeJobPriority Priority, const float TargetRate)
+{
+	check(IsInRenderingThread());
+
+	if (FJobState* State = Jobs.Find(Handle.Id))
+	{
+		State->Job.Desc.Priority = Priority;
+		State->Job.Desc.TargetRate = TargetRate;
+	}
+}
+
+void FComputeScheduler::LogJobs() const
+{
+	print("ComputeScheduler: %d jobs, budget %.2fms", Jobs.Num(), CVarComputeSchedulerBudgetMs.GetValueOnRenderThread())
+	for (const TPair<uint32, FJobState>& Pair : Jobs)
+	{
+		const FJobState& State = Pair.Value;
+		const FComputeJobDesc& Desc = State.Job.Desc;
+		print("  %s: %s, %.1f/s, %.3fms (%s), %lld runs, %lld deferred, %lld skipped",
+			*Desc.Name.ToString(),
+			*StaticEnum<EComputeJobPriority>()->GetNameStringByValue(static_cast<int64>(Desc.Priority)),
+			Desc.TargetRate,
+			State.CostMs,
+			State.bCostMeasured ? TEXT("measured") : TEXT("estimated"),
+			State.NumRuns,
+			State.NumDeferred,
+			State.NumSkipped)
+	}
+}
+
+void FComputeScheduler::Tick_RenderThread(FRHICommandListImmediate& RHICmdList)
+{
+	check(IsInRenderingThread());
+	SCOPE_CYCLE_COUNTER(STAT_ComputeScheduler_Tick);
+	CSV_SCOPED_TIMING_STAT(ComputeShaders, ComputeSchedulerTick);
+
+	PollQueries();
+
+	const double Now = FPlatformTime::Seconds();
+	const int32 MaxDeferredFrames = FMath::Max(CVarComputeSchedulerMaxDeferredFrames.GetValueOnRenderThread(), 0);
+
+	struct FCandidate
+	{
+		uint32 JobId;
+		FJobState* State;
+		uint32 InputHash;
+		EComputeJobPriority Priority;
+	};
+
+	// Jobs that are due and have something new to render
+	TArray<FCandidate, TInlineAllocator<16>> Candidates;
+	int32 NumSkipped = 0;
+	for (TPair<uint32, FJobState>& Pair : Jobs)
+	{
+		FJobState& State = Pair.Value;
+		if (Now + RateSlackSeconds < State.NextRunTime)
+		{
+			continue;
+		}
+
+		uint32 InputHash = 0;
+		if (!State.Job.Prepare(InputHash))
+		{
+			continue;
+		}
+		if (State.bHasRun && InputHash == State.LastInputHash)
+		{
+			// The output from the last run is still valid
+			State.NumSkipped++;
+			NumSkipped++;
+			continue;
+		}
+
+		// Deferred for too long, stop it from starving
+		const EComputeJobPriority Priority = State.NumDeferredFrames >= MaxDeferredFrames ? EComputeJobPriority::Critical : State.Job.Desc.Priority;
+		Candidates.Add({ Pair.Key, &State, InputHash, Priority });
+	}
+	INC_DWORD_STAT_BY(STAT_ComputeScheduler_JobsSkipped, NumSkipped);
+
+	if (Candidates.Num() == 0)
+	{
+		return;
+	}
+
+	// Highest priority first, then whichever has waited longest
+	Candidates.Sort([](const FCandidate& A, const FCandidate& B)
+	{
+		if (A.Priority != B.Priority)
+		{
+			return A.Priority > B.Priority;
+		}
+		return A.State->NumDeferredFrames > B.State->NumDeferredFrames;
+	});
+
+	// Pack under the budget. The first job always runs, however expensive it is
+	const float BudgetMs = CVarComputeSchedulerBudgetMs.GetValueOnRenderThread();
+	float ScheduledMs = 0.f;
+	int32 NumToRun = 0;
+	int32 NumDeferred = 0;
+	for (FCandidate& Candidate : Candidates)
+	{
+		FJobState& State = *Candidate.State;
+		const bool bFits = BudgetMs <= 0.f || ScheduledMs + State.CostMs <= BudgetMs;
+		if (bFits || NumToRun == 0 || Candidate.Priority == EComputeJobPriority::Critical)
+		{
+			ScheduledMs += State.CostMs;
+			Candidates[NumToRun++] = Candidate;
+		}
+		else
+		{
+			State.NumDeferredFrames++;
+			State.NumDeferred++;
+			NumDeferred++;
+		}
+	}
+	Candidates.SetNum(NumToRun, false);
+
+	INC_DWORD_STAT_BY(STAT_ComputeScheduler_JobsRun, NumToRun);
+	INC_DWORD_STAT_BY(STAT_ComputeScheduler_JobsDeferred, NumDeferred);
+	INC_FLOAT_STAT_BY(STAT_ComputeScheduler_ScheduledMs, ScheduledMs);
+
+	// One graph for every job
+	const uint32 FrameNumber = GFrameNumberRenderThread;
+	const bool bTimestamps = GSupportsTimestampRenderQueries && !GUsingNullRHI;
+	TArray<double, TInlineAllocator<16>> RenderThreadMs;
+	{
+		FRDGBuilder GraphBuilder(RHICmdList);
+		RDG_EVENT_SCOPE(GraphBuilder, "ComputeScheduler");
+
+		for (const FCandidate& Candidate : Candidates)
+		{
+			FJobState& State = *Candidate.State;
+			const double StartTime = FPlatformTime::Seconds();
+
+			// Timestamps around the job's passes, the graph runs them in order
+			FPendingQuery Query = { Candidate.JobId, FrameNumber };
+			const bool bTimed = bTimestamps && State.NumQueriesInFlight < MaxQueriesInFlight;
+			if (bTimed)
+			{
+				if (State.FreeQueries.Num() > 0)
+				{
+					Query.Queries = State.FreeQueries.Pop(false);
+				}
+				else
+				{
+					Query.Queries.Start = RHICreateRenderQuery(RQT_AbsoluteTime);
+					Query.Queries.End = RHICreateRenderQuery(RQT_AbsoluteTime);
+				}
+				State.NumQueriesInFlight++;
+				AddTimestampPass(GraphBuilder, Query.Queries.Start);
+			}
+
+			State.Job.AddPasses(GraphBuilder);
+
+			if (bTimed)
+			{
+				AddTimestampPass(GraphBuilder, Query.Queries.End);
+				PendingQueries.Add(MoveTemp(Query));
+			}
+			RenderThreadMs.Add((FPlatformTime::Seconds() - StartTime) * 1000.0);
+
+			State.bHasRun = true;
+			State.LastInputHash = Candidate.InputHash;
+			State.NumDeferredFrames = 0;
+			State.NumRuns++;
+
+			// Keep to the rate on average, but don't try to catch up after being deferred
+			const float TargetRate = State.Job.Desc.TargetRate;
+			if (TargetRate > 0.f)
+			{
+				const double Interval = 1.0 / TargetRate;
+				State.NextRunTime = State.NextRunTime + Interval > Now ? State.NextRunTime + Interval : Now + Interval;
+			}
+		}
+
+		GraphBuilder.Execute();
+	}
+
+	for (int32 Index = 0; Index < Candidates.Num(); Index++)
+	{
+		FJobState& State = *Candidates[Index].State;
+		const double StartTime = FPlatformTime::Seconds();
+		if (State.Job.PostExecute)
+		{
+			State.Job.PostExecute();
+		}
+
+		if (State.Job.Desc.Timings)
+		{
+			State.Job.Desc.Timings->RecordRenderThread(FrameNumber, RenderThreadMs[Index] + (FPlatformTime::Seconds() - StartTime) * 1000.0);
+		}
+	}
+}
+
+void FComputeScheduler::PollQueries()
+{
+	// Oldest first, stop at the first one that isn't ready so they are picked up in order
+	int32 NumCompleted = 0;
+	for (FPendingQuery& Pending : PendingQueries)
+	{
+		uint64 StartMicroseconds = 0;
+		uint64 EndMicroseconds = 0;
+		if (!RHIGetRenderQueryResult(Pending.Queries.Start, StartMicroseconds, false) || !RHIGetRenderQueryResult(Pending.Queries.End, EndMicroseconds, false))
+		{
+			break;
+		}
+		NumCompleted++;
+
+		FJobState* State = Jobs.Find(Pending.JobId);
+		if (State == nullptr)
+		{
+			continue;
+		}
+		State->NumQueriesInFlight--;
+		State->FreeQueries.Add(MoveTemp(Pending.Queries));
+
+		const float MeasuredMs = (EndMicroseconds - StartMicroseconds) / 1000.f;
+		State->CostMs = State->bCostMeasured ? FMath::Lerp(State->CostMs, MeasuredMs, CostLearningRate) : MeasuredMs;
+		State->bCostMeasured = true;
+
+		if (State->Job.Desc.Timings)
+		{
+			State->Job.Desc.Timings->RecordGPU(Pending.FrameNumber, MeasuredMs);
+		}
+	}
+	PendingQueries.RemoveAt(0, NumCompleted, false);
+
+	// Queries that never complete (e.g. device lost) shouldn't pile up, or stop their jobs from being timed
+	if (PendingQueries.Num() > FComputeShaderTimingHistory::MaxFrames)
+	{
+		const int32 NumDropped = PendingQueries.Num() - FComputeShaderTimingHistory::MaxFrames;
+		for (int32 Index = 0; Index < NumDropped; Index++)
+		{
+			if (FJobState* State = Jobs.Find(PendingQueries[Index].JobId))
+			{
+				State->NumQueriesInFlight--;
+			}
+		}
+		PendingQueries.RemoveAt(0, NumDropped, false);
+	}
+}
+
+static FAutoConsoleCommand GComputeSchedulerListCommand(
+	TEXT("ComputeScheduler.List"),
+	TEXT("Logs every compute job with its priority, rate, learned cost and how often it was run, deferred and skipped."),
+	FConsoleCommandDelegate::CreateLambda([]()
+	{
+		ENQUEUE_RENDER_COMMAND(ComputeSchedulerList)([](FRHICommandListImmediate& RHICmdList)
+		{
+			FComputeScheduler::Get().LogJobs();
+		});
+	})
+);
@@ -0,0 +1,74 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "ComputeShaderStats.h"
+
+DEFINE_STAT(STAT_ComputeShaders_PersistentMemory);
+DEFINE_STAT(STAT_ComputeShaders_ReadbackMemory);
+DEFINE_STAT(STAT_ComputeShaders_TransientTextureBytes);
+DEFINE_STAT(STAT_ComputeShaders_TransientBufferBytes);
+DEFINE_STAT(STAT_ComputeShaders_CompactFormatBytesSaved);
+DEFINE_STAT(STAT_ComputeShaders_CompactFormatMemorySaved);
+
+CSV_DEFINE_CATEGORY_MODULE(COMPUTESHADERS_API, ComputeShaders, true);
+
+void RecordCompactFormatBytesSaved(const int64 Bytes)
+{
+	if (Bytes > 0)
+	{
+		INC_DWORD_STAT_BY(STAT_ComputeShaders_CompactFormatBytesSaved, static_cast<uint32>(FMath::Min<int64>(Bytes, MAX_uint32)));
+		CSV_CUSTOM_STAT(ComputeShaders, CompactFormatSavedKB, Bytes / 1024.f, ECsvCustomStatOp::Accumulate);
+	}
+}
+
+void RecordCompactFormatWrite(const int64 NumTexels, const EPixelFormat Format, const EPixelFormat FullFormat)
+{
+	const int32 SavedBytesPerTexel = GPixelFormats[FullFormat].BlockBytes - GPixelFormats[Format].BlockBytes;
+	if (SavedBytesPerTexel > 0)
+	{
+		RecordCompactFormatBytesSaved(NumTexels * SavedBytesPerTexel);
+	}
+}
+
+void FComputeShaderTimingHistory::RecordGameThread(const uint32 FrameNumber, const float Milliseconds)
+{
+	FScopeLock Lock(&CriticalSection);
+	FindOrAddFrame(FrameNumber).GameThreadMs = Milliseconds;
+}
+
+void FComputeShaderTimingHistory::RecordRenderThread(const uint32 FrameNumber, const float Milliseconds)
+{
+	FScopeLock Lock(&CriticalSection);
+	FindOrAddFrame(FrameNumber).RenderThreadMs = Milliseconds;
+}
+
+void FComputeShaderTimingHistory::RecordGPU(const uint32 FrameNumber, const float Milliseconds)
+{
+	FScopeLock Lock(&CriticalSection);
+	FindOrAddFrame(FrameNumber).GPUMs = Milliseconds;
+}
+
+TArray<FComputeShaderFrameTiming> FComputeShaderTimingHistory::GetTimings() const
+{
+	FScopeLock Lock(&CriticalSection);
+	return Frames;
+}
+
+FComputeShaderFrameTiming& FComputeShaderTimingHistory::FindOrAddFrame(const uint32 FrameNumber)
+{
+	// Recent frames are at the end
+	for (int32 Index = Frames.Num() - 1; Index >= 0; Index--)
+	{
+		if (Frames[Index].FrameNumber == static_cast<int32>(FrameNumber))
+		{
+			return Frames[Index];
+		}
+	}
+
+	if (Frames.Num() >= MaxFrames)
+	{
+		Frames.RemoveAt(0, 1, false);
+	}
+	FComputeShaderFrameTiming& Frame = Frames.AddDefaulted_GetRef();
+	Frame.FrameNumber = static_cast<int32>(FrameNumber);
+	return Frame;
+}
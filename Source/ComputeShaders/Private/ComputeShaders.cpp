@@ -1,6 +1,10 @@
 // Copyright Ben Sutherland 2021. All rights reserved.
 
 #include "ComputeShaders.h"
+#include "ComputeReadback.h"
+#include "ComputeScheduler.h"
+#include "NoiseBatchService.h"
+#include "NoiseTileCache.h"
 #include "Modules/ModuleManager.h"
 #include "ShaderCore.h"
 
@@ -17,6 +21,11 @@ void FComputeShadersModule::StartupModule()
 
 void FComputeShadersModule::ShutdownModule()
 {
+	FComputeReadbackManager::Shutdown();
+	FNoiseBatchService::Shutdown();
+	FNoiseTileCache::Shutdown();
+	// After everything that registers jobs
+	FComputeScheduler::Shutdown();
 }
 
 IMPLEMENT_GAME_MODULE(FComputeShadersModule, ComputeShaders);
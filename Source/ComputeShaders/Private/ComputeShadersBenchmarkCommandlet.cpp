@@ -0,0 +1,892 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "ComputeShadersBenchmarkCommandlet.h"
+
+#include "CoherentNoise.h"
+#include "ComputeShaders.h"
+#include "ComputeShadersCommandletUtils.h"
+#include "NoiseTileCache.h"
+#include "RayTracingCPU.h"
+#include "RayTracingCS.h"
+#include "RayTracingGPU.h"
+#include "RayTracingManager.h"
+#include "RayTracingMeshBVH.h"
+#include "RayTracingSIMD.h"
+#include "RenderingThread.h"
+#include "WhiteNoiseCS.h"
+#include "Async/ParallelFor.h"
+#include "Camera/CameraTypes.h"
+#include "Dom/JsonObject.h"
+#include "Engine/Texture2D.h"
+#include "Engine/TextureRenderTarget2D.h"
+#include "HAL/FileManager.h"
+#include "Math/RandomStream.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Serialization/JsonSerializer.h"
+
+
+using namespace ComputeShadersCommandletUtils;
+
+namespace
+{
+	struct FBenchmarkSettings
+	{
+		TArray<int32> Resolutions = { 256, 512 };
+		TArray<int32> SphereCounts = { 64, 1024 };
+		TArray<int32> AASamples = { 1, 4 };
+		TArray<int32> Bounces = { 2, 8 };
+		TArray<int32> NoiseResolutions = { 256, 1024 };
+		TArray<int32> InstanceCounts = { 1, 16 };
+		TArray<int32> TriangleCounts = { 4096, 65536 };
+		// Same noise for every noise workload
+		FCoherentNoiseSettings Noise;
+		// Render target formats, and whether the sphere BVH is uploaded packed
+		EPixelFormat NoiseFormat = PF_R32_FLOAT;
+		EPixelFormat RayTracingFormat = PF_FloatRGBA;
+		bool bPackedScene = false;
+		int32 NumWarmup = 2;
+		int32 NumReps = 5;
+		bool bRayTracing = true;
+		bool bNoise = true;
+		bool bMesh = true;
+		bool bCPU = true;
+		bool bGPU = true;
+		FString OutputDir;
+	};
+
+	// Repetitions of one measurement
+	struct FBenchmarkMetric
+	{
+		FString Name;
+		TArray<double> Values;
+
+		double GetMean() const
+		{
+			double Sum = 0.0;
+			for (const double Value : Values)
+			{
+				Sum += Value;
+			}
+			return Values.Num() > 0 ? Sum / Values.Num() : 0.0;
+		}
+
+		double GetStdDev() const
+		{
+			const double Mean = GetMean();
+			double SumSq = 0.0;
+			for (const double Value : Values)
+			{
+				SumSq += FMath::Square(Value - Mean);
+			}
+			return Values.Num() > 1 ? FMath::Sqrt(SumSq / (Values.Num() - 1)) : 0.0;
+		}
+
+		double GetMedian() const
+		{
+			if (Values.Num() == 0)
+			{
+				return 0.0;
+			}
+			TArray<double> Sorted = Values;
+			Sorted.Sort();
+			const int32 Mid = Sorted.Num() / 2;
+			return Sorted.Num() % 2 ? Sorted[Mid] : 0.5 * (Sorted[Mid - 1] + Sorted[Mid]);
+		}
+
+		double GetMin() const { return Values.Num() > 0 ? FMath::Min(Values) : 0.0; }
+		double GetMax() const { return Values.Num() > 0 ? FMath::Max(Values) : 0.0; }
+	};
+
+	struct FBenchmarkResult
+	{
+		FString Workload;
+		// Same keys for every workload so the CSV has fixed columns, -1 when it doesn't apply
+		int32 Resolution = -1;
+		int32 Spheres = -1;
+		int32 AASamples = -1;
+		int32 Bounces = -1;
+		int32 Instances = -1;
+		int32 Triangles = -1;
+		TArray<FBenchmarkMetric> Metrics;
+
+		FBenchmarkMetric& GetMetric(const TCHAR* Name)
+		{
+			for (FBenchmarkMetric& Metric : Metrics)
+			{
+				if (Metric.Name == Name)
+				{
+					return Metric;
+				}
+			}
+			FBenchmarkMetric& Metric = Metrics.AddDefaulted_GetRef();
+			Metric.Name = Name;
+			return Metric;
+		}
+	};
+
+	TArray<int32> ParseIntList(const FString& Params, const TCHAR* Key, const TArray<int32>& Default)
+	{
+		FString Value;
+		if (!FParse::Value(*Params, Key, Value, false))
+		{
+			return Default;
+		}
+
+		TArray<FString> Parts;
+		Value.ParseIntoArray(Parts, TEXT(","));
+		TArray<int32> Result;
+		for (const FString& Part : Parts)
+		{
+			Result.Add(FMath::Max(1, FCString::Atoi(*Part)));
+		}
+		return Result.Num() > 0 ? Result : Default;
+	}
+
+	FBenchmarkSettings ParseSettings(const FString& Params)
+	{
+		FBenchmarkSettings Settings;
+		Settings.Resolutions = ParseIntList(Params, TEXT("Resolutions="), Settings.Resolutions);
+		Settings.SphereCounts = ParseIntList(Params, TEXT("Spheres="), Settings.SphereCounts);
+		Settings.AASamples = ParseIntList(Params, TEXT("AASamples="), Settings.AASamples);
+		Settings.Bounces = ParseIntList(Params, TEXT("Bounces="), Settings.Bounces);
+		Settings.NoiseResolutions = ParseIntList(Params, TEXT("NoiseResolutions="), Settings.NoiseResolutions);
+		Settings.InstanceCounts = ParseIntList(Params, TEXT("Instances="), Settings.InstanceCounts);
+		Settings.TriangleCounts = ParseIntList(Params, TEXT("Triangles="), Settings.TriangleCounts);
+		FString NoiseType;
+		if (FParse::Value(*Params, TEXT("NoiseType="), NoiseType))
+		{
+			const int64 Value = StaticEnum<ECoherentNoiseType>()->GetValueByNameString(NoiseType);
+			Settings.Noise.Type = Value != INDEX_NONE ? static_cast<ECoherentNoiseType>(Value) : Settings.Noise.Type;
+		}
+		FString NoiseFractal;
+		if (FParse::Value(*Params, TEXT("NoiseFractal="), NoiseFractal))
+		{
+			const int64 Value = StaticEnum<ECoherentNoiseFractal>()->GetValueByNameString(NoiseFractal);
+			Settings.Noise.Fractal = Value != INDEX_NONE ? static_cast<ECoherentNoiseFractal>(Value) : Settings.Noise.Fractal;
+		}
+		FParse::Value(*Params, TEXT("NoiseFrequency="), Settings.Noise.Frequency);
+		FParse::Value(*Params, TEXT("NoiseOctaves="), Settings.Noise.Octaves);
+		FString NoiseFormat;
+		if (FParse::Value(*Params, TEXT("NoiseFormat="), NoiseFormat))
+		{
+			const int64 Value = StaticEnum<ECoherentNoiseFormat>()->GetValueByNameString(NoiseFormat);
+			const EPixelFormat Format = Value != INDEX_NONE ? CoherentNoise::GetPixelFormat(static_cast<ECoherentNoiseFormat>(Value)) : PF_Unknown;
+			Settings.NoiseFormat = Format != PF_Unknown ? Format : Settings.NoiseFormat;
+		}
+		FString RayTracingFormat;
+		if (FParse::Value(*Params, TEXT("RayTracingFormat="), RayTracingFormat))
+		{
+			const int64 Value = StaticEnum<ERayTracingOutputFormat>()->GetValueByNameString(RayTracingFormat);
+			const EPixelFormat Format = Value != INDEX_NONE ? ARayTracingManager::GetPixelFormat(static_cast<ERayTracingOutputFormat>(Value)) : PF_Unknown;
+			Settings.RayTracingFormat = Format != PF_Unknown ? Format : Settings.RayTracingFormat;
+		}
+		Settings.bPackedScene = FParse::Param(*Params, TEXT("PackedScene"));
+		FParse::Value(*Params, TEXT("Warmup="), Settings.NumWarmup);
+		FParse::Value(*Params, TEXT("Reps="), Settings.NumReps);
+		Settings.NumWarmup = FMath::Max(0, Settings.NumWarmup);
+		Settings.NumReps = FMath::Max(1, Settings.NumReps);
+
+		FString Workloads;
+		if (FParse::Value(*Params, TEXT("Workloads="), Workloads, false))
+		{
+			Settings.bRayTracing = Workloads.Contains(TEXT("RayTracing"));
+			Settings.bNoise = Workloads.Contains(TEXT("Noise"));
+			Settings.bMesh = Workloads.Contains(TEXT("Mesh"));
+		}
+		Settings.bCPU = !FParse::Param(*Params, TEXT("SkipCPU"));
+		Settings.bGPU = !FParse::Param(*Params, TEXT("SkipGPU")) && !GUsingNullRHI;
+
+		if (!FParse::Value(*Params, TEXT("Output="), Settings.OutputDir))
+		{
+			Settings.OutputDir = FPaths::Combine(FPaths::ProjectSavedDir(), TEXT("Benchmarks"));
+		}
+		return Settings;
+	}
+
+	FMinimalViewInfo CreateView(const int32 NumSpheres)
+	{
+		FMinimalViewInfo ViewInfo;
+		ViewInfo.Location = FVector(-300.f * FMath::Sqrt(static_cast<float>(NumSpheres)), 0.f, 1000.f);
+		ViewInfo.Rotation = FRotator(-20.f, 0.f, 0.f);
+		ViewInfo.FOV = 90.f;
+		return ViewInfo;
+	}
+
+	// Timings of one render command. GPU time is negative if timestamps aren't supported
+	struct FRenderThreadTimings
+	{
+		double RenderThreadMs = 0.0;
+		double GPUMs = -1.0;
+	};
+
+	// Runs AddPasses in its own graph on the render thread and waits for the GPU
+	FRenderThreadTimings TimeRenderThreadWork(TFunction<void(FRDGBuilder&)>&& AddPasses)
+	{
+		FRenderThreadTimings Timings;
+		ENQUEUE_RENDER_COMMAND(ComputeShadersBenchmark)([&Timings, AddPasses = MoveTemp(AddPasses)](FRHICommandListImmediate& RHICmdList)
+		{
+			const FRenderQueryRHIRef StartQuery = RHICreateRenderQuery(RQT_AbsoluteTime);
+			const FRenderQueryRHIRef EndQuery = RHICreateRenderQuery(RQT_AbsoluteTime);
+
+			const double StartTime = FPlatformTime::Seconds();
+			RHICmdList.EndRenderQuery(StartQuery);
+			{
+				FRDGBuilder GraphBuilder(RHICmdList);
+				AddPasses(GraphBuilder);
+				GraphBuilder.Execute();
+			}
+			RHICmdList.EndRenderQuery(EndQuery);
+			Timings.RenderThreadMs = (FPlatformTime::Seconds() - StartTime) * 1000.0;
+
+			// Results are in microseconds
+			RHICmdList.ImmediateFlush(EImmediateFlushType::FlushRHIThread);
+			uint64 StartMicroseconds = 0;
+			uint64 EndMicroseconds = 0;
+			if (RHIGetRenderQueryResult(StartQuery, StartMicroseconds, true) && RHIGetRenderQueryResult(EndQuery, EndMicroseconds, true))
+			{
+				Timings.GPUMs = (EndMicroseconds - StartMicroseconds) / 1000.0;
+			}
+		});
+		FlushRenderingCommands();
+		return Timings;
+	}
+
+	// Scalar, 1 ray x 8 and 4 ray packet sphere intersection. Whether they agree is checked by ComputeShaders.RayTracing.SIMD
+	void RunSphereIntersection(const FBenchmarkSettings& Settings, const int32 NumSpheres, TArray<FBenchmarkResult>& OutResults)
+	{
+		const int32 NumRays = 4096;
+		FBenchmarkResult& Result = OutResults.AddDefaulted_GetRef();
+		Result.Workload = TEXT("RayTracingSIMD");
+		Result.Spheres = NumSpheres;
+		print("RayTracingSIMD %d spheres x %d rays", NumSpheres, NumRays)
+
+		const TArray<FVector4> Spheres = CreateSpheres(NumSpheres);
+		FSphereSoA SpheresSoA;
+		SpheresSoA.Set(Spheres);
+
+		// From the ray tracing camera in every direction, fixed seed so runs are comparable
+		const FVector Origin = CreateView(NumSpheres).Location;
+		FRandomStream Random(1234);
+		TArray<FRayTracingRay> Rays;
+		Rays.Reserve(NumRays);
+		for (int32 i = 0; i < NumRays; i++)
+		{
+			Rays.Emplace(Origin, Random.GetUnitVector());
+		}
+		const double NumTests = static_cast<double>(NumSpheres) * NumRays;
+
+		for (int32 Rep = -Settings.NumWarmup; Rep < Settings.NumReps; Rep++)
+		{
+			double StartTime = FPlatformTime::Seconds();
+			for (int32 i = 0; i < NumRays; i++)
+			{
+				FRayTracingHit Hit;
+				RayTracingSIMD::IntersectSpheresScalar(Rays[i], Hit, Spheres);
+			}
+			const double ScalarSeconds = FPlatformTime::Seconds() - StartTime;
+
+			StartTime = FPlatformTime::Seconds();
+			for (int32 i = 0; i < NumRays; i++)
+			{
+				FRayTracingHit Hit;
+				RayTracingSIMD::IntersectSpheres(Rays[i], Hit, SpheresSoA);
+			}
+			const double SIMDSeconds = FPlatformTime::Seconds() - StartTime;
+
+			StartTime = FPlatformTime::Seconds();
+			for (int32 i = 0; i < NumRays; i += 4)
+			{
+				const FRayTracingRay PacketRays[4] = { Rays[i], Rays[i + 1], Rays[i + 2], Rays[i + 3] };
+				FRayTracingHit PacketHits[4];
+				int32 PacketIndices[4];
+				RayTracingSIMD::IntersectSpheresPacket4(PacketRays, PacketHits, SpheresSoA, PacketIndices);
+			}
+			const double PacketSeconds = FPlatformTime::Seconds() - StartTime;
+
+			if (Rep >= 0)
+			{
+				Result.GetMetric(TEXT("CPUScalarMs")).Values.Add(ScalarSeconds * 1000.0);
+				Result.GetMetric(TEXT("CPUSIMDMs")).Values.Add(SIMDSeconds * 1000.0);
+				Result.GetMetric(TEXT("CPUPacketMs")).Values.Add(PacketSeconds * 1000.0);
+				Result.GetMetric(TEXT("CPUMtestsPerSecond")).Values.Add(NumTests / SIMDSeconds / 1.0e6);
+			}
+		}
+	}
+
+	void RunRayTracing(const FBenchmarkSettings& Settings, TArray<FBenchmarkResult>& OutResults)
+	{
+		if (Settings.bCPU)
+		{
+			for (const int32 NumSpheres : Settings.SphereCounts)
+			{
+				RunSphereIntersection(Settings, NumSpheres, OutResults);
+			}
+		}
+
+		const FRayTracingSkyboxImage CPUSkybox = CreateCPUSkybox();
+		UTexture2D* GPUSkybox = Settings.bGPU ? CreateGPUSkybox(CPUSkybox) : nullptr;
+		if (GPUSkybox)
+		{
+			GPUSkybox->AddToRoot();
+		}
+
+		for (const int32 Resolution : Settings.Resolutions)
+		{
+			UTextureRenderTarget2D* RenderTarget = Settings.bGPU ? CreateRenderTarget(FIntPoint(Resolution, Resolution), Settings.RayTracingFormat) : nullptr;
+			if (RenderTarget)
+			{
+				RenderTarget->AddToRoot();
+				FlushRenderingCommands();
+			}
+
+			for (const int32 NumSpheres : Settings.SphereCounts)
+			{
+				const TArray<FVector4> Spheres = CreateSpheres(NumSpheres);
+				for (const int32 NumSamples : Settings.AASamples)
+				{
+					for (const int32 Bounces : Settings.Bounces)
+					{
+						FBenchmarkResult& Result = OutResults.AddDefaulted_GetRef();
+						Result.Workload = TEXT("RayTracing");
+						Result.Resolution = Resolution;
+						Result.Spheres = NumSpheres;
+						Result.AASamples = NumSamples;
+						Result.Bounces = FRayTracingCS::GetPermutationMaxBounces(Bounces);
+						print("RayTracing %dx%d, %d spheres, %d samples, %d bounces", Resolution, Resolution, NumSpheres, NumSamples, Result.Bounces)
+
+						for (int32 Rep = -Settings.NumWarmup; Rep < Settings.NumReps; Rep++)
+						{
+							const bool bRecord = Rep >= 0;
+
+							// Game thread setup, same work ARayTracingManager does when the scene changes
+							const double SetupStart = FPlatformTime::Seconds();
+							FRayTracingParams Params;
+							Params.SetCamera(CreateView(NumSpheres), FIntPoint(Resolution, Resolution));
+							Params.PixelFormat = Settings.RayTracingFormat;
+							Params.Colour = FLinearColor::White;
+							Params.MaxBounces = Result.Bounces;
+							const TSharedRef<FSphereBVH, ESPMode::ThreadSafe> BVH = MakeShared<FSphereBVH, ESPMode::ThreadSafe>();
+							BVH->Build(Spheres);
+							Params.SphereBVH = BVH;
+							Params.NumSamples = NumSamples;
+							const double SetupMs = (FPlatformTime::Seconds() - SetupStart) * 1000.0;
+							if (bRecord)
+							{
+								Result.GetMetric(TEXT("SetupMs")).Values.Add(SetupMs);
+							}
+
+							if (Settings.bCPU)
+							{
+								TArray<FLinearColor> Image;
+								const FRayTracingCPUStats Stats = FRayTracingCPURenderer::Render(Params, CPUSkybox, Image);
+								if (bRecord)
+								{
+									Result.GetMetric(TEXT("CPURenderMs")).Values.Add(Stats.RenderSeconds * 1000.0);
+									Result.GetMetric(TEXT("CPUMraysPerSecond")).Values.Add(Stats.GetRaysPerSecond() / 1.0e6);
+								}
+							}
+
+							if (Settings.bGPU && GPUSkybox && RenderTarget)
+							{
+								Params.SceneUpload.SetFull(*BVH);
+								if (Settings.bPackedScene && BVH->GetNodes().Num() > 0)
+								{
+									const FSphereBVHNode& RootNode = BVH->GetNodes()[0];
+									Params.SceneUpload.Packing = FSphereBVHPacking::Create(FBox(RootNode.BoundsMin, RootNode.BoundsMax));
+								}
+								Params.SkyboxResource = GPUSkybox->Resource;
+								Params.RenderTargetResource = RenderTarget->GameThread_GetRenderTargetResource();
+								Params.GroupShape = 0;
+								Params.GroupSize = FRayTracingCS::GetGroupSize(Params.GroupShape);
+
+								// Each rep starts from an empty state so the full scene upload is included
+								FRayTracingGPUState State;
+								const FRenderThreadTimings Timings = TimeRenderThreadWork([&Params, &State](FRDGBuilder& GraphBuilder)
+								{
+									FRayTracingGPURenderer::AddPasses(GraphBuilder, Params, State);
+								});
+								ENQUEUE_RENDER_COMMAND(ReleaseBenchmarkState)([&State](FRHICommandListImmediate& RHICmdList)
+								{
+									State.Release();
+								});
+								FlushRenderingCommands();
+
+								if (bRecord)
+								{
+									Result.GetMetric(TEXT("RenderThreadMs")).Values.Add(Timings.RenderThreadMs);
+									if (Timings.GPUMs >= 0.0)
+									{
+										Result.GetMetric(TEXT("GPUMs")).Values.Add(Timings.GPUMs);
+									}
+								}
+							}
+						}
+					}
+				}
+			}
+
+			if (RenderTarget)
+			{
+				RenderTarget->RemoveFromRoot();
+			}
+		}
+
+		if (GPUSkybox)
+		{
+			GPUSkybox->RemoveFromRoot();
+		}
+	}
+
+	// Triangle mesh memory, traversal cost and render times. One sphere so the mesh dominates
+	void RunMesh(const FBenchmarkSettings& Settings, TArray<FBenchmarkResult>& OutResults)
+	{
+		const FRayTracingSkyboxImage CPUSkybox = CreateCPUSkybox();
+		UTexture2D* GPUSkybox = Settings.bGPU ? CreateGPUSkybox(CPUSkybox) : nullptr;
+		if (GPUSkybox)
+		{
+			GPUSkybox->AddToRoot();
+		}
+
+		const TSharedRef<FSphereBVH, ESPMode::ThreadSafe> SphereBVH = MakeShared<FSphereBVH, ESPMode::ThreadSafe>();
+		SphereBVH->Build(CreateSpheres(1));
+		const int32 Bounces = FRayTracingCS::GetPermutationMaxBounces(Settings.Bounces[0]);
+
+		for (const int32 Resolution : Settings.Resolutions)
+		{
+			UTextureRenderTarget2D* RenderTarget = Settings.bGPU ? CreateRenderTarget(FIntPoint(Resolution, Resolution), Settings.RayTracingFormat) : nullptr;
+			if (RenderTarget)
+			{
+				RenderTarget->AddToRoot();
+				FlushRenderingCommands();
+			}
+
+			for (const int32 NumTriangles : Settings.TriangleCounts)
+			{
+				TArray<FVector> Vertices;
+				TArray<uint32> Indices;
+				CreateMesh(NumTriangles, Vertices, Indices);
+
+				FBenchmarkResult& Result = OutResults.AddDefaulted_GetRef();
+				Result.Workload = TEXT("RayTracingMesh");
+				Result.Resolution = Resolution;
+				Result.Triangles = Indices.Num() / 3;
+				Result.AASamples = 1;
+				Result.Bounces = Bounces;
+				print("RayTracingMesh %dx%d, %d triangles", Resolution, Resolution, Result.Triangles)
+
+				for (int32 Rep = -Settings.NumWarmup; Rep < Settings.NumReps; Rep++)
+				{
+					const bool bRecord = Rep >= 0;
+
+					const double BuildStart = FPlatformTime::Seconds();
+					const TSharedRef<FTriangleMeshBVH, ESPMode::ThreadSafe> MeshBVH = MakeShared<FTriangleMeshBVH, ESPMode::ThreadSafe>();
+					MeshBVH->Build(Vertices, Indices);
+					const double BuildMs = (FPlatformTime::Seconds() - BuildStart) * 1000.0;
+
+					FRayTracingParams Params;
+					Params.SetCamera(CreateView(FMath::RoundToInt(FMath::Sqrt(Result.Triangles / 2.f))), FIntPoint(Resolution, Resolution));
+					Params.PixelFormat = Settings.RayTracingFormat;
+					Params.Colour = FLinearColor::White;
+					Params.MaxBounces = Bounces;
+					Params.SphereBVH = SphereBVH;
+					Params.MeshBVH = MeshBVH;
+					Params.NumSamples = 1;
+
+					// Primary rays through the pixel centres against the mesh alone, per row so the rows can run in parallel
+					TArray<FTriangleMeshTraversalStats> RowStats;
+					RowStats.SetNum(Resolution);
+					ParallelFor(Resolution, [&Params, &MeshBVH, &RowStats, Resolution](const int32 Y)
+					{
+						for (int32 X = 0; X < Resolution; X++)
+						{
+							FVector2D UV = ((FVector2D(X, Y) + FVector2D(0.5f, 0.5f)) / FVector2D(Params.TexSize)) * 2.f - 1.f;
+							UV.Y = 1.f - UV.Y;
+							FRayTracingHit Hit;
+							MeshBVH->Trace(FRayTracingCPURenderer::CreateCameraRay(Params, UV), Hit, &RowStats[Y]);
+						}
+					});
+					FTriangleMeshTraversalStats TraversalStats;
+					for (const FTriangleMeshTraversalStats& Row : RowStats)
+					{
+						TraversalStats.NumRays += Row.NumRays;
+						TraversalStats.NodesVisited += Row.NodesVisited;
+						TraversalStats.TrianglesTested += Row.TrianglesTested;
+					}
+
+					if (bRecord)
+					{
+						const FTriangleMeshStats MeshStats = MeshBVH->GetStats();
+						Result.GetMetric(TEXT("BuildMs")).Values.Add(BuildMs);
+						Result.GetMetric(TEXT("MeshKB")).Values.Add(MeshStats.GetTotalBytes() / 1024.0);
+						Result.GetMetric(TEXT("BytesPerTriangle")).Values.Add(MeshStats.GetBytesPerTriangle());
+						Result.GetMetric(TEXT("SAHCost")).Values.Add(MeshStats.SAHCost);
+						Result.GetMetric(TEXT("NodesPerRay")).Values.Add(TraversalStats.GetNodesPerRay());
+						Result.GetMetric(TEXT("TrianglesPerRay")).Values.Add(TraversalStats.GetTrianglesPerRay());
+					}
+
+					if (Settings.bCPU)
+					{
+						TArray<FLinearColor> Image;
+						const FRayTracingCPUStats Stats = FRayTracingCPURenderer::Render(Params, CPUSkybox, Image);
+						if (bRecord)
+						{
+							Result.GetMetric(TEXT("CPURenderMs")).Values.Add(Stats.RenderSeconds * 1000.0);
+							Result.GetMetric(TEXT("CPUMraysPerSecond")).Values.Add(Stats.GetRaysPerSecond() / 1.0e6);
+						}
+					}
+
+					if (Settings.bGPU && GPUSkybox && RenderTarget)
+					{
+						Params.SceneUpload.SetFull(*SphereBVH);
+						Params.SceneUpload.bMeshUpload = true;
+						Params.SceneUpload.Mesh = MeshBVH;
+						Params.SkyboxResource = GPUSkybox->Resource;
+						Params.RenderTargetResource = RenderTarget->GameThread_GetRenderTargetResource();
+						Params.GroupShape = 0;
+						Params.GroupSize = FRayTracingCS::GetGroupSize(Params.GroupShape);
+
+						FRayTracingGPUState State;
+						const FRenderThreadTimings Timings = TimeRenderThreadWork([&Params, &State](FRDGBuilder& GraphBuilder)
+						{
+							FRayTracingGPURenderer::AddPasses(GraphBuilder, Params, State);
+						});
+						ENQUEUE_RENDER_COMMAND(ReleaseBenchmarkState)([&State](FRHICommandListImmediate& RHICmdList)
+						{
+							State.Release();
+						});
+						FlushRenderingCommands();
+
+						if (bRecord)
+						{
+							Result.GetMetric(TEXT("RenderThreadMs")).Values.Add(Timings.RenderThreadMs);
+							if (Timings.GPUMs >= 0.0)
+							{
+								Result.GetMetric(TEXT("GPUMs")).Values.Add(Timings.GPUMs);
+							}
+						}
+					}
+				}
+			}
+
+			if (RenderTarget)
+			{
+				RenderTarget->RemoveFromRoot();
+			}
+		}
+
+		if (GPUSkybox)
+		{
+			GPUSkybox->RemoveFromRoot();
+		}
+	}
+
+	// Scalar, 4 wide and parallel CPU evaluation of one region
+	void RunNoiseCPU(const FBenchmarkSettings& Settings, const int32 Resolution, TArray<FBenchmarkResult>& OutResults)
+	{
+		FBenchmarkResult& Result = OutResults.AddDefaulted_GetRef();
+		Result.Workload = TEXT("NoiseCPU");
+		Result.Resolution = Resolution;
+		print("NoiseCPU %dx%d", Resolution, Resolution)
+
+		const FIntPoint Size(Resolution, Resolution);
+		TArray<FVector2D> Positions;
+		Positions.Reserve(Size.X * Size.Y);
+		for (int32 Y = 0; Y < Size.Y; Y++)
+		{
+			for (int32 X = 0; X < Size.X; X++)
+			{
+				Positions.Add(CoherentNoise::GetTexelPosition(X, Y));
+			}
+		}
+		TArray<float> Values;
+		Values.SetNumUninitialized(Positions.Num());
+		const double NumSamples = Positions.Num();
+
+		for (int32 Rep = -Settings.NumWarmup; Rep < Settings.NumReps; Rep++)
+		{
+			const uint32 Seed = CoherentNoise::GetSeed(0, Rep + Settings.NumWarmup);
+
+			double StartTime = FPlatformTime::Seconds();
+			for (int32 i = 0; i < Positions.Num(); i++)
+			{
+				Values[i] = CoherentNoise::Evaluate(Settings.Noise, Seed, Positions[i]);
+			}
+			const double ScalarSeconds = FPlatformTime::Seconds() - StartTime;
+
+			StartTime = FPlatformTime::Seconds();
+			CoherentNoise::EvaluateBatch(Settings.Noise, Seed, Positions, Values);
+			const double BatchSeconds = FPlatformTime::Seconds() - StartTime;
+
+			StartTime = FPlatformTime::Seconds();
+			CoherentNoise::EvaluateRegion(Settings.Noise, Seed, FIntPoint::ZeroValue, Size, Values);
+			const double RegionSeconds = FPlatformTime::Seconds() - StartTime;
+
+			if (Rep >= 0)
+			{
+				Result.GetMetric(TEXT("CPUScalarMs")).Values.Add(ScalarSeconds * 1000.0);
+				Result.GetMetric(TEXT("CPUBatchMs")).Values.Add(BatchSeconds * 1000.0);
+				Result.GetMetric(TEXT("CPUParallelMs")).Values.Add(RegionSeconds * 1000.0);
+				Result.GetMetric(TEXT("CPUMsamplesPerSecond")).Values.Add(NumSamples / RegionSeconds / 1.0e6);
+			}
+		}
+	}
+
+	enum class ENoiseMode
+	{
+		Direct,
+		Batched,
+		Cached
+	};
+
+	void RunNoise(const FBenchmarkSettings& Settings, TArray<FBenchmarkResult>& OutResults)
+	{
+		for (const int32 Resolution : Settings.NoiseResolutions)
+		{
+			if (Settings.bCPU)
+			{
+				RunNoiseCPU(Settings, Resolution, OutResults);
+			}
+			if (!Settings.bGPU)
+			{
+				continue;
+			}
+
+			for (const int32 NumInstances : Settings.InstanceCounts)
+			{
+				print("Noise %dx%d, %d instances", Resolution, Resolution, NumInstances)
+
+				// Proxies without a manager, so FNoiseBatchService and the scheduler don't render or latch them between the timed reps
+				TArray<UTextureRenderTarget2D*> RenderTargets;
+				TArray<TSharedPtr<FWhiteNoiseCSProxy, ESPMode::ThreadSafe>> Proxies;
+				for (int32 i = 0; i < NumInstances; i++)
+				{
+					UTextureRenderTarget2D* RenderTarget = CreateRenderTarget(FIntPoint(Resolution, Resolution), Settings.NoiseFormat);
+					RenderTarget->AddToRoot();
+					RenderTargets.Add(RenderTarget);
+					Proxies.Add(MakeShared<FWhiteNoiseCSProxy, ESPMode::ThreadSafe>());
+					Proxies.Last()->SetRenderingEnabled(true);
+				}
+				FlushRenderingCommands();
+
+				// The one dispatch per instance path, the batched path and static noise served from the tile cache
+				for (const ENoiseMode Mode : { ENoiseMode::Direct, ENoiseMode::Batched, ENoiseMode::Cached })
+				{
+					const bool bBatched = Mode == ENoiseMode::Batched;
+					const bool bCached = Mode == ENoiseMode::Cached;
+					FBenchmarkResult& Result = OutResults.AddDefaulted_GetRef();
+					Result.Workload = bCached ? TEXT("NoiseCached") : bBatched ? TEXT("NoiseBatched") : TEXT("Noise");
+					Result.Resolution = Resolution;
+					Result.Instances = NumInstances;
+
+					for (int32 Rep = -Settings.NumWarmup; Rep < Settings.NumReps; Rep++)
+					{
+						const double SetupStart = FPlatformTime::Seconds();
+						for (int32 i = 0; i < NumInstances; i++)
+						{
+							FWhiteNoiseCSParameters Parameters(RenderTargets[i]);
+							// Cached noise stays the same, so the warmup fills the cache and the timed reps copy tiles out of it
+							Parameters.TimeStamp = bCached ? 0 : Rep + Settings.NumWarmup;
+							Parameters.Seed = i;
+							Parameters.Noise = Settings.Noise;
+							Parameters.bUseTileCache = bCached;
+							Proxies[i]->SetParameters(Parameters);
+						}
+						const double SetupMs = (FPlatformTime::Seconds() - SetupStart) * 1000.0;
+
+						TArray<FWhiteNoiseCSProxy*> RepProxies;
+						for (const TSharedPtr<FWhiteNoiseCSProxy, ESPMode::ThreadSafe>& Proxy : Proxies)
+						{
+							RepProxies.Add(Proxy.Get());
+						}
+
+						const FNoiseTileCacheStats CacheStatsBefore = FNoiseTileCache::GetStats();
+						const FRenderThreadTimings Timings = TimeRenderThreadWork([&RepProxies, bBatched, bCached](FRDGBuilder& GraphBuilder)
+						{
+							for (FWhiteNoiseCSProxy* Proxy : RepProxies)
+							{
+								Proxy->LatchParameters_RenderThread();
+								// Otherwise every rep after the first skips the unchanged request and measures nothing
+								if (bCached)
+								{
+									Proxy->ResetTileRequest_RenderThread();
+								}
+							}
+							if (bBatched && RepProxies.Num() > 1)
+							{
+								FWhiteNoiseCSProxy::AddBatchedPasses_RenderThread(GraphBuilder, RepProxies);
+							}
+							else
+							{
+								for (FWhiteNoiseCSProxy* Proxy : RepProxies)
+								{
+									Proxy->AddPasses_RenderThread(GraphBuilder);
+								}
+							}
+						});
+
+						if (bCached)
+						{
+							// The graph has executed, same as the batch service does after every frame
+							ENQUEUE_RENDER_COMMAND(TrimNoiseTileCache)([](FRHICommandListImmediate& RHICmdList)
+							{
+								FNoiseTileCache::Get().Trim();
+							});
+							FlushRenderingCommands();
+						}
+
+						if (Rep >= 0)
+						{
+							Result.GetMetric(TEXT("SetupMs")).Values.Add(SetupMs);
+							Result.GetMetric(TEXT("RenderThreadMs")).Values.Add(Timings.RenderThreadMs);
+							if (Timings.GPUMs >= 0.0)
+							{
+								Result.GetMetric(TEXT("GPUMs")).Values.Add(Timings.GPUMs);
+							}
+							if (bCached)
+							{
+								const FNoiseTileCacheStats CacheStats = FNoiseTileCache::GetStats();
+								Result.GetMetric(TEXT("TileHits")).Values.Add(CacheStats.NumHits - CacheStatsBefore.NumHits);
+								Result.GetMetric(TEXT("TileMisses")).Values.Add(CacheStats.NumMisses - CacheStatsBefore.NumMisses);
+								Result.GetMetric(TEXT("TileCacheMB")).Values.Add(CacheStats.ResidentBytes / (1024.0 * 1024.0));
+							}
+						}
+					}
+				}
+
+				// They hold render thread resources, so the last reference goes there
+				ENQUEUE_RENDER_COMMAND(ReleaseBenchmarkNoise)([Proxies = MoveTemp(Proxies)](FRHICommandListImmediate& RHICmdList) mutable
+				{
+					Proxies.Reset();
+				});
+				FlushRenderingCommands();
+				for (UTextureRenderTarget2D* RenderTarget : RenderTargets)
+				{
+					RenderTarget->RemoveFromRoot();
+				}
+			}
+		}
+	}
+
+	bool WriteCSV(const FString& Path, const TArray<FBenchmarkResult>& Results, const FBenchmarkSettings& Settings)
+	{
+		FString CSV = TEXT("Workload,Resolution,Spheres,AASamples,Bounces,Instances,Triangles,Metric,Mean,Median,Min,Max,StdDev,Reps,Warmup\n");
+		for (const FBenchmarkResult& Result : Results)
+		{
+			for (const FBenchmarkMetric& Metric : Result.Metrics)
+			{
+				CSV += FString::Printf(TEXT("%s,%d,%d,%d,%d,%d,%d,%s,%.4f,%.4f,%.4f,%.4f,%.4f,%d,%d\n"),
+					*Result.Workload, Result.Resolution, Result.Spheres, Result.AASamples, Result.Bounces, Result.Instances, Result.Triangles,
+					*Metric.Name, Metric.GetMean(), Metric.GetMedian(), Metric.GetMin(), Metric.GetMax(), Metric.GetStdDev(),
+					Metric.Values.Num(), Settings.NumWarmup);
+			}
+		}
+		return FFileHelper::SaveStringToFile(CSV, *Path);
+	}
+
+	bool WriteJSON(const FString& Path, const TArray<FBenchmarkResult>& Results, const FBenchmarkSettings& Settings)
+	{
+		const TSharedRef<FJsonObject> Root = MakeShared<FJsonObject>();
+		Root->SetStringField(TEXT("RHI"), GUsingNullRHI ? TEXT("Null") : GDynamicRHI ? GDynamicRHI->GetName() : TEXT("None"));
+		Root->SetStringField(TEXT("CPU"), FPlatformMisc::GetCPUBrand());
+		Root->SetStringField(TEXT("GPU"), GRHIAdapterName);
+		Root->SetNumberField(TEXT("Warmup"), Settings.NumWarmup);
+		Root->SetNumberField(TEXT("Reps"), Settings.NumReps);
+		Root->SetStringField(TEXT("NoiseType"), StaticEnum<ECoherentNoiseType>()->GetNameStringByValue(static_cast<int64>(Settings.Noise.Type)));
+		Root->SetStringField(TEXT("NoiseFractal"), StaticEnum<ECoherentNoiseFractal>()->GetNameStringByValue(static_cast<int64>(Settings.Noise.Fractal)));
+		Root->SetNumberField(TEXT("NoiseFrequency"), Settings.Noise.Frequency);
+		Root->SetNumberField(TEXT("NoiseOctaves"), Settings.Noise.GetNumOctaves());
+		Root->SetStringField(TEXT("NoiseFormat"), GPixelFormats[Settings.NoiseFormat].Name);
+		Root->SetStringField(TEXT("RayTracingFormat"), GPixelFormats[Settings.RayTracingFormat].Name);
+		Root->SetBoolField(TEXT("PackedScene"), Settings.bPackedScene);
+
+		TArray<TSharedPtr<FJsonValue>> ResultValues;
+		for (const FBenchmarkResult& Result : Results)
+		{
+			const TSharedRef<FJsonObject> ResultObject = MakeShared<FJsonObject>();
+			ResultObject->SetStringField(TEXT("Workload"), Result.Workload);
+			auto SetOptional = [&ResultObject](const TCHAR* Name, const int32 Value)
+			{
+				if (Value >= 0)
+				{
+					ResultObject->SetNumberField(Name, Value);
+				}
+			};
+			SetOptional(TEXT("Resolution"), Result.Resolution);
+			SetOptional(TEXT("Spheres"), Result.Spheres);
+			SetOptional(TEXT("AASamples"), Result.AASamples);
+			SetOptional(TEXT("Bounces"), Result.Bounces);
+			SetOptional(TEXT("Instances"), Result.Instances);
+			SetOptional(TEXT("Triangles"), Result.Triangles);
+
+			const TSharedRef<FJsonObject> MetricsObject = MakeShared<FJsonObject>();
+			for (const FBenchmarkMetric& Metric : Result.Metrics)
+			{
+				const TSharedRef<FJsonObject> MetricObject = MakeShared<FJsonObject>();
+				MetricObject->SetNumberField(TEXT("Mean"), Metric.GetMean());
+				MetricObject->SetNumberField(TEXT("Median"), Metric.GetMedian());
+				MetricObject->SetNumberField(TEXT("Min"), Metric.GetMin());
+				MetricObject->SetNumberField(TEXT("Max"), Metric.GetMax());
+				MetricObject->SetNumberField(TEXT("StdDev"), Metric.GetStdDev());
+
+				TArray<TSharedPtr<FJsonValue>> Samples;
+				for (const double Value : Metric.Values)
+				{
+					Samples.Add(MakeShared<FJsonValueNumber>(Value));
+				}
+				MetricObject->SetArrayField(TEXT("Samples"), Samples);
+				MetricsObject->SetObjectField(Metric.Name, MetricObject);
+			}
+			ResultObject->SetObjectField(TEXT("Metrics"), MetricsObject);
+			ResultValues.Add(MakeShared<FJsonValueObject>(ResultObject));
+		}
+		Root->SetArrayField(TEXT("Results"), ResultValues);
+
+		FString JSON;
+		const TSharedRef<TJsonWriter<>> Writer = TJsonWriterFactory<>::Create(&JSON);
+		return FJsonSerializer::Serialize(Root, Writer) && FFileHelper::SaveStringToFile(JSON, *Path);
+	}
+}
+
+UComputeShadersBenchmarkCommandlet::UComputeShadersBenchmarkCommandlet()
+{
+	IsClient = false;
+	IsServer = false;
+	IsEditor = false;
+	LogToConsole = true;
+}
+
+int32 UComputeShadersBenchmarkCommandlet::Main(const FString& Params)
+{
+	const FBenchmarkSettings Settings = ParseSettings(Params);
+	print("ComputeShaders benchmark: %d warmup, %d reps, CPU %s, GPU %s", Settings.NumWarmup, Settings.NumReps,
+		Settings.bCPU ? TEXT("on") : TEXT("off"), Settings.bGPU ? TEXT("on") : TEXT("off"))
+
+	TArray<FBenchmarkResult> Results;
+	if (Settings.bRayTracing)
+	{
+		RunRayTracing(Settings, Results);
+	}
+	if (Settings.bMesh)
+	{
+		RunMesh(Settings, Results);
+	}
+	if (Settings.bNoise)
+	{
+		RunNoise(Settings, Results);
+	}
+
+	IFileManager::Get().MakeDirectory(*Settings.OutputDir, true);
+	const FString BaseName = FString::Printf(TEXT("ComputeShadersBenchmark-%s"), *FDateTime::Now().ToString());
+	const FString CSVPath = FPaths::Combine(Settings.OutputDir, BaseName + TEXT(".csv"));
+	const FString JSONPath = FPaths::Combine(Settings.OutputDir, BaseName + TEXT(".json"));
+
+	if (!WriteCSV(CSVPath, Results, Settings) || !WriteJSON(JSONPath, Results, Settings))
+	{
+		printe("Failed to write benchmark results to %s", *Settings.OutputDir)
+		return 1;
+	}
+
+	print("Wrote %d results to %s and %s", Results.Num(), *CSVPath, *JSONPath)
+	return 0;
+}
@@ -0,0 +1,90 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "ComputeShadersCommandletUtils.h"
+
+#include "Engine/Texture2D.h"
+#include "Engine/TextureRenderTarget2D.h"
+#include "Math/RandomStream.h"
+
+
+TArray<FVector4> ComputeShadersCommandletUtils::CreateSpheres(const int32 NumSpheres)
+{
+	FRandomStream Random(NumSpheres);
+	const float Extent = 200.f * FMath::Sqrt(static_cast<float>(NumSpheres));
+	TArray<FVector4> Spheres;
+	Spheres.Reserve(NumSpheres);
+	for (int32 i = 0; i < NumSpheres; i++)
+	{
+		const float Radius = Random.FRandRange(20.f, 80.f);
+		Spheres.Emplace(Random.FRandRange(-Extent, Extent), Random.FRandRange(-Extent, Extent), Radius, Radius);
+	}
+	return Spheres;
+}
+
+void ComputeShadersCommandletUtils::CreateMesh(const int32 NumTriangles, TArray<FVector>& OutVertices, TArray<uint32>& OutIndices)
+{
+	// Two triangles per grid cell
+	const int32 Cells = FMath::Max(1, FMath::RoundToInt(FMath::Sqrt(NumTriangles / 2.f)));
+	const float Extent = 200.f * FMath::Sqrt(static_cast<float>(Cells));
+	const float CellSize = 2.f * Extent / Cells;
+
+	OutVertices.Reset((Cells + 1) * (Cells + 1));
+	for (int32 Y = 0; Y <= Cells; Y++)
+	{
+		for (int32 X = 0; X <= Cells; X++)
+		{
+			const float PosX = -Extent + X * CellSize;
+			const float PosY = -Extent + Y * CellSize;
+			OutVertices.Emplace(PosX, PosY, 150.f + 100.f * FMath::Sin(PosX * 0.01f) * FMath::Cos(PosY * 0.013f));
+		}
+	}
+
+	OutIndices.Reset(Cells * Cells * 6);
+	for (int32 Y = 0; Y < Cells; Y++)
+	{
+		for (int32 X = 0; X < Cells; X++)
+		{
+			const uint32 Corner = Y * (Cells + 1) + X;
+			OutIndices.Append({ Corner, Corner + 1, Corner + Cells + 1 });
+			OutIndices.Append({ Corner + 1, Corner + Cells + 2, Corner + Cells + 1 });
+		}
+	}
+}
+
+FRayTracingSkyboxImage ComputeShadersCommandletUtils::CreateCPUSkybox()
+{
+	FRayTracingSkyboxImage Skybox;
+	Skybox.Size = FIntPoint(64, 32);
+	Skybox.Pixels.SetNumUninitialized(Skybox.Size.X * Skybox.Size.Y);
+	for (int32 Y = 0; Y < Skybox.Size.Y; Y++)
+	{
+		const FLinearColor Colour = FMath::Lerp(FLinearColor(0.3f, 0.5f, 1.f), FLinearColor(0.8f, 0.8f, 0.7f), Y / static_cast<float>(Skybox.Size.Y - 1));
+		for (int32 X = 0; X < Skybox.Size.X; X++)
+		{
+			Skybox.Pixels[Y * Skybox.Size.X + X] = Colour;
+		}
+	}
+	return Skybox;
+}
+
+UTexture2D* ComputeShadersCommandletUtils::CreateGPUSkybox(const FRayTracingSkyboxImage& Source)
+{
+	UTexture2D* Texture = UTexture2D::CreateTransient(Source.Size.X, Source.Size.Y, PF_B8G8R8A8);
+	Texture->SRGB = false;
+	FColor* Pixels = static_cast<FColor*>(Texture->PlatformData->Mips[0].BulkData.Lock(LOCK_READ_WRITE));
+	for (int32 i = 0; i < Source.Pixels.Num(); i++)
+	{
+		Pixels[i] = Source.Pixels[i].QuantizeRound();
+	}
+	Texture->PlatformData->Mips[0].BulkData.Unlock();
+	Texture->UpdateResource();
+	return Texture;
+}
+
+UTextureRenderTarget2D* ComputeShadersCommandletUtils::CreateRenderTarget(const FIntPoint& Size, const EPixelFormat Format)
+{
+	UTextureRenderTarget2D* RenderTarget = NewObject<UTextureRenderTarget2D>();
+	RenderTarget->bCanCreateUAV = true;
+	RenderTarget->InitCustomFormat(Size.X, Size.Y, Format, true);
+	return RenderTarget;
+}
@@ -0,0 +1,28 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "RayTracingCPU.h"
+
+class UTexture2D;
+class UTextureRenderTarget2D;
+
+// Scene and resource setup shared by the commandlets
+namespace ComputeShadersCommandletUtils
+{
+	// Same kind of scene as the sample level, spheres resting above the ground plane
+	TArray<FVector4> CreateSpheres(int32 NumSpheres);
+
+	// Rolling heightfield above the ground plane with about NumTriangles triangles, 3 indices per triangle
+	void CreateMesh(int32 NumTriangles, TArray<FVector>& OutVertices, TArray<uint32>& OutIndices);
+
+	// Vertical gradient so the CPU and GPU skies are comparable
+	FRayTracingSkyboxImage CreateCPUSkybox();
+
+	// Transient texture with the same pixels as the CPU skybox
+	UTexture2D* CreateGPUSkybox(const FRayTracingSkyboxImage& Source);
+
+	UTextureRenderTarget2D* CreateRenderTarget(const FIntPoint& Size, EPixelFormat Format);
+}
@@ -0,0 +1,159 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "NoiseBatchService.h"
+
+#include "ComputeScheduler.h"
+#include "NoiseTileCache.h"
+#include "RenderGraphBuilder.h"
+#include "WhiteNoiseCS.h"
+
+
+DECLARE_CYCLE_STAT(TEXT("NoiseBatch Prepare (RT)"), STAT_NoiseBatch_Prepare, STATGROUP_ComputeShaders);
+DECLARE_CYCLE_STAT(TEXT("NoiseBatch AddPasses (RT)"), STAT_NoiseBatch_AddPasses, STATGROUP_ComputeShaders);
+
+FNoiseBatchService* FNoiseBatchService::Instance = nullptr;
+FComputeShaderTimingHistory FNoiseBatchService::Timings;
+
+FNoiseBatchService& FNoiseBatchService::Get_RenderThread()
+{
+	check(IsInRenderingThread());
+
+	if (Instance == nullptr)
+	{
+		Instance = new FNoiseBatchService();
+	}
+	return *Instance;
+}
+
+void FNoiseBatchService::GameThread_Register(const TSharedRef<FWhiteNoiseCSProxy, ESPMode::ThreadSafe>& Proxy)
+{
+	check(IsInGameThread());
+
+	ENQUEUE_RENDER_COMMAND(RegisterNoiseManager)([Proxy](FRHICommandListImmediate& RHICmdList)
+	{
+		Get_RenderThread().Proxies.AddUnique(Proxy);
+	});
+}
+
+void FNoiseBatchService::GameThread_Unregister(TSharedPtr<FWhiteNoiseCSProxy, ESPMode::ThreadSafe> Proxy)
+{
+	check(IsInGameThread() && Proxy.IsValid());
+
+	// The command takes the only game thread reference, so the proxy is always deleted on the render thread
+	ENQUEUE_RENDER_COMMAND(UnregisterNoiseManager)([Proxy = MoveTemp(Proxy)](FRHICommandListImmediate& RHICmdList)
+	{
+		if (Instance)
+		{
+			Instance->Proxies.RemoveSingleSwap(Proxy.ToSharedRef(), false);
+		}
+	});
+}
+
+void FNoiseBatchService::Shutdown()
+{
+	ENQUEUE_RENDER_COMMAND(ShutdownNoiseBatchService)([](FRHICommandListImmediate& RHICmdList)
+	{
+		delete Instance;
+		Instance = nullptr;
+	});
+}
+
+FNoiseBatchService::FNoiseBatchService()
+{
+	// Already on the render thread
+	FComputeJob Job;
+	Job.Desc.Name = TEXT("Noise");
+	Job.Desc.Timings = &Timings;
+	Job.Prepare = [this](uint32& OutInputHash) { return Prepare_RenderThread(OutInputHash); };
+	Job.AddPasses = [this](FRDGBuilder& GraphBuilder) { AddPasses_RenderThread(GraphBuilder); };
+	Job.PostExecute = [this]() { PostExecute_RenderThread(); };
+	JobHandle = FComputeScheduler::Get().RegisterJob(MoveTemp(Job));
+}
+
+FNoiseBatchService::~FNoiseBatchService()
+{
+	FComputeScheduler::UnregisterJob(JobHandle);
+}
+
+bool FNoiseBatchService::Prepare_RenderThread(uint32& OutInputHash)
+{
+	check(IsInRenderingThread());
+	SCOPE_CYCLE_COUNTER(STAT_NoiseBatch_Prepare);
+
+	for (TPair<FNoiseBatchKey, TArray<FWhiteNoiseCSProxy*>>& Batch : Batches)
+	{
+		Batch.Value.Reset();
+	}
+
+	bool bAnyToRender = false;
+	OutInputHash = 0;
+	CachedProxies.Reset();
+	for (const TSharedRef<FWhiteNoiseCSProxy, ESPMode::ThreadSafe>& ProxyRef : Proxies)
+	{
+		FWhiteNoiseCSProxy* Proxy = &ProxyRef.Get();
+		Proxy->LatchParameters_RenderThread();
+		if (!Proxy->ShouldRender_RenderThread())
+		{
+			continue;
+		}
+		OutInputHash = HashCombine(OutInputHash, Proxy->GetRequestHash_RenderThread());
+		bAnyToRender = true;
+
+		if (Proxy->UsesTileCache_RenderThread())
+		{
+			// Cached noise mostly doesn't dispatch at all, so there is nothing to batch
+			CachedProxies.Add(Proxy);
+		}
+		else
+		{
+			const FCoherentNoiseSettings& Noise = Proxy->GetNoiseSettings_RenderThread();
+			const FNoiseBatchKey Key = { Proxy->GetOutputSize_RenderThread(), Proxy->GetOutputFormat_RenderThread(), Noise.Type, Noise.Fractal };
+			Batches.FindOrAdd(Key).Add(Proxy);
+		}
+	}
+	return bAnyToRender;
+}
+
+void FNoiseBatchService::AddPasses_RenderThread(FRDGBuilder& GraphBuilder)
+{
+	check(IsInRenderingThread());
+	SCOPE_CYCLE_COUNTER(STAT_NoiseBatch_AddPasses);
+	CSV_SCOPED_TIMING_STAT(ComputeShaders, NoiseBatchAddPasses);
+	RDG_EVENT_SCOPE(GraphBuilder, "NoiseBatch");
+
+	for (FWhiteNoiseCSProxy* Proxy : CachedProxies)
+	{
+		Proxy->AddPasses_RenderThread(GraphBuilder);
+	}
+
+	for (TPair<FNoiseBatchKey, TArray<FWhiteNoiseCSProxy*>>& Batch : Batches)
+	{
+		if (Batch.Value.Num() == 1)
+		{
+			// Nothing to share, write straight into the render target
+			Batch.Value[0]->AddPasses_RenderThread(GraphBuilder);
+		}
+		else if (Batch.Value.Num() > 1)
+		{
+			FWhiteNoiseCSProxy::AddBatchedPasses_RenderThread(GraphBuilder, Batch.Value);
+		}
+	}
+}
+
+void FNoiseBatchService::PostExecute_RenderThread()
+{
+	// New tiles have been extracted now, so it's safe to evict
+	if (CachedProxies.Num() > 0)
+	{
+		FNoiseTileCache::Get().Trim();
+	}
+
+	// Drop keys that weren't used this frame so the map doesn't grow with every resize
+	for (auto It = Batches.CreateIterator(); It; ++It)
+	{
+		if (It.Value().Num() == 0)
+		{
+			It.RemoveCurrent();
+		}
+	}
+}
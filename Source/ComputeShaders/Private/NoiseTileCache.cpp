@@ -0,0 +1,238 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "NoiseTileCache.h"
+
+#include "ComputeShaderStats.h"
+#include "RenderGraphUtils.h"
+#include "RenderTargetPool.h"
+#include "WhiteNoiseCS.h"
+#include "HAL/IConsoleManager.h"
+
+
+static TAutoConsoleVariable<int32> CVarNoiseTileCacheEnable(
+	TEXT("Noise.TileCache.Enable"),
+	1,
+	TEXT("Serve noise requests from the tile cache instead of generating them every frame."),
+	ECVF_RenderThreadSafe
+);
+
+static TAutoConsoleVariable<int32> CVarNoiseTileCacheBudgetMB(
+	TEXT("Noise.TileCache.BudgetMB"),
+	64,
+	TEXT("GPU memory the noise tile cache can keep resident before the least recently used tiles are evicted."),
+	ECVF_RenderThreadSafe
+);
+
+static TAutoConsoleVariable<int32> CVarNoiseTileCacheTileSize(
+	TEXT("Noise.TileCache.TileSize"),
+	256,
+	TEXT("Width and height of a noise tile in texels. Changing it invalidates the resident tiles."),
+	ECVF_RenderThreadSafe
+);
+
+DECLARE_CYCLE_STAT(TEXT("NoiseTileCache AddPasses (RT)"), STAT_NoiseTileCache_AddPasses, STATGROUP_ComputeShaders);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Noise Tile Hits"), STAT_NoiseTileCache_Hits, STATGROUP_ComputeShaders);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Noise Tile Misses"), STAT_NoiseTileCache_Misses, STATGROUP_ComputeShaders);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Noise Tile Evictions"), STAT_NoiseTileCache_Evictions, STATGROUP_ComputeShaders);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Noise Tiles Resident"), STAT_NoiseTileCache_ResidentTiles, STATGROUP_ComputeShaders);
+DECLARE_MEMORY_STAT(TEXT("Noise Tile Cache Memory"), STAT_NoiseTileCache_ResidentMemory, STATGROUP_ComputeShaders);
+
+FNoiseTileCache* FNoiseTileCache::Instance = nullptr;
+FCriticalSection FNoiseTileCache::StatsCriticalSection;
+FNoiseTileCacheStats FNoiseTileCache::Stats;
+
+FNoiseTileKey::FNoiseTileKey(const FCoherentNoiseSettings& Settings, const uint32 InSeed, const FIntPoint& InOrigin, const FIntPoint& InSize, const EPixelFormat InFormat):
+	Type(Settings.Type),
+	Fractal(Settings.Fractal),
+	NumOctaves(Settings.GetNumOctaves()),
+	Frequency(Settings.Frequency),
+	// Unused by a single octave, so they shouldn't stop it from being shared
+	Lacunarity(NumOctaves > 1 ? Settings.Lacunarity : 0.f),
+	Gain(NumOctaves > 1 ? Settings.Gain : 0.f),
+	Seed(InSeed),
+	Origin(InOrigin),
+	Size(InSize),
+	Format(InFormat)
+{}
+
+FNoiseTileCache& FNoiseTileCache::Get()
+{
+	check(IsInRenderingThread());
+
+	if (Instance == nullptr)
+	{
+		Instance = new FNoiseTileCache();
+	}
+	return *Instance;
+}
+
+void FNoiseTileCache::Shutdown()
+{
+	ENQUEUE_RENDER_COMMAND(ShutdownNoiseTileCache)([](FRHICommandListImmediate& RHICmdList)
+	{
+		delete Instance;
+		Instance = nullptr;
+	});
+}
+
+bool FNoiseTileCache::IsEnabled()
+{
+	return CVarNoiseTileCacheEnable.GetValueOnAnyThread() != 0;
+}
+
+FNoiseTileCache::~FNoiseTileCache()
+{
+	for (const TPair<FNoiseTileKey, TUniquePtr<FTile>>& Pair : Tiles)
+	{
+		ReleaseTile(*Pair.Value);
+	}
+}
+
+void FNoiseTileCache::ReleaseTile(const FTile& Tile)
+{
+	DEC_MEMORY_STAT_BY(STAT_NoiseTileCache_ResidentMemory, Tile.NumBytes);
+	DEC_DWORD_STAT(STAT_NoiseTileCache_ResidentTiles);
+
+	FScopeLock Lock(&StatsCriticalSection);
+	Stats.NumResidentTiles--;
+	Stats.ResidentBytes -= Tile.NumBytes;
+}
+
+void FNoiseTileCache::AddPasses(FRDGBuilder& GraphBuilder, const FRDGTextureRef Output, const FCoherentNoiseSettings& Settings, const uint32 Seed, const FIntPoint& RegionOffset)
+{
+	check(IsInRenderingThread());
+	SCOPE_CYCLE_COUNTER(STAT_NoiseTileCache_AddPasses);
+
+	const FIntPoint Size = Output->Desc.Extent;
+	const EPixelFormat Format = Output->Desc.Format;
+	const int32 TileSize = FMath::Max(CVarNoiseTileCacheTileSize.GetValueOnRenderThread(), NUM_THREADS_PER_GROUP_DIMENSION);
+	const int64 TileBytes = static_cast<int64>(TileSize) * TileSize * GPixelFormats[Format].BlockBytes;
+	RDG_EVENT_SCOPE(GraphBuilder, "NoiseTileCache %dx%d", Size.X, Size.Y);
+
+	// Tiles are aligned to multiples of TileSize in noise space, so the same texel always lands in the same tile
+	auto FloorDivide = [TileSize](const int32 Value) { return Value >= 0 ? Value / TileSize : -((TileSize - 1 - Value) / TileSize); };
+	const FIntPoint FirstTile(FloorDivide(RegionOffset.X), FloorDivide(RegionOffset.Y));
+	const FIntPoint LastTile(FloorDivide(RegionOffset.X + Size.X - 1), FloorDivide(RegionOffset.Y + Size.Y - 1));
+
+	int32 NumHits = 0;
+	int32 NumMisses = 0;
+	int32 NumNewTiles = 0;
+	for (int32 TileY = FirstTile.Y; TileY <= LastTile.Y; TileY++)
+	{
+		for (int32 TileX = FirstTile.X; TileX <= LastTile.X; TileX++)
+		{
+			const FIntPoint Origin(TileX * TileSize, TileY * TileSize);
+			const FNoiseTileKey Key(Settings, Seed, Origin, FIntPoint(TileSize, TileSize), Format);
+
+			TUniquePtr<FTile>& Tile = Tiles.FindOrAdd(Key);
+			if (!Tile.IsValid())
+			{
+				Tile = MakeUnique<FTile>();
+				Tile->NumBytes = TileBytes;
+				NumNewTiles++;
+
+				INC_MEMORY_STAT_BY(STAT_NoiseTileCache_ResidentMemory, TileBytes);
+				INC_DWORD_STAT(STAT_NoiseTileCache_ResidentTiles);
+			}
+			Tile->LastUsed = ++UseCounter;
+
+			FRDGTextureRef TileTex;
+			if (Tile->Texture.IsValid())
+			{
+				TileTex = GraphBuilder.RegisterExternalTexture(Tile->Texture, TEXT("NoiseTile"));
+				NumHits++;
+			}
+			else if (Tile->PendingGraph == &GraphBuilder)
+			{
+				// Generated earlier in this graph, it's only extracted once the graph executes
+				TileTex = Tile->PendingTexture;
+				NumHits++;
+			}
+			else
+			{
+				const FRDGTextureDesc Desc = FRDGTextureDesc::Create2D(Key.Size, Format, FClearValueBinding::Black, TexCreate_ShaderResource | TexCreate_UAV);
+				TileTex = FindOrCreatePooledTexture(GraphBuilder, Desc, Tile->Texture, TEXT("NoiseTile"));
+				AddCoherentNoisePass(GraphBuilder, GraphBuilder.CreateUAV(TileTex), Key.Size, Settings, Seed, Origin);
+				Tile->PendingGraph = &GraphBuilder;
+				Tile->PendingTexture = TileTex;
+				NumMisses++;
+			}
+
+			// The part of the tile that overlaps the request
+			const FIntPoint Min = FIntPoint(FMath::Max(Origin.X, RegionOffset.X), FMath::Max(Origin.Y, RegionOffset.Y));
+			const FIntPoint Max = FIntPoint(FMath::Min(Origin.X + TileSize, RegionOffset.X + Size.X), FMath::Min(Origin.Y + TileSize, RegionOffset.Y + Size.Y));
+
+			FRHICopyTextureInfo CopyInfo;
+			CopyInfo.Size = FIntVector(Max.X - Min.X, Max.Y - Min.Y, 1);
+			CopyInfo.SourcePosition = FIntVector(Min.X - Origin.X, Min.Y - Origin.Y, 0);
+			CopyInfo.DestPosition = FIntVector(Min.X - RegionOffset.X, Min.Y - RegionOffset.Y, 0);
+			AddCopyTexturePass(GraphBuilder, TileTex, Output, CopyInfo);
+		}
+	}
+
+	INC_DWORD_STAT_BY(STAT_NoiseTileCache_Hits, NumHits);
+	INC_DWORD_STAT_BY(STAT_NoiseTileCache_Misses, NumMisses);
+
+	FScopeLock Lock(&StatsCriticalSection);
+	Stats.NumHits += NumHits;
+	Stats.NumMisses += NumMisses;
+	Stats.NumResidentTiles += NumNewTiles;
+	Stats.ResidentBytes += NumNewTiles * TileBytes;
+}
+
+void FNoiseTileCache::Trim()
+{
+	check(IsInRenderingThread());
+
+	const int64 BudgetBytes = static_cast<int64>(FMath::Max(CVarNoiseTileCacheBudgetMB.GetValueOnRenderThread(), 0)) * 1024 * 1024;
+	const int32 TileSize = FMath::Max(CVarNoiseTileCacheTileSize.GetValueOnRenderThread(), NUM_THREADS_PER_GROUP_DIMENSION);
+
+	int64 ResidentBytes = 0;
+	TArray<TPair<uint64, FNoiseTileKey>> Candidates;
+	for (auto It = Tiles.CreateIterator(); It; ++It)
+	{
+		// Tiles of an old tile size can never be hit again
+		if (It.Key().Size != FIntPoint(TileSize, TileSize))
+		{
+			ReleaseTile(*It.Value());
+			It.RemoveCurrent();
+			continue;
+		}
+		// The graphs have executed, so the textures have been extracted
+		It.Value()->PendingGraph = nullptr;
+		It.Value()->PendingTexture = nullptr;
+		ResidentBytes += It.Value()->NumBytes;
+		Candidates.Emplace(It.Value()->LastUsed, It.Key());
+	}
+
+	int32 NumEvicted = 0;
+	if (ResidentBytes > BudgetBytes)
+	{
+		// Oldest first
+		Candidates.Sort([](const TPair<uint64, FNoiseTileKey>& A, const TPair<uint64, FNoiseTileKey>& B) { return A.Key < B.Key; });
+		for (const TPair<uint64, FNoiseTileKey>& Candidate : Candidates)
+		{
+			if (ResidentBytes <= BudgetBytes)
+			{
+				break;
+			}
+
+			const TUniquePtr<FTile> Tile = Tiles.FindAndRemoveChecked(Candidate.Value);
+			ResidentBytes -= Tile->NumBytes;
+			ReleaseTile(*Tile);
+			NumEvicted++;
+		}
+	}
+
+	INC_DWORD_STAT_BY(STAT_NoiseTileCache_Evictions, NumEvicted);
+
+	FScopeLock Lock(&StatsCriticalSection);
+	Stats.NumEvictions += NumEvicted;
+	Stats.BudgetBytes = BudgetBytes;
+}
+
+FNoiseTileCacheStats FNoiseTileCache::GetStats()
+{
+	FScopeLock Lock(&StatsCriticalSection);
+	return Stats;
+}
@@ -0,0 +1,108 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "RayTracingAdaptive.h"
+
+#include "GlobalShader.h"
+#include "RenderGraphUtils.h"
+#include "ShaderParameterStruct.h"
+
+
+class FBuildAdaptiveTileListCS : public FGlobalShader
+{
+public:
+	DECLARE_GLOBAL_SHADER(FBuildAdaptiveTileListCS);
+	SHADER_USE_PARAMETER_STRUCT(FBuildAdaptiveTileListCS, FGlobalShader);
+
+	BEGIN_SHADER_PARAMETER_STRUCT(FParameters, )
+		SHADER_PARAMETER_RDG_TEXTURE(Texture2D<float4>, AdaptiveColor)
+		SHADER_PARAMETER_RDG_TEXTURE(Texture2D<float2>, AdaptiveLuminance)
+		SHADER_PARAMETER(FIntPoint, Dimensions)
+		SHADER_PARAMETER(float, NoiseThreshold)
+		SHADER_PARAMETER(uint32, MaxSamples)
+		SHADER_PARAMETER_RDG_BUFFER_UAV(RWStructuredBuffer<uint>, RWTileList)
+		SHADER_PARAMETER_RDG_BUFFER_UAV(RWBuffer<uint>, RWTileCounter)
+	END_SHADER_PARAMETER_STRUCT()
+
+	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters)
+	{
+		return IsFeatureLevelSupported(Parameters.Platform, ERHIFeatureLevel::SM5);
+	}
+
+	static void ModifyCompilationEnvironment(const FGlobalShaderPermutationParameters& Parameters, FShaderCompilerEnvironment& OutEnvironment)
+	{
+		FGlobalShader::ModifyCompilationEnvironment(Parameters, OutEnvironment);
+		OutEnvironment.SetDefine(TEXT("TILE_SIZE"), RAY_TRACING_ADAPTIVE_TILE_SIZE);
+	}
+};
+
+class FBuildAdaptiveIndirectArgsCS : public FGlobalShader
+{
+public:
+	DECLARE_GLOBAL_SHADER(FBuildAdaptiveIndirectArgsCS);
+	SHADER_USE_PARAMETER_STRUCT(FBuildAdaptiveIndirectArgsCS, FGlobalShader);
+
+	BEGIN_SHADER_PARAMETER_STRUCT(FParameters, )
+		SHADER_PARAMETER_RDG_BUFFER_SRV(Buffer<uint>, TileCounter)
+		SHADER_PARAMETER_RDG_BUFFER_UAV(RWBuffer<uint>, RWIndirectArgs)
+	END_SHADER_PARAMETER_STRUCT()
+
+	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters)
+	{
+		return IsFeatureLevelSupported(Parameters.Platform, ERHIFeatureLevel::SM5);
+	}
+
+	static void ModifyCompilationEnvironment(const FGlobalShaderPermutationParameters& Parameters, FShaderCompilerEnvironment& OutEnvironment)
+	{
+		FGlobalShader::ModifyCompilationEnvironment(Parameters, OutEnvironment);
+		OutEnvironment.SetDefine(TEXT("TILE_SIZE"), RAY_TRACING_ADAPTIVE_TILE_SIZE);
+	}
+};
+
+IMPLEMENT_GLOBAL_SHADER(FBuildAdaptiveTileListCS, "/ComputeShaders/RayTracingAdaptiveCS.usf", "BuildTileListCS", SF_Compute)
+IMPLEMENT_GLOBAL_SHADER(FBuildAdaptiveIndirectArgsCS, "/ComputeShaders/RayTracingAdaptiveCS.usf", "BuildIndirectArgsCS", SF_Compute)
+
+FRDGBufferRef AddBuildAdaptiveTileListPass(FRDGBuilder& GraphBuilder, const FRDGTextureRef AdaptiveColor, const FRDGTextureRef AdaptiveLuminance, const FIntPoint& Dimensions, const FRayTracingAdaptiveSettings& Settings, const FRDGBufferRef TileList)
+{
+	const FRDGBufferRef TileCounter = GraphBuilder.CreateBuffer(FRDGBufferDesc::CreateBufferDesc(sizeof(uint32), 1), TEXT("AdaptiveTileCounter"));
+	const FRDGBufferUAVRef TileCounterUAV = GraphBuilder.CreateUAV(TileCounter, PF_R32_UINT);
+	AddClearUAVPass(GraphBuilder, TileCounterUAV, 0u);
+
+	// One group per tile, the group finds the noisiest pixel and appends the tile
+	{
+		FBuildAdaptiveTileListCS::FParameters* PassParameters = GraphBuilder.AllocParameters<FBuildAdaptiveTileListCS::FParameters>();
+		PassParameters->AdaptiveColor = AdaptiveColor;
+		PassParameters->AdaptiveLuminance = AdaptiveLuminance;
+		PassParameters->Dimensions = Dimensions;
+		PassParameters->NoiseThreshold = Settings.NoiseThreshold;
+		PassParameters->MaxSamples = Settings.MaxSamples;
+		PassParameters->RWTileList = GraphBuilder.CreateUAV(TileList);
+		PassParameters->RWTileCounter = TileCounterUAV;
+
+		const TShaderMapRef<FBuildAdaptiveTileListCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
+		FComputeShaderUtils::AddPass(
+			GraphBuilder,
+			RDG_EVENT_NAME("BuildAdaptiveTileList"),
+			ComputeShader,
+			PassParameters,
+			FComputeShaderUtils::GetGroupCount(Dimensions, RAY_TRACING_ADAPTIVE_TILE_SIZE)
+		);
+	}
+
+	const FRDGBufferRef IndirectArgs = GraphBuilder.CreateBuffer(FRDGBufferDesc::CreateIndirectDesc<FRHIDispatchIndirectParameters>(1), TEXT("AdaptiveIndirectArgs"));
+	{
+		FBuildAdaptiveIndirectArgsCS::FParameters* PassParameters = GraphBuilder.AllocParameters<FBuildAdaptiveIndirectArgsCS::FParameters>();
+		PassParameters->TileCounter = GraphBuilder.CreateSRV(TileCounter, PF_R32_UINT);
+		PassParameters->RWIndirectArgs = GraphBuilder.CreateUAV(IndirectArgs, PF_R32_UINT);
+
+		const TShaderMapRef<FBuildAdaptiveIndirectArgsCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
+		FComputeShaderUtils::AddPass(
+			GraphBuilder,
+			RDG_EVENT_NAME("BuildAdaptiveIndirectArgs"),
+			ComputeShader,
+			PassParameters,
+			FIntVector(1, 1, 1)
+		);
+	}
+
+	return IndirectArgs;
+}
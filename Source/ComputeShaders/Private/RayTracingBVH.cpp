@@ -0,0 +1,421 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "RayTracingBVH.h"
+
+
+namespace
+{
+	FBox GetSphereBounds(const FVector4& Sphere)
+	{
+		const FVector Origin(Sphere.X, Sphere.Y, Sphere.Z);
+		const FVector Extent(FMath::Abs(Sphere.W));
+		return FBox(Origin - Extent, Origin + Extent);
+	}
+
+	// Half the surface area is enough for the SAH, it only ever compares ratios
+	float HalfSurfaceArea(const FBox& Box)
+	{
+		if (!Box.IsValid)
+		{
+			return 0.f;
+		}
+		const FVector Size = Box.GetSize();
+		return Size.X * Size.Y + Size.Y * Size.Z + Size.Z * Size.X;
+	}
+
+	struct FSAHBin
+	{
+		FBox Bounds = FBox(ForceInit);
+		int32 Count = 0;
+	};
+
+	// Binned SAH build shared by the sphere and triangle BVHs, works on primitive bounds only
+	struct FBVHBuilder
+	{
+		FBVHBuilder(TArrayView<const FBox> InBounds, const FSphereBVHBuildSettings& InSettings, TArray<FSphereBVHNode>& OutNodes, TArray<int32>& OutPrimitiveOrder, TArray<int32>& OutRightChildren):
+			Bounds(InBounds),
+			Settings(InSettings),
+			Nodes(OutNodes),
+			PrimitiveOrder(OutPrimitiveOrder),
+			RightChildren(OutRightChildren)
+		{}
+
+		int32 BuildRecursive(int32 Begin, int32 End);
+		void LinkMissIndices();
+
+		TArrayView<const FBox> Bounds;
+		TArray<FVector> Centroids;
+		const FSphereBVHBuildSettings& Settings;
+		TArray<FSphereBVHNode>& Nodes;
+		TArray<int32>& PrimitiveOrder;
+		TArray<int32>& RightChildren;
+	};
+}
+
+void FSphereBVH::Reset()
+{
+	Nodes.Reset();
+	Spheres.Reset();
+	SphereIndices.Reset();
+	ParentIndices.Reset();
+	SpherePositions.Reset();
+	LeafNodes.Reset();
+}
+
+void FSphereBVH::Build(const TArray<FVector4>& InSpheres, const FSphereBVHBuildSettings& Settings)
+{
+	Reset();
+
+	const int32 NumSpheres = InSpheres.Num();
+	if (NumSpheres == 0)
+	{
+		return;
+	}
+
+	TArray<FBox> Bounds;
+	Bounds.SetNumUninitialized(NumSpheres);
+	for (int32 i = 0; i < NumSpheres; i++)
+	{
+		Bounds[i] = GetSphereBounds(InSpheres[i]);
+	}
+
+	TArray<int32> RightChildren;
+	RayTracingBVH::BuildNodes(Bounds, Settings, Nodes, SphereIndices, RightChildren);
+
+	// Store spheres in leaf order so leaves reference a contiguous range
+	Spheres.SetNumUninitialized(NumSpheres);
+	SpherePositions.SetNumUninitialized(NumSpheres);
+	for (int32 i = 0; i < NumSpheres; i++)
+	{
+		Spheres[i] = InSpheres[SphereIndices[i]];
+		SpherePositions[SphereIndices[i]] = i;
+	}
+
+	// Links needed to refit from the leaves up
+	ParentIndices.Init(INDEX_NONE, Nodes.Num());
+	LeafNodes.SetNumUninitialized(NumSpheres);
+	for (int32 NodeIndex = 0; NodeIndex < Nodes.Num(); NodeIndex++)
+	{
+		const FSphereBVHNode& Node = Nodes[NodeIndex];
+		if (Node.IsLeaf())
+		{
+			const int32 First = Node.GetFirstPrimitive();
+			for (int32 i = First; i < First + static_cast<int32>(Node.GetPrimitiveCount()); i++)
+			{
+				LeafNodes[i] = NodeIndex;
+			}
+		}
+		else
+		{
+			ParentIndices[NodeIndex + 1] = NodeIndex;
+			ParentIndices[RightChildren[NodeIndex]] = NodeIndex;
+		}
+	}
+}
+
+void FSphereBVH::Refit(const TArrayView<const int32> ChangedSpheres, const TArrayView<const FVector4> NewSpheres, TArray<int32>& OutChangedSpheres, TArray<int32>& OutChangedNodes)
+{
+	check(NewSpheres.Num() == Spheres.Num());
+
+	// Gather every node that needs refitting, walking up stops at the first node already gathered
+	TArray<int32, TInlineAllocator<64>> DirtyNodes;
+	TSet<int32, DefaultKeyFuncs<int32>, TInlineSetAllocator<64>> VisitedNodes;
+	for (const int32 SphereIndex : ChangedSpheres)
+	{
+		const int32 Position = SpherePositions[SphereIndex];
+		if (Spheres[Position] == NewSpheres[SphereIndex])
+		{
+			continue;
+		}
+		Spheres[Position] = NewSpheres[SphereIndex];
+		OutChangedSpheres.Add(Position);
+
+		bool bAlreadyVisited = false;
+		for (int32 NodeIndex = LeafNodes[Position]; NodeIndex != INDEX_NONE && !bAlreadyVisited; NodeIndex = ParentIndices[NodeIndex])
+		{
+			VisitedNodes.Add(NodeIndex, &bAlreadyVisited);
+			if (!bAlreadyVisited)
+			{
+				DirtyNodes.Add(NodeIndex);
+			}
+		}
+	}
+
+	// Children are always after their parent, so going backwards refits bottom up
+	DirtyNodes.Sort(TGreater<int32>());
+	for (const int32 NodeIndex : DirtyNodes)
+	{
+		FSphereBVHNode& Node = Nodes[NodeIndex];
+
+		FBox NodeBounds(ForceInit);
+		if (Node.IsLeaf())
+		{
+			const uint32 First = Node.GetFirstPrimitive();
+			for (uint32 i = First; i < First + Node.GetPrimitiveCount(); i++)
+			{
+				NodeBounds += GetSphereBounds(Spheres[i]);
+			}
+		}
+		else
+		{
+			// The miss link of the first child is the second child
+			const FSphereBVHNode& FirstChild = Nodes[NodeIndex + 1];
+			const FSphereBVHNode& SecondChild = Nodes[FirstChild.MissIndex];
+			NodeBounds += FBox(FirstChild.BoundsMin, FirstChild.BoundsMax);
+			NodeBounds += FBox(SecondChild.BoundsMin, SecondChild.BoundsMax);
+		}
+
+		if (NodeBounds.Min != Node.BoundsMin || NodeBounds.Max != Node.BoundsMax)
+		{
+			Node.BoundsMin = NodeBounds.Min;
+			Node.BoundsMax = NodeBounds.Max;
+			OutChangedNodes.Add(NodeIndex);
+		}
+	}
+}
+
+int32 FBVHBuilder::BuildRecursive(const int32 Begin, const int32 End)
+{
+	const int32 NodeIndex = Nodes.AddUninitialized();
+	RightChildren.Add(INDEX_NONE);
+
+	FBox NodeBounds(ForceInit);
+	FBox CentroidBounds(ForceInit);
+	for (int32 i = Begin; i < End; i++)
+	{
+		NodeBounds += Bounds[PrimitiveOrder[i]];
+		CentroidBounds += Centroids[PrimitiveOrder[i]];
+	}
+
+	// Don't hold a reference to the node, the array reallocates while recursing
+	Nodes[NodeIndex].BoundsMin = NodeBounds.Min;
+	Nodes[NodeIndex].BoundsMax = NodeBounds.Max;
+	Nodes[NodeIndex].MissIndex = BVH_INVALID_INDEX;
+	Nodes[NodeIndex].PrimitiveData = 0;
+
+	const int32 Count = End - Begin;
+	auto MakeLeaf = [this, NodeIndex, Begin, Count]()
+	{
+		Nodes[NodeIndex].PrimitiveData = (static_cast<uint32>(Begin) << BVH_PRIMITIVE_COUNT_BITS) | static_cast<uint32>(Count);
+		return NodeIndex;
+	};
+
+	if (Count == 1)
+	{
+		return MakeLeaf();
+	}
+
+	// Split along the axis with the largest centroid spread
+	const FVector CentroidExtent = CentroidBounds.GetSize();
+	const int32 Axis = CentroidExtent.X > CentroidExtent.Y
+		? (CentroidExtent.X > CentroidExtent.Z ? 0 : 2)
+		: (CentroidExtent.Y > CentroidExtent.Z ? 1 : 2);
+
+	int32 Mid = INDEX_NONE;
+	if (CentroidExtent[Axis] > SMALL_NUMBER)
+	{
+		// Binned SAH
+		const int32 NumBins = Settings.NumBins;
+		const float BinScale = NumBins / CentroidExtent[Axis];
+		const float AxisMin = CentroidBounds.Min[Axis];
+		auto GetBin = [this, NumBins, BinScale, AxisMin, Axis](const int32 PrimitiveIndex)
+		{
+			return FMath::Clamp(static_cast<int32>((Centroids[PrimitiveIndex][Axis] - AxisMin) * BinScale), 0, NumBins - 1);
+		};
+
+		TArray<FSAHBin, TInlineAllocator<32>> Bins;
+		Bins.SetNum(NumBins);
+		for (int32 i = Begin; i < End; i++)
+		{
+			FSAHBin& Bin = Bins[GetBin(PrimitiveOrder[i])];
+			Bin.Bounds += Bounds[PrimitiveOrder[i]];
+			Bin.Count++;
+		}
+
+		// Sweep from the right to get the cost of everything right of each split plane
+		TArray<float, TInlineAllocator<32>> RightCosts;
+		RightCosts.SetNumUninitialized(NumBins - 1);
+		FBox Accumulated(ForceInit);
+		int32 AccumulatedCount = 0;
+		for (int32 Bin = NumBins - 1; Bin > 0; Bin--)
+		{
+			Accumulated += Bins[Bin].Bounds;
+			AccumulatedCount += Bins[Bin].Count;
+			RightCosts[Bin - 1] = AccumulatedCount * HalfSurfaceArea(Accumulated);
+		}
+
+		// Sweep from the left to find the cheapest split plane
+		Accumulated = FBox(ForceInit);
+		AccumulatedCount = 0;
+		float BestCost = TNumericLimits<float>::Max();
+		int32 BestSplit = INDEX_NONE;
+		for (int32 Bin = 0; Bin < NumBins - 1; Bin++)
+		{
+			Accumulated += Bins[Bin].Bounds;
+			AccumulatedCount += Bins[Bin].Count;
+			if (AccumulatedCount == 0 || AccumulatedCount == Count)
+			{
+				continue;
+			}
+
+			const float Cost = AccumulatedCount * HalfSurfaceArea(Accumulated) + RightCosts[Bin];
+			if (Cost < BestCost)
+			{
+				BestCost = Cost;
+				BestSplit = Bin;
+			}
+		}
+
+		const float NodeArea = FMath::Max(HalfSurfaceArea(NodeBounds), SMALL_NUMBER);
+		const float SplitCost = Settings.TraversalCost + BestCost / NodeArea;
+		if (Count <= Settings.MaxLeafSize && Count <= SplitCost)
+		{
+			return MakeLeaf();
+		}
+
+		if (BestSplit != INDEX_NONE)
+		{
+			// Partition indices in place around the split plane
+			int32 Left = Begin;
+			int32 Right = End - 1;
+			while (Left <= Right)
+			{
+				if (GetBin(PrimitiveOrder[Left]) <= BestSplit)
+				{
+					Left++;
+				}
+				else
+				{
+					Swap(PrimitiveOrder[Left], PrimitiveOrder[Right]);
+					Right--;
+				}
+			}
+			Mid = Left;
+		}
+	}
+
+	if (Mid == INDEX_NONE || Mid == Begin || Mid == End)
+	{
+		if (Count <= Settings.MaxLeafSize)
+		{
+			return MakeLeaf();
+		}
+
+		// All centroids are (nearly) coincident, fall back to an even split so leaves stay small
+		Sort(PrimitiveOrder.GetData() + Begin, Count, [this, Axis](const int32 A, const int32 B)
+		{
+			return Centroids[A][Axis] < Centroids[B][Axis];
+		});
+		Mid = Begin + Count / 2;
+	}
+
+	// First child is always NodeIndex + 1
+	BuildRecursive(Begin, Mid);
+	RightChildren[NodeIndex] = BuildRecursive(Mid, End);
+
+	return NodeIndex;
+}
+
+void FBVHBuilder::LinkMissIndices()
+{
+	// The miss link of a left child is its sibling, the right child inherits the parent's miss link
+	TArray<TPair<int32, uint32>, TInlineAllocator<64>> Stack;
+	Stack.Emplace(0, BVH_INVALID_INDEX);
+	while (Stack.Num() > 0)
+	{
+		const TPair<int32, uint32> Entry = Stack.Pop(false);
+		FSphereBVHNode& Node = Nodes[Entry.Key];
+		Node.MissIndex = Entry.Value;
+
+		if (!Node.IsLeaf())
+		{
+			const int32 RightChild = RightChildren[Entry.Key];
+			Stack.Emplace(RightChild, Entry.Value);
+			Stack.Emplace(Entry.Key + 1, static_cast<uint32>(RightChild));
+		}
+	}
+}
+
+void RayTracingBVH::BuildNodes(const TArrayView<const FBox> Bounds, const FSphereBVHBuildSettings& Settings, TArray<FSphereBVHNode>& OutNodes, TArray<int32>& OutPrimitiveOrder, TArray<int32>& OutRightChildren)
+{
+	OutNodes.Reset();
+	OutPrimitiveOrder.Reset();
+	OutRightChildren.Reset();
+
+	const int32 NumPrimitives = Bounds.Num();
+	if (NumPrimitives == 0)
+	{
+		return;
+	}
+
+	check(Settings.MaxLeafSize > 0 && static_cast<uint32>(Settings.MaxLeafSize) <= BVH_PRIMITIVE_COUNT_MASK);
+	check(Settings.NumBins > 1);
+	check(static_cast<uint32>(NumPrimitives) < (1u << (32 - BVH_PRIMITIVE_COUNT_BITS)));
+
+	// Cache centroids, the build only shuffles indices
+	FBVHBuilder Builder(Bounds, Settings, OutNodes, OutPrimitiveOrder, OutRightChildren);
+	Builder.Centroids.SetNumUninitialized(NumPrimitives);
+	OutPrimitiveOrder.SetNumUninitialized(NumPrimitives);
+	for (int32 i = 0; i < NumPrimitives; i++)
+	{
+		Builder.Centroids[i] = Bounds[i].GetCenter();
+		OutPrimitiveOrder[i] = i;
+	}
+
+	// A binary tree has at most 2N-1 nodes
+	OutNodes.Reserve(2 * NumPrimitives - 1);
+	OutRightChildren.Reserve(2 * NumPrimitives - 1);
+
+	Builder.BuildRecursive(0, NumPrimitives);
+	Builder.LinkMissIndices();
+}
+
+void FSphereBVH::Trace(const FRayTracingRay& Ray, FRayTracingHit& BestHit) const
+{
+	const FVector InvDirection = RayTracingCPU::SafeInverse(Ray.Direction);
+
+	// Stackless traversal, mirrors TraceBVH in RayTracingCS.usf
+	uint32 NodeIndex = Nodes.Num() > 0 ? 0 : BVH_INVALID_INDEX;
+	while (NodeIndex != BVH_INVALID_INDEX)
+	{
+		const FSphereBVHNode& Node = Nodes[NodeIndex];
+		if (RayTracingCPU::IntersectBox(Ray.Origin, InvDirection, Node.BoundsMin, Node.BoundsMax, BestHit.Distance))
+		{
+			if (Node.IsLeaf())
+			{
+				const uint32 First = Node.GetFirstPrimitive();
+				const uint32 Last = First + Node.GetPrimitiveCount();
+				for (uint32 i = First; i < Last; i++)
+				{
+					RayTracingCPU::IntersectSphere(Ray, BestHit, Spheres[i]);
+				}
+				NodeIndex = Node.MissIndex;
+			}
+			else
+			{
+				NodeIndex++;
+			}
+		}
+		else
+		{
+			NodeIndex = Node.MissIndex;
+		}
+	}
+}
+
+float FSphereBVH::ComputeSAHCost(const float TraversalCost) const
+{
+	if (Nodes.Num() == 0)
+	{
+		return 0.f;
+	}
+
+	const float RootArea = FMath::Max(HalfSurfaceArea(FBox(Nodes[0].BoundsMin, Nodes[0].BoundsMax)), SMALL_NUMBER);
+	float Cost = 0.f;
+	for (const FSphereBVHNode& Node : Nodes)
+	{
+		const float Probability = HalfSurfaceArea(FBox(Node.BoundsMin, Node.BoundsMax)) / RootArea;
+		Cost += Probability * (Node.IsLeaf() ? static_cast<float>(Node.GetPrimitiveCount()) : TraversalCost);
+	}
+	return Cost;
+}
@@ -0,0 +1,488 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "RayTracingCPU.h"
+
+#include "RayTracingManager.h"
+#include "RayTracingMeshBVH.h"
+#include "Async/ParallelFor.h"
+#include "Engine/Texture2D.h"
+
+
+namespace
+{
+	// Shade() reflection coefficient
+	const float SpecularCoefficient = 0.6f;
+	// Offset applied along the normal to avoid self intersection
+	const float HitNormalOffset = 0.001f;
+
+	template<typename TPixel>
+	void ConvertPixels(const void* Data, const int32 NumPixels, TArray<FLinearColor>& OutPixels, TFunctionRef<FLinearColor(const TPixel&)> Convert)
+	{
+		const TPixel* Pixels = static_cast<const TPixel*>(Data);
+		OutPixels.SetNumUninitialized(NumPixels);
+		for (int32 i = 0; i < NumPixels; i++)
+		{
+			OutPixels[i] = Convert(Pixels[i]);
+		}
+	}
+}
+
+bool FRayTracingSkyboxImage::Initialize(UTexture2D* Texture)
+{
+	Size = FIntPoint::ZeroValue;
+	Pixels.Reset();
+
+	if (Texture == nullptr)
+	{
+		return false;
+	}
+
+	const bool bSRGB = Texture->SRGB;
+	auto ConvertColor = [bSRGB](const FColor& Color) { return bSRGB ? FLinearColor(Color) : Color.ReinterpretAsLinear(); };
+	auto ConvertHalf = [](const FFloat16Color& Color) { return FLinearColor(Color); };
+
+#if WITH_EDITORONLY_DATA
+	// Source data is always uncompressed, prefer it when we have it
+	TArray64<uint8> MipData;
+	if (Texture->Source.IsValid() && Texture->Source.GetMipData(MipData, 0))
+	{
+		const int32 NumPixels = Texture->Source.GetSizeX() * Texture->Source.GetSizeY();
+		switch (Texture->Source.GetFormat())
+		{
+		case TSF_BGRA8:
+			ConvertPixels<FColor>(MipData.GetData(), NumPixels, Pixels, ConvertColor);
+			break;
+		case TSF_RGBA16F:
+			ConvertPixels<FFloat16Color>(MipData.GetData(), NumPixels, Pixels, ConvertHalf);
+			break;
+		default:
+			break;
+		}
+
+		if (Pixels.Num() == NumPixels)
+		{
+			Size = FIntPoint(Texture->Source.GetSizeX(), Texture->Source.GetSizeY());
+			return true;
+		}
+	}
+#endif // WITH_EDITORONLY_DATA
+
+	FTexturePlatformData* PlatformData = Texture->PlatformData;
+	if (PlatformData == nullptr || PlatformData->Mips.Num() == 0)
+	{
+		printw("Skybox %s has no platform data, the CPU backend will render a black sky", *Texture->GetName())
+		return false;
+	}
+
+	FTexture2DMipMap& Mip = PlatformData->Mips[0];
+	const int32 NumPixels = Mip.SizeX * Mip.SizeY;
+	const void* Data = Mip.BulkData.Lock(LOCK_READ_ONLY);
+	if (Data != nullptr)
+	{
+		switch (PlatformData->PixelFormat)
+		{
+		case PF_B8G8R8A8:
+			ConvertPixels<FColor>(Data, NumPixels, Pixels, ConvertColor);
+			break;
+		case PF_FloatRGBA:
+			ConvertPixels<FFloat16Color>(Data, NumPixels, Pixels, ConvertHalf);
+			break;
+		case PF_A32B32G32R32F:
+			ConvertPixels<FLinearColor>(Data, NumPixels, Pixels, [](const FLinearColor& Color) { return Color; });
+			break;
+		default:
+			printw("Skybox %s uses compressed pixel format %s, set it to an uncompressed format for the CPU backend",
+				*Texture->GetName(), GPixelFormats[PlatformData->PixelFormat].Name)
+			break;
+		}
+	}
+	Mip.BulkData.Unlock();
+
+	if (Pixels.Num() != NumPixels)
+	{
+		Pixels.Reset();
+		return false;
+	}
+
+	Size = FIntPoint(Mip.SizeX, Mip.SizeY);
+	return true;
+}
+
+FLinearColor FRayTracingSkyboxImage::Sample(const FVector2D& UV) const
+{
+	if (!IsValid())
+	{
+		return FLinearColor::Black;
+	}
+
+	// Texel centres are at half integers
+	const float X = UV.X * Size.X - 0.5f;
+	const float Y = UV.Y * Size.Y - 0.5f;
+	const int32 X0 = FMath::FloorToInt(X);
+	const int32 Y0 = FMath::FloorToInt(Y);
+	const float FracX = X - X0;
+	const float FracY = Y - Y0;
+
+	auto Fetch = [this](const int32 PixelX, const int32 PixelY)
+	{
+		const int32 WrappedX = (PixelX % Size.X + Size.X) % Size.X;
+		const int32 WrappedY = (PixelY % Size.Y + Size.Y) % Size.Y;
+		return Pixels[WrappedY * Size.X + WrappedX];
+	};
+
+	const FLinearColor Top = FMath::Lerp(Fetch(X0, Y0), Fetch(X0 + 1, Y0), FracX);
+	const FLinearColor Bottom = FMath::Lerp(Fetch(X0, Y0 + 1), Fetch(X0 + 1, Y0 + 1), FracX);
+	return FMath::Lerp(Top, Bottom, FracY);
+}
+
+FRayTracingRay FRayTracingCPURenderer::CreateCameraRay(const FRayTracingParams& Params, const FVector2D& UV)
+{
+	// Transform camera origin to world space
+	const FVector Origin = Params.CameraToWorldMat.TransformPosition(FVector::ZeroVector);
+
+	// Transform UV from view-space to camera space
+	FVector Direction(Params.CameraInverseProjection.TransformFVector4(FVector4(UV.X, UV.Y, 0.f, 1.f)));
+	// Transform from camera space to world space
+	Direction = Params.CameraToWorldMat.TransformVector(Direction);
+
+	return FRayTracingRay(Origin, Direction.GetSafeNormal());
+}
+
+void FRayTracingCPURenderer::Trace(const FRayTracingRay& Ray, FRayTracingHit& BestHit, const FSphereBVH& BVH, const FTriangleMeshBVH* MeshBVH)
+{
+	RayTracingCPU::IntersectGroundPlane(Ray, BestHit);
+	BVH.Trace(Ray, BestHit);
+	if (MeshBVH)
+	{
+		MeshBVH->Trace(Ray, BestHit);
+	}
+}
+
+FVector FRayTracingCPURenderer::TraceRay(FRayTracingRay Ray, const FSphereBVH& BVH, const FTriangleMeshBVH* MeshBVH, const FRayTracingSkyboxImage& Skybox, const int32 MaxBounces, int64& NumRays)
+{
+	FVector Result(ForceInitToZero);
+	for (int32 Bounce = 0; Bounce < MaxBounces; Bounce++)
+	{
+		NumRays++;
+
+		// Trace
+		FRayTracingHit Hit;
+		Trace(Ray, Hit, BVH, MeshBVH);
+
+		// Shade
+		if (Hit.IsValid())
+		{
+			Ray.Origin = Hit.Position + Hit.Normal * HitNormalOffset;
+			Ray.Direction = Ray.Direction - 2.f * FVector::DotProduct(Ray.Direction, Hit.Normal) * Hit.Normal;
+			Ray.Energy *= SpecularCoefficient;
+		}
+		else
+		{
+			// Hit the sky
+			const float Theta = FMath::Atan2(Ray.Direction.X, Ray.Direction.Y) / PI + 0.5f;
+			const float Phi = FMath::Acos(FMath::Clamp(Ray.Direction.Z, -1.f, 1.f)) / PI;
+			const FLinearColor Sky = Skybox.Sample(FVector2D(Theta, Phi));
+			Result += Ray.Energy * FVector(Sky.R, Sky.G, Sky.B);
+			break;
+		}
+	}
+	return Result;
+}
+
+FLinearColor FRayTracingCPURenderer::RenderPixel(const FRayTracingParams& Params, const FRayTracingSkyboxImage& Skybox, const FIntPoint& Pixel, int64& NumRays)
+{
+	const int32 NumSamples = FMath::Max(1, Params.NumSamples);
+	const float SampleWeight = 1.f / NumSamples;
+
+	const TArray<FVector2D>& SampleTable = FRayTracingSampleTables::Get(Params.SampleSequence);
+	const FVector2D Rotation = Params.bPerPixelRotation ? FRayTracingSampleTables::GetPixelRotation(Pixel) : FVector2D::ZeroVector;
+
+	FVector Result(ForceInitToZero);
+	for (int32 Sample = 0; Sample < NumSamples; Sample++)
+	{
+		const FVector2D Offset = FRayTracingSampleTables::GetSample(SampleTable, Params.FirstSample + Sample, Rotation);
+
+		// Transform pixel to [-1,1] range, same as ConvertUV
+		FVector2D UV = ((FVector2D(Pixel) + Offset) / FVector2D(Params.TexSize)) * 2.f - 1.f;
+		UV.Y = 1.f - UV.Y;
+
+		Result += TraceRay(CreateCameraRay(Params, UV), *Params.SphereBVH, Params.MeshBVH.Get(), Skybox, Params.MaxBounces, NumRays) * SampleWeight;
+	}
+
+	return FLinearColor(Result.X, Result.Y, Result.Z, 1.f);
+}
+
+FRayTracingCPUStats FRayTracingCPURenderer::Render(const FRayTracingParams& Params, const FRayTracingSkyboxImage& Skybox, TArray<FLinearColor>& OutImage, const int32 TileSize)
+{
+	FRayTracingCPUStats Stats;
+	if (Params.TexSize.X <= 0 || Params.TexSize.Y <= 0 || !Params.SphereBVH.IsValid())
+	{
+		return Stats;
+	}
+
+	if (Params.UseAdaptiveSampling())
+	{
+		return RenderAdaptive(Params, Skybox, OutImage);
+	}
+
+	OutImage.SetNumUninitialized(Params.TexSize.X * Params.TexSize.Y);
+
+	const FIntPoint NumTiles(
+		FMath::DivideAndRoundUp(Params.TexSize.X, TileSize),
+		FMath::DivideAndRoundUp(Params.TexSize.Y, TileSize)
+	);
+	Stats.NumTiles = NumTiles.X * NumTiles.Y;
+
+	FThreadSafeCounter64 TotalRays;
+	const double StartTime = FPlatformTime::Seconds();
+
+	// ParallelFor hands out tiles to workers as they become free, so expensive tiles don't hold up the others
+	ParallelFor(Stats.NumTiles, [&](const int32 TileIndex)
+	{
+		const FIntPoint TileMin(TileIndex % NumTiles.X * TileSize, TileIndex / NumTiles.X * TileSize);
+		const FIntPoint TileMax(
+			FMath::Min(TileMin.X + TileSize, Params.TexSize.X),
+			FMath::Min(TileMin.Y + TileSize, Params.TexSize.Y)
+		);
+
+		int64 TileRays = 0;
+		for (int32 Y = TileMin.Y; Y < TileMax.Y; Y++)
+		{
+			for (int32 X = TileMin.X; X < TileMax.X; X++)
+			{
+				OutImage[Y * Params.TexSize.X + X] = RenderPixel(Params, Skybox, FIntPoint(X, Y), TileRays);
+			}
+		}
+		TotalRays.Add(TileRays);
+	});
+
+	Stats.RenderSeconds = FPlatformTime::Seconds() - StartTime;
+	Stats.NumRays = TotalRays.GetValue();
+	return Stats;
+}
+
+void FRayTracingCPURenderer::ComputeGuides(const FRayTracingParams& Params, const FRayTracingSkyboxImage& Skybox, FRayTracingCPUGuides& OutGuides)
+{
+	const int32 NumPixels = Params.TexSize.X * Params.TexSize.Y;
+	OutGuides.NormalDepth.SetNumUninitialized(NumPixels);
+	OutGuides.Albedo.SetNumUninitialized(NumPixels);
+	if (NumPixels <= 0 || !Params.SphereBVH.IsValid())
+	{
+		return;
+	}
+
+	ParallelFor(Params.TexSize.Y, [&](const int32 Y)
+	{
+		for (int32 X = 0; X < Params.TexSize.X; X++)
+		{
+			FVector2D UV = ((FVector2D(X, Y) + FVector2D(0.5f, 0.5f)) / FVector2D(Params.TexSize)) * 2.f - 1.f;
+			UV.Y = 1.f - UV.Y;
+			const FRayTracingRay Ray = CreateCameraRay(Params, UV);
+
+			FRayTracingHit Hit;
+			Trace(Ray, Hit, *Params.SphereBVH, Params.MeshBVH.Get());
+
+			const int32 PixelIndex = Y * Params.TexSize.X + X;
+			if (Hit.IsValid())
+			{
+				OutGuides.NormalDepth[PixelIndex] = FVector4(Hit.Normal, Hit.Distance);
+				OutGuides.Albedo[PixelIndex] = FLinearColor(SpecularCoefficient, SpecularCoefficient, SpecularCoefficient);
+			}
+			else
+			{
+				const float Theta = FMath::Atan2(Ray.Direction.X, Ray.Direction.Y) / PI + 0.5f;
+				const float Phi = FMath::Acos(FMath::Clamp(Ray.Direction.Z, -1.f, 1.f)) / PI;
+				OutGuides.NormalDepth[PixelIndex] = FVector4(0.f, 0.f, 0.f, 0.f);
+				OutGuides.Albedo[PixelIndex] = Skybox.Sample(FVector2D(Theta, Phi));
+			}
+		}
+	});
+}
+
+FRayTracingCPUStats FRayTracingCPURenderer::RenderAdaptive(const FRayTracingParams& Params, const FRayTracingSkyboxImage& Skybox, TArray<FLinearColor>& OutImage, TArray<int32>* OutSampleCounts)
+{
+	FRayTracingCPUStats Stats;
+	const int32 NumPixels = Params.TexSize.X * Params.TexSize.Y;
+	const int32 TileSize = RAY_TRACING_ADAPTIVE_TILE_SIZE;
+	const FIntPoint NumTiles(
+		FMath::DivideAndRoundUp(Params.TexSize.X, TileSize),
+		FMath::DivideAndRoundUp(Params.TexSize.Y, TileSize)
+	);
+	Stats.NumTiles = NumTiles.X * NumTiles.Y;
+
+	// Same as AdaptiveColor and AdaptiveLuminance
+	TArray<FVector> ColourSums;
+	TArray<FVector2D> LuminanceSums;
+	TArray<int32> SampleCounts;
+	ColourSums.Init(FVector::ZeroVector, NumPixels);
+	LuminanceSums.Init(FVector2D::ZeroVector, NumPixels);
+	SampleCounts.Init(0, NumPixels);
+
+	const TArray<FVector2D>& SampleTable = FRayTracingSampleTables::Get(Params.SampleSequence);
+	const FRayTracingAdaptiveSettings& Settings = Params.Adaptive;
+
+	auto TraceTile = [&](const int32 TileIndex, const int32 NumSamples, int64& NumRays)
+	{
+		const FIntPoint TileMin(TileIndex % NumTiles.X * TileSize, TileIndex / NumTiles.X * TileSize);
+		const FIntPoint TileMax(
+			FMath::Min(TileMin.X + TileSize, Params.TexSize.X),
+			FMath::Min(TileMin.Y + TileSize, Params.TexSize.Y)
+		);
+
+		for (int32 Y = TileMin.Y; Y < TileMax.Y; Y++)
+		{
+			for (int32 X = TileMin.X; X < TileMax.X; X++)
+			{
+				const int32 PixelIndex = Y * Params.TexSize.X + X;
+				const FVector2D Rotation = Params.bPerPixelRotation ? FRayTracingSampleTables::GetPixelRotation(FIntPoint(X, Y)) : FVector2D::ZeroVector;
+				const uint32 SampleStart = Params.FirstSample + SampleCounts[PixelIndex];
+
+				for (int32 Sample = 0; Sample < NumSamples; Sample++)
+				{
+					const FVector2D Offset = FRayTracingSampleTables::GetSample(SampleTable, SampleStart + Sample, Rotation);
+					FVector2D UV = ((FVector2D(X, Y) + Offset) / FVector2D(Params.TexSize)) * 2.f - 1.f;
+					UV.Y = 1.f - UV.Y;
+
+					const FVector Colour = TraceRay(CreateCameraRay(Params, UV), *Params.SphereBVH, Params.MeshBVH.Get(), Skybox, Params.MaxBounces, NumRays);
+					const float Luminance = RayTracingAdaptive::GetLuminance(Colour);
+					ColourSums[PixelIndex] += Colour;
+					LuminanceSums[PixelIndex] += FVector2D(Luminance, Luminance * Luminance);
+				}
+				SampleCounts[PixelIndex] += NumSamples;
+			}
+		}
+	};
+
+	FThreadSafeCounter64 TotalRays;
+	const double StartTime = FPlatformTime::Seconds();
+
+	// Base samples on every tile
+	const int32 BaseSamples = RayTracingAdaptive::GetBaseSamples(Params.NumSamples);
+	ParallelFor(Stats.NumTiles, [&](const int32 TileIndex)
+	{
+		int64 TileRays = 0;
+		TraceTile(TileIndex, BaseSamples, TileRays);
+		TotalRays.Add(TileRays);
+	});
+
+	// Refinement, same tile test as BuildTileListCS
+	const int32 SamplesPerPass = FMath::Max(1, Settings.SamplesPerPass);
+	TArray<int32> TileList;
+	for (int32 Pass = 0; Pass < Settings.MaxPasses; Pass++)
+	{
+		TileList.Reset();
+		for (int32 TileIndex = 0; TileIndex < Stats.NumTiles; TileIndex++)
+		{
+			const FIntPoint TileMin(TileIndex % NumTiles.X * TileSize, TileIndex / NumTiles.X * TileSize);
+			if (SampleCounts[TileMin.Y * Params.TexSize.X + TileMin.X] >= Settings.MaxSamples)
+			{
+				continue;
+			}
+
+			float TileError = 0.f;
+			for (int32 Y = TileMin.Y; Y < FMath::Min(TileMin.Y + TileSize, Params.TexSize.Y); Y++)
+			{
+				for (int32 X = TileMin.X; X < FMath::Min(TileMin.X + TileSize, Params.TexSize.X); X++)
+				{
+					const int32 PixelIndex = Y * Params.TexSize.X + X;
+					const FVector2D& Luminance = LuminanceSums[PixelIndex];
+					TileError = FMath::Max(TileError, RayTracingAdaptive::GetPixelError(Luminance.X, Luminance.Y, SampleCounts[PixelIndex]));
+				}
+			}
+			if (TileError > Settings.NoiseThreshold)
+			{
+				TileList.Add(TileIndex);
+			}
+		}
+
+		if (TileList.Num() == 0)
+		{
+			break;
+		}
+		Stats.NumRefinedTiles += TileList.Num();
+
+		ParallelFor(TileList.Num(), [&](const int32 ListIndex)
+		{
+			int64 TileRays = 0;
+			TraceTile(TileList[ListIndex], SamplesPerPass, TileRays);
+			TotalRays.Add(TileRays);
+		});
+	}
+
+	OutImage.SetNumUninitialized(NumPixels);
+	for (int32 PixelIndex = 0; PixelIndex < NumPixels; PixelIndex++)
+	{
+		const FVector Colour = ColourSums[PixelIndex] / SampleCounts[PixelIndex];
+		OutImage[PixelIndex] = FLinearColor(Colour.X, Colour.Y, Colour.Z, 1.f);
+	}
+	if (OutSampleCounts)
+	{
+		*OutSampleCounts = MoveTemp(SampleCounts);
+	}
+
+	Stats.RenderSeconds = FPlatformTime::Seconds() - StartTime;
+	Stats.NumRays = TotalRays.GetValue();
+	return Stats;
+}
+
+void FRayTracingCPURenderer::UploadToTexture_RenderThread(FRHICommandListImmediate& RHICmdList, FRHITexture* Texture, const FIntPoint& Size, const TArray<FLinearColor>& Image)
+{
+	check(IsInRenderingThread());
+
+	FRHITexture2D* Texture2D = Texture ? Texture->GetTexture2D() : nullptr;
+	if (Texture2D == nullptr || Image.Num() != Size.X * Size.Y)
+	{
+		return;
+	}
+
+	const FUpdateTextureRegion2D Region(0, 0, 0, 0, Size.X, Size.Y);
+	switch (Texture2D->GetFormat())
+	{
+	case PF_A32B32G32R32F:
+		RHIUpdateTexture2D(Texture2D, 0, Region, Size.X * sizeof(FLinearColor), reinterpret_cast<const uint8*>(Image.GetData()));
+		break;
+	case PF_FloatRGBA:
+		{
+			TArray<FFloat16Color> Converted;
+			Converted.SetNumUninitialized(Image.Num());
+			for (int32 i = 0; i < Image.Num(); i++)
+			{
+				Converted[i] = FFloat16Color(Image[i]);
+			}
+			RHIUpdateTexture2D(Texture2D, 0, Region, Size.X * sizeof(FFloat16Color), reinterpret_cast<const uint8*>(Converted.GetData()));
+		}
+		break;
+	case PF_FloatR11G11B10:
+		{
+			// Each channel is a half float without the sign and the low mantissa bits, negative values clamp to 0
+			auto PackChannel = [](const float Value, const int32 MantissaShift)
+			{
+				const FFloat16 Half(FMath::Max(Value, 0.f));
+				return static_cast<uint32>(Half.Encoded >> MantissaShift);
+			};
+			TArray<uint32> Converted;
+			Converted.SetNumUninitialized(Image.Num());
+			for (int32 i = 0; i < Image.Num(); i++)
+			{
+				Converted[i] = PackChannel(Image[i].R, 4) | PackChannel(Image[i].G, 4) << 11 | PackChannel(Image[i].B, 5) << 22;
+			}
+			RHIUpdateTexture2D(Texture2D, 0, Region, Size.X * sizeof(uint32), reinterpret_cast<const uint8*>(Converted.GetData()));
+		}
+		break;
+	case PF_B8G8R8A8:
+		{
+			const bool bSRGB = EnumHasAnyFlags(Texture2D->GetFlags(), TexCreate_SRGB);
+			TArray<FColor> Converted;
+			Converted.SetNumUninitialized(Image.Num());
+			for (int32 i = 0; i < Image.Num(); i++)
+			{
+				Converted[i] = Image[i].ToFColor(bSRGB);
+			}
+			RHIUpdateTexture2D(Texture2D, 0, Region, Size.X * sizeof(FColor), reinterpret_cast<const uint8*>(Converted.GetData()));
+		}
+		break;
+	default:
+		printw("CPU ray tracing backend can't write to pixel format %s", GPixelFormats[Texture2D->GetFormat()].Name)
+		break;
+	}
+}
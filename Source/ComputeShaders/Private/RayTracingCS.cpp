@@ -2,6 +2,21 @@
 
 #include "RayTracingCS.h"
 
+#include "HAL/IConsoleManager.h"
+
+
+static TAutoConsoleVariable<int32> CVarRayTracingBenchmarkPermutations(
+	TEXT("RayTracing.BenchmarkPermutations"),
+	0,
+	TEXT("Compile the 16x16, 32x32 and 8x4 thread group shapes of RayTracingCS for benchmarking. Without it ThreadGroupShape is always 8x8."),
+	ECVF_ReadOnly
+);
+
+bool FRayTracingCS::ShouldCompileBenchmarkPermutations()
+{
+	return CVarRayTracingBenchmarkPermutations.GetValueOnAnyThread() != 0;
+}
+
 
 //                      Shader Class            Shader Virtual Path			HLSL main function name			Type
 IMPLEMENT_GLOBAL_SHADER(FRayTracingCS, "/ComputeShaders/RayTracingCS.usf",			"MainCS",			SF_Compute)
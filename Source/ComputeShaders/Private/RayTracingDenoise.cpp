@@ -0,0 +1,155 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "RayTracingDenoise.h"
+
+#include "ComputeShaderStats.h"
+#include "GlobalShader.h"
+#include "RenderGraphUtils.h"
+#include "ShaderParameterStruct.h"
+#include "Async/ParallelFor.h"
+
+
+#define RAY_TRACING_DENOISE_THREADGROUP_SIZE 8
+
+DECLARE_CYCLE_STAT(TEXT("RayTracing Denoise CPU"), STAT_RayTracing_DenoiseCPU, STATGROUP_ComputeShaders);
+DECLARE_GPU_STAT_NAMED(RayTracingDenoise, TEXT("Ray Tracing Denoise"));
+
+class FRayTracingDenoiseCS : public FGlobalShader
+{
+public:
+	DECLARE_GLOBAL_SHADER(FRayTracingDenoiseCS);
+	SHADER_USE_PARAMETER_STRUCT(FRayTracingDenoiseCS, FGlobalShader);
+
+	BEGIN_SHADER_PARAMETER_STRUCT(FParameters, )
+		SHADER_PARAMETER_RDG_TEXTURE(Texture2D<float4>, InputTexture)
+		SHADER_PARAMETER_RDG_TEXTURE(Texture2D<float4>, NormalDepthTexture)
+		SHADER_PARAMETER_RDG_TEXTURE(Texture2D<float4>, AlbedoTexture)
+		SHADER_PARAMETER_RDG_TEXTURE_UAV(RWTexture2D<float4>, OutputTexture)
+		SHADER_PARAMETER(FIntPoint, Dimensions)
+		SHADER_PARAMETER(int32, StepSize)
+		SHADER_PARAMETER(float, ColourPhi)
+		SHADER_PARAMETER(float, NormalPower)
+		SHADER_PARAMETER(float, DepthSigma)
+		SHADER_PARAMETER(float, AlbedoSigma)
+	END_SHADER_PARAMETER_STRUCT()
+
+	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters)
+	{
+		return IsFeatureLevelSupported(Parameters.Platform, ERHIFeatureLevel::SM5);
+	}
+
+	static void ModifyCompilationEnvironment(const FGlobalShaderPermutationParameters& Parameters, FShaderCompilerEnvironment& OutEnvironment)
+	{
+		FGlobalShader::ModifyCompilationEnvironment(Parameters, OutEnvironment);
+		OutEnvironment.SetDefine(TEXT("THREADGROUPSIZE_X"), RAY_TRACING_DENOISE_THREADGROUP_SIZE);
+		OutEnvironment.SetDefine(TEXT("THREADGROUPSIZE_Y"), RAY_TRACING_DENOISE_THREADGROUP_SIZE);
+	}
+};
+
+IMPLEMENT_GLOBAL_SHADER(FRayTracingDenoiseCS, "/ComputeShaders/RayTracingDenoiseCS.usf", "MainCS", SF_Compute)
+
+void AddRayTracingDenoisePasses(FRDGBuilder& GraphBuilder, const FRDGTextureRef Colour, const FRDGTextureRef NormalDepth, const FRDGTextureRef Albedo, const FRayTracingDenoiseSettings& Settings, const FRDGTextureRef Output)
+{
+	RDG_EVENT_SCOPE(GraphBuilder, "RayTracing Denoise");
+	RDG_GPU_STAT_SCOPE(GraphBuilder, RayTracingDenoise);
+
+	const FIntPoint Dimensions = Colour->Desc.Extent;
+	const TShaderMapRef<FRayTracingDenoiseCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
+
+	// Ping pong between transient textures, the last iteration writes Output. The input is never written so the caller's texture stays the noisy image
+	const int32 NumIterations = FMath::Max(Settings.Iterations, 1);
+	FRDGTextureDesc Desc = Colour->Desc;
+	Desc.Flags |= TexCreate_ShaderResource | TexCreate_UAV;
+	FRDGTextureRef PingPong[2] = {
+		NumIterations > 1 ? GraphBuilder.CreateTexture(Desc, TEXT("RayTracingDenoiseA")) : nullptr,
+		NumIterations > 2 ? GraphBuilder.CreateTexture(Desc, TEXT("RayTracingDenoiseB")) : nullptr
+	};
+	INC_DWORD_STAT_BY(STAT_ComputeShaders_TransientTextureBytes, Dimensions.X * Dimensions.Y * GPixelFormats[Desc.Format].BlockBytes * FMath::Min(NumIterations - 1, 2));
+
+	FRDGTextureRef Input = Colour;
+	for (int32 Iteration = 0; Iteration < NumIterations; Iteration++)
+	{
+		const FRDGTextureRef IterationOutput = Iteration == NumIterations - 1 ? Output : PingPong[Iteration & 1];
+
+		FRayTracingDenoiseCS::FParameters* PassParameters = GraphBuilder.AllocParameters<FRayTracingDenoiseCS::FParameters>();
+		PassParameters->InputTexture = Input;
+		PassParameters->NormalDepthTexture = NormalDepth;
+		PassParameters->AlbedoTexture = Albedo;
+		PassParameters->OutputTexture = GraphBuilder.CreateUAV(IterationOutput);
+		PassParameters->Dimensions = Dimensions;
+		PassParameters->StepSize = 1 << Iteration;
+		PassParameters->ColourPhi = RayTracingDenoise::GetColourPhi(Settings, Iteration);
+		PassParameters->NormalPower = Settings.NormalPower;
+		PassParameters->DepthSigma = Settings.DepthSigma;
+		PassParameters->AlbedoSigma = Settings.AlbedoSigma;
+
+		FComputeShaderUtils::AddPass(
+			GraphBuilder,
+			RDG_EVENT_NAME("ATrous(Step %d)", 1 << Iteration),
+			ComputeShader,
+			PassParameters,
+			FComputeShaderUtils::GetGroupCount(Dimensions, RAY_TRACING_DENOISE_THREADGROUP_SIZE)
+		);
+		Input = IterationOutput;
+	}
+}
+
+void RayTracingDenoise::Denoise(const FIntPoint& Size, TArray<FLinearColor>& Colour, const TArray<FVector4>& NormalDepth, const TArray<FLinearColor>& Albedo, const FRayTracingDenoiseSettings& Settings)
+{
+	SCOPE_CYCLE_COUNTER(STAT_RayTracing_DenoiseCPU);
+
+	const int32 NumPixels = Size.X * Size.Y;
+	if (NumPixels <= 0 || Colour.Num() != NumPixels || NormalDepth.Num() != NumPixels || Albedo.Num() != NumPixels)
+	{
+		return;
+	}
+
+	TArray<FLinearColor> Output;
+	Output.SetNumUninitialized(NumPixels);
+
+	for (int32 Iteration = 0; Iteration < Settings.Iterations; Iteration++)
+	{
+		const int32 StepSize = 1 << Iteration;
+		const float ColourPhi = GetColourPhi(Settings, Iteration);
+
+		// Same taps and weights as RayTracingDenoiseCS.usf, one row per task
+		ParallelFor(Size.Y, [&](const int32 Y)
+		{
+			for (int32 X = 0; X < Size.X; X++)
+			{
+				const int32 P = Y * Size.X + X;
+
+				FLinearColor Sum = FLinearColor::Transparent;
+				float WeightSum = 0.f;
+				for (int32 OffsetY = -2; OffsetY <= 2; OffsetY++)
+				{
+					const int32 QY = Y + OffsetY * StepSize;
+					if (QY < 0 || QY >= Size.Y)
+					{
+						continue;
+					}
+					for (int32 OffsetX = -2; OffsetX <= 2; OffsetX++)
+					{
+						const int32 QX = X + OffsetX * StepSize;
+						if (QX < 0 || QX >= Size.X)
+						{
+							continue;
+						}
+
+						const int32 Q = QY * Size.X + QX;
+						const float Weight = KernelWeights[FMath::Abs(OffsetX)] * KernelWeights[FMath::Abs(OffsetY)]
+							* GetEdgeWeight(Settings, ColourPhi, Colour[P], Colour[Q], NormalDepth[P], NormalDepth[Q], Albedo[P], Albedo[Q]);
+						Sum += Colour[Q] * Weight;
+						WeightSum += Weight;
+					}
+				}
+
+				// The centre tap always has weight
+				Output[P] = Sum / WeightSum;
+				Output[P].A = 1.f;
+			}
+		});
+
+		Swap(Colour, Output);
+	}
+}
@@ -0,0 +1,558 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "RayTracingGPU.h"
+
+#include "ComputePipeline.h"
+#include "ComputeShaderStats.h"
+#include "RayTracingAdaptive.h"
+#include "RayTracingCS.h"
+#include "RayTracingDenoise.h"
+#include "RayTracingManager.h"
+#include "RayTracingMeshBVH.h"
+#include "RayTracingReconstruct.h"
+#include "RayTracingSampling.h"
+#include "RenderGraphUtils.h"
+#include "ScatterUpload.h"
+#include "ShaderHelpers.h"
+
+
+DECLARE_CYCLE_STAT(TEXT("RayTracing Render (RT)"), STAT_RayTracing_Render_RenderThread, STATGROUP_ComputeShaders);
+DECLARE_CYCLE_STAT(TEXT("RayTracing AddPasses (RT)"), STAT_RayTracing_AddPasses, STATGROUP_ComputeShaders);
+DECLARE_GPU_STAT_NAMED(RayTracing, TEXT("Ray Tracing"));
+
+void FRayTracingGPUState::Release()
+{
+	AccumulationTexture.SafeRelease();
+	OutputTarget.SafeRelease();
+	SphereBuffer.SafeRelease();
+	BVHNodeBuffer.SafeRelease();
+	ScenePacking = FSphereBVHPacking();
+	MeshNodeBuffer.SafeRelease();
+	MeshVertexBuffer.SafeRelease();
+	MeshIndexBuffer.SafeRelease();
+	NumMeshNodes = 0;
+	SampleTable.SafeRelease();
+	SampleTableSequence = INDEX_NONE;
+	UpdateMemoryStats();
+}
+
+void FRayTracingGPUState::UpdateMemoryStats()
+{
+	int64 Memory = 0;
+	if (AccumulationTexture.IsValid())
+	{
+		Memory += AccumulationTexture->ComputeMemorySize();
+	}
+	if (SphereBuffer.IsValid())
+	{
+		Memory += SphereBuffer->Desc.GetTotalNumBytes();
+	}
+	if (BVHNodeBuffer.IsValid())
+	{
+		Memory += BVHNodeBuffer->Desc.GetTotalNumBytes();
+	}
+	for (const TRefCountPtr<FRDGPooledBuffer>* MeshBuffer : { &MeshNodeBuffer, &MeshVertexBuffer, &MeshIndexBuffer })
+	{
+		if (MeshBuffer->IsValid())
+		{
+			Memory += (*MeshBuffer)->Desc.GetTotalNumBytes();
+		}
+	}
+	if (SampleTable.IsValid())
+	{
+		Memory += SampleTable->Desc.GetTotalNumBytes();
+	}
+
+	// What the packed scene buffers would take at full precision
+	int64 SavedMemory = 0;
+	if (ScenePacking.IsValid() && SphereBuffer.IsValid() && BVHNodeBuffer.IsValid())
+	{
+		SavedMemory += static_cast<int64>(SphereBuffer->Desc.NumElements) * (sizeof(FVector4) - sizeof(FPackedSphere));
+		SavedMemory += static_cast<int64>(BVHNodeBuffer->Desc.NumElements) * (sizeof(FSphereBVHNode) - sizeof(FTriangleBVHNode));
+	}
+	if (SavedMemory > TrackedSavedMemory)
+	{
+		INC_MEMORY_STAT_BY(STAT_ComputeShaders_CompactFormatMemorySaved, SavedMemory - TrackedSavedMemory);
+	}
+	else if (SavedMemory < TrackedSavedMemory)
+	{
+		DEC_MEMORY_STAT_BY(STAT_ComputeShaders_CompactFormatMemorySaved, TrackedSavedMemory - SavedMemory);
+	}
+	TrackedSavedMemory = SavedMemory;
+
+	if (Memory > TrackedMemory)
+	{
+		INC_MEMORY_STAT_BY(STAT_ComputeShaders_PersistentMemory, Memory - TrackedMemory);
+	}
+	else if (Memory < TrackedMemory)
+	{
+		DEC_MEMORY_STAT_BY(STAT_ComputeShaders_PersistentMemory, TrackedMemory - Memory);
+	}
+	TrackedMemory = Memory;
+}
+
+void FRayTracingGPURenderer::Render_RenderThread(FRHICommandListImmediate& RHICmdList, const FRayTracingParams& FrameParams, FRayTracingGPUState& State)
+{
+	check(IsInRenderingThread());
+	SCOPE_CYCLE_COUNTER(STAT_RayTracing_Render_RenderThread);
+	CSV_SCOPED_TIMING_STAT(ComputeShaders, RayTracingRenderThread);
+
+	FRDGBuilder GraphBuilder(RHICmdList);
+	AddPasses(GraphBuilder, FrameParams, State);
+	GraphBuilder.Execute();
+
+	// Extractions are only filled in by Execute
+	State.UpdateMemoryStats();
+}
+
+bool FRayTracingGPURenderer::AddPasses(FRDGBuilder& GraphBuilder, const FRayTracingParams& FrameParams, FRayTracingGPUState& State)
+{
+	SCOPE_CYCLE_COUNTER(STAT_RayTracing_AddPasses);
+	RDG_EVENT_SCOPE(GraphBuilder, "RayTracing %dx%d", FrameParams.TexSize.X, FrameParams.TexSize.Y);
+	RDG_GPU_STAT_SCOPE(GraphBuilder, RayTracing);
+
+	// Persistent scene buffers (spheres in BVH leaf order), only the changes are uploaded
+	const FRayTracingSceneUpload& SceneUpload = FrameParams.SceneUpload;
+	if (!SceneUpload.bFullUpload && !State.SphereBuffer.IsValid())
+	{
+		// Only happens if the buffers were released, wait for the next full upload
+		return false;
+	}
+
+	// A new packing always comes with a full upload, the buffers change stride with it
+	if (SceneUpload.bFullUpload)
+	{
+		State.ScenePacking = SceneUpload.Packing;
+	}
+	const FSphereBVHPacking& Packing = State.ScenePacking;
+	const bool bPackedScene = Packing.IsValid();
+
+	FRDGBufferRef SphereBuffer;
+	FRDGBufferRef BVHNodeBuffer;
+	if (bPackedScene)
+	{
+		// Packed here rather than on the game thread so dropped frames still merge their changes at full precision.
+		// The uploads copy the data, so these can go out of scope
+		const int32 NumSpheres = SceneUpload.Spheres.Num();
+		TArray<FPackedSphere> PackedSpheres;
+		PackedSpheres.SetNumUninitialized(NumSpheres);
+		for (int32 i = 0; i < NumSpheres; i++)
+		{
+			PackedSpheres[i] = Packing.PackSphere(SceneUpload.Spheres[i]);
+		}
+
+		const int32 NumNodes = SceneUpload.Nodes.Num();
+		TArray<FTriangleBVHNode> PackedNodes;
+		PackedNodes.SetNumUninitialized(NumNodes);
+		for (int32 i = 0; i < NumNodes; i++)
+		{
+			const uint32 NodeIndex = SceneUpload.bFullUpload ? i : SceneUpload.NodeIndices[i];
+			PackedNodes[i] = Packing.PackNode(SceneUpload.Nodes[i], NodeIndex, SceneUpload.NumNodes);
+		}
+
+		SphereBuffer = UpdatePersistentStructuredBuffer(
+			GraphBuilder,
+			State.SphereBuffer,
+			TEXT("SphereBuffer"),
+			sizeof(FPackedSphere),
+			SceneUpload.NumSpheres,
+			SceneUpload.bFullUpload ? PackedSpheres.GetData() : nullptr,
+			SceneUpload.SphereIndices,
+			PackedSpheres.GetData()
+		);
+		BVHNodeBuffer = UpdatePersistentStructuredBuffer(
+			GraphBuilder,
+			State.BVHNodeBuffer,
+			TEXT("BVHNodeBuffer"),
+			sizeof(FTriangleBVHNode),
+			SceneUpload.NumNodes,
+			SceneUpload.bFullUpload ? PackedNodes.GetData() : nullptr,
+			SceneUpload.NodeIndices,
+			PackedNodes.GetData()
+		);
+
+		RecordCompactFormatBytesSaved(
+			static_cast<int64>(NumSpheres) * (sizeof(FVector4) - sizeof(FPackedSphere)) + static_cast<int64>(NumNodes) * (sizeof(FSphereBVHNode) - sizeof(FTriangleBVHNode)));
+	}
+	else
+	{
+		SphereBuffer = UpdatePersistentStructuredBuffer(
+			GraphBuilder,
+			State.SphereBuffer,
+			TEXT("SphereBuffer"),
+			sizeof(FVector4),
+			SceneUpload.NumSpheres,
+			SceneUpload.bFullUpload ? SceneUpload.Spheres.GetData() : nullptr,
+			SceneUpload.SphereIndices,
+			SceneUpload.Spheres.GetData()
+		);
+
+		BVHNodeBuffer = UpdatePersistentStructuredBuffer(
+			GraphBuilder,
+			State.BVHNodeBuffer,
+			TEXT("BVHNodeBuffer"),
+			sizeof(FSphereBVHNode),
+			SceneUpload.NumNodes,
+			SceneUpload.bFullUpload ? SceneUpload.Nodes.GetData() : nullptr,
+			SceneUpload.NodeIndices,
+			SceneUpload.Nodes.GetData()
+		);
+	}
+
+	// Triangle meshes only go up when they change, the buffers always exist so the shader has something bound
+	FRDGBufferRef MeshNodeBuffer;
+	FRDGBufferRef MeshVertexBuffer;
+	FRDGBufferRef MeshIndexBuffer;
+	if (SceneUpload.bMeshUpload || !State.MeshNodeBuffer.IsValid())
+	{
+		const FTriangleMeshBVH* Mesh = SceneUpload.bMeshUpload ? SceneUpload.Mesh.Get() : nullptr;
+		const bool bHasMesh = Mesh != nullptr && !Mesh->IsEmpty();
+
+		// Never read, NumMeshNodes is 0
+		static const FTriangleBVHNode EmptyNode = {};
+		static const FVector EmptyVertex = FVector::ZeroVector;
+		static const uint32 EmptyIndex = 0;
+
+		MeshNodeBuffer = UpdatePersistentStructuredBuffer(
+			GraphBuilder,
+			State.MeshNodeBuffer,
+			TEXT("MeshNodeBuffer"),
+			sizeof(FTriangleBVHNode),
+			bHasMesh ? Mesh->GetNodes().Num() : 1,
+			bHasMesh ? static_cast<const void*>(Mesh->GetNodes().GetData()) : &EmptyNode
+		);
+		MeshVertexBuffer = UpdatePersistentStructuredBuffer(
+			GraphBuilder,
+			State.MeshVertexBuffer,
+			TEXT("MeshVertexBuffer"),
+			sizeof(FVector),
+			bHasMesh ? Mesh->GetVertices().Num() : 1,
+			bHasMesh ? static_cast<const void*>(Mesh->GetVertices().GetData()) : &EmptyVertex
+		);
+		MeshIndexBuffer = UpdatePersistentStructuredBuffer(
+			GraphBuilder,
+			State.MeshIndexBuffer,
+			TEXT("MeshIndexBuffer"),
+			sizeof(uint32),
+			bHasMesh ? Mesh->GetIndices().Num() : 1,
+			bHasMesh ? static_cast<const void*>(Mesh->GetIndices().GetData()) : &EmptyIndex
+		);
+
+		State.NumMeshNodes = bHasMesh ? Mesh->GetNodes().Num() : 0;
+		State.MeshBoundsOrigin = bHasMesh ? Mesh->GetBoundsOrigin() : FVector::ZeroVector;
+		State.MeshBoundsScale = bHasMesh ? Mesh->GetBoundsScale() : FVector::ZeroVector;
+	}
+	else
+	{
+		MeshNodeBuffer = GraphBuilder.RegisterExternalBuffer(State.MeshNodeBuffer, TEXT("MeshNodeBuffer"));
+		MeshVertexBuffer = GraphBuilder.RegisterExternalBuffer(State.MeshVertexBuffer, TEXT("MeshVertexBuffer"));
+		MeshIndexBuffer = GraphBuilder.RegisterExternalBuffer(State.MeshIndexBuffer, TEXT("MeshIndexBuffer"));
+	}
+
+	if (FrameParams.SkyboxResource == nullptr || FrameParams.RenderTargetResource == nullptr || !FrameParams.RenderTargetResource->TextureRHI.IsValid())
+	{
+		// The scene changes are still applied so later frames stay in sync
+		return false;
+	}
+
+	// Packed buffers have their own bindings, each permutation only reads one pair
+	const FRDGBufferSRVRef SphereBufferSRV = GraphBuilder.CreateSRV(SphereBuffer);
+	const FRDGBufferSRVRef BVHNodeBufferSRV = GraphBuilder.CreateSRV(BVHNodeBuffer);
+	
+	// Anti-aliasing sample table, the tables never change so it only goes up when the sequence does
+	const bool bAdaptive = FrameParams.UseAdaptiveSampling();
+	const int32 NumSamples = bAdaptive ? RayTracingAdaptive::GetBaseSamples(FrameParams.NumSamples) : FMath::Max(1, FrameParams.NumSamples);
+	const int32 SampleSequence = static_cast<int32>(FrameParams.SampleSequence);
+	FRDGBufferRef SampleTableBuffer;
+	if (State.SampleTable.IsValid() && State.SampleTableSequence == SampleSequence)
+	{
+		SampleTableBuffer = GraphBuilder.RegisterExternalBuffer(State.SampleTable, TEXT("RayTracingSampleTable"));
+	}
+	else
+	{
+		const TArray<FVector2D>& SampleTable = FRayTracingSampleTables::Get(FrameParams.SampleSequence);
+		SampleTableBuffer = CreateStructuredBuffer(
+			GraphBuilder,
+			TEXT("RayTracingSampleTable"),
+			SampleTable.GetTypeSize(),
+			SampleTable.Num(),
+			SampleTable.GetData(),
+			SampleTable.Num() * SampleTable.GetTypeSize(),
+			ERDGInitialDataFlags::NoCopy
+		);
+		GraphBuilder.QueueBufferExtraction(SampleTableBuffer, &State.SampleTable, ERHIAccess::SRVCompute);
+		State.SampleTableSequence = SampleSequence;
+
+		INC_DWORD_STAT_BY(STAT_ComputeShaders_TransientBufferBytes, SampleTable.Num() * SampleTable.GetTypeSize());
+	}
+	
+	// Persistent accumulation texture for progressive mode
+	FRDGTextureRef AccumulationTex = nullptr;
+	FRDGTextureUAVRef AccumulationUAV = nullptr;
+	uint32 PreviousSampleCount = 0;
+	if (FrameParams.bProgressive)
+	{
+		// Full precision so thousands of samples can be summed without banding
+		const FRDGTextureDesc AccumulationDesc = FRDGTextureDesc::Create2D(
+			FrameParams.TexSize,
+			PF_A32B32G32R32F,
+			FClearValueBinding::Black,
+			TexCreate_ShaderResource | TexCreate_UAV
+		);
+
+		bool bCreated = false;
+		AccumulationTex = FindOrCreatePooledTexture(GraphBuilder, AccumulationDesc, State.AccumulationTexture, TEXT("RayTracingAccumulation"), &bCreated);
+		
+		// Nothing to add to in a new texture
+		PreviousSampleCount = bCreated ? 0 : FrameParams.PreviousSampleCount;
+		AccumulationUAV = GraphBuilder.CreateUAV(AccumulationTex);
+
+		// The skipped checkerboard pixels read their sample count, stale ones would look converged
+		if (FrameParams.bCheckerboard && PreviousSampleCount == 0)
+		{
+			AddClearUAVPass(GraphBuilder, AccumulationUAV, FLinearColor::Transparent);
+		}
+	}
+	
+	// Set shader parameters, the output is set by the trace stage. Multi-view writes a texture array instead
+	const bool bMultiView = FrameParams.IsMultiView();
+	FRayTracingCS::FParameters* PassParameters = GraphBuilder.AllocParameters<FRayTracingCS::FParameters>();
+	PassParameters->OutputTexture = nullptr;
+	PassParameters->SkyboxTexture = FrameParams.SkyboxResource->TextureRHI;
+	PassParameters->SkyboxTextureSampler = TStaticSamplerState<SF_Bilinear, AM_Wrap, AM_Wrap>::CreateRHI();
+	PassParameters->Dimensions = FrameParams.TexSize;
+	PassParameters->CameraToWorld = FrameParams.CameraToWorldMat;
+	PassParameters->CameraInverseProjection = FrameParams.CameraInverseProjection;
+	PassParameters->Colour = FrameParams.Colour;
+	PassParameters->SphereBuffer = bPackedScene ? nullptr : SphereBufferSRV;
+	PassParameters->BVHNodeBuffer = bPackedScene ? nullptr : BVHNodeBufferSRV;
+	PassParameters->PackedSphereBuffer = bPackedScene ? SphereBufferSRV : nullptr;
+	PassParameters->PackedBVHNodeBuffer = bPackedScene ? BVHNodeBufferSRV : nullptr;
+	PassParameters->MeshNodeBuffer = GraphBuilder.CreateSRV(MeshNodeBuffer);
+	PassParameters->MeshVertexBuffer = GraphBuilder.CreateSRV(MeshVertexBuffer);
+	PassParameters->MeshIndexBuffer = GraphBuilder.CreateSRV(MeshIndexBuffer);
+	PassParameters->NumMeshNodes = State.NumMeshNodes;
+	PassParameters->MeshBoundsOrigin = State.MeshBoundsOrigin;
+	PassParameters->MeshBoundsScale = State.MeshBoundsScale;
+	PassParameters->NumSphereNodes = SceneUpload.NumNodes;
+	PassParameters->SceneBoundsOrigin = Packing.Origin;
+	PassParameters->SceneBoundsScale = Packing.Scale;
+	PassParameters->SphereRadiusScale = Packing.RadiusScale;
+	PassParameters->SampleTable = GraphBuilder.CreateSRV(SampleTableBuffer);
+	PassParameters->SampleTableMask = FRayTracingSampleTables::TableSize - 1;
+	PassParameters->FirstSample = FrameParams.FirstSample;
+	PassParameters->NumSamples = NumSamples;
+	PassParameters->bPerPixelRotation = FrameParams.bPerPixelRotation ? 1 : 0;
+	PassParameters->AccumulationTexture = AccumulationUAV;
+	PassParameters->PreviousSampleCount = PreviousSampleCount;
+	PassParameters->bCheckerboard = FrameParams.bCheckerboard ? 1 : 0;
+	PassParameters->CheckerboardParity = FrameParams.CheckerboardParity;
+
+	FRayTracingCS::FPermutationDomain PermutationVector;
+	PermutationVector.Set<FRayTracingCS::FProgressiveDim>(FrameParams.bProgressive);
+	PermutationVector.Set<FRayTracingCS::FMaxBouncesDim>(FrameParams.MaxBounces);
+	PermutationVector.Set<FRayTracingCS::FFixedAASamplesDim>(FRayTracingCS::GetPermutationFixedAASamples(NumSamples));
+	const int32 GroupShape = FRayTracingCS::GetPermutationGroupShape(FrameParams.GroupShape, FrameParams.Denoise.bEnabled, bPackedScene);
+	PermutationVector.Set<FRayTracingCS::FGroupShapeDim>(GroupShape);
+	PermutationVector.Set<FRayTracingCS::FPackedSceneDim>(bPackedScene);
+	checkf(!bPackedScene || (!FrameParams.IsMultiView() && !FrameParams.Denoise.bEnabled), TEXT("Packed scenes aren't compiled with multi-view or denoiser guides"));
+
+	if (bMultiView)
+	{
+		AddMultiViewPasses(GraphBuilder, FrameParams, PassParameters, PermutationVector);
+		return true;
+	}
+
+	// Denoiser guides, written by the trace
+	FRDGTextureRef GuideNormalDepth = nullptr;
+	FRDGTextureRef GuideAlbedo = nullptr;
+	if (FrameParams.Denoise.bEnabled)
+	{
+		GuideNormalDepth = GraphBuilder.CreateTexture(
+			FRDGTextureDesc::Create2D(FrameParams.TexSize, PF_A32B32G32R32F, FClearValueBinding::Black, TexCreate_ShaderResource | TexCreate_UAV),
+			TEXT("RayTracingGuideNormalDepth")
+		);
+		GuideAlbedo = GraphBuilder.CreateTexture(
+			FRDGTextureDesc::Create2D(FrameParams.TexSize, PF_FloatRGBA, FClearValueBinding::Black, TexCreate_ShaderResource | TexCreate_UAV),
+			TEXT("RayTracingGuideAlbedo")
+		);
+		INC_DWORD_STAT_BY(STAT_ComputeShaders_TransientTextureBytes, FrameParams.TexSize.X * FrameParams.TexSize.Y * (sizeof(FLinearColor) + sizeof(FFloat16Color)));
+
+		PassParameters->GuideNormalDepth = GraphBuilder.CreateUAV(GuideNormalDepth);
+		PassParameters->GuideAlbedo = GraphBuilder.CreateUAV(GuideAlbedo);
+		PermutationVector.Set<FRayTracingCS::FWriteGuidesDim>(true);
+	}
+
+	// Trace, denoise, upscale. Whichever stage is last writes straight into the render target
+	FComputePipeline Pipeline;
+	Pipeline.AddStage(TEXT("RayTracingRenderTarget"), [&](FRDGBuilder& StageGraphBuilder, FRDGTextureRef, const FRDGTextureRef Output)
+	{
+		PassParameters->OutputTexture = StageGraphBuilder.CreateUAV(Output);
+		if (bAdaptive)
+		{
+			AddAdaptivePasses(StageGraphBuilder, FrameParams, PassParameters, PermutationVector);
+		}
+		else
+		{
+			const TShaderMapRef<FRayTracingCS> RayTracingShader(GetGlobalShaderMap(GMaxRHIFeatureLevel), PermutationVector);
+
+			// Utility to actually run ("Dispatch") the compute shader
+			FComputeShaderUtils::AddPass(
+				StageGraphBuilder,
+				RDG_EVENT_NAME("RayTracing Compute Shader"),
+				RayTracingShader,
+				PassParameters,
+				FrameParams.GetGroupCount(FRayTracingCS::GetGroupSize(GroupShape))
+			);
+		}
+
+		// Half the pixels were traced, fill in the rest before anything filters the image
+		if (FrameParams.bCheckerboard)
+		{
+			AddCheckerboardFillPass(StageGraphBuilder, Output, AccumulationTex, FrameParams.CheckerboardParity);
+		}
+	}, FrameParams.TexSize, FrameParams.PixelFormat);
+
+	// The accumulation keeps the noisy samples, only the displayed image is filtered
+	if (FrameParams.Denoise.bEnabled)
+	{
+		Pipeline.AddStage(TEXT("RayTracingDenoised"), [&](FRDGBuilder& StageGraphBuilder, const FRDGTextureRef Input, const FRDGTextureRef Output)
+		{
+			AddRayTracingDenoisePasses(StageGraphBuilder, Input, GuideNormalDepth, GuideAlbedo, FrameParams.Denoise, Output);
+		});
+	}
+
+	// Reduced resolution, denoised at the traced size as the guides are
+	if (FrameParams.TexSize != FrameParams.OutputSize)
+	{
+		Pipeline.AddStage(TEXT("RayTracingUpscaled"), [](FRDGBuilder& StageGraphBuilder, const FRDGTextureRef Input, const FRDGTextureRef Output)
+		{
+			AddUpscalePass(StageGraphBuilder, Input, Output);
+		}, FrameParams.OutputSize);
+	}
+
+	const FRDGTextureRef OutputTex = RegisterExternalRenderTarget(GraphBuilder, FrameParams.RenderTargetResource->TextureRHI, State.OutputTarget, TEXT("RayTracingOutput"));
+	Pipeline.AddPasses(GraphBuilder, nullptr, OutputTex);
+
+	// Every stage writes in the render target's format, compared to the float4 the trace used to write
+	const int64 TracedTexels = static_cast<int64>(FrameParams.TexSize.X) * FrameParams.TexSize.Y;
+	RecordCompactFormatWrite(FrameParams.Denoise.bEnabled ? TracedTexels * 2 : TracedTexels, FrameParams.PixelFormat, PF_A32B32G32R32F);
+	if (FrameParams.TexSize != FrameParams.OutputSize)
+	{
+		RecordCompactFormatWrite(static_cast<int64>(FrameParams.OutputSize.X) * FrameParams.OutputSize.Y, FrameParams.PixelFormat, PF_A32B32G32R32F);
+	}
+
+	return true;
+}
+
+void FRayTracingGPURenderer::AddAdaptivePasses(FRDGBuilder& GraphBuilder, const FRayTracingParams& FrameParams, FRayTracingCS::FParameters* BaseParameters, FRayTracingCS::FPermutationDomain PermutationVector)
+{
+	const FRayTracingAdaptiveSettings& Settings = FrameParams.Adaptive;
+	check(FRayTracingCS::GetGroupSize(0) == FIntPoint(RAY_TRACING_ADAPTIVE_TILE_SIZE, RAY_TRACING_ADAPTIVE_TILE_SIZE));
+
+	// Colour sum and sample count, luminance sum and sum of squares
+	const FRDGTextureRef AdaptiveColor = GraphBuilder.CreateTexture(
+		FRDGTextureDesc::Create2D(FrameParams.TexSize, PF_A32B32G32R32F, FClearValueBinding::Black, TexCreate_ShaderResource | TexCreate_UAV),
+		TEXT("RayTracingAdaptiveColor")
+	);
+	const FRDGTextureRef AdaptiveLuminance = GraphBuilder.CreateTexture(
+		FRDGTextureDesc::Create2D(FrameParams.TexSize, PF_G32R32F, FClearValueBinding::Black, TexCreate_ShaderResource | TexCreate_UAV),
+		TEXT("RayTracingAdaptiveLuminance")
+	);
+	INC_DWORD_STAT_BY(STAT_ComputeShaders_TransientTextureBytes, FrameParams.TexSize.X * FrameParams.TexSize.Y * (sizeof(FLinearColor) + sizeof(FVector2D)));
+
+	const FIntVector TileCount = FComputeShaderUtils::GetGroupCount(FrameParams.TexSize, RAY_TRACING_ADAPTIVE_TILE_SIZE);
+	const FRDGBufferRef TileList = GraphBuilder.CreateBuffer(FRDGBufferDesc::CreateStructuredDesc(sizeof(uint32), TileCount.X * TileCount.Y), TEXT("AdaptiveTileList"));
+
+	PermutationVector.Set<FRayTracingCS::FGroupShapeDim>(0);
+	PermutationVector.Set<FRayTracingCS::FAdaptiveDim>(true);
+
+	// Base samples on every tile
+	BaseParameters->AdaptiveColor = GraphBuilder.CreateUAV(AdaptiveColor);
+	BaseParameters->AdaptiveLuminance = GraphBuilder.CreateUAV(AdaptiveLuminance);
+	BaseParameters->bUseTileList = 0;
+	{
+		const TShaderMapRef<FRayTracingCS> RayTracingShader(GetGlobalShaderMap(GMaxRHIFeatureLevel), PermutationVector);
+		FComputeShaderUtils::AddPass(
+			GraphBuilder,
+			RDG_EVENT_NAME("RayTracing Adaptive Base (%d spp)", BaseParameters->NumSamples),
+			RayTracingShader,
+			BaseParameters,
+			TileCount
+		);
+	}
+
+	// Refinement, the GPU decides which tiles go again so nothing waits on a readback.
+	// Passes after convergence dispatch zero groups
+	const int32 SamplesPerPass = FMath::Max(1, Settings.SamplesPerPass);
+	PermutationVector.Set<FRayTracingCS::FFixedAASamplesDim>(FRayTracingCS::GetPermutationFixedAASamples(SamplesPerPass));
+	const TShaderMapRef<FRayTracingCS> RefineShader(GetGlobalShaderMap(GMaxRHIFeatureLevel), PermutationVector);
+
+	for (int32 Pass = 0; Pass < Settings.MaxPasses; Pass++)
+	{
+		const FRDGBufferRef IndirectArgs = AddBuildAdaptiveTileListPass(GraphBuilder, AdaptiveColor, AdaptiveLuminance, FrameParams.TexSize, Settings, TileList);
+
+		FRayTracingCS::FParameters* PassParameters = GraphBuilder.AllocParameters<FRayTracingCS::FParameters>();
+		*PassParameters = *BaseParameters;
+		PassParameters->NumSamples = SamplesPerPass;
+		PassParameters->bUseTileList = 1;
+		PassParameters->AdaptiveTileList = GraphBuilder.CreateSRV(TileList);
+		PassParameters->IndirectArgs = IndirectArgs;
+
+		FComputeShaderUtils::AddPass(
+			GraphBuilder,
+			RDG_EVENT_NAME("RayTracing Adaptive Refine %d (+%d spp)", Pass, SamplesPerPass),
+			RefineShader,
+			PassParameters,
+			IndirectArgs,
+			0
+		);
+	}
+}
+
+void FRayTracingGPURenderer::AddMultiViewPasses(FRDGBuilder& GraphBuilder, const FRayTracingParams& FrameParams, FRayTracingCS::FParameters* PassParameters, FRayTracingCS::FPermutationDomain PermutationVector)
+{
+	const int32 NumViews = FrameParams.Views.Num();
+
+	// Every view shares the scene buffers and sample table, only the matrices differ
+	const FRDGBufferRef ViewBuffer = CreateStructuredBuffer(
+		GraphBuilder,
+		TEXT("RayTracingViews"),
+		sizeof(FRayTracingViewMatrices),
+		NumViews,
+		FrameParams.Views.GetData(),
+		NumViews * sizeof(FRayTracingViewMatrices)
+	);
+	const FRDGTextureRef OutputArray = GraphBuilder.CreateTexture(
+		FRDGTextureDesc::Create2DArray(FrameParams.TexSize, FrameParams.PixelFormat, FClearValueBinding::Black, TexCreate_ShaderResource | TexCreate_UAV, NumViews),
+		TEXT("RayTracingMultiViewOutput")
+	);
+	INC_DWORD_STAT_BY(STAT_ComputeShaders_TransientBufferBytes, NumViews * sizeof(FRayTracingViewMatrices));
+	INC_DWORD_STAT_BY(STAT_ComputeShaders_TransientTextureBytes, FrameParams.TexSize.X * FrameParams.TexSize.Y * GPixelFormats[FrameParams.PixelFormat].BlockBytes * NumViews);
+	RecordCompactFormatWrite(static_cast<int64>(FrameParams.TexSize.X) * FrameParams.TexSize.Y * NumViews, FrameParams.PixelFormat, PF_A32B32G32R32F);
+
+	PassParameters->ViewBuffer = GraphBuilder.CreateSRV(ViewBuffer);
+	PassParameters->OutputTextureArray = GraphBuilder.CreateUAV(OutputArray);
+
+	PermutationVector.Set<FRayTracingCS::FGroupShapeDim>(0);
+	PermutationVector.Set<FRayTracingCS::FMultiViewDim>(true);
+
+	// View index in Z
+	FIntVector GroupCount = FComputeShaderUtils::GetGroupCount(FrameParams.TexSize, FRayTracingCS::GetGroupSize(0));
+	GroupCount.Z = NumViews;
+
+	const TShaderMapRef<FRayTracingCS> RayTracingShader(GetGlobalShaderMap(GMaxRHIFeatureLevel), PermutationVector);
+	FComputeShaderUtils::AddPass(
+		GraphBuilder,
+		RDG_EVENT_NAME("RayTracing MultiView (%d views)", NumViews),
+		RayTracingShader,
+		PassParameters,
+		GroupCount
+	);
+
+	// One copy for all the slices
+	FRHICopyTextureInfo CopyInfo;
+	CopyInfo.Size = FIntVector(FrameParams.TexSize.X, FrameParams.TexSize.Y, 1);
+	CopyInfo.NumSlices = NumViews;
+	AddReadbackTexturePass(GraphBuilder, TEXT("MultiViewRenderTarget"), OutputArray, FrameParams.RenderTargetResource->TextureRHI, CopyInfo);
+}
@@ -3,44 +3,133 @@
 #include "RayTracingManager.h"
 
 #include "EngineUtils.h"
+#include "ComputeShaderStats.h"
 #include "RayTracingCS.h"
+#include "RayTracingGPU.h"
+#include "RayTracingSceneSubsystem.h"
+#include "RayTracingSphereComponent.h"
 #include "RenderGraphBuilder.h"
 #include "RenderGraphUtils.h"
 #include "ShaderHelpers.h"
 #include "Camera/CameraComponent.h"
 #include "Engine/StaticMeshActor.h"
+#include "Engine/Texture2D.h"
 #include "Engine/TextureCube.h"
 #include "Engine/TextureRenderTarget2D.h"
+#include "Engine/TextureRenderTarget2DArray.h"
 #include "Kismet/GameplayStatics.h"
+#include "Misc/ScopeExit.h"
 
 
-ARayTracingManager::ARayTracingManager()
+DECLARE_CYCLE_STAT(TEXT("RayTracing Render (GT)"), STAT_RayTracing_Render, STATGROUP_ComputeShaders);
+DECLARE_CYCLE_STAT(TEXT("RayTracing UpdateParams (GT)"), STAT_RayTracing_UpdateParams, STATGROUP_ComputeShaders);
+DECLARE_CYCLE_STAT(TEXT("RayTracing UpdateScene (GT)"), STAT_RayTracing_UpdateScene, STATGROUP_ComputeShaders);
+DECLARE_CYCLE_STAT(TEXT("RayTracing Render CPU (GT)"), STAT_RayTracing_RenderCPU, STATGROUP_ComputeShaders);
+DECLARE_DWORD_COUNTER_STAT(TEXT("RayTracing CPU Rays"), STAT_RayTracing_CPURays, STATGROUP_ComputeShaders);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("RayTracing CPU Mrays/s"), STAT_RayTracing_CPUMraysPerSecond, STATGROUP_ComputeShaders);
+
+
+void FRayTracingSceneUpload::SetFull(const FSphereBVH& BVH)
 {
-	Camera = CreateDefaultSubobject<UCameraComponent>(TEXT("Camera Component"));
-	RootComponent = Camera;
+	bFullUpload = true;
+	SphereIndices.Reset();
+	NodeIndices.Reset();
+	Spheres = BVH.GetSpheres();
+	Nodes = BVH.GetNodes();
+	NumSpheres = Spheres.Num();
+	NumNodes = Nodes.Num();
 }
 
-void ARayTracingManager::BeginPlay()
+namespace
 {
-	Super::BeginPlay();
-	Render();
+	// Merges a later scatter into Indices/Elements, which are either a scatter or, with bFull, the whole buffer
+	template <typename ElementType>
+	void AppendChanges(const bool bFull, TArray<uint32>& Indices, TArray<ElementType>& Elements, const TArray<uint32>& NewIndices, const TArray<ElementType>& NewElements)
+	{
+		if (bFull)
+		{
+			for (int32 i = 0; i < NewIndices.Num(); i++)
+			{
+				Elements[NewIndices[i]] = NewElements[i];
+			}
+			return;
+		}
+
+		// The scatter pass writes each element once, so later changes replace earlier ones instead of being added
+		TMap<uint32, int32> Positions;
+		Positions.Reserve(Indices.Num() + NewIndices.Num());
+		for (int32 i = 0; i < Indices.Num(); i++)
+		{
+			Positions.Add(Indices[i], i);
+		}
+		for (int32 i = 0; i < NewIndices.Num(); i++)
+		{
+			if (const int32* Position = Positions.Find(NewIndices[i]))
+			{
+				Elements[*Position] = NewElements[i];
+			}
+			else
+			{
+				Positions.Add(NewIndices[i], Indices.Num());
+				Indices.Add(NewIndices[i]);
+				Elements.Add(NewElements[i]);
+			}
+		}
+	}
 }
 
-void ARayTracingManager::Render()
+void FRayTracingSceneUpload::Append(FRayTracingSceneUpload&& Newer)
 {
-	if (Camera == nullptr || RenderTarget == nullptr || SkyboxTexture == nullptr)
+	if (Newer.bFullUpload)
 	{
-		printw("NULL Camera, RenderTarget or SkyboxTexture")
-		return;
+		bFullUpload = true;
+		SphereIndices.Reset();
+		NodeIndices.Reset();
+		Spheres = MoveTemp(Newer.Spheres);
+		Nodes = MoveTemp(Newer.Nodes);
 	}
+	else
+	{
+		// A scatter is always the same size as the upload before it
+		AppendChanges(bFullUpload, SphereIndices, Spheres, Newer.SphereIndices, Newer.Spheres);
+		AppendChanges(bFullUpload, NodeIndices, Nodes, Newer.NodeIndices, Newer.Nodes);
+	}
+	NumSpheres = Newer.NumSpheres;
+	NumNodes = Newer.NumNodes;
+	Packing = Newer.Packing;
 
-	// Save params
-	Params.TexSize = FIntPoint(RenderTarget->SizeX, RenderTarget->SizeY);
-	const float AspectRatio = static_cast<float>(Params.TexSize.X) / static_cast<float>(Params.TexSize.Y);
-	
-	// Get Camera Settings
-	FMinimalViewInfo ViewInfo; 
-	Camera->GetCameraView(0.f, ViewInfo);
+	if (Newer.bMeshUpload)
+	{
+		bMeshUpload = true;
+		Mesh = MoveTemp(Newer.Mesh);
+	}
+}
+
+void FRayTracingSceneUpload::ClearChanges()
+{
+	bFullUpload = false;
+	SphereIndices.Empty();
+	Spheres.Empty();
+	NodeIndices.Empty();
+	Nodes.Empty();
+	bMeshUpload = false;
+	Mesh.Reset();
+}
+
+void FRayTracingParams::SetCamera(const FMinimalViewInfo& ViewInfo, const FIntPoint& InOutputSize, const ERayTracingResolutionMode ResolutionMode)
+{
+	OutputSize = InOutputSize;
+	TexSize = RayTracingReconstruct::GetTraceSize(OutputSize, ResolutionMode);
+
+	// From the output, rounding up the traced size would stretch the image slightly
+	const FRayTracingViewMatrices Matrices = FRayTracingViewMatrices::Create(ViewInfo, OutputSize);
+	CameraToWorldMat = Matrices.CameraToWorld;
+	CameraInverseProjection = Matrices.CameraInverseProjection;
+}
+
+FRayTracingViewMatrices FRayTracingViewMatrices::Create(const FMinimalViewInfo& ViewInfo, const FIntPoint& Size)
+{
+	const float AspectRatio = static_cast<float>(Size.X) / static_cast<float>(Size.Y);
 
 	FMatrix ProjectionMatrix = FReversedZPerspectiveMatrix(
 		FMath::Max(0.001f, ViewInfo.FOV) * PI / 360.0f,
@@ -57,120 +146,737 @@ void ARayTracingManager::Render()
 		ProjectionMatrix,
 		ViewProjectionMatrix
 	);
+
+	FRayTracingViewMatrices Matrices;
+	Matrices.CameraToWorld = ViewMatrix.Inverse();
+	Matrices.CameraInverseProjection = ProjectionMatrix;
+	return Matrices;
+}
+
+
+ARayTracingManager::ARayTracingManager()
+{
+	PrimaryActorTick.bCanEverTick = true;
 	
-	Params.CameraToWorldMat = ViewMatrix.Inverse();
-	Params.CameraInverseProjection = ProjectionMatrix;
+	Camera = CreateDefaultSubobject<UCameraComponent>(TEXT("Camera Component"));
+	RootComponent = Camera;
 
-	// Copy over all the spheres in the scene by name
-	for (TActorIterator<AStaticMeshActor> It(GetWorld()); It; ++It)
+	Backend = ERayTracingBackend::GPU;
+	MaxBounces = RAY_TRACING_MAX_BOUNCES;
+	ThreadGroupShape = ERayTracingThreadGroupShape::Group8x8;
+	ResolutionMode = ERayTracingResolutionMode::Full;
+	SampleSequence = ERayTracingSampleSequence::Sobol;
+	bPerPixelRotation = true;
+	bProgressive = false;
+	SamplesPerFrame = 1;
+	MaxAccumulatedSamples = 1024;
+	AccumulatedSamples = 0;
+	bResetRequested = false;
+	bSceneRebuildPending = true;
+	bMeshRebuildPending = true;
+	bGPUFullUploadPending = true;
+	bGPUMeshUploadPending = true;
+	bPackedScene = false;
+	OutputFormat = ERayTracingOutputFormat::Default;
+	TransientRenderTarget = nullptr;
+	Priority = EComputeJobPriority::Normal;
+	UpdateRate = 0.f;
+	SentPriority = Priority;
+	SentUpdateRate = UpdateRate;
+}
+
+EPixelFormat ARayTracingManager::GetPixelFormat(const ERayTracingOutputFormat Format)
+{
+	switch (Format)
 	{
-		if (It->GetName().Contains(TEXT("Sphere")))
+	case ERayTracingOutputFormat::RGBA32F:
+		return PF_A32B32G32R32F;
+	case ERayTracingOutputFormat::RGBA16F:
+		return PF_FloatRGBA;
+	case ERayTracingOutputFormat::R11G11B10:
+		return PF_FloatR11G11B10;
+	default:
+		return PF_Unknown;
+	}
+}
+
+void ARayTracingManager::BeginPlay()
+{
+	Super::BeginPlay();
+
+	// The asset is shared with everything else that uses it, so it's never changed here
+	TransientRenderTarget = nullptr;
+	if (RenderTarget && !ShouldUseCPUBackend())
+	{
+		const EPixelFormat PixelFormat = GetPixelFormat(OutputFormat);
+		if (PixelFormat != PF_Unknown && RenderTarget->GetFormat() != PixelFormat)
+		{
+			printw("%s: RenderTarget %s is %s, not the OutputFormat %s. Rendering into a transient render target instead, see GetOutputRenderTarget",
+				*GetName(), *RenderTarget->GetName(), GPixelFormats[RenderTarget->GetFormat()].Name, GPixelFormats[PixelFormat].Name)
+			TransientRenderTarget = NewObject<UTextureRenderTarget2D>(this, NAME_None, RF_Transient);
+			TransientRenderTarget->bCanCreateUAV = true;
+			TransientRenderTarget->ClearColor = RenderTarget->ClearColor;
+			TransientRenderTarget->InitCustomFormat(RenderTarget->SizeX, RenderTarget->SizeY, PixelFormat, true);
+			TransientRenderTarget->UpdateResourceImmediate(true);
+		}
+		else if (!RenderTarget->bCanCreateUAV)
 		{
-			Params.SphereBuffer.Emplace(It->GetActorLocation(), It->GetActorScale().Z * 50.f);
+			printw("%s: RenderTarget %s doesn't allow UAVs, the image is copied into it every frame. Enable bCanCreateUAV on the asset to write it directly",
+				*GetName(), *RenderTarget->GetName())
 		}
 	}
 
-	// Make sure we have at least one sphere
-	if (Params.SphereBuffer.Num() == 0)
+	if (URayTracingSceneSubsystem* Scene = GetWorld()->GetSubsystem<URayTracingSceneSubsystem>())
 	{
-		Params.SphereBuffer.Emplace(0.f, 0.f, 50.f, 50.f);
+		SpheresChangedHandle = Scene->OnSpheresChanged().AddUObject(this, &ARayTracingManager::HandleSpheresChanged);
+		MeshesChangedHandle = Scene->OnMeshesChanged().AddUObject(this, &ARayTracingManager::HandleMeshesChanged);
 	}
+	RegisterLegacySpheres();
+	bSceneRebuildPending = true;
+	bMeshRebuildPending = true;
+
+	// Frames are queued from Render and traced when the scheduler runs the job
+	FComputeJob Job;
+	Job.Desc.Name = GetFName();
+	Job.Desc.Priority = Priority;
+	Job.Desc.TargetRate = UpdateRate;
+	SentPriority = Priority;
+	SentUpdateRate = UpdateRate;
+	Job.Desc.EstimatedCostMs = 1.f;
+	Job.Desc.Timings = &Timings;
+	ENQUEUE_RENDER_COMMAND(RegisterRayTracingJob)([this, Job = MoveTemp(Job)](FRHICommandListImmediate& RHICmdList) mutable
+	{
+		Job.Prepare = [this](uint32& OutInputHash) { return Prepare_RenderThread(OutInputHash); };
+		Job.AddPasses = [this](FRDGBuilder& GraphBuilder) { AddPasses_RenderThread(GraphBuilder); };
+		Job.PostExecute = [this]() { PostExecute_RenderThread(); };
+		JobHandle = FComputeScheduler::Get().RegisterJob(MoveTemp(Job));
+	});
 	
-	Params.PixelFormat = GetPixelFormatFromRenderTargetFormat(RenderTarget->RenderTargetFormat);
-	
-	ENQUEUE_RENDER_COMMAND(RunComputeShader)([this](FRHICommandListImmediate& RHICmdList)
+	Render();
+}
+
+void ARayTracingManager::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+	if (URayTracingSceneSubsystem* Scene = GetWorld()->GetSubsystem<URayTracingSceneSubsystem>())
+	{
+		Scene->OnSpheresChanged().Remove(SpheresChangedHandle);
+		Scene->OnMeshesChanged().Remove(MeshesChangedHandle);
+	}
+	SpheresChangedHandle.Reset();
+	MeshesChangedHandle.Reset();
+
+	Super::EndPlay(EndPlayReason);
+}
+
+void ARayTracingManager::Tick(float DeltaSeconds)
+{
+	Super::Tick(DeltaSeconds);
+
+	// BeginPlay already rendered the one-shot image, multi-view renders again when a camera moves
+	if (bProgressive || MultiViewRenderTarget != nullptr)
 	{
-		this->Execute_RenderThread(RHICmdList);
+		Render();
+	}
+}
+
+void ARayTracingManager::BeginDestroy()
+{
+	Super::BeginDestroy();
+
+	// Render commands capture this, wait for them before we go away
+	ENQUEUE_RENDER_COMMAND(ReleaseRayTracingManager)([this](FRHICommandListImmediate& RHICmdList)
+	{
+		FComputeScheduler::UnregisterJob(JobHandle);
+		PendingSceneUpload = FRayTracingSceneUpload();
+		GPUState.Release();
 	});
+	ReleaseFence.BeginFence();
 }
 
+bool ARayTracingManager::IsReadyForFinishDestroy()
+{
+	return Super::IsReadyForFinishDestroy() && ReleaseFence.IsFenceComplete();
+}
 
-void ARayTracingManager::Execute_RenderThread(FRHICommandListImmediate& RHICmdList)
+void ARayTracingManager::Render()
 {
-	// Only execute from render thread
-	check(IsInRenderingThread());
+	SCOPE_CYCLE_COUNTER(STAT_RayTracing_Render);
+	CSV_SCOPED_TIMING_STAT(ComputeShaders, RayTracingRender);
 
-	FRDGBuilder GraphBuilder(RHICmdList);
+	const uint32 FrameNumber = GFrameNumber;
+	const double StartTime = FPlatformTime::Seconds();
+	ON_SCOPE_EXIT
+	{
+		Timings.RecordGameThread(FrameNumber, (FPlatformTime::Seconds() - StartTime) * 1000.0);
+	};
 
-	// Create the Sphere Buffer and copy over elements
-	const uint32 SphereBufferSize = Params.SphereBuffer.Num() * Params.SphereBuffer.GetTypeSize();
-	
-	const FRDGBufferRef SphereBuffer = CreateStructuredBuffer(
-		GraphBuilder,
-		TEXT("SphereBuffer"),
-		Params.SphereBuffer.GetTypeSize(),
-		Params.SphereBuffer.Num(),
-		Params.SphereBuffer.GetData(),
-		SphereBufferSize,
-		ERDGInitialDataFlags::None // Possible to skip the copy if you can guarantee the lifetime of the data
-	);
+	if (Camera == nullptr || (RenderTarget == nullptr && MultiViewRenderTarget == nullptr) || SkyboxTexture == nullptr)
+	{
+		printw("NULL Camera, RenderTarget or SkyboxTexture")
+		return;
+	}
 
-	const FRDGBufferSRVRef SphereBufferSRV = GraphBuilder.CreateSRV(SphereBuffer);
-	
-	// Create the random buffer (for antialiasing)
-	TArray<FVector2D> RandomBufferData;
-	const int32 NumSamples = FMath::Max(1, NumAASamples);
-	RandomBufferData.Reserve(NumSamples);
-	for (int32 Sample = 0; Sample < NumSamples; Sample++)
+	const bool bSceneChanged = UpdateParams();
+	const bool bMultiView = Params.IsMultiView();
+	if (bMultiView)
+	{
+		// Never accumulated, the last render stays valid until something changes
+		if (!bSceneChanged && AccumulatedSamples > 0)
+		{
+			return;
+		}
+		AccumulatedSamples = 0;
+	}
+	else if (bSceneChanged || !bProgressive)
 	{
-		RandomBufferData.Emplace(FMath::FRand(), FMath::FRand());
+		AccumulatedSamples = 0;
 	}
-	const uint32 RandBufferSize = RandomBufferData.Num() * RandomBufferData.GetTypeSize();
-	
-	const FRDGBufferRef RandomBuffer = CreateStructuredBuffer(
-		GraphBuilder,
-		TEXT("RandomBuffer"),
-		RandomBufferData.GetTypeSize(),
-		NumSamples,
-		RandomBufferData.GetData(),
-		RandBufferSize,
-		ERDGInitialDataFlags::None
-	);
 
-	const FRDGBufferUAVRef RandomBufferUAV = GraphBuilder.CreateUAV(RandomBuffer);
-	
-	// Create the RenderTarget Texture
-	const FRDGTextureDesc RenderTargetDesc = FRDGTextureDesc::Create2D(
-		Params.TexSize,
-		Params.PixelFormat,
-		FClearValueBinding::Black,
-		TexCreate_RenderTargetable | TexCreate_ShaderResource | TexCreate_UAV
-	);
-	const FRDGTextureRef RenderTargetTex = GraphBuilder.CreateTexture(RenderTargetDesc, TEXT("RayTracingRenderTarget"));
+	int32 NumSamples = FMath::Max(1, NumAASamples);
+	if (bProgressive && !bMultiView)
+	{
+		// Converged, nothing to do until something changes
+		if (MaxAccumulatedSamples > 0 && AccumulatedSamples >= MaxAccumulatedSamples)
+		{
+			return;
+		}
 
-	// Create a Render Target UAV
-	FRDGTextureUAV* RenderTargetUAV = GraphBuilder.CreateUAV(RenderTargetTex);
-	
-	// Set shader parameters
-	FRayTracingCS::FParameters* PassParameters = GraphBuilder.AllocParameters<FRayTracingCS::FParameters>();
-	PassParameters->OutputTexture = RenderTargetUAV;
-	PassParameters->SkyboxTexture = SkyboxTexture->Resource->TextureRHI;
-	PassParameters->SkyboxTextureSampler = TStaticSamplerState<SF_Bilinear, AM_Wrap, AM_Wrap>::CreateRHI();
-	PassParameters->Dimensions = Params.TexSize;
-	PassParameters->CameraToWorld = Params.CameraToWorldMat;
-	PassParameters->CameraInverseProjection = Params.CameraInverseProjection;
-	PassParameters->Colour = Colour;
-	PassParameters->SphereBuffer = SphereBufferSRV;
-	PassParameters->RandomBuffer = RandomBufferUAV;
-
-	const TShaderMapRef<FRayTracingCS> RayTracingShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
+		NumSamples = FMath::Max(1, SamplesPerFrame);
+		if (MaxAccumulatedSamples > 0)
+		{
+			NumSamples = FMath::Min(NumSamples, MaxAccumulatedSamples - AccumulatedSamples);
+		}
+	}
+
+	// Sub-pixel offsets (for antialiasing), progressive frames carry on along the sequence
+	Params.SampleSequence = SampleSequence;
+	Params.FirstSample = AccumulatedSamples;
+	Params.NumSamples = NumSamples;
+	Params.bPerPixelRotation = bPerPixelRotation;
+	Params.Adaptive = Adaptive;
+	Params.Denoise = Denoise;
+
+	Params.bProgressive = bProgressive && !bMultiView;
+	Params.PreviousSampleCount = AccumulatedSamples;
+	Params.GroupShape = static_cast<int32>(ThreadGroupShape);
+	Params.GroupSize = FRayTracingCS::GetGroupSize(Params.GroupShape);
+	AccumulatedSamples += NumSamples;
+
+	// Alternate cells every frame, progressive frames fill the whole image in two
+	Params.bCheckerboard = ResolutionMode == ERayTracingResolutionMode::Checkerboard && !bMultiView;
+	Params.CheckerboardParity ^= 1;
+
+	if (ShouldUseCPUBackend())
+	{
+		if (bMultiView)
+		{
+			printw("MultiViewRenderTarget needs the GPU backend")
+			return;
+		}
+
+		Render_CPU();
+		return;
+	}
+
+	Params.SkyboxResource = SkyboxTexture->Resource;
+	Params.RenderTargetResource = bMultiView ? MultiViewRenderTarget->GameThread_GetRenderTargetResource() : GetOutputRenderTarget()->GameThread_GetRenderTargetResource();
+
+	// Scene changes can't be dropped like frames, they are queued and merged on the render thread
+	FRayTracingSceneUpload SceneUpload;
+	BuildSceneUpload(SceneUpload);
+	if (SceneUpload.HasChanges())
+	{
+		SceneUploadSerial++;
+		ENQUEUE_RENDER_COMMAND(QueueRayTracingSceneUpload)([this, SceneUpload = MoveTemp(SceneUpload), Serial = SceneUploadSerial](FRHICommandListImmediate& RHICmdList) mutable
+		{
+			this->QueueSceneUpload_RenderThread(MoveTemp(SceneUpload), Serial);
+		});
+	}
+
+	if (Priority != SentPriority || UpdateRate != SentUpdateRate)
+	{
+		SentPriority = Priority;
+		SentUpdateRate = UpdateRate;
+		ENQUEUE_RENDER_COMMAND(SetRayTracingPriority)([this, JobPriority = Priority, JobRate = UpdateRate](FRHICommandListImmediate& RHICmdList)
+		{
+			FComputeScheduler::Get().SetPriority(JobHandle, JobPriority, JobRate);
+		});
+	}
+
+	if (!Params.bProgressive || Params.PreviousSampleCount == 0)
+	{
+		AccumulationEpoch++;
+	}
+
+	FRayTracingQueuedFrame Frame;
+	Frame.Params = Params;
+	Frame.FrameIndex = ++NumPublishedFrames;
+	Frame.SceneUploadSerial = SceneUploadSerial;
+	Frame.AccumulationEpoch = AccumulationEpoch;
+	Frames.Publish(MoveTemp(Frame));
+}
+
+bool ARayTracingManager::UpdateParams()
+{
+	SCOPE_CYCLE_COUNTER(STAT_RayTracing_UpdateParams);
+
+	bool bChanged = bResetRequested;
+	bResetRequested = false;
+
+	const bool bMultiView = MultiViewRenderTarget != nullptr;
+	const FIntPoint OutputSize = bMultiView
+		? FIntPoint(MultiViewRenderTarget->SizeX, MultiViewRenderTarget->SizeY)
+		: FIntPoint(GetOutputRenderTarget()->SizeX, GetOutputRenderTarget()->SizeY);
+	const ERayTracingResolutionMode FrameResolutionMode = bMultiView ? ERayTracingResolutionMode::Full : ResolutionMode;
 	
-	// Utility to actually run ("Dispatch") the compute shader
-	FComputeShaderUtils::AddPass(
-		GraphBuilder,
-		RDG_EVENT_NAME("RayTracing Compute Shader"),
-		RayTracingShader,
-		PassParameters,
-		Params.GetGroupCount()
-	);
+	// Get Camera Settings
+	FMinimalViewInfo ViewInfo; 
+	Camera->GetCameraView(0.f, ViewInfo);
 
-	// Get resulting texture out of the GPU
-	AddReadbackTexturePass(GraphBuilder, TEXT("RenderTarget"), RenderTargetTex, RenderTarget->GetRenderTargetResource()->TextureRHI);
+	const FMatrix PreviousCameraToWorld = Params.CameraToWorldMat;
+	const FMatrix PreviousProjection = Params.CameraInverseProjection;
+	const FIntPoint PreviousTexSize = Params.TexSize;
+	const FIntPoint PreviousOutputSize = Params.OutputSize;
+	Params.SetCamera(ViewInfo, OutputSize, FrameResolutionMode);
 	
-	// Get buffer data back out of the GPU
-	TArray<FVector2D> RandomBufferOut;
-	RandomBufferOut.SetNumUninitialized(NumSamples);
-	AddReadbackStructuredBufferPass(GraphBuilder, RandomBuffer, RandomBufferOut.GetData(), RandBufferSize);
+	// Switching to or from checkerboard changes which pixels the accumulation has samples for
+	bChanged |= Params.TexSize != PreviousTexSize
+		|| OutputSize != PreviousOutputSize
+		|| Params.bCheckerboard != (FrameResolutionMode == ERayTracingResolutionMode::Checkerboard)
+		|| !Params.CameraToWorldMat.Equals(PreviousCameraToWorld)
+		|| !Params.CameraInverseProjection.Equals(PreviousProjection)
+		|| RenderedSkyboxTexture.Get() != SkyboxTexture;
+
+	// Camera is slice 0, one slice per extra view after that
+	const TArray<FRayTracingViewMatrices> PreviousViews = MoveTemp(Params.Views);
+	Params.Views.Reset();
+	if (bMultiView)
+	{
+		Params.Views.Add({ Params.CameraToWorldMat, Params.CameraInverseProjection });
+		for (UCameraComponent* ExtraView : ExtraViews)
+		{
+			if (ExtraView == nullptr)
+			{
+				continue;
+			}
+			if (Params.Views.Num() >= MultiViewRenderTarget->Slices)
+			{
+				printw("MultiViewRenderTarget has %d slices, only rendering the first %d views", MultiViewRenderTarget->Slices, Params.Views.Num())
+				break;
+			}
+
+			FMinimalViewInfo ExtraViewInfo;
+			ExtraView->GetCameraView(0.f, ExtraViewInfo);
+			Params.Views.Add(FRayTracingViewMatrices::Create(ExtraViewInfo, OutputSize));
+		}
+	}
+
+	bChanged |= Params.Views.Num() != PreviousViews.Num();
+	for (int32 i = 0; i < Params.Views.Num() && i < PreviousViews.Num(); i++)
+	{
+		bChanged |= !Params.Views[i].CameraToWorld.Equals(PreviousViews[i].CameraToWorld)
+			|| !Params.Views[i].CameraInverseProjection.Equals(PreviousViews[i].CameraInverseProjection);
+	}
+
+	// Save params
+	Params.PixelFormat = bMultiView ? MultiViewRenderTarget->GetFormat() : GetOutputRenderTarget()->GetFormat();
+	Params.Colour = Colour;
+	RenderedSkyboxTexture = SkyboxTexture;
+
+	// Both backends use the same bounce count so they stay comparable
+	const int32 NewMaxBounces = FRayTracingCS::GetPermutationMaxBounces(MaxBounces);
+	bChanged |= NewMaxBounces != Params.MaxBounces;
+	Params.MaxBounces = NewMaxBounces;
+
+	bChanged |= UpdateScene();
+
+	return bChanged;
+}
+
+bool ARayTracingManager::UpdateScene()
+{
+	SCOPE_CYCLE_COUNTER(STAT_RayTracing_UpdateScene);
+
+	URayTracingSceneSubsystem* Scene = GetWorld()->GetSubsystem<URayTracingSceneSubsystem>();
+	if (Scene)
+	{
+		// Anything that changed since the last frame comes in through HandleSpheresChanged and HandleMeshesChanged
+		Scene->FlushChanges();
+	}
+
+	const bool bMeshesChanged = UpdateMeshes(Scene);
+
+	if (bSceneRebuildPending || !SceneBVH.IsValid())
+	{
+		bSceneRebuildPending = false;
+		PendingChangedSpheres.Reset();
+
+		TArray<FVector4> Spheres;
+		if (Scene)
+		{
+			Spheres = Scene->GetSpheres();
+		}
+
+		// Make sure we have at least one sphere
+		if (Spheres.Num() == 0)
+		{
+			Spheres.Emplace(0.f, 0.f, 50.f, 50.f);
+		}
+
+		// Build on the game thread, the render thread only uploads it
+		const double BuildStartTime = FPlatformTime::Seconds();
+		SceneBVH = MakeShared<FSphereBVH, ESPMode::ThreadSafe>();
+		SceneBVH->Build(Spheres);
+		printv("Built sphere BVH: %d spheres, %d nodes, SAH cost %.2f in %.2fms",
+			Spheres.Num(), SceneBVH->GetNodes().Num(), SceneBVH->ComputeSAHCost(),
+			(FPlatformTime::Seconds() - BuildStartTime) * 1000.0);
+
+		Params.SphereBVH = SceneBVH;
+		bGPUFullUploadPending = true;
+		PendingGPUSpheres.Reset();
+		PendingGPUNodes.Reset();
+		return true;
+	}
+
+	if (PendingChangedSpheres.Num() == 0 || Scene == nullptr)
+	{
+		return bMeshesChanged;
+	}
+
+	// Only the moved spheres and the nodes above them are touched
+	TArray<int32> ChangedSpheres = PendingChangedSpheres.Array();
+	PendingChangedSpheres.Reset();
+
+	TArray<int32> RefitSpheres;
+	TArray<int32> RefitNodes;
+	SceneBVH->Refit(ChangedSpheres, Scene->GetSpheres(), RefitSpheres, RefitNodes);
+
+	if (!bGPUFullUploadPending)
+	{
+		for (const int32 Index : RefitSpheres)
+		{
+			PendingGPUSpheres.Add(Index);
+		}
+		for (const int32 Index : RefitNodes)
+		{
+			PendingGPUNodes.Add(Index);
+		}
+	}
+	return RefitSpheres.Num() > 0 || bMeshesChanged;
+}
+
+bool ARayTracingManager::UpdateMeshes(URayTracingSceneSubsystem* Scene)
+{
+	if (!bMeshRebuildPending)
+	{
+		return false;
+	}
+	bMeshRebuildPending = false;
+
+	TArray<FVector> Vertices;
+	TArray<uint32> Indices;
+	if (Scene)
+	{
+		Scene->GatherTriangles(Vertices, Indices);
+	}
+
+	const bool bHadMeshes = SceneMeshBVH.IsValid();
+	SceneMeshBVH.Reset();
+	Params.MeshBVH.Reset();
+	bGPUMeshUploadPending = true;
+	if (Indices.Num() == 0)
+	{
+		return bHadMeshes;
+	}
+
+	// Same as the spheres, built here and only uploaded by the render thread
+	const double BuildStartTime = FPlatformTime::Seconds();
+	SceneMeshBVH = MakeShared<FTriangleMeshBVH, ESPMode::ThreadSafe>();
+	SceneMeshBVH->Build(Vertices, Indices);
+	const FTriangleMeshStats Stats = SceneMeshBVH->GetStats();
+	printv("Built mesh BVH: %d triangles, %d vertices, %d nodes, %.1f bytes per triangle (%.2fMB), SAH cost %.2f in %.2fms",
+		Stats.NumTriangles, Stats.NumVertices, Stats.NumNodes, Stats.GetBytesPerTriangle(), Stats.GetTotalBytes() / (1024.f * 1024.f),
+		Stats.SAHCost, (FPlatformTime::Seconds() - BuildStartTime) * 1000.0);
+
+	Params.MeshBVH = SceneMeshBVH;
+	return true;
+}
+
+void ARayTracingManager::HandleSpheresChanged(const bool bLayoutChanged, const TArrayView<const int32> ChangedSpheres)
+{
+	if (bLayoutChanged)
+	{
+		bSceneRebuildPending = true;
+	}
+	else if (!bSceneRebuildPending)
+	{
+		for (const int32 Index : ChangedSpheres)
+		{
+			PendingChangedSpheres.Add(Index);
+		}
+	}
+}
+
+void ARayTracingManager::RegisterLegacySpheres()
+{
+	// Left over from an earlier BeginPlay, they would count as the level's own spheres below
+	for (URayTracingSphereComponent* SphereComponent : LegacySphereComponents)
+	{
+		if (IsValid(SphereComponent))
+		{
+			SphereComponent->DestroyComponent();
+		}
+	}
+	LegacySphereComponents.Reset();
+
+	URayTracingSceneSubsystem* Scene = GetWorld()->GetSubsystem<URayTracingSceneSubsystem>();
+	if (Scene == nullptr || Scene->GetNumSpheres() > 0)
+	{
+		return;
+	}
+
+	// Only done once, the components keep the scene up to date from then on
+	int32 NumRegistered = 0;
+	for (TActorIterator<AStaticMeshActor> It(GetWorld()); It; ++It)
+	{
+		if (It->GetName().Contains(TEXT("Sphere")) && It->FindComponentByClass<URayTracingSphereComponent>() == nullptr)
+		{
+			// An instance component, so the actor owns it like one added in the details panel
+			URayTracingSphereComponent* SphereComponent = NewObject<URayTracingSphereComponent>(*It);
+			SphereComponent->CreationMethod = EComponentCreationMethod::Instance;
+			SphereComponent->SetupAttachment(It->GetRootComponent());
+			It->AddInstanceComponent(SphereComponent);
+			SphereComponent->RegisterComponent();
+			LegacySphereComponents.Add(SphereComponent);
+			NumRegistered++;
+		}
+	}
+
+	if (NumRegistered > 0)
+	{
+		printw("No RayTracingSphereComponents in the level, added them to %d actors named Sphere", NumRegistered)
+	}
+}
+
+void ARayTracingManager::BuildSceneUpload(FRayTracingSceneUpload& Upload)
+{
+	if (bGPUFullUploadRequested.AtomicSet(false))
+	{
+		bGPUFullUploadPending = true;
+	}
+
+	const TArray<FVector4>& Spheres = SceneBVH->GetSpheres();
+	const TArray<FSphereBVHNode>& Nodes = SceneBVH->GetNodes();
+	Upload.NumSpheres = Spheres.Num();
+	Upload.NumNodes = Nodes.Num();
+
+	// A new packing changes every packed element. Only replaced when the scene is rebuilt or moves out of it,
+	// so the precision follows the scene size without repacking on every refit
+	if (ShouldPackScene() && Nodes.Num() > 0)
+	{
+		const FBox SceneBounds(Nodes[0].BoundsMin, Nodes[0].BoundsMax);
+		if (bGPUFullUploadPending || !ScenePacking.Contains(SceneBounds))
+		{
+			ScenePacking = FSphereBVHPacking::Create(SceneBounds);
+			bGPUFullUploadPending = true;
+		}
+	}
+	else if (ScenePacking.IsValid())
+	{
+		ScenePacking = FSphereBVHPacking();
+		bGPUFullUploadPending = true;
+	}
+	Upload.Packing = ScenePacking;
+
+	// Scattering costs twice the bandwidth of a plain upload, past half the scene just send everything
+	const bool bMostlyChanged = PendingGPUSpheres.Num() * 2 > Spheres.Num() || PendingGPUNodes.Num() * 2 > Nodes.Num();
+	Upload.bFullUpload = bGPUFullUploadPending || bMostlyChanged;
+	if (Upload.bFullUpload)
+	{
+		Upload.SetFull(*SceneBVH);
+	}
+	else
+	{
+		Upload.SphereIndices.Reserve(PendingGPUSpheres.Num());
+		Upload.Spheres.Reserve(PendingGPUSpheres.Num());
+		for (const int32 Index : PendingGPUSpheres)
+		{
+			Upload.SphereIndices.Add(Index);
+			Upload.Spheres.Add(Spheres[Index]);
+		}
+
+		Upload.NodeIndices.Reserve(PendingGPUNodes.Num());
+		Upload.Nodes.Reserve(PendingGPUNodes.Num());
+		for (const int32 Index : PendingGPUNodes)
+		{
+			Upload.NodeIndices.Add(Index);
+			Upload.Nodes.Add(Nodes[Index]);
+		}
+	}
+
+	// The mesh also goes with the first upload, in case the GPU buffers were released
+	Upload.bMeshUpload = bGPUMeshUploadPending || bGPUFullUploadPending;
+	if (Upload.bMeshUpload)
+	{
+		Upload.Mesh = SceneMeshBVH;
+	}
+
+	bGPUFullUploadPending = false;
+	bGPUMeshUploadPending = false;
+	PendingGPUSpheres.Reset();
+	PendingGPUNodes.Reset();
+}
+
+bool ARayTracingManager::ShouldUseCPUBackend() const
+{
+	// No point dispatching compute shaders that will never run
+	return Backend == ERayTracingBackend::CPU || GUsingNullRHI;
+}
+
+bool ARayTracingManager::ShouldPackScene() const
+{
+	return bPackedScene && MultiViewRenderTarget == nullptr && !Denoise.bEnabled;
+}
+
+void ARayTracingManager::Render_CPU()
+{
+	SCOPE_CYCLE_COUNTER(STAT_RayTracing_RenderCPU);
+	CSV_SCOPED_TIMING_STAT(ComputeShaders, RayTracingRenderCPU);
+
+	// Only copy the skybox when it changes, it's the slowest part of the setup
+	if (CPUSkyboxSource.Get() != SkyboxTexture || !CPUSkybox.IsValid())
+	{
+		CPUSkybox.Initialize(SkyboxTexture);
+		CPUSkyboxSource = SkyboxTexture;
+	}
+
+	TArray<FLinearColor> FrameImage;
+	LastCPUStats = FRayTracingCPURenderer::Render(Params, CPUSkybox, FrameImage);
+	// Every frame, so through stats and the CSV profiler rather than the log
+	INC_DWORD_STAT_BY(STAT_RayTracing_CPURays, LastCPUStats.NumRays);
+	INC_FLOAT_STAT_BY(STAT_RayTracing_CPUMraysPerSecond, LastCPUStats.GetRaysPerSecond() / 1.0e6);
+	CSV_CUSTOM_STAT(ComputeShaders, CPURays, static_cast<int32>(LastCPUStats.NumRays), ECsvCustomStatOp::Set);
+	CSV_CUSTOM_STAT(ComputeShaders, CPUMraysPerSecond, static_cast<float>(LastCPUStats.GetRaysPerSecond() / 1.0e6), ECsvCustomStatOp::Set);
+
+	if (Params.bProgressive)
+	{
+		// Same as the PROGRESSIVE shader permutation, keep a running sum and output the average
+		const float FrameSamples = Params.NumSamples;
+		if (Params.PreviousSampleCount == 0 || CPUAccumulation.Num() != FrameImage.Num())
+		{
+			CPUAccumulation.Init(FLinearColor::Transparent, FrameImage.Num());
+		}
+
+		const float InvTotalSamples = 1.f / (Params.PreviousSampleCount + FrameSamples);
+		CPUImage.SetNumUninitialized(FrameImage.Num());
+		for (int32 i = 0; i < FrameImage.Num(); i++)
+		{
+			CPUAccumulation[i] += FrameImage[i] * FrameSamples;
+			CPUImage[i] = CPUAccumulation[i] * InvTotalSamples;
+			CPUImage[i].A = 1.f;
+		}
+	}
+	else
+	{
+		CPUImage = MoveTemp(FrameImage);
+	}
+
+	if (Params.Denoise.bEnabled)
+	{
+		FRayTracingCPUGuides Guides;
+		FRayTracingCPURenderer::ComputeGuides(Params, CPUSkybox, Guides);
+		RayTracingDenoise::Denoise(Params.TexSize, CPUImage, Guides.NormalDepth, Guides.Albedo, Params.Denoise);
+	}
+
+	// Reduced resolution, the accumulation stays at the traced size
+	TArray<FLinearColor> OutputImage;
+	if (Params.TexSize != Params.OutputSize)
+	{
+		RayTracingReconstruct::Upscale(Params.TexSize, CPUImage, Params.OutputSize, OutputImage);
+	}
+	else
+	{
+		OutputImage = CPUImage;
+	}
+
+	// Copy the image so the render thread doesn't read it while we render the next one
+	ENQUEUE_RENDER_COMMAND(UploadCPURayTracing)([Image = MoveTemp(OutputImage), Size = Params.OutputSize, Resource = GetOutputRenderTarget()->GameThread_GetRenderTargetResource()](FRHICommandListImmediate& RHICmdList)
+	{
+		FRayTracingCPURenderer::UploadToTexture_RenderThread(RHICmdList, Resource->TextureRHI, Size, Image);
+	});
+}
+
+
+void ARayTracingManager::QueueSceneUpload_RenderThread(FRayTracingSceneUpload&& Upload, const uint32 Serial)
+{
+	check(IsInRenderingThread());
+
+	PendingSceneUpload.Append(MoveTemp(Upload));
+	AppliedSceneUploadSerial = Serial;
+}
+
+bool ARayTracingManager::Prepare_RenderThread(uint32& OutInputHash)
+{
+	check(IsInRenderingThread());
+
+	Frames.Latch();
+	if (!Frames.HasValue())
+	{
+		return false;
+	}
+
+	const FRayTracingQueuedFrame& Frame = Frames.Get();
+	OutInputHash = Frame.FrameIndex;
+	// Wait for the frame's scene changes, they're still in the render command queue
+	return Frame.FrameIndex != TracedFrameIndex && Frame.SceneUploadSerial <= AppliedSceneUploadSerial;
+}
+
+void ARayTracingManager::AddPasses_RenderThread(FRDGBuilder& GraphBuilder)
+{
+	check(IsInRenderingThread());
+
+	// The latched frame is only ever touched here, the game thread publishes into the other slots
+	FRayTracingQueuedFrame& Frame = Frames.Get();
+	FRayTracingParams& FrameParams = Frame.Params;
+	FrameParams.SceneUpload = MoveTemp(PendingSceneUpload);
+	TracedFrameIndex = Frame.FrameIndex;
+
+	// Accumulate on top of what was actually traced, not what the game thread sent. If the frame that started
+	// this accumulation was dropped, start over
+	if (FrameParams.bProgressive && FrameParams.PreviousSampleCount > 0)
+	{
+		FrameParams.PreviousSampleCount = Frame.AccumulationEpoch == GPUAccumulationEpoch ? GPUAccumulatedSamples : 0;
+	}
+	if (FrameParams.bCheckerboard)
+	{
+		FrameParams.CheckerboardParity = GPUCheckerboardParity ^ 1;
+	}
+
+	bTracedSceneUpload = FRayTracingGPURenderer::AddPasses(GraphBuilder, FrameParams, GPUState);
+	if (bTracedSceneUpload)
+	{
+		GPUAccumulatedSamples = FrameParams.bProgressive ? FrameParams.PreviousSampleCount + FrameParams.NumSamples : 0;
+		GPUCheckerboardParity = FrameParams.CheckerboardParity;
+		GPUAccumulationEpoch = Frame.AccumulationEpoch;
+	}
+	else if (!GPUState.SphereBuffer.IsValid() && !FrameParams.SceneUpload.bFullUpload)
+	{
+		// The buffers are gone, the scatters can only be applied on top of a full upload from the game thread
+		bGPUFullUploadRequested = true;
+	}
+}
+
+void ARayTracingManager::PostExecute_RenderThread()
+{
+	// The graph may still have been reading the upload's arrays until now. Nothing was queued since AddPasses_RenderThread,
+	// so an untraced upload can go straight back. Scattering it again is harmless if it was applied
+	FRayTracingSceneUpload& TracedUpload = Frames.Get().Params.SceneUpload;
+	if (bTracedSceneUpload)
+	{
+		TracedUpload.ClearChanges();
+	}
+	PendingSceneUpload = MoveTemp(TracedUpload);
 
-	GraphBuilder.Execute();
+	// Extractions are only filled in by Execute
+	GPUState.UpdateMemoryStats();
 }
@@ -0,0 +1,224 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "RayTracingMeshBVH.h"
+
+
+namespace
+{
+	// Largest quantised value used by the mesh bounds, the last step is slack for float rounding
+	const int32 MaxQuantisedBound = 0xFFFE;
+
+	float HalfSurfaceArea(const FBox& Box)
+	{
+		const FVector Size = Box.GetSize();
+		return Size.X * Size.Y + Size.Y * Size.Z + Size.Z * Size.X;
+	}
+}
+
+void FTriangleMeshBVH::Reset()
+{
+	Nodes.Reset();
+	Vertices.Reset();
+	Indices.Reset();
+	BoundsOrigin = FVector::ZeroVector;
+	BoundsScale = FVector::ZeroVector;
+}
+
+void FTriangleMeshBVH::Build(const TArray<FVector>& InVertices, const TArray<uint32>& InIndices, const FSphereBVHBuildSettings& Settings)
+{
+	Reset();
+	check(InIndices.Num() % 3 == 0);
+
+	// Degenerate triangles can never be hit, leave them out of the tree
+	TArray<FBox> Bounds;
+	TArray<int32> Triangles;
+	Bounds.Reserve(InIndices.Num() / 3);
+	Triangles.Reserve(InIndices.Num() / 3);
+	FBox MeshBounds(ForceInit);
+	for (int32 Triangle = 0; Triangle < InIndices.Num() / 3; Triangle++)
+	{
+		const FVector& V0 = InVertices[InIndices[Triangle * 3 + 0]];
+		const FVector& V1 = InVertices[InIndices[Triangle * 3 + 1]];
+		const FVector& V2 = InVertices[InIndices[Triangle * 3 + 2]];
+		if (FVector::CrossProduct(V1 - V0, V2 - V0).SizeSquared() <= 0.f)
+		{
+			continue;
+		}
+
+		FBox TriangleBounds(ForceInit);
+		TriangleBounds += V0;
+		TriangleBounds += V1;
+		TriangleBounds += V2;
+		Bounds.Add(TriangleBounds);
+		Triangles.Add(Triangle);
+		MeshBounds += TriangleBounds;
+	}
+
+	const int32 NumTriangles = Triangles.Num();
+	if (NumTriangles == 0)
+	{
+		return;
+	}
+	// The top bit of a leaf is the leaf flag
+	check(static_cast<uint32>(NumTriangles) < (1u << (31 - BVH_PRIMITIVE_COUNT_BITS)));
+
+	// Build at full precision, then quantise
+	TArray<FSphereBVHNode> FullNodes;
+	TArray<int32> TriangleOrder;
+	TArray<int32> RightChildren;
+	RayTracingBVH::BuildNodes(Bounds, Settings, FullNodes, TriangleOrder, RightChildren);
+
+	Vertices = InVertices;
+	Indices.SetNumUninitialized(NumTriangles * 3);
+	for (int32 i = 0; i < NumTriangles; i++)
+	{
+		const int32 Triangle = Triangles[TriangleOrder[i]];
+		Indices[i * 3 + 0] = InIndices[Triangle * 3 + 0];
+		Indices[i * 3 + 1] = InIndices[Triangle * 3 + 1];
+		Indices[i * 3 + 2] = InIndices[Triangle * 3 + 2];
+	}
+
+	BoundsOrigin = MeshBounds.Min;
+	BoundsScale = MeshBounds.GetSize() / MaxQuantisedBound;
+
+	const uint32 NumNodes = FullNodes.Num();
+	Nodes.SetNumUninitialized(NumNodes);
+	for (uint32 NodeIndex = 0; NodeIndex < NumNodes; NodeIndex++)
+	{
+		const FSphereBVHNode& FullNode = FullNodes[NodeIndex];
+		FTriangleBVHNode& Node = Nodes[NodeIndex];
+		Quantise(FBox(FullNode.BoundsMin, FullNode.BoundsMax), Node);
+
+		if (FullNode.IsLeaf())
+		{
+			// Depth first, nothing is under a leaf so the next node is where a miss goes anyway
+			checkSlow(FullNode.MissIndex == (NodeIndex + 1 < NumNodes ? NodeIndex + 1 : BVH_INVALID_INDEX));
+			Node.Data = MESH_BVH_LEAF_FLAG | FullNode.PrimitiveData;
+		}
+		else
+		{
+			Node.Data = FullNode.MissIndex == BVH_INVALID_INDEX ? NumNodes : FullNode.MissIndex;
+		}
+	}
+}
+
+void FTriangleMeshBVH::Quantise(const FBox& Box, FTriangleBVHNode& OutNode) const
+{
+	for (int32 Axis = 0; Axis < 3; Axis++)
+	{
+		const float Origin = BoundsOrigin[Axis];
+		const float Scale = BoundsScale[Axis];
+		if (Scale <= 0.f)
+		{
+			// Flat along this axis, every box is exactly the origin
+			OutNode.QuantisedMin[Axis] = 0;
+			OutNode.QuantisedMax[Axis] = 0;
+			continue;
+		}
+
+		int32 Min = FMath::Clamp(FMath::FloorToInt((Box.Min[Axis] - Origin) / Scale), 0, MaxQuantisedBound);
+		int32 Max = FMath::Clamp(FMath::CeilToInt((Box.Max[Axis] - Origin) / Scale), 0, MaxQuantisedBound);
+
+		// The division can round either way. Take the tightest steps that still contain the box, so a box inside another never quantises bigger
+		while (Min < MaxQuantisedBound && Origin + (Min + 1) * Scale <= Box.Min[Axis])
+		{
+			Min++;
+		}
+		while (Max > 0 && Origin + (Max - 1) * Scale >= Box.Max[Axis])
+		{
+			Max--;
+		}
+		while (Min > 0 && Origin + Min * Scale > Box.Min[Axis])
+		{
+			Min--;
+		}
+		while (Max < 0xFFFF && Origin + Max * Scale < Box.Max[Axis])
+		{
+			Max++;
+		}
+
+		OutNode.QuantisedMin[Axis] = static_cast<uint16>(Min);
+		OutNode.QuantisedMax[Axis] = static_cast<uint16>(Max);
+	}
+}
+
+FBox FTriangleMeshBVH::GetNodeBounds(const FTriangleBVHNode& Node) const
+{
+	const FVector Min(Node.QuantisedMin[0], Node.QuantisedMin[1], Node.QuantisedMin[2]);
+	const FVector Max(Node.QuantisedMax[0], Node.QuantisedMax[1], Node.QuantisedMax[2]);
+	return FBox(BoundsOrigin + Min * BoundsScale, BoundsOrigin + Max * BoundsScale);
+}
+
+void FTriangleMeshBVH::Trace(const FRayTracingRay& Ray, FRayTracingHit& BestHit, FTriangleMeshTraversalStats* Stats) const
+{
+	const FVector InvDirection = RayTracingCPU::SafeInverse(Ray.Direction);
+	int64 NodesVisited = 0;
+	int64 TrianglesTested = 0;
+
+	// Stackless traversal, mirrors TraceMeshBVH in RayTracingCS.usf
+	const uint32 NumNodes = Nodes.Num();
+	uint32 NodeIndex = 0;
+	while (NodeIndex < NumNodes)
+	{
+		const FTriangleBVHNode& Node = Nodes[NodeIndex];
+		const FBox Bounds = GetNodeBounds(Node);
+		NodesVisited++;
+
+		if (RayTracingCPU::IntersectBox(Ray.Origin, InvDirection, Bounds.Min, Bounds.Max, BestHit.Distance))
+		{
+			if (Node.IsLeaf())
+			{
+				const uint32 First = Node.GetFirstTriangle();
+				const uint32 Last = First + Node.GetTriangleCount();
+				for (uint32 i = First; i < Last; i++)
+				{
+					RayTracingCPU::IntersectTriangle(Ray, BestHit, Vertices[Indices[i * 3 + 0]], Vertices[Indices[i * 3 + 1]], Vertices[Indices[i * 3 + 2]]);
+				}
+				TrianglesTested += Last - First;
+			}
+			// Interior nodes continue with the first child, leaves with their miss link. Both are the next node
+			NodeIndex++;
+		}
+		else
+		{
+			NodeIndex = Node.GetMissIndex(NodeIndex);
+		}
+	}
+
+	if (Stats)
+	{
+		Stats->NumRays++;
+		Stats->NodesVisited += NodesVisited;
+		Stats->TrianglesTested += TrianglesTested;
+	}
+}
+
+float FTriangleMeshBVH::ComputeSAHCost(const float TraversalCost) const
+{
+	if (Nodes.Num() == 0)
+	{
+		return 0.f;
+	}
+
+	const float RootArea = FMath::Max(HalfSurfaceArea(GetNodeBounds(Nodes[0])), SMALL_NUMBER);
+	float Cost = 0.f;
+	for (const FTriangleBVHNode& Node : Nodes)
+	{
+		const float Probability = HalfSurfaceArea(GetNodeBounds(Node)) / RootArea;
+		Cost += Probability * (Node.IsLeaf() ? static_cast<float>(Node.GetTriangleCount()) : TraversalCost);
+	}
+	return Cost;
+}
+
+FTriangleMeshStats FTriangleMeshBVH::GetStats() const
+{
+	FTriangleMeshStats Stats;
+	Stats.NumTriangles = GetNumTriangles();
+	Stats.NumVertices = Vertices.Num();
+	Stats.NumNodes = Nodes.Num();
+	Stats.NodeBytes = Nodes.Num() * sizeof(FTriangleBVHNode);
+	Stats.VertexBytes = Vertices.Num() * sizeof(FVector);
+	Stats.IndexBytes = Indices.Num() * sizeof(uint32);
+	Stats.SAHCost = ComputeSAHCost();
+	return Stats;
+}
@@ -0,0 +1,121 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "RayTracingMeshComponent.h"
+
+#include "ComputeShaders.h"
+#include "RayTracingSceneSubsystem.h"
+#include "StaticMeshResources.h"
+#include "Components/StaticMeshComponent.h"
+#include "Engine/StaticMesh.h"
+#include "Engine/World.h"
+
+
+URayTracingMeshComponent::URayTracingMeshComponent()
+{
+	StaticMesh = nullptr;
+	SceneIndex = INDEX_NONE;
+
+	// Needed for OnUpdateTransform
+	bWantsOnUpdateTransform = true;
+}
+
+void URayTracingMeshComponent::SetStaticMesh(UStaticMesh* NewMesh)
+{
+	if (StaticMesh != NewMesh)
+	{
+		StaticMesh = NewMesh;
+		MarkSceneDirty();
+	}
+}
+
+UStaticMesh* URayTracingMeshComponent::GetTracedMesh() const
+{
+	if (StaticMesh)
+	{
+		return StaticMesh;
+	}
+
+	const UStaticMeshComponent* Parent = Cast<UStaticMeshComponent>(GetAttachParent());
+	return Parent ? Parent->GetStaticMesh() : nullptr;
+}
+
+bool URayTracingMeshComponent::GetTriangles(TArray<FVector>& OutVertices, TArray<uint32>& OutIndices) const
+{
+	const UStaticMesh* Mesh = GetTracedMesh();
+	if (Mesh == nullptr || Mesh->RenderData == nullptr || Mesh->RenderData->LODResources.Num() == 0)
+	{
+		return false;
+	}
+
+	const FStaticMeshLODResources& LOD = Mesh->RenderData->LODResources[0];
+	const FPositionVertexBuffer& Positions = LOD.VertexBuffers.PositionVertexBuffer;
+	TArray<uint32> LODIndices;
+	LOD.IndexBuffer.GetCopy(LODIndices);
+	if (Positions.GetVertexData() == nullptr || LODIndices.Num() == 0)
+	{
+		printw("%s: %s has no CPU accessible geometry, enable Allow CPU Access on it to ray trace it", *GetPathName(), *Mesh->GetName())
+		return false;
+	}
+
+	const FTransform& Transform = GetComponentTransform();
+	const uint32 BaseVertex = OutVertices.Num();
+	OutVertices.Reserve(OutVertices.Num() + Positions.GetNumVertices());
+	for (uint32 i = 0; i < Positions.GetNumVertices(); i++)
+	{
+		OutVertices.Add(Transform.TransformPosition(Positions.VertexPosition(i)));
+	}
+
+	OutIndices.Reserve(OutIndices.Num() + LODIndices.Num());
+	for (const uint32 Index : LODIndices)
+	{
+		OutIndices.Add(BaseVertex + Index);
+	}
+	return true;
+}
+
+void URayTracingMeshComponent::OnRegister()
+{
+	Super::OnRegister();
+
+	if (URayTracingSceneSubsystem* Scene = GetWorld() ? GetWorld()->GetSubsystem<URayTracingSceneSubsystem>() : nullptr)
+	{
+		Scene->AddMesh(this);
+	}
+}
+
+void URayTracingMeshComponent::OnUnregister()
+{
+	if (URayTracingSceneSubsystem* Scene = GetWorld() ? GetWorld()->GetSubsystem<URayTracingSceneSubsystem>() : nullptr)
+	{
+		Scene->RemoveMesh(this);
+	}
+
+	Super::OnUnregister();
+}
+
+void URayTracingMeshComponent::OnUpdateTransform(const EUpdateTransformFlags UpdateTransformFlags, const ETeleportType Teleport)
+{
+	Super::OnUpdateTransform(UpdateTransformFlags, Teleport);
+	MarkSceneDirty();
+}
+
+#if WITH_EDITOR
+void URayTracingMeshComponent::PostEditChangeProperty(FPropertyChangedEvent& PropertyChangedEvent)
+{
+	Super::PostEditChangeProperty(PropertyChangedEvent);
+	MarkSceneDirty();
+}
+#endif
+
+void URayTracingMeshComponent::MarkSceneDirty()
+{
+	if (SceneIndex == INDEX_NONE)
+	{
+		return;
+	}
+
+	if (URayTracingSceneSubsystem* Scene = GetWorld() ? GetWorld()->GetSubsystem<URayTracingSceneSubsystem>() : nullptr)
+	{
+		Scene->MarkMeshDirty(this);
+	}
+}
@@ -0,0 +1,113 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "RayTracingPackedScene.h"
+
+
+namespace
+{
+	// Same as FTriangleMeshBVH, one step is left above the bounds so nodes can round outwards past them
+	const int32 MaxQuantisedValue = 0xFFFE;
+
+	// Room on each side, as a fraction of the scene size
+	const float PackingSlack = 0.25f;
+}
+
+FSphereBVHPacking FSphereBVHPacking::Create(const FBox& SceneBounds)
+{
+	// A single sphere or a flat scene would otherwise have no size to divide
+	const float MinSize = 1.f;
+	const FVector Size = SceneBounds.GetSize().ComponentMax(FVector(MinSize));
+	const FVector Min = SceneBounds.GetCenter() - Size * (0.5f + PackingSlack);
+
+	FSphereBVHPacking Packing;
+	Packing.Origin = Min;
+	Packing.Scale = Size * (1.f + 2.f * PackingSlack) / MaxQuantisedValue;
+	Packing.RadiusScale = Packing.Scale.GetMax();
+	return Packing;
+}
+
+bool FSphereBVHPacking::Contains(const FBox& Box) const
+{
+	if (!IsValid())
+	{
+		return false;
+	}
+	const FVector Max = Origin + Scale * MaxQuantisedValue;
+	return Box.Min.X >= Origin.X && Box.Min.Y >= Origin.Y && Box.Min.Z >= Origin.Z
+		&& Box.Max.X <= Max.X && Box.Max.Y <= Max.Y && Box.Max.Z <= Max.Z;
+}
+
+FPackedSphere FSphereBVHPacking::PackSphere(const FVector4& Sphere) const
+{
+	FPackedSphere Packed;
+	FVector PackedOrigin;
+	for (int32 Axis = 0; Axis < 3; Axis++)
+	{
+		Packed.Origin[Axis] = static_cast<uint16>(FMath::Clamp(FMath::RoundToInt((Sphere[Axis] - Origin[Axis]) / Scale[Axis]), 0, MaxQuantisedValue));
+		PackedOrigin[Axis] = Origin[Axis] + Packed.Origin[Axis] * Scale[Axis];
+	}
+
+	// Rounded up past the origin's rounding so the packed sphere contains the real one. Never 0, small spheres would disappear
+	const float Radius = Sphere.W + FVector::Dist(PackedOrigin, FVector(Sphere));
+	int32 PackedRadius = FMath::Clamp(FMath::CeilToInt(Radius / RadiusScale), 1, 0xFFFF);
+	while (PackedRadius < 0xFFFF && PackedRadius * RadiusScale < Radius)
+	{
+		PackedRadius++;
+	}
+	Packed.Radius = static_cast<uint16>(PackedRadius);
+	return Packed;
+}
+
+FVector4 FSphereBVHPacking::UnpackSphere(const FPackedSphere& Sphere) const
+{
+	const FVector Offset(Sphere.Origin[0], Sphere.Origin[1], Sphere.Origin[2]);
+	return FVector4(Origin + Offset * Scale, Sphere.Radius * RadiusScale);
+}
+
+FTriangleBVHNode FSphereBVHPacking::PackNode(const FSphereBVHNode& Node, const uint32 NodeIndex, const uint32 NumNodes) const
+{
+	// A packed sphere can stick out of the real bounds by half a step of its origin on the axis, plus its radius growing
+	// by the whole origin error and a radius step
+	const FVector Padding = Scale * 0.5f + FVector(Scale.Size() * 0.5f + RadiusScale);
+	const FVector BoundsMin = Node.BoundsMin - Padding;
+	const FVector BoundsMax = Node.BoundsMax + Padding;
+
+	FTriangleBVHNode Packed;
+	for (int32 Axis = 0; Axis < 3; Axis++)
+	{
+		int32 Min = FMath::Clamp(FMath::FloorToInt((BoundsMin[Axis] - Origin[Axis]) / Scale[Axis]), 0, MaxQuantisedValue);
+		int32 Max = FMath::Clamp(FMath::CeilToInt((BoundsMax[Axis] - Origin[Axis]) / Scale[Axis]), 0, MaxQuantisedValue);
+
+		// The division can round the wrong way, step outwards until unpacking gives a box at least as big
+		while (Min > 0 && Origin[Axis] + Min * Scale[Axis] > BoundsMin[Axis])
+		{
+			Min--;
+		}
+		while (Max < 0xFFFF && Origin[Axis] + Max * Scale[Axis] < BoundsMax[Axis])
+		{
+			Max++;
+		}
+
+		Packed.QuantisedMin[Axis] = static_cast<uint16>(Min);
+		Packed.QuantisedMax[Axis] = static_cast<uint16>(Max);
+	}
+
+	if (Node.IsLeaf())
+	{
+		// Depth first, nothing is under a leaf so the next node is where a miss goes anyway
+		checkSlow(Node.MissIndex == (NodeIndex + 1 < NumNodes ? NodeIndex + 1 : BVH_INVALID_INDEX));
+		Packed.Data = MESH_BVH_LEAF_FLAG | Node.PrimitiveData;
+	}
+	else
+	{
+		Packed.Data = Node.MissIndex == BVH_INVALID_INDEX ? NumNodes : Node.MissIndex;
+	}
+	return Packed;
+}
+
+FBox FSphereBVHPacking::GetNodeBounds(const FTriangleBVHNode& Node) const
+{
+	const FVector QuantisedMin(Node.QuantisedMin[0], Node.QuantisedMin[1], Node.QuantisedMin[2]);
+	const FVector QuantisedMax(Node.QuantisedMax[0], Node.QuantisedMax[1], Node.QuantisedMax[2]);
+	return FBox(Origin + QuantisedMin * Scale, Origin + QuantisedMax * Scale);
+}
@@ -0,0 +1,146 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "RayTracingReconstruct.h"
+
+#include "GlobalShader.h"
+#include "RenderGraphUtils.h"
+#include "ShaderParameterStruct.h"
+#include "Async/ParallelFor.h"
+
+
+#define RAY_TRACING_RECONSTRUCT_THREADGROUP_SIZE 8
+
+class FRayTracingCheckerboardFillCS : public FGlobalShader
+{
+public:
+	DECLARE_GLOBAL_SHADER(FRayTracingCheckerboardFillCS);
+	SHADER_USE_PARAMETER_STRUCT(FRayTracingCheckerboardFillCS, FGlobalShader);
+
+	// Use the accumulated average where there is one (progressive mode)
+	class FUseAccumulationDim : SHADER_PERMUTATION_BOOL("USE_ACCUMULATION");
+	using FPermutationDomain = TShaderPermutationDomain<FUseAccumulationDim>;
+
+	BEGIN_SHADER_PARAMETER_STRUCT(FParameters, )
+		SHADER_PARAMETER_RDG_TEXTURE_UAV(RWTexture2D<float4>, RWOutputTexture)
+		SHADER_PARAMETER_RDG_TEXTURE(Texture2D<float4>, AccumulationTexture)
+		SHADER_PARAMETER(FIntPoint, Dimensions)
+		SHADER_PARAMETER(uint32, CheckerboardParity)
+	END_SHADER_PARAMETER_STRUCT()
+
+	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters)
+	{
+		return IsFeatureLevelSupported(Parameters.Platform, ERHIFeatureLevel::SM5);
+	}
+
+	static void ModifyCompilationEnvironment(const FGlobalShaderPermutationParameters& Parameters, FShaderCompilerEnvironment& OutEnvironment)
+	{
+		FGlobalShader::ModifyCompilationEnvironment(Parameters, OutEnvironment);
+		OutEnvironment.SetDefine(TEXT("THREADGROUPSIZE_X"), RAY_TRACING_RECONSTRUCT_THREADGROUP_SIZE);
+		OutEnvironment.SetDefine(TEXT("THREADGROUPSIZE_Y"), RAY_TRACING_RECONSTRUCT_THREADGROUP_SIZE);
+	}
+};
+
+class FRayTracingUpscaleCS : public FGlobalShader
+{
+public:
+	DECLARE_GLOBAL_SHADER(FRayTracingUpscaleCS);
+	SHADER_USE_PARAMETER_STRUCT(FRayTracingUpscaleCS, FGlobalShader);
+
+	BEGIN_SHADER_PARAMETER_STRUCT(FParameters, )
+		SHADER_PARAMETER_RDG_TEXTURE(Texture2D<float4>, InputTexture)
+		SHADER_PARAMETER_SAMPLER(SamplerState, InputSampler)
+		SHADER_PARAMETER_RDG_TEXTURE_UAV(RWTexture2D<float4>, RWOutputTexture)
+		SHADER_PARAMETER(FIntPoint, Dimensions)
+		SHADER_PARAMETER(FVector2D, InvDimensions)
+	END_SHADER_PARAMETER_STRUCT()
+
+	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters)
+	{
+		return IsFeatureLevelSupported(Parameters.Platform, ERHIFeatureLevel::SM5);
+	}
+
+	static void ModifyCompilationEnvironment(const FGlobalShaderPermutationParameters& Parameters, FShaderCompilerEnvironment& OutEnvironment)
+	{
+		FGlobalShader::ModifyCompilationEnvironment(Parameters, OutEnvironment);
+		OutEnvironment.SetDefine(TEXT("THREADGROUPSIZE_X"), RAY_TRACING_RECONSTRUCT_THREADGROUP_SIZE);
+		OutEnvironment.SetDefine(TEXT("THREADGROUPSIZE_Y"), RAY_TRACING_RECONSTRUCT_THREADGROUP_SIZE);
+	}
+};
+
+IMPLEMENT_GLOBAL_SHADER(FRayTracingCheckerboardFillCS, "/ComputeShaders/RayTracingReconstructCS.usf", "CheckerboardFillCS", SF_Compute)
+IMPLEMENT_GLOBAL_SHADER(FRayTracingUpscaleCS, "/ComputeShaders/RayTracingReconstructCS.usf", "UpscaleCS", SF_Compute)
+
+void AddCheckerboardFillPass(FRDGBuilder& GraphBuilder, const FRDGTextureRef Output, const FRDGTextureRef Accumulation, const uint32 Parity)
+{
+	const FIntPoint Dimensions = Output->Desc.Extent;
+
+	FRayTracingCheckerboardFillCS::FParameters* PassParameters = GraphBuilder.AllocParameters<FRayTracingCheckerboardFillCS::FParameters>();
+	PassParameters->RWOutputTexture = GraphBuilder.CreateUAV(Output);
+	PassParameters->AccumulationTexture = Accumulation;
+	PassParameters->Dimensions = Dimensions;
+	PassParameters->CheckerboardParity = Parity;
+
+	FRayTracingCheckerboardFillCS::FPermutationDomain PermutationVector;
+	PermutationVector.Set<FRayTracingCheckerboardFillCS::FUseAccumulationDim>(Accumulation != nullptr);
+
+	// One thread per skipped pixel, same layout as the trace
+	const TShaderMapRef<FRayTracingCheckerboardFillCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel), PermutationVector);
+	FComputeShaderUtils::AddPass(
+		GraphBuilder,
+		RDG_EVENT_NAME("CheckerboardFill"),
+		ComputeShader,
+		PassParameters,
+		FComputeShaderUtils::GetGroupCount(FIntPoint(FMath::DivideAndRoundUp(Dimensions.X, 2), Dimensions.Y), RAY_TRACING_RECONSTRUCT_THREADGROUP_SIZE)
+	);
+}
+
+void AddUpscalePass(FRDGBuilder& GraphBuilder, const FRDGTextureRef Input, const FRDGTextureRef Output)
+{
+	const FIntPoint OutputSize = Output->Desc.Extent;
+
+	FRayTracingUpscaleCS::FParameters* PassParameters = GraphBuilder.AllocParameters<FRayTracingUpscaleCS::FParameters>();
+	PassParameters->InputTexture = Input;
+	PassParameters->InputSampler = TStaticSamplerState<SF_Bilinear, AM_Clamp, AM_Clamp>::CreateRHI();
+	PassParameters->RWOutputTexture = GraphBuilder.CreateUAV(Output);
+	PassParameters->Dimensions = OutputSize;
+	PassParameters->InvDimensions = FVector2D(1.f / OutputSize.X, 1.f / OutputSize.Y);
+
+	const TShaderMapRef<FRayTracingUpscaleCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
+	FComputeShaderUtils::AddPass(
+		GraphBuilder,
+		RDG_EVENT_NAME("RayTracingUpscale(%dx%d -> %dx%d)", Input->Desc.Extent.X, Input->Desc.Extent.Y, OutputSize.X, OutputSize.Y),
+		ComputeShader,
+		PassParameters,
+		FComputeShaderUtils::GetGroupCount(OutputSize, RAY_TRACING_RECONSTRUCT_THREADGROUP_SIZE)
+	);
+}
+
+void RayTracingReconstruct::Upscale(const FIntPoint& InputSize, const TArray<FLinearColor>& Input, const FIntPoint& OutputSize, TArray<FLinearColor>& Output)
+{
+	Output.SetNumUninitialized(OutputSize.X * OutputSize.Y);
+	if (Input.Num() != InputSize.X * InputSize.Y || Input.Num() == 0)
+	{
+		return;
+	}
+
+	// Same as SampleLevel with a clamped bilinear sampler
+	ParallelFor(OutputSize.Y, [&](const int32 Y)
+	{
+		const float SrcY = FMath::Clamp((Y + 0.5f) * InputSize.Y / OutputSize.Y - 0.5f, 0.f, InputSize.Y - 1.f);
+		const int32 Y0 = FMath::FloorToInt(SrcY);
+		const int32 Y1 = FMath::Min(Y0 + 1, InputSize.Y - 1);
+		const float FracY = SrcY - Y0;
+
+		for (int32 X = 0; X < OutputSize.X; X++)
+		{
+			const float SrcX = FMath::Clamp((X + 0.5f) * InputSize.X / OutputSize.X - 0.5f, 0.f, InputSize.X - 1.f);
+			const int32 X0 = FMath::FloorToInt(SrcX);
+			const int32 X1 = FMath::Min(X0 + 1, InputSize.X - 1);
+			const float FracX = SrcX - X0;
+
+			const FLinearColor Top = FMath::Lerp(Input[Y0 * InputSize.X + X0], Input[Y0 * InputSize.X + X1], FracX);
+			const FLinearColor Bottom = FMath::Lerp(Input[Y1 * InputSize.X + X0], Input[Y1 * InputSize.X + X1], FracX);
+			Output[Y * OutputSize.X + X] = FMath::Lerp(Top, Bottom, FracY);
+		}
+	});
+}
@@ -0,0 +1,540 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "RayTracingRenderCommandlet.h"
+
+#include "ComputeShaders.h"
+#include "ComputeShadersCommandletUtils.h"
+#include "IImageWrapper.h"
+#include "IImageWrapperModule.h"
+#include "RayTracingCPU.h"
+#include "RayTracingCS.h"
+#include "RayTracingGPU.h"
+#include "RayTracingManager.h"
+#include "RenderCommandFence.h"
+#include "RenderingThread.h"
+#include "Camera/CameraTypes.h"
+#include "Dom/JsonObject.h"
+#include "Engine/Texture2D.h"
+#include "Engine/TextureRenderTarget2D.h"
+#include "HAL/FileManager.h"
+#include "HAL/Runnable.h"
+#include "HAL/RunnableThread.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Modules/ModuleManager.h"
+#include "Serialization/JsonSerializer.h"
+
+
+using namespace ComputeShadersCommandletUtils;
+
+namespace
+{
+	struct FRenderSettings
+	{
+		FString SequencePath;
+		FString OutputDir;
+		EImageFormat Format = EImageFormat::EXR;
+		FIntPoint Size = FIntPoint(1280, 720);
+		int32 NumSamples = 64;
+		int32 SamplesPerPass = 16;
+		int32 MaxBounces = 4;
+		bool bDenoise = false;
+		bool bCPU = false;
+		int32 NumEncoderThreads = 2;
+		int32 QueueDepth = 4;
+		int32 NumSpheres = 64;
+		int32 NumFrames = 120;
+	};
+
+	struct FRenderSequence
+	{
+		TArray<FVector4> Spheres;
+		TArray<FMinimalViewInfo> Frames;
+	};
+
+	// A finished frame waiting to be encoded
+	struct FRenderedFrame
+	{
+		int32 Index = 0;
+		FIntPoint Size = FIntPoint::ZeroValue;
+		TArray<FLinearColor> Pixels;
+	};
+
+	FRenderSettings ParseSettings(const FString& Params)
+	{
+		FRenderSettings Settings;
+		FParse::Value(*Params, TEXT("Sequence="), Settings.SequencePath);
+		FParse::Value(*Params, TEXT("Width="), Settings.Size.X);
+		FParse::Value(*Params, TEXT("Height="), Settings.Size.Y);
+		FParse::Value(*Params, TEXT("Samples="), Settings.NumSamples);
+		FParse::Value(*Params, TEXT("SamplesPerPass="), Settings.SamplesPerPass);
+		FParse::Value(*Params, TEXT("Bounces="), Settings.MaxBounces);
+		FParse::Value(*Params, TEXT("EncoderThreads="), Settings.NumEncoderThreads);
+		FParse::Value(*Params, TEXT("QueueDepth="), Settings.QueueDepth);
+		FParse::Value(*Params, TEXT("Spheres="), Settings.NumSpheres);
+		FParse::Value(*Params, TEXT("Frames="), Settings.NumFrames);
+		Settings.bDenoise = FParse::Param(*Params, TEXT("Denoise"));
+		Settings.bCPU = FParse::Param(*Params, TEXT("CPU")) || GUsingNullRHI;
+
+		Settings.Size = Settings.Size.ComponentMax(FIntPoint(1, 1));
+		Settings.NumSamples = FMath::Max(1, Settings.NumSamples);
+		Settings.SamplesPerPass = FMath::Max(1, Settings.SamplesPerPass);
+		Settings.MaxBounces = FRayTracingCS::GetPermutationMaxBounces(Settings.MaxBounces);
+		Settings.NumEncoderThreads = FMath::Max(1, Settings.NumEncoderThreads);
+		Settings.QueueDepth = FMath::Max(1, Settings.QueueDepth);
+		Settings.NumSpheres = FMath::Max(1, Settings.NumSpheres);
+		Settings.NumFrames = FMath::Max(1, Settings.NumFrames);
+
+		FString Format;
+		if (FParse::Value(*Params, TEXT("Format="), Format) && Format.Equals(TEXT("PNG"), ESearchCase::IgnoreCase))
+		{
+			Settings.Format = EImageFormat::PNG;
+		}
+
+		if (!FParse::Value(*Params, TEXT("Output="), Settings.OutputDir))
+		{
+			Settings.OutputDir = FPaths::Combine(FPaths::ProjectSavedDir(), TEXT("RayTracingRenders"), FDateTime::Now().ToString());
+		}
+		return Settings;
+	}
+
+	bool ReadVector(const TSharedPtr<FJsonObject>& Object, const TCHAR* Field, FVector& OutVector)
+	{
+		const TArray<TSharedPtr<FJsonValue>>* Values;
+		if (!Object->TryGetArrayField(Field, Values) || Values->Num() != 3)
+		{
+			return false;
+		}
+		OutVector = FVector((*Values)[0]->AsNumber(), (*Values)[1]->AsNumber(), (*Values)[2]->AsNumber());
+		return true;
+	}
+
+	bool LoadSequence(const FString& Path, FRenderSequence& OutSequence)
+	{
+		FString JSON;
+		TSharedPtr<FJsonObject> Root;
+		if (!FFileHelper::LoadFileToString(JSON, *Path) || !FJsonSerializer::Deserialize(TJsonReaderFactory<>::Create(JSON), Root) || !Root.IsValid())
+		{
+			printe("Couldn't read the sequence %s", *Path)
+			return false;
+		}
+
+		const TArray<TSharedPtr<FJsonValue>>* Spheres;
+		if (Root->TryGetArrayField(TEXT("Spheres"), Spheres))
+		{
+			for (const TSharedPtr<FJsonValue>& Sphere : *Spheres)
+			{
+				const TArray<TSharedPtr<FJsonValue>>& Values = Sphere->AsArray();
+				if (Values.Num() == 4)
+				{
+					OutSequence.Spheres.Emplace(Values[0]->AsNumber(), Values[1]->AsNumber(), Values[2]->AsNumber(), Values[3]->AsNumber());
+				}
+			}
+		}
+
+		const TArray<TSharedPtr<FJsonValue>>* Frames;
+		if (Root->TryGetArrayField(TEXT("Frames"), Frames))
+		{
+			for (const TSharedPtr<FJsonValue>& Frame : *Frames)
+			{
+				const TSharedPtr<FJsonObject> FrameObject = Frame->AsObject();
+				FVector Location;
+				FVector Rotation = FVector::ZeroVector;
+				if (!FrameObject.IsValid() || !ReadVector(FrameObject, TEXT("Location"), Location))
+				{
+					continue;
+				}
+				ReadVector(FrameObject, TEXT("Rotation"), Rotation);
+
+				FMinimalViewInfo& ViewInfo = OutSequence.Frames.AddDefaulted_GetRef();
+				ViewInfo.Location = Location;
+				ViewInfo.Rotation = FRotator(Rotation.X, Rotation.Y, Rotation.Z);
+				ViewInfo.FOV = FrameObject->HasField(TEXT("FOV")) ? FrameObject->GetNumberField(TEXT("FOV")) : 90.f;
+			}
+		}
+
+		if (OutSequence.Spheres.Num() == 0 || OutSequence.Frames.Num() == 0)
+		{
+			printe("The sequence %s needs at least one sphere and one frame", *Path)
+			return false;
+		}
+		return true;
+	}
+
+	// Circles the generated scene looking at the middle
+	FRenderSequence CreateOrbitSequence(const int32 NumSpheres, const int32 NumFrames)
+	{
+		FRenderSequence Sequence;
+		Sequence.Spheres = CreateSpheres(NumSpheres);
+
+		const float Distance = 300.f * FMath::Sqrt(static_cast<float>(NumSpheres));
+		for (int32 i = 0; i < NumFrames; i++)
+		{
+			const float Angle = 2.f * PI * i / NumFrames;
+			FMinimalViewInfo& ViewInfo = Sequence.Frames.AddDefaulted_GetRef();
+			ViewInfo.Location = FVector(FMath::Cos(Angle) * Distance, FMath::Sin(Angle) * Distance, 1000.f);
+			ViewInfo.Rotation = (-ViewInfo.Location).Rotation();
+			ViewInfo.FOV = 90.f;
+		}
+		return Sequence;
+	}
+
+	// Bounded queue drained by a pool of encoder threads.
+	// Push blocks while the queue is full, so at most QueueDepth + NumThreads frames are held at once
+	class FFrameEncoderPool
+	{
+	public:
+		FFrameEncoderPool(const FString& InOutputDir, const EImageFormat InFormat, const int32 NumThreads, const int32 InQueueDepth)
+			: OutputDir(InOutputDir)
+			, Format(InFormat)
+			, QueueDepth(InQueueDepth)
+		{
+			// Module loading isn't thread safe, do it before the workers start
+			ImageWrapperModule = &FModuleManager::LoadModuleChecked<IImageWrapperModule>(TEXT("ImageWrapper"));
+			WorkEvent = FPlatformProcess::GetSynchEventFromPool(false);
+			SpaceEvent = FPlatformProcess::GetSynchEventFromPool(false);
+
+			for (int32 i = 0; i < NumThreads; i++)
+			{
+				FWorker* Worker = Workers.Add_GetRef(MakeUnique<FWorker>(*this)).Get();
+				Threads.Emplace(FRunnableThread::Create(Worker, *FString::Printf(TEXT("RayTracingFrameEncoder%d"), i)));
+			}
+		}
+
+		~FFrameEncoderPool()
+		{
+			Finish();
+			FPlatformProcess::ReturnSynchEventToPool(WorkEvent);
+			FPlatformProcess::ReturnSynchEventToPool(SpaceEvent);
+		}
+
+		void Push(FRenderedFrame&& Frame)
+		{
+			while (true)
+			{
+				{
+					FScopeLock Lock(&CriticalSection);
+					if (Queue.Num() < QueueDepth)
+					{
+						Queue.Add(MoveTemp(Frame));
+						WorkEvent->Trigger();
+						return;
+					}
+				}
+				// Encoding is the bottleneck, wait for a worker to take one
+				SpaceEvent->Wait();
+			}
+		}
+
+		// Encodes everything still queued and stops the workers
+		void Finish()
+		{
+			bStopping = true;
+			WorkEvent->Trigger();
+			for (const TUniquePtr<FRunnableThread>& Thread : Threads)
+			{
+				Thread->WaitForCompletion();
+			}
+			Threads.Reset();
+		}
+
+		int32 GetNumWritten() const { return NumWritten.GetValue(); }
+		int32 GetNumFailed() const { return NumFailed.GetValue(); }
+
+	private:
+		class FWorker : public FRunnable
+		{
+		public:
+			explicit FWorker(FFrameEncoderPool& InPool) : Pool(InPool) {}
+
+			virtual uint32 Run() override
+			{
+				FRenderedFrame Frame;
+				while (Pool.Pop(Frame))
+				{
+					if (Pool.Encode(Frame))
+					{
+						Pool.NumWritten.Increment();
+					}
+					else
+					{
+						Pool.NumFailed.Increment();
+					}
+				}
+				return 0;
+			}
+
+		private:
+			FFrameEncoderPool& Pool;
+		};
+
+		// Returns false once stopping and there's nothing left
+		bool Pop(FRenderedFrame& OutFrame)
+		{
+			while (true)
+			{
+				{
+					FScopeLock Lock(&CriticalSection);
+					if (Queue.Num() > 0)
+					{
+						// Oldest first so the files appear in order
+						OutFrame = MoveTemp(Queue[0]);
+						Queue.RemoveAt(0, 1, false);
+						SpaceEvent->Trigger();
+						// The events are auto reset and only wake one worker, pass it on while there's more
+						if (Queue.Num() > 0)
+						{
+							WorkEvent->Trigger();
+						}
+						return true;
+					}
+				}
+				if (bStopping)
+				{
+					// Wake the next worker so it sees it too
+					WorkEvent->Trigger();
+					return false;
+				}
+				WorkEvent->Wait();
+			}
+		}
+
+		bool Encode(const FRenderedFrame& Frame) const
+		{
+			const TSharedPtr<IImageWrapper> ImageWrapper = ImageWrapperModule->CreateImageWrapper(Format);
+			if (!ImageWrapper.IsValid())
+			{
+				return false;
+			}
+
+			const int32 NumPixels = Frame.Size.X * Frame.Size.Y;
+			bool bRawSet;
+			if (Format == EImageFormat::EXR)
+			{
+				// Linear, full precision
+				bRawSet = ImageWrapper->SetRaw(Frame.Pixels.GetData(), NumPixels * sizeof(FLinearColor), Frame.Size.X, Frame.Size.Y, ERGBFormat::RGBA, 32);
+			}
+			else
+			{
+				TArray<FColor> Colors;
+				Colors.SetNumUninitialized(NumPixels);
+				for (int32 i = 0; i < NumPixels; i++)
+				{
+					Colors[i] = Frame.Pixels[i].ToFColor(true);
+				}
+				bRawSet = ImageWrapper->SetRaw(Colors.GetData(), NumPixels * sizeof(FColor), Frame.Size.X, Frame.Size.Y, ERGBFormat::BGRA, 8);
+			}
+
+			const TCHAR* Extension = Format == EImageFormat::EXR ? TEXT("exr") : TEXT("png");
+			const FString Path = FPaths::Combine(OutputDir, FString::Printf(TEXT("Frame_%05d.%s"), Frame.Index, Extension));
+			return bRawSet && FFileHelper::SaveArrayToFile(ImageWrapper->GetCompressed(), *Path);
+		}
+
+		FString OutputDir;
+		EImageFormat Format;
+		int32 QueueDepth;
+		IImageWrapperModule* ImageWrapperModule = nullptr;
+
+		FCriticalSection CriticalSection;
+		TArray<FRenderedFrame> Queue;
+		// Frames were queued or we're stopping, and a frame was taken off a full queue
+		FEvent* WorkEvent = nullptr;
+		FEvent* SpaceEvent = nullptr;
+		FThreadSafeBool bStopping;
+		FThreadSafeCounter NumWritten;
+		FThreadSafeCounter NumFailed;
+
+		TArray<TUniquePtr<FWorker>> Workers;
+		TArray<TUniquePtr<FRunnableThread>> Threads;
+	};
+
+	FRayTracingParams CreateParams(const FRenderSettings& Settings, const TSharedRef<FSphereBVH, ESPMode::ThreadSafe>& BVH)
+	{
+		FRayTracingParams Params;
+		Params.PixelFormat = PF_FloatRGBA;
+		Params.Colour = FLinearColor::White;
+		Params.MaxBounces = Settings.MaxBounces;
+		Params.SphereBVH = BVH;
+		Params.GroupShape = 0;
+		Params.GroupSize = FRayTracingCS::GetGroupSize(Params.GroupShape);
+		Params.Denoise.bEnabled = Settings.bDenoise;
+		return Params;
+	}
+
+	// The CPU backend takes every sample at once, there's no watchdog to worry about
+	void RenderFrame_CPU(FRayTracingParams& Params, const FRayTracingSkyboxImage& Skybox, const FRenderSettings& Settings, TArray<FLinearColor>& OutPixels)
+	{
+		Params.NumSamples = Settings.NumSamples;
+		FRayTracingCPURenderer::Render(Params, Skybox, OutPixels);
+
+		if (Params.Denoise.bEnabled)
+		{
+			FRayTracingCPUGuides Guides;
+			FRayTracingCPURenderer::ComputeGuides(Params, Skybox, Guides);
+			RayTracingDenoise::Denoise(Params.TexSize, OutPixels, Guides.NormalDepth, Guides.Albedo, Params.Denoise);
+		}
+	}
+
+	// Accumulates SamplesPerPass at a time so long renders don't trip the GPU watchdog, then reads the render target back.
+	// Only queues the render commands, OutPixels is written once the render thread gets to the readback
+	void RenderFrame_GPU(FRayTracingParams& Params, FRayTracingGPUState& State, const FRenderSettings& Settings, UTextureRenderTarget2D* RenderTarget, TArray<FLinearColor>& OutPixels)
+	{
+		const bool bDenoise = Params.Denoise.bEnabled;
+		Params.bProgressive = Settings.NumSamples > Settings.SamplesPerPass;
+
+		for (int32 Sample = 0; Sample < Settings.NumSamples; Sample += Settings.SamplesPerPass)
+		{
+			Params.FirstSample = Sample;
+			Params.PreviousSampleCount = Sample;
+			Params.NumSamples = FMath::Min(Settings.SamplesPerPass, Settings.NumSamples - Sample);
+			// Only the last pass is kept
+			Params.Denoise.bEnabled = bDenoise && Sample + Params.NumSamples >= Settings.NumSamples;
+
+			ENQUEUE_RENDER_COMMAND(RayTracingRenderPass)([Params, &State](FRHICommandListImmediate& RHICmdList)
+			{
+				FRayTracingGPURenderer::Render_RenderThread(RHICmdList, Params, State);
+			});
+
+			// The scene only goes up once
+			Params.SceneUpload = FRayTracingSceneUpload();
+			Params.SceneUpload.NumSpheres = Params.SphereBVH->GetSpheres().Num();
+			Params.SceneUpload.NumNodes = Params.SphereBVH->GetNodes().Num();
+		}
+		Params.Denoise.bEnabled = bDenoise;
+
+		ENQUEUE_RENDER_COMMAND(RayTracingRenderReadback)([&OutPixels, Size = Params.OutputSize, Resource = RenderTarget->GameThread_GetRenderTargetResource()](FRHICommandListImmediate& RHICmdList)
+		{
+			TArray<FFloat16Color> HalfPixels;
+			RHICmdList.ReadSurfaceFloatData(Resource->GetRenderTargetTexture(), FIntRect(FIntPoint::ZeroValue, Size), HalfPixels, CubeFace_PosX, 0, 0);
+
+			OutPixels.SetNumUninitialized(HalfPixels.Num());
+			for (int32 i = 0; i < HalfPixels.Num(); i++)
+			{
+				OutPixels[i] = FLinearColor(HalfPixels[i]);
+			}
+		});
+	}
+}
+
+URayTracingRenderCommandlet::URayTracingRenderCommandlet()
+{
+	IsClient = false;
+	IsServer = false;
+	IsEditor = false;
+	LogToConsole = true;
+}
+
+int32 URayTracingRenderCommandlet::Main(const FString& Params)
+{
+	const FRenderSettings Settings = ParseSettings(Params);
+
+	FRenderSequence Sequence;
+	if (Settings.SequencePath.IsEmpty())
+	{
+		Sequence = CreateOrbitSequence(Settings.NumSpheres, Settings.NumFrames);
+	}
+	else if (!LoadSequence(Settings.SequencePath, Sequence))
+	{
+		return 1;
+	}
+
+	if (!IFileManager::Get().MakeDirectory(*Settings.OutputDir, true))
+	{
+		printe("Couldn't create %s", *Settings.OutputDir)
+		return 1;
+	}
+
+	print("Rendering %d frames at %dx%d, %d samples, %d bounces on the %s to %s", Sequence.Frames.Num(), Settings.Size.X, Settings.Size.Y,
+		Settings.NumSamples, Settings.MaxBounces, Settings.bCPU ? TEXT("CPU") : TEXT("GPU"), *Settings.OutputDir)
+
+	// Static scene, built once for the whole sequence
+	const TSharedRef<FSphereBVH, ESPMode::ThreadSafe> BVH = MakeShared<FSphereBVH, ESPMode::ThreadSafe>();
+	BVH->Build(Sequence.Spheres);
+	FRayTracingParams RenderParams = CreateParams(Settings, BVH);
+
+	const FRayTracingSkyboxImage CPUSkybox = CreateCPUSkybox();
+	UTexture2D* GPUSkybox = nullptr;
+	UTextureRenderTarget2D* RenderTarget = nullptr;
+	FRayTracingGPUState GPUState;
+	if (!Settings.bCPU)
+	{
+		GPUSkybox = CreateGPUSkybox(CPUSkybox);
+		GPUSkybox->AddToRoot();
+		RenderTarget = CreateRenderTarget(Settings.Size, PF_FloatRGBA);
+		RenderTarget->AddToRoot();
+		FlushRenderingCommands();
+
+		RenderParams.SkyboxResource = GPUSkybox->Resource;
+		RenderParams.RenderTargetResource = RenderTarget->GameThread_GetRenderTargetResource();
+		RenderParams.SceneUpload.SetFull(*BVH);
+	}
+
+	const double StartTime = FPlatformTime::Seconds();
+	int32 NumFailed;
+	{
+		FFrameEncoderPool Encoder(Settings.OutputDir, Settings.Format, Settings.NumEncoderThreads, Settings.QueueDepth);
+
+		// GPU frames stay in flight until the next one is queued, so the render thread works while the last one waits for the encoder
+		TUniquePtr<FRenderedFrame> PendingFrame;
+		FRenderCommandFence PendingFence;
+		double PendingStartTime = 0.0;
+		const auto PushPendingFrame = [&]()
+		{
+			if (PendingFrame.IsValid())
+			{
+				PendingFence.Wait();
+				print("Frame %d/%d rendered in %.2fms", PendingFrame->Index + 1, Sequence.Frames.Num(), (FPlatformTime::Seconds() - PendingStartTime) * 1000.0)
+				Encoder.Push(MoveTemp(*PendingFrame));
+				PendingFrame.Reset();
+			}
+		};
+
+		for (int32 FrameIndex = 0; FrameIndex < Sequence.Frames.Num(); FrameIndex++)
+		{
+			const double FrameStartTime = FPlatformTime::Seconds();
+			RenderParams.SetCamera(Sequence.Frames[FrameIndex], Settings.Size);
+
+			// The readback writes into the pixels later, they need a stable address
+			TUniquePtr<FRenderedFrame> Frame = MakeUnique<FRenderedFrame>();
+			Frame->Index = FrameIndex;
+			Frame->Size = Settings.Size;
+			if (Settings.bCPU)
+			{
+				RenderFrame_CPU(RenderParams, CPUSkybox, Settings, Frame->Pixels);
+				print("Frame %d/%d rendered in %.2fms", FrameIndex + 1, Sequence.Frames.Num(), (FPlatformTime::Seconds() - FrameStartTime) * 1000.0)
+				Encoder.Push(MoveTemp(*Frame));
+			}
+			else
+			{
+				RenderFrame_GPU(RenderParams, GPUState, Settings, RenderTarget, Frame->Pixels);
+				PushPendingFrame();
+				PendingFrame = MoveTemp(Frame);
+				PendingFence.BeginFence();
+				PendingStartTime = FrameStartTime;
+			}
+		}
+		PushPendingFrame();
+
+		Encoder.Finish();
+		NumFailed = Encoder.GetNumFailed();
+		print("Wrote %d frames in %.2fs", Encoder.GetNumWritten(), FPlatformTime::Seconds() - StartTime)
+	}
+
+	if (!Settings.bCPU)
+	{
+		ENQUEUE_RENDER_COMMAND(ReleaseRayTracingRenderState)([&GPUState](FRHICommandListImmediate& RHICmdList)
+		{
+			GPUState.Release();
+		});
+		FlushRenderingCommands();
+		RenderTarget->RemoveFromRoot();
+		GPUSkybox->RemoveFromRoot();
+	}
+
+	if (NumFailed > 0)
+	{
+		printe("Failed to encode %d frames", NumFailed)
+		return 1;
+	}
+	return 0;
+}
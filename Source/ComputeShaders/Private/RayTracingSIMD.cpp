@@ -0,0 +1,226 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "RayTracingSIMD.h"
+
+#include "SIMDHelpers.h"
+
+
+namespace
+{
+	using SIMDHelpers::VectorSqrtExact;
+
+	// Per lane closest hit, nearest first then lowest index (the order the scalar loop would have found it in)
+	struct FLaneHits
+	{
+		VectorRegister Distance;
+		VectorRegister Index;
+	};
+
+	// Intersects one ray (broadcast) against the 4 spheres starting at First, mirrors RayTracingCPU::IntersectSphere.
+	// Operations are done in the same order as the scalar version so the distances are bit identical
+	FORCEINLINE void IntersectSpheres4(
+		const VectorRegister& RayOriginX, const VectorRegister& RayOriginY, const VectorRegister& RayOriginZ,
+		const VectorRegister& RayDirX, const VectorRegister& RayDirY, const VectorRegister& RayDirZ,
+		const FSphereSoA& Spheres, const int32 First, const VectorRegister& LaneIndices, FLaneHits& Hits)
+	{
+		const VectorRegister Zero = VectorZero();
+
+		const VectorRegister DeltaX = VectorSubtract(RayOriginX, VectorLoad(&Spheres.X[First]));
+		const VectorRegister DeltaY = VectorSubtract(RayOriginY, VectorLoad(&Spheres.Y[First]));
+		const VectorRegister DeltaZ = VectorSubtract(RayOriginZ, VectorLoad(&Spheres.Z[First]));
+		const VectorRegister Radius = VectorLoad(&Spheres.Radius[First]);
+
+		const VectorRegister DirDotDelta = VectorAdd(VectorAdd(VectorMultiply(RayDirX, DeltaX), VectorMultiply(RayDirY, DeltaY)), VectorMultiply(RayDirZ, DeltaZ));
+		const VectorRegister DeltaDotDelta = VectorAdd(VectorAdd(VectorMultiply(DeltaX, DeltaX), VectorMultiply(DeltaY, DeltaY)), VectorMultiply(DeltaZ, DeltaZ));
+		const VectorRegister B = VectorNegate(DirDotDelta);
+		const VectorRegister Discriminant = VectorAdd(VectorSubtract(VectorMultiply(B, B), DeltaDotDelta), VectorMultiply(Radius, Radius));
+
+		// Negative discriminants give NaNs here, they fail every comparison below
+		const VectorRegister SqrtD = VectorSqrtExact(Discriminant);
+		const VectorRegister Near = VectorSubtract(B, SqrtD);
+		const VectorRegister Far = VectorAdd(B, SqrtD);
+		const VectorRegister T = VectorSelect(VectorCompareGT(Near, Zero), Near, Far);
+
+		const VectorRegister Hit = VectorBitwiseAnd(
+			VectorBitwiseAnd(VectorCompareGE(Discriminant, Zero), VectorCompareGT(T, Zero)),
+			VectorCompareLT(T, Hits.Distance)
+		);
+
+		Hits.Distance = VectorSelect(Hit, T, Hits.Distance);
+		Hits.Index = VectorSelect(Hit, VectorAdd(LaneIndices, VectorSetFloat1(static_cast<float>(First))), Hits.Index);
+	}
+
+	// Same as the end of RayTracingCPU::IntersectSphere
+	FORCEINLINE void FillHit(const FRayTracingRay& Ray, FRayTracingHit& BestHit, const float Distance, const FVector4& Sphere)
+	{
+		BestHit.Distance = Distance;
+		BestHit.Position = Ray.Origin + Distance * Ray.Direction;
+		BestHit.Normal = (BestHit.Position - FVector(Sphere.X, Sphere.Y, Sphere.Z)).GetSafeNormal();
+	}
+}
+
+void FSphereSoA::Set(const TArray<FVector4>& Spheres)
+{
+	Reset();
+	X.Reserve(Spheres.Num());
+	Y.Reserve(Spheres.Num());
+	Z.Reserve(Spheres.Num());
+	Radius.Reserve(Spheres.Num());
+	for (const FVector4& Sphere : Spheres)
+	{
+		Add(Sphere);
+	}
+}
+
+void FSphereSoA::Add(const FVector4& Sphere)
+{
+	X.Add(Sphere.X);
+	Y.Add(Sphere.Y);
+	Z.Add(Sphere.Z);
+	Radius.Add(Sphere.W);
+}
+
+void FSphereSoA::Reset()
+{
+	X.Reset();
+	Y.Reset();
+	Z.Reset();
+	Radius.Reset();
+}
+
+int32 RayTracingSIMD::IntersectSpheresScalar(const FRayTracingRay& Ray, FRayTracingHit& BestHit, const TArray<FVector4>& Spheres)
+{
+	int32 HitIndex = INDEX_NONE;
+	for (int32 i = 0; i < Spheres.Num(); i++)
+	{
+		const float PreviousDistance = BestHit.Distance;
+		RayTracingCPU::IntersectSphere(Ray, BestHit, Spheres[i]);
+		if (BestHit.Distance != PreviousDistance)
+		{
+			HitIndex = i;
+		}
+	}
+	return HitIndex;
+}
+
+int32 RayTracingSIMD::IntersectSpheres(const FRayTracingRay& Ray, FRayTracingHit& BestHit, const FSphereSoA& Spheres)
+{
+	const VectorRegister RayOriginX = VectorSetFloat1(Ray.Origin.X);
+	const VectorRegister RayOriginY = VectorSetFloat1(Ray.Origin.Y);
+	const VectorRegister RayOriginZ = VectorSetFloat1(Ray.Origin.Z);
+	const VectorRegister RayDirX = VectorSetFloat1(Ray.Direction.X);
+	const VectorRegister RayDirY = VectorSetFloat1(Ray.Direction.Y);
+	const VectorRegister RayDirZ = VectorSetFloat1(Ray.Direction.Z);
+	const VectorRegister LaneIndices = MakeVectorRegister(0.f, 1.f, 2.f, 3.f);
+
+	// Two independent sets of lanes, 8 spheres per iteration hides the sqrt latency
+	FLaneHits HitsA = { VectorSetFloat1(BestHit.Distance), VectorSetFloat1(-1.f) };
+	FLaneHits HitsB = HitsA;
+
+	const int32 NumSpheres = Spheres.Num();
+	int32 i = 0;
+	for (; i + 8 <= NumSpheres; i += 8)
+	{
+		IntersectSpheres4(RayOriginX, RayOriginY, RayOriginZ, RayDirX, RayDirY, RayDirZ, Spheres, i, LaneIndices, HitsA);
+		IntersectSpheres4(RayOriginX, RayOriginY, RayOriginZ, RayDirX, RayDirY, RayDirZ, Spheres, i + 4, LaneIndices, HitsB);
+	}
+	if (i + 4 <= NumSpheres)
+	{
+		IntersectSpheres4(RayOriginX, RayOriginY, RayOriginZ, RayDirX, RayDirY, RayDirZ, Spheres, i, LaneIndices, HitsA);
+		i += 4;
+	}
+
+	// Reduce the 8 lanes, indices are exact as floats up to 2^24 spheres
+	float Distances[8];
+	float Indices[8];
+	VectorStore(HitsA.Distance, Distances);
+	VectorStore(HitsB.Distance, Distances + 4);
+	VectorStore(HitsA.Index, Indices);
+	VectorStore(HitsB.Index, Indices + 4);
+
+	float BestDistance = BestHit.Distance;
+	int32 HitIndex = INDEX_NONE;
+	for (int32 Lane = 0; Lane < 8; Lane++)
+	{
+		const int32 LaneIndex = static_cast<int32>(Indices[Lane]);
+		if (LaneIndex >= 0 && (Distances[Lane] < BestDistance || (Distances[Lane] == BestDistance && LaneIndex < HitIndex)))
+		{
+			BestDistance = Distances[Lane];
+			HitIndex = LaneIndex;
+		}
+	}
+
+	if (HitIndex != INDEX_NONE)
+	{
+		FillHit(Ray, BestHit, BestDistance, Spheres.Get(HitIndex));
+	}
+
+	// Leftovers, they come after everything above so a tie can't replace an earlier sphere
+	for (; i < NumSpheres; i++)
+	{
+		const float PreviousDistance = BestHit.Distance;
+		RayTracingCPU::IntersectSphere(Ray, BestHit, Spheres.Get(i));
+		if (BestHit.Distance != PreviousDistance)
+		{
+			HitIndex = i;
+		}
+	}
+	return HitIndex;
+}
+
+void RayTracingSIMD::IntersectSpheresPacket4(const FRayTracingRay (&Rays)[4], FRayTracingHit (&BestHits)[4], const FSphereSoA& Spheres, int32 (&OutIndices)[4])
+{
+	const VectorRegister RayOriginX = MakeVectorRegister(Rays[0].Origin.X, Rays[1].Origin.X, Rays[2].Origin.X, Rays[3].Origin.X);
+	const VectorRegister RayOriginY = MakeVectorRegister(Rays[0].Origin.Y, Rays[1].Origin.Y, Rays[2].Origin.Y, Rays[3].Origin.Y);
+	const VectorRegister RayOriginZ = MakeVectorRegister(Rays[0].Origin.Z, Rays[1].Origin.Z, Rays[2].Origin.Z, Rays[3].Origin.Z);
+	const VectorRegister RayDirX = MakeVectorRegister(Rays[0].Direction.X, Rays[1].Direction.X, Rays[2].Direction.X, Rays[3].Direction.X);
+	const VectorRegister RayDirY = MakeVectorRegister(Rays[0].Direction.Y, Rays[1].Direction.Y, Rays[2].Direction.Y, Rays[3].Direction.Y);
+	const VectorRegister RayDirZ = MakeVectorRegister(Rays[0].Direction.Z, Rays[1].Direction.Z, Rays[2].Direction.Z, Rays[3].Direction.Z);
+	const VectorRegister Zero = VectorZero();
+
+	VectorRegister BestDistance = MakeVectorRegister(BestHits[0].Distance, BestHits[1].Distance, BestHits[2].Distance, BestHits[3].Distance);
+	VectorRegister BestIndex = VectorSetFloat1(-1.f);
+
+	// Each lane is a ray, the sphere is broadcast. Spheres are visited in order so strict less than keeps the first on ties
+	for (int32 i = 0; i < Spheres.Num(); i++)
+	{
+		const VectorRegister DeltaX = VectorSubtract(RayOriginX, VectorSetFloat1(Spheres.X[i]));
+		const VectorRegister DeltaY = VectorSubtract(RayOriginY, VectorSetFloat1(Spheres.Y[i]));
+		const VectorRegister DeltaZ = VectorSubtract(RayOriginZ, VectorSetFloat1(Spheres.Z[i]));
+		const VectorRegister Radius = VectorSetFloat1(Spheres.Radius[i]);
+
+		const VectorRegister DirDotDelta = VectorAdd(VectorAdd(VectorMultiply(RayDirX, DeltaX), VectorMultiply(RayDirY, DeltaY)), VectorMultiply(RayDirZ, DeltaZ));
+		const VectorRegister DeltaDotDelta = VectorAdd(VectorAdd(VectorMultiply(DeltaX, DeltaX), VectorMultiply(DeltaY, DeltaY)), VectorMultiply(DeltaZ, DeltaZ));
+		const VectorRegister B = VectorNegate(DirDotDelta);
+		const VectorRegister Discriminant = VectorAdd(VectorSubtract(VectorMultiply(B, B), DeltaDotDelta), VectorMultiply(Radius, Radius));
+
+		const VectorRegister SqrtD = VectorSqrtExact(Discriminant);
+		const VectorRegister Near = VectorSubtract(B, SqrtD);
+		const VectorRegister T = VectorSelect(VectorCompareGT(Near, Zero), Near, VectorAdd(B, SqrtD));
+
+		const VectorRegister Hit = VectorBitwiseAnd(
+			VectorBitwiseAnd(VectorCompareGE(Discriminant, Zero), VectorCompareGT(T, Zero)),
+			VectorCompareLT(T, BestDistance)
+		);
+
+		BestDistance = VectorSelect(Hit, T, BestDistance);
+		BestIndex = VectorSelect(Hit, VectorSetFloat1(static_cast<float>(i)), BestIndex);
+	}
+
+	float Distances[4];
+	float Indices[4];
+	VectorStore(BestDistance, Distances);
+	VectorStore(BestIndex, Indices);
+	for (int32 Lane = 0; Lane < 4; Lane++)
+	{
+		OutIndices[Lane] = static_cast<int32>(Indices[Lane]);
+		if (OutIndices[Lane] >= 0)
+		{
+			FillHit(Rays[Lane], BestHits[Lane], Distances[Lane], Spheres.Get(OutIndices[Lane]));
+		}
+		else
+		{
+			OutIndices[Lane] = INDEX_NONE;
+		}
+	}
+}
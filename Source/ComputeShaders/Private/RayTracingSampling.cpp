@@ -0,0 +1,114 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "RayTracingSampling.h"
+
+
+namespace RayTracingSampling
+{
+	float RadicalInverse(uint32 Index, const uint32 Base)
+	{
+		const double InvBase = 1.0 / Base;
+		double Factor = InvBase;
+		double Result = 0.0;
+		while (Index > 0)
+		{
+			Result += (Index % Base) * Factor;
+			Index /= Base;
+			Factor *= InvBase;
+		}
+		return static_cast<float>(Result);
+	}
+
+	uint32 ReverseBits(uint32 Bits)
+	{
+		Bits = (Bits << 16) | (Bits >> 16);
+		Bits = ((Bits & 0x00ff00ff) << 8) | ((Bits & 0xff00ff00) >> 8);
+		Bits = ((Bits & 0x0f0f0f0f) << 4) | ((Bits & 0xf0f0f0f0) >> 4);
+		Bits = ((Bits & 0x33333333) << 2) | ((Bits & 0xcccccccc) >> 2);
+		Bits = ((Bits & 0x55555555) << 1) | ((Bits & 0xaaaaaaaa) >> 1);
+		return Bits;
+	}
+
+	// Second Sobol dimension, direction numbers from the primitive polynomial x + 1
+	uint32 SobolSecondDimension(uint32 Index)
+	{
+		uint32 Result = 0;
+		for (uint32 Direction = 1u << 31; Index > 0; Index >>= 1, Direction ^= Direction >> 1)
+		{
+			if (Index & 1)
+			{
+				Result ^= Direction;
+			}
+		}
+		return Result;
+	}
+
+	// Largest float below 1, so 32 bit fractions never round up to 1
+	float ToUnitFloat(const uint32 Bits)
+	{
+		return FMath::Min(Bits * (1.f / 4294967296.f), 0.99999994f);
+	}
+
+	TArray<FVector2D> Generate(const ERayTracingSampleSequence Sequence)
+	{
+		TArray<FVector2D> Table;
+		Table.SetNumUninitialized(FRayTracingSampleTables::TableSize);
+
+		switch (Sequence)
+		{
+		case ERayTracingSampleSequence::Random:
+			{
+				FRandomStream Random(0x5EED);
+				for (FVector2D& Sample : Table)
+				{
+					Sample.X = Random.FRand();
+					Sample.Y = Random.FRand();
+				}
+			}
+			break;
+		case ERayTracingSampleSequence::Halton:
+			// Skip index 0, it's (0,0) for every base
+			for (int32 Index = 0; Index < Table.Num(); Index++)
+			{
+				Table[Index] = FVector2D(RadicalInverse(Index + 1, 2), RadicalInverse(Index + 1, 3));
+			}
+			break;
+		case ERayTracingSampleSequence::Sobol:
+			for (int32 Index = 0; Index < Table.Num(); Index++)
+			{
+				Table[Index] = FVector2D(ToUnitFloat(ReverseBits(Index)), ToUnitFloat(SobolSecondDimension(Index)));
+			}
+			break;
+		case ERayTracingSampleSequence::R2:
+			{
+				// 1 / plastic number and its square, in double so late samples don't drift
+				const double G = 1.32471795724474602596;
+				const double A1 = 1.0 / G;
+				const double A2 = 1.0 / (G * G);
+				for (int32 Index = 0; Index < Table.Num(); Index++)
+				{
+					Table[Index] = FVector2D(static_cast<float>(FMath::Frac(0.5 + A1 * Index)), static_cast<float>(FMath::Frac(0.5 + A2 * Index)));
+				}
+			}
+			break;
+		default:
+			checkNoEntry();
+		}
+		return Table;
+	}
+}
+
+const TArray<FVector2D>& FRayTracingSampleTables::Get(const ERayTracingSampleSequence Sequence)
+{
+	// Built once, the first caller pays for all of them (a few hundred microseconds)
+	static const TArray<FVector2D> Tables[] = {
+		RayTracingSampling::Generate(ERayTracingSampleSequence::Random),
+		RayTracingSampling::Generate(ERayTracingSampleSequence::Halton),
+		RayTracingSampling::Generate(ERayTracingSampleSequence::Sobol),
+		RayTracingSampling::Generate(ERayTracingSampleSequence::R2),
+	};
+
+	const int32 Index = static_cast<int32>(Sequence);
+	check(Index >= 0 && Index < UE_ARRAY_COUNT(Tables));
+	return Tables[Index];
+}
@@ -0,0 +1,143 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "RayTracingSceneSubsystem.h"
+
+#include "RayTracingMeshComponent.h"
+#include "RayTracingSphereComponent.h"
+
+
+void URayTracingSceneSubsystem::AddSphere(URayTracingSphereComponent* Component)
+{
+	check(Component);
+	if (Component->SceneIndex != INDEX_NONE)
+	{
+		return;
+	}
+
+	// Everything gets rebuilt anyway
+	ClearDirtySpheres();
+	bLayoutChanged = true;
+
+	Component->SceneIndex = Components.Add(Component);
+	Spheres.Add(Component->GetSphere());
+	DirtyFlags.Add(false);
+}
+
+void URayTracingSceneSubsystem::RemoveSphere(URayTracingSphereComponent* Component)
+{
+	check(Component);
+	const int32 Index = Component->SceneIndex;
+	if (Index == INDEX_NONE)
+	{
+		return;
+	}
+	check(Components[Index] == Component);
+
+	ClearDirtySpheres();
+	bLayoutChanged = true;
+
+	// Keep the arrays packed, the last sphere takes the removed slot
+	Components.RemoveAtSwap(Index, 1, false);
+	Spheres.RemoveAtSwap(Index, 1, false);
+	DirtyFlags.RemoveAtSwap(Index);
+	if (Components.IsValidIndex(Index))
+	{
+		Components[Index]->SceneIndex = Index;
+	}
+	Component->SceneIndex = INDEX_NONE;
+}
+
+void URayTracingSceneSubsystem::MarkSphereDirty(URayTracingSphereComponent* Component)
+{
+	check(Component);
+	const int32 Index = Component->SceneIndex;
+	if (Index == INDEX_NONE)
+	{
+		return;
+	}
+
+	Spheres[Index] = Component->GetSphere();
+
+	// A layout change already sends everything
+	if (!bLayoutChanged && !DirtyFlags[Index])
+	{
+		DirtyFlags[Index] = true;
+		DirtySpheres.Add(Index);
+	}
+}
+
+void URayTracingSceneSubsystem::AddMesh(URayTracingMeshComponent* Component)
+{
+	check(Component);
+	if (Component->SceneIndex != INDEX_NONE)
+	{
+		return;
+	}
+
+	Component->SceneIndex = MeshComponents.Add(Component);
+	bMeshesChanged = true;
+}
+
+void URayTracingSceneSubsystem::RemoveMesh(URayTracingMeshComponent* Component)
+{
+	check(Component);
+	const int32 Index = Component->SceneIndex;
+	if (Index == INDEX_NONE)
+	{
+		return;
+	}
+	check(MeshComponents[Index] == Component);
+
+	MeshComponents.RemoveAtSwap(Index, 1, false);
+	if (MeshComponents.IsValidIndex(Index))
+	{
+		MeshComponents[Index]->SceneIndex = Index;
+	}
+	Component->SceneIndex = INDEX_NONE;
+	bMeshesChanged = true;
+}
+
+void URayTracingSceneSubsystem::MarkMeshDirty(URayTracingMeshComponent* Component)
+{
+	check(Component);
+	if (Component->SceneIndex != INDEX_NONE)
+	{
+		bMeshesChanged = true;
+	}
+}
+
+void URayTracingSceneSubsystem::FlushChanges()
+{
+	if (bMeshesChanged)
+	{
+		bMeshesChanged = false;
+		MeshesChangedDelegate.Broadcast();
+	}
+
+	if (!bLayoutChanged && DirtySpheres.Num() == 0)
+	{
+		return;
+	}
+
+	SpheresChangedDelegate.Broadcast(bLayoutChanged, DirtySpheres);
+
+	ClearDirtySpheres();
+	bLayoutChanged = false;
+}
+
+void URayTracingSceneSubsystem::GatherTriangles(TArray<FVector>& OutVertices, TArray<uint32>& OutIndices) const
+{
+	for (const URayTracingMeshComponent* Component : MeshComponents)
+	{
+		Component->GetTriangles(OutVertices, OutIndices);
+	}
+}
+
+void URayTracingSceneSubsystem::ClearDirtySpheres()
+{
+	for (const int32 Index : DirtySpheres)
+	{
+		DirtyFlags[Index] = false;
+	}
+	DirtySpheres.Reset();
+}
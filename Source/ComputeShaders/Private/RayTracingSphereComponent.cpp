@@ -0,0 +1,78 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "RayTracingSphereComponent.h"
+
+#include "RayTracingSceneSubsystem.h"
+#include "Engine/World.h"
+
+
+URayTracingSphereComponent::URayTracingSphereComponent()
+{
+	Radius = 50.f;
+	SceneIndex = INDEX_NONE;
+	Mobility = EComponentMobility::Movable;
+
+	// Needed for OnUpdateTransform
+	bWantsOnUpdateTransform = true;
+}
+
+void URayTracingSphereComponent::SetRadius(const float NewRadius)
+{
+	if (Radius != NewRadius)
+	{
+		Radius = NewRadius;
+		MarkSceneDirty();
+	}
+}
+
+FVector4 URayTracingSphereComponent::GetSphere() const
+{
+	return FVector4(GetComponentLocation(), Radius * GetComponentScale().Z);
+}
+
+void URayTracingSphereComponent::OnRegister()
+{
+	Super::OnRegister();
+
+	if (URayTracingSceneSubsystem* Scene = GetWorld() ? GetWorld()->GetSubsystem<URayTracingSceneSubsystem>() : nullptr)
+	{
+		Scene->AddSphere(this);
+	}
+}
+
+void URayTracingSphereComponent::OnUnregister()
+{
+	if (URayTracingSceneSubsystem* Scene = GetWorld() ? GetWorld()->GetSubsystem<URayTracingSceneSubsystem>() : nullptr)
+	{
+		Scene->RemoveSphere(this);
+	}
+
+	Super::OnUnregister();
+}
+
+void URayTracingSphereComponent::OnUpdateTransform(const EUpdateTransformFlags UpdateTransformFlags, const ETeleportType Teleport)
+{
+	Super::OnUpdateTransform(UpdateTransformFlags, Teleport);
+	MarkSceneDirty();
+}
+
+#if WITH_EDITOR
+void URayTracingSphereComponent::PostEditChangeProperty(FPropertyChangedEvent& PropertyChangedEvent)
+{
+	Super::PostEditChangeProperty(PropertyChangedEvent);
+	MarkSceneDirty();
+}
+#endif
+
+void URayTracingSphereComponent::MarkSceneDirty()
+{
+	if (SceneIndex == INDEX_NONE)
+	{
+		return;
+	}
+
+	if (URayTracingSceneSubsystem* Scene = GetWorld() ? GetWorld()->GetSubsystem<URayTracingSceneSubsystem>() : nullptr)
+	{
+		Scene->MarkSphereDirty(this);
+	}
+}
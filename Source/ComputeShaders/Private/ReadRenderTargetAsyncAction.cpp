@@ -0,0 +1,66 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "ReadRenderTargetAsyncAction.h"
+
+#include "ComputeReadback.h"
+#include "ShaderHelpers.h"
+#include "Engine/TextureRenderTarget2D.h"
+
+
+UReadRenderTargetAsyncAction* UReadRenderTargetAsyncAction::ReadRenderTargetAsync(UObject* WorldContextObject, UTextureRenderTarget2D* RenderTarget)
+{
+	UReadRenderTargetAsyncAction* Action = NewObject<UReadRenderTargetAsyncAction>();
+	Action->RenderTarget = RenderTarget;
+	Action->RegisterWithGameInstance(WorldContextObject);
+	return Action;
+}
+
+void UReadRenderTargetAsyncAction::Activate()
+{
+	FTextureRenderTargetResource* Resource = RenderTarget ? RenderTarget->GameThread_GetRenderTargetResource() : nullptr;
+	if (Resource == nullptr)
+	{
+		Fail();
+		return;
+	}
+
+	TWeakObjectPtr<UReadRenderTargetAsyncAction> WeakThis(this);
+	ENQUEUE_RENDER_COMMAND(ReadRenderTargetAsync)([WeakThis, Resource](FRHICommandListImmediate& RHICmdList)
+	{
+		FRDGBuilder GraphBuilder(RHICmdList);
+
+		TRefCountPtr<IPooledRenderTarget> PooledTarget;
+		const FRDGTextureRef Texture = RegisterExternalRenderTarget(GraphBuilder, Resource->TextureRHI, PooledTarget, TEXT("ReadbackRenderTarget"));
+
+		// Called on the game thread
+		FComputeReadbackManager::Get().EnqueueTextureReadback(GraphBuilder, Texture, [WeakThis](FComputeTextureReadbackData&& Data)
+		{
+			if (UReadRenderTargetAsyncAction* This = WeakThis.Get())
+			{
+				This->HandleReadback(MoveTemp(Data));
+			}
+		});
+
+		GraphBuilder.Execute();
+	});
+}
+
+void UReadRenderTargetAsyncAction::HandleReadback(FComputeTextureReadbackData&& Data)
+{
+	TArray<FLinearColor> Pixels;
+	if (!Data.ToLinearColors(Pixels))
+	{
+		printw("ReadRenderTargetAsync: unsupported pixel format %s", GPixelFormats[Data.Format].Name)
+		Fail();
+		return;
+	}
+
+	OnCompleted.Broadcast(Pixels, Data.Size);
+	SetReadyToDestroy();
+}
+
+void UReadRenderTargetAsyncAction::Fail()
+{
+	OnFailed.Broadcast(TArray<FLinearColor>(), FIntPoint::ZeroValue);
+	SetReadyToDestroy();
+}
@@ -0,0 +1,30 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+// VectorRegister operations the engine doesn't have in an exact form, shared by the SIMD CPU paths
+namespace SIMDHelpers
+{
+	// Correctly rounded so the result matches FMath::Sqrt, unlike VectorReciprocalSqrt
+	FORCEINLINE VectorRegister VectorSqrtExact(const VectorRegister& V)
+	{
+#if PLATFORM_ENABLE_VECTORINTRINSICS_NEON
+		return vsqrtq_f32(V);
+#elif PLATFORM_ENABLE_VECTORINTRINSICS
+		return _mm_sqrt_ps(V);
+#else
+		float Lanes[4];
+		VectorStore(V, Lanes);
+		return MakeVectorRegister(FMath::Sqrt(Lanes[0]), FMath::Sqrt(Lanes[1]), FMath::Sqrt(Lanes[2]), FMath::Sqrt(Lanes[3]));
+#endif
+	}
+
+	// Same as static_cast<float>(FMath::FloorToInt(V)) for |V| < 2^31, so -0 floors to +0 like the scalar version
+	FORCEINLINE VectorRegister VectorFloorExact(const VectorRegister& V)
+	{
+		const VectorRegister Truncated = VectorIntToFloat(VectorFloatToInt(V));
+		return VectorSubtract(Truncated, VectorBitwiseAnd(VectorCompareGT(Truncated, V), VectorOne()));
+	}
+}
@@ -0,0 +1,134 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "ScatterUpload.h"
+
+#include "ComputeShaderStats.h"
+#include "GlobalShader.h"
+#include "RenderGraphUtils.h"
+#include "ShaderParameterStruct.h"
+
+
+#define SCATTER_UPLOAD_THREADGROUP_SIZE 64
+
+DECLARE_GPU_STAT_NAMED(ScatterUpload, TEXT("Scatter Upload"));
+
+class FScatterUploadCS : public FGlobalShader
+{
+public:
+	DECLARE_GLOBAL_SHADER(FScatterUploadCS);
+	SHADER_USE_PARAMETER_STRUCT(FScatterUploadCS, FGlobalShader);
+
+	// Element size in uint2s
+	class FElementSizeDim : SHADER_PERMUTATION_SPARSE_INT("ELEMENT_UINT2_COUNT", 1, 2, 4);
+	using FPermutationDomain = TShaderPermutationDomain<FElementSizeDim>;
+
+	BEGIN_SHADER_PARAMETER_STRUCT(FParameters, )
+		SHADER_PARAMETER_RDG_BUFFER_SRV(StructuredBuffer<uint>, UploadIndices)
+		SHADER_PARAMETER_RDG_BUFFER_SRV(StructuredBuffer<FScatterElement>, UploadData)
+		SHADER_PARAMETER_RDG_BUFFER_UAV(RWStructuredBuffer<FScatterElement>, DestBuffer)
+		SHADER_PARAMETER(uint32, NumUploads)
+	END_SHADER_PARAMETER_STRUCT()
+
+	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters)
+	{
+		return IsFeatureLevelSupported(Parameters.Platform, ERHIFeatureLevel::SM5);
+	}
+
+	static void ModifyCompilationEnvironment(const FGlobalShaderPermutationParameters& Parameters, FShaderCompilerEnvironment& OutEnvironment)
+	{
+		FGlobalShader::ModifyCompilationEnvironment(Parameters, OutEnvironment);
+		OutEnvironment.SetDefine(TEXT("THREADGROUPSIZE_X"), SCATTER_UPLOAD_THREADGROUP_SIZE);
+	}
+};
+
+IMPLEMENT_GLOBAL_SHADER(FScatterUploadCS, "/ComputeShaders/ScatterUploadCS.usf", "MainCS", SF_Compute)
+
+
+void AddScatterUploadPass(FRDGBuilder& GraphBuilder, const FRDGBufferRef DestBuffer, const TArrayView<const uint32> Indices, const void* Data, const uint32 BytesPerElement)
+{
+	check(DestBuffer && Data);
+	check(BytesPerElement == 8 || BytesPerElement == 16 || BytesPerElement == 32);
+	check(DestBuffer->Desc.BytesPerElement == BytesPerElement);
+
+	const int32 NumUploads = Indices.Num();
+	if (NumUploads == 0)
+	{
+		return;
+	}
+
+	RDG_GPU_STAT_SCOPE(GraphBuilder, ScatterUpload);
+	INC_DWORD_STAT_BY(STAT_ComputeShaders_TransientBufferBytes, NumUploads * (sizeof(uint32) + BytesPerElement));
+	CSV_CUSTOM_STAT(ComputeShaders, UploadKB, NumUploads * (sizeof(uint32) + BytesPerElement) / 1024.f, ECsvCustomStatOp::Accumulate);
+
+	const FRDGBufferRef IndexBuffer = CreateStructuredBuffer(
+		GraphBuilder,
+		TEXT("ScatterUploadIndices"),
+		sizeof(uint32),
+		NumUploads,
+		Indices.GetData(),
+		NumUploads * sizeof(uint32),
+		ERDGInitialDataFlags::None
+	);
+
+	const FRDGBufferRef DataBuffer = CreateStructuredBuffer(
+		GraphBuilder,
+		TEXT("ScatterUploadData"),
+		BytesPerElement,
+		NumUploads,
+		Data,
+		NumUploads * BytesPerElement,
+		ERDGInitialDataFlags::None
+	);
+
+	FScatterUploadCS::FParameters* PassParameters = GraphBuilder.AllocParameters<FScatterUploadCS::FParameters>();
+	PassParameters->UploadIndices = GraphBuilder.CreateSRV(IndexBuffer);
+	PassParameters->UploadData = GraphBuilder.CreateSRV(DataBuffer);
+	PassParameters->DestBuffer = GraphBuilder.CreateUAV(DestBuffer);
+	PassParameters->NumUploads = NumUploads;
+
+	FScatterUploadCS::FPermutationDomain PermutationVector;
+	PermutationVector.Set<FScatterUploadCS::FElementSizeDim>(BytesPerElement / 8);
+
+	const TShaderMapRef<FScatterUploadCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel), PermutationVector);
+	FComputeShaderUtils::AddPass(
+		GraphBuilder,
+		RDG_EVENT_NAME("ScatterUpload(%s, %d)", DestBuffer->Name, NumUploads),
+		ComputeShader,
+		PassParameters,
+		FComputeShaderUtils::GetGroupCount(NumUploads, SCATTER_UPLOAD_THREADGROUP_SIZE)
+	);
+}
+
+FRDGBufferRef UpdatePersistentStructuredBuffer(FRDGBuilder& GraphBuilder, TRefCountPtr<FRDGPooledBuffer>& PooledBuffer, const TCHAR* Name, const uint32 BytesPerElement, const uint32 NumElements, const void* FullData, const TArrayView<const uint32> ChangedIndices, const void* ChangedData)
+{
+	if (FullData == nullptr)
+	{
+		// Nothing to scatter into, the caller has to send everything the first time
+		check(PooledBuffer.IsValid() && PooledBuffer->Desc.NumElements == NumElements);
+
+		const FRDGBufferRef Buffer = GraphBuilder.RegisterExternalBuffer(PooledBuffer, Name);
+		if (ChangedIndices.Num() > 0)
+		{
+			AddScatterUploadPass(GraphBuilder, Buffer, ChangedIndices, ChangedData, BytesPerElement);
+			
+			// Keeps the scatter from being culled if nothing reads the buffer this frame
+			GraphBuilder.QueueBufferExtraction(Buffer, &PooledBuffer, ERHIAccess::SRVCompute);
+		}
+		return Buffer;
+	}
+
+	INC_DWORD_STAT_BY(STAT_ComputeShaders_TransientBufferBytes, NumElements * BytesPerElement);
+	CSV_CUSTOM_STAT(ComputeShaders, UploadKB, NumElements * BytesPerElement / 1024.f, ECsvCustomStatOp::Accumulate);
+
+	const FRDGBufferRef Buffer = CreateStructuredBuffer(
+		GraphBuilder,
+		Name,
+		BytesPerElement,
+		NumElements,
+		FullData,
+		NumElements * BytesPerElement,
+		ERDGInitialDataFlags::None
+	);
+	GraphBuilder.QueueBufferExtraction(Buffer, &PooledBuffer, ERHIAccess::SRVCompute);
+	return Buffer;
+}
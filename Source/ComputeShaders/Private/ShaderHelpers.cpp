@@ -2,10 +2,33 @@
 
 #include "ShaderHelpers.h"
 
+#include "GlobalShader.h"
+#include "PixelShaderUtils.h"
 #include "RenderGraphBuilder.h"
 #include "RenderGraphUtils.h"
+#include "RenderTargetPool.h"
+#include "ShaderParameterStruct.h"
 
 
+class FConvertTexturePS : public FGlobalShader
+{
+public:
+	DECLARE_GLOBAL_SHADER(FConvertTexturePS);
+	SHADER_USE_PARAMETER_STRUCT(FConvertTexturePS, FGlobalShader);
+
+	BEGIN_SHADER_PARAMETER_STRUCT(FParameters, )
+		SHADER_PARAMETER_RDG_TEXTURE(Texture2D<float4>, InputTexture)
+		RENDER_TARGET_BINDING_SLOTS()
+	END_SHADER_PARAMETER_STRUCT()
+
+	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters)
+	{
+		return IsFeatureLevelSupported(Parameters.Platform, ERHIFeatureLevel::SM5);
+	}
+};
+
+IMPLEMENT_GLOBAL_SHADER(FConvertTexturePS, "/ComputeShaders/ConvertTexturePS.usf", "ConvertTexturePS", SF_Pixel)
+
 void AddReadbackTexturePass(FRDGBuilder& GraphBuilder, const TCHAR* Name, const FRDGTextureRef SrcTexture, FTextureRHIRef DestTextureRHI, const FRHICopyTextureInfo& CopyInfo)
 {
 	AddReadbackTexturePass(
@@ -25,48 +48,135 @@ void AddReadbackTexturePass(FRDGBuilder& GraphBuilder, const TCHAR* Name, const
 	});
 }
 
-BEGIN_SHADER_PARAMETER_STRUCT(FReadbackStructuredBufferParameters, )
-	RDG_BUFFER_ACCESS(Buffer, ERHIAccess::CopySrc)
-END_SHADER_PARAMETER_STRUCT()
+void AddConvertTexturePass(FRDGBuilder& GraphBuilder, const FRDGTextureRef Input, const FRDGTextureRef Output)
+{
+	check(Input && Output && Input->Desc.Extent == Output->Desc.Extent);
+
+	FConvertTexturePS::FParameters* PassParameters = GraphBuilder.AllocParameters<FConvertTexturePS::FParameters>();
+	PassParameters->InputTexture = Input;
+	PassParameters->RenderTargets[0] = FRenderTargetBinding(Output, ERenderTargetLoadAction::ENoAction);
+
+	FGlobalShaderMap* ShaderMap = GetGlobalShaderMap(GMaxRHIFeatureLevel);
+	const TShaderMapRef<FConvertTexturePS> PixelShader(ShaderMap);
+	FPixelShaderUtils::AddFullscreenPass(
+		GraphBuilder,
+		ShaderMap,
+		RDG_EVENT_NAME("ConvertTexture(%s -> %s)", GPixelFormats[Input->Desc.Format].Name, GPixelFormats[Output->Desc.Format].Name),
+		PixelShader,
+		PassParameters,
+		FIntRect(FIntPoint::ZeroValue, Output->Desc.Extent)
+	);
+}
+
+bool IsTypedUAVStoreFormat(const EPixelFormat Format)
+{
+	if (!GPixelFormats[Format].Supported)
+	{
+		return false;
+	}
+
+	switch (Format)
+	{
+	case PF_A32B32G32R32F:
+	case PF_FloatRGBA:
+	case PF_A16B16G16R16:
+	case PF_R32G32B32A32_UINT:
+	case PF_R16G16B16A16_UINT:
+	case PF_R16G16B16A16_SINT:
+	case PF_G32R32F:
+	case PF_R32G32_UINT:
+	case PF_A2B10G10R10:
+	case PF_FloatR11G11B10:
+	case PF_R8G8B8A8:
+	case PF_R8G8B8A8_UINT:
+	case PF_R8G8B8A8_SNORM:
+	case PF_G16R16F:
+	case PF_G16R16:
+	case PF_R16G16_UINT:
+	case PF_R32_FLOAT:
+	case PF_R32_UINT:
+	case PF_R32_SINT:
+	case PF_R8G8:
+	case PF_R16F:
+	case PF_G16:
+	case PF_R16_UINT:
+	case PF_R16_SINT:
+	case PF_G8:
+	case PF_R8_UINT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool IsUAVCompatible(const FRHITexture* TextureRHI)
+{
+	return TextureRHI && EnumHasAnyFlags(TextureRHI->GetFlags(), TexCreate_UAV) && IsTypedUAVStoreFormat(TextureRHI->GetFormat());
+}
 
-void AddReadbackStructuredBufferPass(FRDGBuilder& GraphBuilder, const FRDGBufferRef SrcBuffer, void* DestBufferPtr, const uint32 BufferSize)
+FRDGTextureRef RegisterExternalRenderTarget(FRDGBuilder& GraphBuilder, FRHITexture* TextureRHI, TRefCountPtr<IPooledRenderTarget>& CachedPooledTexture, const TCHAR* Name)
 {
-	FReadbackStructuredBufferParameters* PassParameters = GraphBuilder.AllocParameters<FReadbackStructuredBufferParameters>();
-	PassParameters->Buffer = SrcBuffer;
+	check(TextureRHI);
 	
-	GraphBuilder.AddPass(
-		RDG_EVENT_NAME("StructuredBufferReadback(%s)", SrcBuffer->Name),
-		PassParameters,
-		ERDGPassFlags::Readback,
-	[SrcBuffer, DestBufferPtr, BufferSize](FRHICommandListImmediate& RHICmdList)
+	// Wrapping the RHI texture allocates, only do it when the texture changes
+	if (!CachedPooledTexture.IsValid() || CachedPooledTexture->GetRenderTargetItem().ShaderResourceTexture != TextureRHI)
 	{
-		FRHIStructuredBuffer* StructuredBuffer = SrcBuffer->GetRHIStructuredBuffer();
-		void* SrcPtr = RHICmdList.LockStructuredBuffer(StructuredBuffer, 0, BufferSize, RLM_ReadOnly);
-		FMemory::Memcpy(DestBufferPtr, SrcPtr, BufferSize);
-		RHICmdList.UnlockStructuredBuffer(StructuredBuffer);
-	});
+		CachedPooledTexture = CreateRenderTarget(TextureRHI, Name);
+	}
+	return GraphBuilder.RegisterExternalTexture(CachedPooledTexture, Name);
+}
+
+FRDGTextureRef FindOrCreatePooledTexture(FRDGBuilder& GraphBuilder, const FRDGTextureDesc& Desc, TRefCountPtr<IPooledRenderTarget>& PooledTexture, const TCHAR* Name, bool* bOutCreated)
+{
+	// The whole desc, a texture with the same size and format can still lack a UAV, mips or samples the caller needs
+	const bool bMatches = PooledTexture.IsValid() && PooledTexture->GetDesc().Compare(Translate(Desc), true);
+
+	if (bOutCreated)
+	{
+		*bOutCreated = !bMatches;
+	}
+	
+	if (bMatches)
+	{
+		return GraphBuilder.RegisterExternalTexture(PooledTexture, Name);
+	}
+
+	const FRDGTextureRef Texture = GraphBuilder.CreateTexture(Desc, Name);
+	GraphBuilder.QueueTextureExtraction(Texture, &PooledTexture);
+	return Texture;
 }
 
 void FRenderTickHelper::GameThread_Register()
 {
 	// Register on the render thread
-	ENQUEUE_RENDER_COMMAND(CreateRenderTickHelper)([this](FRHICommandList& RHICmdList)
+	ENQUEUE_RENDER_COMMAND(RegisterRenderTickHelper)([this](FRHICommandList& RHICmdList)
 	{
 		this->Register();
 	});
-	
-	// Make sure it gets done before we return
-	FlushRenderingCommands();
 }
 
 void FRenderTickHelper::GameThread_Unregister()
 {
-	// Register on the render thread
-	ENQUEUE_RENDER_COMMAND(CreateRenderTickHelper)([this](FRHICommandList& RHICmdList)
+	// Unregister on the render thread
+	ENQUEUE_RENDER_COMMAND(UnregisterRenderTickHelper)([this](FRHICommandList& RHICmdList)
 	{
 		this->Unregister();
 	});
-	
-	// Make sure it gets done before we return
-	FlushRenderingCommands();
+}
+
+void FRenderTickHelper::GameThread_Release(TUniquePtr<FRenderTickHelper>&& Helper)
+{
+	FRenderTickHelper* HelperPtr = Helper.Release();
+	if (HelperPtr == nullptr)
+	{
+		return;
+	}
+
+	// The game thread is done with it, the render thread owns it from here
+	ENQUEUE_RENDER_COMMAND(ReleaseRenderTickHelper)([HelperPtr](FRHICommandList& RHICmdList)
+	{
+		HelperPtr->TickImplementation.Unbind();
+		HelperPtr->Unregister();
+		delete HelperPtr;
+	});
 }
@@ -0,0 +1,205 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "CoherentNoise.h"
+
+#include "ComputeReadback.h"
+#include "RenderingThread.h"
+#include "WhiteNoiseCS.h"
+#include "Misc/AutomationTest.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+namespace
+{
+	// Every type and fractal, at a frequency where the coherent types span several cells of the region
+	TArray<FCoherentNoiseSettings> CreateAllSettings()
+	{
+		TArray<FCoherentNoiseSettings> AllSettings;
+		for (int32 Type = 0; Type < static_cast<int32>(ECoherentNoiseType::MAX); Type++)
+		{
+			for (int32 Fractal = 0; Fractal < static_cast<int32>(ECoherentNoiseFractal::MAX); Fractal++)
+			{
+				FCoherentNoiseSettings& Settings = AllSettings.AddDefaulted_GetRef();
+				Settings.Type = static_cast<ECoherentNoiseType>(Type);
+				Settings.Fractal = static_cast<ECoherentNoiseFractal>(Fractal);
+				Settings.Frequency = Settings.Type == ECoherentNoiseType::White ? 1.f : 0.03f;
+			}
+		}
+		return AllSettings;
+	}
+
+	FString GetName(const FCoherentNoiseSettings& Settings)
+	{
+		return StaticEnum<ECoherentNoiseType>()->GetNameStringByValue(static_cast<int64>(Settings.Type))
+			+ TEXT(" ") + StaticEnum<ECoherentNoiseFractal>()->GetNameStringByValue(static_cast<int64>(Settings.Fractal));
+	}
+
+	// Negative offset so cells on both sides of zero are covered
+	FIntPoint GetRegionOffset(const FIntPoint& Size) { return FIntPoint(-Size.X / 2, -Size.Y / 3); }
+
+	// One GPU render of each setting and format, filled in on the game thread as the readbacks arrive
+	struct FNoiseGPUComparison
+	{
+		struct FCase
+		{
+			FCoherentNoiseSettings Settings;
+			EPixelFormat Format = PF_Unknown;
+			bool bComplete = false;
+			FComputeTextureReadbackData Data;
+		};
+
+		FIntPoint Size = FIntPoint::ZeroValue;
+		uint32 Seed = 0;
+		TArray<FCase> Cases;
+		double StartTime = 0.0;
+	};
+
+	using FNoiseGPUComparisonRef = TSharedRef<FNoiseGPUComparison, ESPMode::ThreadSafe>;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FCoherentNoiseBatchMatchesScalarTest, "ComputeShaders.Noise.CPU.BatchMatchesScalar",
+	EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FCoherentNoiseBatchMatchesScalarTest::RunTest(const FString& Parameters)
+{
+	// Widths that aren't a multiple of 4 so the leftover loops are covered too
+	const uint32 Seed = CoherentNoise::GetSeed(1234, 0);
+	for (const FIntPoint Size : { FIntPoint(64, 16), FIntPoint(37, 13), FIntPoint(3, 5) })
+	{
+		const FIntPoint RegionOffset = GetRegionOffset(Size);
+		TArray<FVector2D> Positions;
+		for (int32 Y = 0; Y < Size.Y; Y++)
+		{
+			for (int32 X = 0; X < Size.X; X++)
+			{
+				Positions.Add(CoherentNoise::GetTexelPosition(RegionOffset.X + X, RegionOffset.Y + Y));
+			}
+		}
+
+		for (const FCoherentNoiseSettings& Settings : CreateAllSettings())
+		{
+			const FString What = FString::Printf(TEXT("%s %dx%d"), *GetName(Settings), Size.X, Size.Y);
+
+			TArray<float> ScalarValues;
+			for (const FVector2D& Position : Positions)
+			{
+				ScalarValues.Add(CoherentNoise::Evaluate(Settings, Seed, Position));
+			}
+			TArray<float> BatchValues;
+			BatchValues.SetNumUninitialized(Positions.Num());
+			CoherentNoise::EvaluateBatch(Settings, Seed, Positions, BatchValues);
+			TArray<float> RegionValues;
+			CoherentNoise::EvaluateRegion(Settings, Seed, RegionOffset, Size, RegionValues);
+
+			int32 NumBatchMismatches = 0;
+			int32 NumRegionMismatches = 0;
+			int32 NumOutOfRange = 0;
+			for (int32 i = 0; i < ScalarValues.Num(); i++)
+			{
+				NumBatchMismatches += BatchValues[i] != ScalarValues[i];
+				NumRegionMismatches += RegionValues[i] != ScalarValues[i];
+				NumOutOfRange += !(ScalarValues[i] >= 0.f && ScalarValues[i] <= 1.f);
+			}
+			TestEqual(*FString::Printf(TEXT("%s SIMD values that differ from the scalar ones"), *What), NumBatchMismatches, 0);
+			TestEqual(*FString::Printf(TEXT("%s parallel values that differ from the scalar ones"), *What), NumRegionMismatches, 0);
+			TestEqual(*FString::Printf(TEXT("%s values outside [0, 1]"), *What), NumOutOfRange, 0);
+		}
+	}
+	return true;
+}
+
+// Waits for every readback, then compares them with CoherentNoise::EvaluateRegion
+DEFINE_LATENT_AUTOMATION_COMMAND_TWO_PARAMETER(FCompareNoiseGPUReadbacks, FAutomationTestBase*, Test, FNoiseGPUComparisonRef, Comparison);
+
+bool FCompareNoiseGPUReadbacks::Update()
+{
+	const bool bComplete = Comparison->Cases.FindByPredicate([](const FNoiseGPUComparison::FCase& Case) { return !Case.bComplete; }) == nullptr;
+	if (!bComplete)
+	{
+		if (FPlatformTime::Seconds() - Comparison->StartTime < 30.0)
+		{
+			return false;
+		}
+		Test->AddError(TEXT("Timed out waiting for the GPU noise readbacks"));
+	}
+
+	const FIntPoint RegionOffset = GetRegionOffset(Comparison->Size);
+	for (const FNoiseGPUComparison::FCase& Case : Comparison->Cases)
+	{
+		if (!Case.bComplete)
+		{
+			continue;
+		}
+
+		const FString What = FString::Printf(TEXT("%s (%s)"), *GetName(Case.Settings), GPixelFormats[Case.Format].Name);
+		TArray<float> Expected;
+		CoherentNoise::EvaluateRegion(Case.Settings, Comparison->Seed, RegionOffset, Comparison->Size, Expected);
+		TArray<FLinearColor> Actual;
+		if (!Case.Data.ToLinearColors(Actual) || Actual.Num() != Expected.Num())
+		{
+			Test->AddError(FString::Printf(TEXT("%s: readback failed"), *What));
+			continue;
+		}
+
+		float MaxError = 0.f;
+		for (int32 i = 0; i < Expected.Num(); i++)
+		{
+			MaxError = FMath::Max(MaxError, FMath::Abs(Actual[i].R - Expected[i]));
+		}
+		const float Tolerance = CoherentNoise::GetFormatTolerance(Case.Format);
+		Test->TestTrue(*FString::Printf(TEXT("%s max error %g is within %g"), *What, MaxError, Tolerance), MaxError <= Tolerance);
+	}
+	return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FCoherentNoiseGPUMatchesCPUTest, "ComputeShaders.Noise.GPU.MatchesCPU",
+	EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FCoherentNoiseGPUMatchesCPUTest::RunTest(const FString& Parameters)
+{
+	if (GUsingNullRHI)
+	{
+		AddInfo(TEXT("Skipped, needs a GPU"));
+		return true;
+	}
+
+	const FNoiseGPUComparisonRef Comparison = MakeShared<FNoiseGPUComparison, ESPMode::ThreadSafe>();
+	Comparison->Size = FIntPoint(256, 256);
+	Comparison->Seed = CoherentNoise::GetSeed(1234, 0);
+	Comparison->StartTime = FPlatformTime::Seconds();
+	for (const ECoherentNoiseFormat Format : { ECoherentNoiseFormat::R32F, ECoherentNoiseFormat::R16F, ECoherentNoiseFormat::R8 })
+	{
+		for (const FCoherentNoiseSettings& Settings : CreateAllSettings())
+		{
+			FNoiseGPUComparison::FCase& Case = Comparison->Cases.AddDefaulted_GetRef();
+			Case.Settings = Settings;
+			Case.Format = CoherentNoise::GetPixelFormat(Format);
+		}
+	}
+
+	ENQUEUE_RENDER_COMMAND(NoiseCompareGPU)([Comparison](FRHICommandListImmediate& RHICmdList)
+	{
+		FRDGBuilder GraphBuilder(RHICmdList);
+		const FIntPoint RegionOffset = GetRegionOffset(Comparison->Size);
+		for (int32 Index = 0; Index < Comparison->Cases.Num(); Index++)
+		{
+			const FNoiseGPUComparison::FCase& Case = Comparison->Cases[Index];
+			const FRDGTextureDesc Desc = FRDGTextureDesc::Create2D(Comparison->Size, Case.Format, FClearValueBinding::Black, TexCreate_ShaderResource | TexCreate_UAV);
+			const FRDGTextureRef Texture = GraphBuilder.CreateTexture(Desc, TEXT("NoiseCompareGPU"));
+			AddCoherentNoisePass(GraphBuilder, GraphBuilder.CreateUAV(Texture), Comparison->Size, Case.Settings, Comparison->Seed, RegionOffset);
+
+			// Called on the game thread
+			FComputeReadbackManager::Get().EnqueueTextureReadback(GraphBuilder, Texture, [Comparison, Index](FComputeTextureReadbackData&& Data)
+			{
+				Comparison->Cases[Index].Data = MoveTemp(Data);
+				Comparison->Cases[Index].bComplete = true;
+			});
+		}
+		GraphBuilder.Execute();
+	});
+
+	ADD_LATENT_AUTOMATION_COMMAND(FCompareNoiseGPUReadbacks(this, Comparison));
+	return true;
+}
+
+#endif
@@ -0,0 +1,203 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "ComputeReadback.h"
+
+#include "RenderGraphUtils.h"
+#include "RenderingThread.h"
+#include "Misc/AutomationTest.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+namespace
+{
+	template<typename TexelType>
+	FComputeTextureReadbackData CreateReadbackData(const EPixelFormat Format, const TArray<TexelType>& Texels)
+	{
+		FComputeTextureReadbackData Data;
+		Data.Size = FIntPoint(Texels.Num(), 1);
+		Data.Format = Format;
+		Data.Data.SetNumUninitialized(Texels.Num() * sizeof(TexelType));
+		FMemory::Memcpy(Data.Data.GetData(), Texels.GetData(), Data.Data.Num());
+		return Data;
+	}
+
+	void TestConversion(FAutomationTestBase& Test, const FComputeTextureReadbackData& Data, const TArray<FLinearColor>& Expected)
+	{
+		const TCHAR* FormatName = GPixelFormats[Data.Format].Name;
+		TArray<FLinearColor> Actual;
+		if (!Test.TestTrue(*FString::Printf(TEXT("%s is supported"), FormatName), Data.ToLinearColors(Actual)))
+		{
+			return;
+		}
+		if (!Test.TestEqual(*FString::Printf(TEXT("%s texel count"), FormatName), Actual.Num(), Expected.Num()))
+		{
+			return;
+		}
+		for (int32 i = 0; i < Expected.Num(); i++)
+		{
+			// Every expected value is exactly representable in its format
+			Test.TestTrue(*FString::Printf(TEXT("%s texel %d is %s, expected %s"), FormatName, i, *Actual[i].ToString(), *Expected[i].ToString()), Actual[i] == Expected[i]);
+		}
+	}
+
+	// Unsigned half float with the low mantissa bits dropped, the way R11G11B10 stores a channel
+	uint32 PackSmallFloat(const float Value, const int32 MantissaShift)
+	{
+		const FFloat16 Half(Value);
+		return Half.Encoded >> MantissaShift;
+	}
+
+	// Two rounds of readbacks, more than MaxRetainedStaging at once, the second round reuses the first round's staging
+	struct FReadbackRingTest
+	{
+		static const int32 NumRequests = FComputeReadbackManager::MaxRetainedStaging * 2 + 3;
+
+		int32 Round = 0;
+		TArray<int32> NumCompleted;
+		TArray<FComputeTextureReadbackData> Results;
+		int32 NumPendingAfterEnqueue = 0;
+		int32 NumPendingAfterComplete = 0;
+		int32 NumRetainedStaging = 0;
+		double StartTime = 0.0;
+	};
+
+	using FReadbackRingTestRef = TSharedRef<FReadbackRingTest, ESPMode::ThreadSafe>;
+
+	// Each request clears its own texture to a value only it uses
+	FLinearColor GetClearColor(const int32 Round, const int32 Index)
+	{
+		return FColor(static_cast<uint8>(Index), static_cast<uint8>(Round), 0, 255).ReinterpretAsLinear();
+	}
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FComputeReadbackFormatsTest, "ComputeShaders.Readback.Formats",
+	EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FComputeReadbackFormatsTest::RunTest(const FString& Parameters)
+{
+	// Stored as B, G, R, A
+	TestConversion(*this, CreateReadbackData(PF_B8G8R8A8, TArray<FColor>({ FColor(0x30, 0x20, 0x10, 0xFF), FColor(0, 0, 0, 0), FColor(255, 128, 1, 64) })),
+		{ FLinearColor(0x30 / 255.f, 0x20 / 255.f, 0x10 / 255.f, 1.f), FLinearColor(0.f, 0.f, 0.f, 0.f), FLinearColor(1.f, 128 / 255.f, 1 / 255.f, 64 / 255.f) });
+
+	TestConversion(*this, CreateReadbackData(PF_FloatRGBA, TArray<FFloat16Color>({ FFloat16Color(FLinearColor(0.5f, -2.f, 1024.f, 1.f)), FFloat16Color(FLinearColor(0.f, 0.25f, 65504.f, 0.f)) })),
+		{ FLinearColor(0.5f, -2.f, 1024.f, 1.f), FLinearColor(0.f, 0.25f, 65504.f, 0.f) });
+
+	TestConversion(*this, CreateReadbackData(PF_A32B32G32R32F, TArray<FLinearColor>({ FLinearColor(0.1f, -3.f, 1.0e6f, 0.75f) })),
+		{ FLinearColor(0.1f, -3.f, 1.0e6f, 0.75f) });
+
+	// R in the low 11 bits, then G in 11, then B in the top 10
+	const uint32 PackedR11G11B10 = PackSmallFloat(1.f, 4) | (PackSmallFloat(0.5f, 4) << 11) | (PackSmallFloat(2.f, 5) << 22);
+	const uint32 PackedLarge = PackSmallFloat(0.125f, 4) | (PackSmallFloat(96.f, 4) << 11) | (PackSmallFloat(1024.f, 5) << 22);
+	TestConversion(*this, CreateReadbackData(PF_FloatR11G11B10, TArray<uint32>({ PackedR11G11B10, PackedLarge, 0u })),
+		{ FLinearColor(1.f, 0.5f, 2.f, 1.f), FLinearColor(0.125f, 96.f, 1024.f, 1.f), FLinearColor(0.f, 0.f, 0.f, 1.f) });
+
+	TestConversion(*this, CreateReadbackData(PF_R32_FLOAT, TArray<float>({ -1.5f, 0.f, 3.25f, 1.0e-7f })),
+		{ FLinearColor(-1.5f, 0.f, 0.f, 1.f), FLinearColor(0.f, 0.f, 0.f, 1.f), FLinearColor(3.25f, 0.f, 0.f, 1.f), FLinearColor(1.0e-7f, 0.f, 0.f, 1.f) });
+
+	TestConversion(*this, CreateReadbackData(PF_R16F, TArray<FFloat16>({ FFloat16(0.25f), FFloat16(-1000.f), FFloat16(1.f) })),
+		{ FLinearColor(0.25f, 0.f, 0.f, 1.f), FLinearColor(-1000.f, 0.f, 0.f, 1.f), FLinearColor(1.f, 0.f, 0.f, 1.f) });
+
+	TestConversion(*this, CreateReadbackData(PF_G8, TArray<uint8>({ 0, 128, 255 })),
+		{ FLinearColor(0.f, 0.f, 0.f, 1.f), FLinearColor(128 / 255.f, 0.f, 0.f, 1.f), FLinearColor(1.f, 0.f, 0.f, 1.f) });
+
+	// Rejected rather than read past the end or misinterpreted
+	TArray<FLinearColor> Colors;
+	FComputeTextureReadbackData Truncated = CreateReadbackData(PF_R32_FLOAT, TArray<float>({ 1.f, 2.f }));
+	Truncated.Size = FIntPoint(3, 1);
+	TestFalse(TEXT("Data smaller than the texture is rejected"), Truncated.ToLinearColors(Colors));
+	TestFalse(TEXT("Unsupported formats are rejected"), CreateReadbackData(PF_R8G8, TArray<uint16>({ 0x1234 })).ToLinearColors(Colors));
+	TestEqual(TEXT("Rejected conversions leave no colours"), Colors.Num(), 0);
+	return true;
+}
+
+// Queues every request of the next round in one graph
+DEFINE_LATENT_AUTOMATION_COMMAND_ONE_PARAMETER(FEnqueueRingReadbacks, FReadbackRingTestRef, State);
+
+bool FEnqueueRingReadbacks::Update()
+{
+	State->Round++;
+	State->NumCompleted.Init(0, FReadbackRingTest::NumRequests);
+	State->Results.Reset();
+	State->Results.SetNum(FReadbackRingTest::NumRequests);
+	State->StartTime = FPlatformTime::Seconds();
+
+	ENQUEUE_RENDER_COMMAND(EnqueueRingReadbacks)([State = State](FRHICommandListImmediate& RHICmdList)
+	{
+		FRDGBuilder GraphBuilder(RHICmdList);
+		for (int32 Index = 0; Index < FReadbackRingTest::NumRequests; Index++)
+		{
+			const FRDGTextureDesc Desc = FRDGTextureDesc::Create2D(FIntPoint(4, 4), PF_B8G8R8A8, FClearValueBinding::Black, TexCreate_RenderTargetable | TexCreate_ShaderResource);
+			const FRDGTextureRef Texture = GraphBuilder.CreateTexture(Desc, TEXT("ReadbackRingTest"));
+			AddClearRenderTargetPass(GraphBuilder, Texture, GetClearColor(State->Round, Index));
+
+			// Called on the game thread
+			FComputeReadbackManager::Get().EnqueueTextureReadback(GraphBuilder, Texture, [State, Index](FComputeTextureReadbackData&& Data)
+			{
+				State->NumCompleted[Index]++;
+				State->Results[Index] = MoveTemp(Data);
+			});
+		}
+		GraphBuilder.Execute();
+		State->NumPendingAfterEnqueue = FComputeReadbackManager::Get().GetNumPending();
+	});
+	FlushRenderingCommands();
+	return true;
+}
+
+// Waits for the round to complete, every request has to come back exactly once with its own texture
+DEFINE_LATENT_AUTOMATION_COMMAND_TWO_PARAMETER(FCheckRingReadbacks, FAutomationTestBase*, Test, FReadbackRingTestRef, State);
+
+bool FCheckRingReadbacks::Update()
+{
+	const bool bComplete = !State->NumCompleted.Contains(0);
+	if (!bComplete && FPlatformTime::Seconds() - State->StartTime < 30.0)
+	{
+		return false;
+	}
+
+	ENQUEUE_RENDER_COMMAND(SampleRingReadbacks)([State = State](FRHICommandListImmediate& RHICmdList)
+	{
+		State->NumPendingAfterComplete = FComputeReadbackManager::Get().GetNumPending();
+		State->NumRetainedStaging = FComputeReadbackManager::Get().GetNumRetainedStaging();
+	});
+	FlushRenderingCommands();
+
+	const FString What = FString::Printf(TEXT("Round %d"), State->Round);
+	Test->TestTrue(*FString::Printf(TEXT("%s queued every request"), *What), State->NumPendingAfterEnqueue >= FReadbackRingTest::NumRequests);
+	for (int32 Index = 0; Index < FReadbackRingTest::NumRequests; Index++)
+	{
+		Test->TestEqual(*FString::Printf(TEXT("%s request %d completions"), *What, Index), State->NumCompleted[Index], 1);
+	}
+	Test->TestEqual(*FString::Printf(TEXT("%s nothing left pending"), *What), State->NumPendingAfterComplete, 0);
+	Test->TestTrue(*FString::Printf(TEXT("%s retained %d staging buffers, at most %d"), *What, State->NumRetainedStaging, FComputeReadbackManager::MaxRetainedStaging),
+		State->NumRetainedStaging <= FComputeReadbackManager::MaxRetainedStaging);
+
+	// NullRHI copies nothing, only the bookkeeping can be checked there
+	if (!GUsingNullRHI)
+	{
+		for (int32 Index = 0; Index < FReadbackRingTest::NumRequests; Index++)
+		{
+			TArray<FLinearColor> Colors;
+			const FLinearColor Expected = GetClearColor(State->Round, Index);
+			const bool bMatches = State->Results[Index].ToLinearColors(Colors) && Colors.Num() > 0 && Colors[0] == Expected && Colors.Last() == Expected;
+			Test->TestTrue(*FString::Printf(TEXT("%s request %d read back its own texture"), *What, Index), bMatches);
+		}
+	}
+	return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FComputeReadbackRingTest, "ComputeShaders.Readback.StagingRing",
+	EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FComputeReadbackRingTest::RunTest(const FString& Parameters)
+{
+	const FReadbackRingTestRef State = MakeShared<FReadbackRingTest, ESPMode::ThreadSafe>();
+	for (int32 Round = 0; Round < 2; Round++)
+	{
+		ADD_LATENT_AUTOMATION_COMMAND(FEnqueueRingReadbacks(State));
+		ADD_LATENT_AUTOMATION_COMMAND(FCheckRingReadbacks(this, State));
+	}
+	return true;
+}
+
+#endif
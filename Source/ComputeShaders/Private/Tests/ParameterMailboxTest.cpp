@@ -0,0 +1,164 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "ParameterMailbox.h"
+
+#include "Async/Async.h"
+#include "Misc/AutomationTest.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+namespace
+{
+	// Every value is derived from Writer and Sequence, so a struct mixed from two publishes is caught
+	struct FMailboxStressPayload
+	{
+		static constexpr int32 NumValues = 62;
+
+		uint32 Writer = 0;
+		uint32 Sequence = 0;
+		uint32 Values[NumValues];
+
+		void Fill(const uint32 InWriter, const uint32 InSequence)
+		{
+			Writer = InWriter;
+			Sequence = InSequence;
+			for (int32 i = 0; i < NumValues; i++)
+			{
+				Values[i] = HashCombine(HashCombine(Writer, Sequence), i);
+			}
+		}
+
+		bool IsConsistent() const
+		{
+			for (int32 i = 0; i < NumValues; i++)
+			{
+				if (Values[i] != HashCombine(HashCombine(Writer, Sequence), i))
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+	};
+
+	struct FMailboxStressResult
+	{
+		int64 NumLatched = 0;
+		int64 NumTorn = 0;
+		int64 NumOutOfOrder = 0;
+	};
+
+	// Publishes from NumWriters threads while another latches, for Seconds
+	FMailboxStressResult RunMailboxStress(const int32 NumWriters, const double Seconds, int64& OutNumPublished)
+	{
+		TParameterMailbox<FMailboxStressPayload> Mailbox;
+		FThreadSafeBool bStopping;
+		FThreadSafeCounter64 NumPublished;
+
+		TArray<TFuture<void>> Writers;
+		for (int32 WriterIndex = 0; WriterIndex < NumWriters; WriterIndex++)
+		{
+			Writers.Add(Async(EAsyncExecution::Thread, [&Mailbox, &bStopping, &NumPublished, WriterIndex]()
+			{
+				FMailboxStressPayload Payload;
+				uint32 Sequence = 0;
+				while (!bStopping)
+				{
+					Payload.Fill(WriterIndex, ++Sequence);
+					Mailbox.Publish(Payload);
+				}
+				NumPublished.Add(Sequence);
+			}));
+		}
+
+		// The reader only ever sees each writer's values in the order they were published
+		TFuture<FMailboxStressResult> Reader = Async(EAsyncExecution::Thread, [&Mailbox, &bStopping, NumWriters]()
+		{
+			TArray<uint32> LastSequence;
+			LastSequence.SetNumZeroed(NumWriters);
+			FMailboxStressResult Result;
+			while (!bStopping)
+			{
+				if (!Mailbox.Latch())
+				{
+					continue;
+				}
+				Result.NumLatched++;
+
+				const FMailboxStressPayload& Payload = Mailbox.Get();
+				if (!Payload.IsConsistent() || Payload.Writer >= static_cast<uint32>(NumWriters))
+				{
+					Result.NumTorn++;
+					continue;
+				}
+				if (Payload.Sequence <= LastSequence[Payload.Writer])
+				{
+					Result.NumOutOfOrder++;
+				}
+				LastSequence[Payload.Writer] = Payload.Sequence;
+
+				// Again after the writers have had time to publish more, they must never touch the latched slot
+				if (!Payload.IsConsistent())
+				{
+					Result.NumTorn++;
+				}
+			}
+			return Result;
+		});
+
+		FPlatformProcess::Sleep(static_cast<float>(Seconds));
+		bStopping = true;
+		for (TFuture<void>& Writer : Writers)
+		{
+			Writer.Wait();
+		}
+		OutNumPublished = NumPublished.GetValue();
+		return Reader.Get();
+	}
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FParameterMailboxStressTest, "ComputeShaders.ParameterMailbox.Stress",
+	EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FParameterMailboxStressTest::RunTest(const FString& Parameters)
+{
+	// A single writer is the game thread case, several check the writers are serialised with each other
+	for (const int32 NumWriters : { 1, 4 })
+	{
+		int64 NumPublished = 0;
+		const FMailboxStressResult Result = RunMailboxStress(NumWriters, 0.5, NumPublished);
+		AddInfo(FString::Printf(TEXT("%d writers: %lld published, %lld latched"), NumWriters, NumPublished, Result.NumLatched));
+
+		TestTrue(FString::Printf(TEXT("%d writers published"), NumWriters), NumPublished > 0);
+		TestTrue(FString::Printf(TEXT("%d writers latched"), NumWriters), Result.NumLatched > 0);
+		TestEqual(FString::Printf(TEXT("%d writers torn values"), NumWriters), Result.NumTorn, 0ll);
+		TestEqual(FString::Printf(TEXT("%d writers out of order values"), NumWriters), Result.NumOutOfOrder, 0ll);
+	}
+	return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FParameterMailboxLatchTest, "ComputeShaders.ParameterMailbox.Latch",
+	EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FParameterMailboxLatchTest::RunTest(const FString& Parameters)
+{
+	TParameterMailbox<int32> Mailbox;
+	TestFalse(TEXT("Nothing to latch before a publish"), Mailbox.Latch());
+	TestFalse(TEXT("No value before a latch"), Mailbox.HasValue());
+
+	Mailbox.Publish(1);
+	TestTrue(TEXT("Latches a publish"), Mailbox.Latch());
+	TestEqual(TEXT("Latched value"), Mailbox.Get(), 1);
+	TestFalse(TEXT("Nothing new to latch"), Mailbox.Latch());
+	TestEqual(TEXT("Keeps the latched value"), Mailbox.Get(), 1);
+
+	// Only the latest of several publishes is kept
+	Mailbox.Publish(2);
+	Mailbox.Publish(3);
+	Mailbox.Publish(4);
+	TestTrue(TEXT("Latches after several publishes"), Mailbox.Latch());
+	TestEqual(TEXT("Latest value"), Mailbox.Get(), 4);
+	return true;
+}
+
+#endif
@@ -0,0 +1,152 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "RayTracingCPU.h"
+
+#include "ComputeShadersCommandletUtils.h"
+#include "RayTracingManager.h"
+#include "Misc/AutomationTest.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+namespace
+{
+	const int32 NumTestSpheres = 16;
+
+	// Benchmark spheres from above, sphere edges are noisy and the sky and ground are smooth
+	FRayTracingParams CreateAdaptiveParams()
+	{
+		FMinimalViewInfo ViewInfo;
+		ViewInfo.Location = FVector(-300.f * FMath::Sqrt(static_cast<float>(NumTestSpheres)), 0.f, 1000.f);
+		ViewInfo.Rotation = FRotator(-20.f, 0.f, 0.f);
+		ViewInfo.FOV = 90.f;
+
+		FRayTracingParams Params;
+		Params.SetCamera(ViewInfo, FIntPoint(64, 64));
+		Params.Colour = FLinearColor::White;
+		Params.MaxBounces = 4;
+		const TSharedRef<FSphereBVH, ESPMode::ThreadSafe> BVH = MakeShared<FSphereBVH, ESPMode::ThreadSafe>();
+		BVH->Build(ComputeShadersCommandletUtils::CreateSpheres(NumTestSpheres));
+		Params.SphereBVH = BVH;
+
+		Params.NumSamples = 4;
+		Params.Adaptive.bEnabled = true;
+		Params.Adaptive.SamplesPerPass = 4;
+		Params.Adaptive.NoiseThreshold = 0.02f;
+		return Params;
+	}
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FRayTracingAdaptiveConvergedTilesTest, "ComputeShaders.RayTracing.Adaptive.ConvergedTilesStop",
+	EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FRayTracingAdaptiveConvergedTilesTest::RunTest(const FString& Parameters)
+{
+	const FRayTracingSkyboxImage Skybox = ComputeShadersCommandletUtils::CreateCPUSkybox();
+	FRayTracingParams Params = CreateAdaptiveParams();
+	// Only the passes limit the samples
+	Params.Adaptive.MaxSamples = 1000;
+
+	// Samples are read from the sequence in order, so the longer render starts with exactly the passes of the shorter one
+	const int32 FewPasses = 2;
+	Params.Adaptive.MaxPasses = FewPasses;
+	TArray<FLinearColor> Image;
+	TArray<int32> FewPassCounts;
+	FRayTracingCPURenderer::RenderAdaptive(Params, Skybox, Image, &FewPassCounts);
+
+	Params.Adaptive.MaxPasses = 8;
+	TArray<int32> ManyPassCounts;
+	FRayTracingCPURenderer::RenderAdaptive(Params, Skybox, Image, &ManyPassCounts);
+
+	const int32 BaseSamples = RayTracingAdaptive::GetBaseSamples(Params.NumSamples);
+	const int32 FewPassLimit = BaseSamples + FewPasses * Params.Adaptive.SamplesPerPass;
+	const int32 TileSize = RAY_TRACING_ADAPTIVE_TILE_SIZE;
+	const FIntPoint TexSize = Params.TexSize;
+
+	int32 NumConverged = 0;
+	int32 NumRefined = 0;
+	for (int32 TileY = 0; TileY < TexSize.Y; TileY += TileSize)
+	{
+		for (int32 TileX = 0; TileX < TexSize.X; TileX += TileSize)
+		{
+			// Tiles are refined as a whole
+			const int32 FewPassCount = FewPassCounts[TileY * TexSize.X + TileX];
+			const int32 ManyPassCount = ManyPassCounts[TileY * TexSize.X + TileX];
+			for (int32 Y = TileY; Y < FMath::Min(TileY + TileSize, TexSize.Y); Y++)
+			{
+				for (int32 X = TileX; X < FMath::Min(TileX + TileSize, TexSize.X); X++)
+				{
+					if (FewPassCounts[Y * TexSize.X + X] != FewPassCount || ManyPassCounts[Y * TexSize.X + X] != ManyPassCount)
+					{
+						AddError(FString::Printf(TEXT("Pixel %d,%d has a different sample count to the rest of its tile"), X, Y));
+					}
+				}
+			}
+
+			TestTrue(*FString::Printf(TEXT("Tile %d,%d has its base samples"), TileX, TileY), FewPassCount >= BaseSamples);
+			TestTrue(*FString::Printf(TEXT("Tile %d,%d never loses samples"), TileX, TileY), ManyPassCount >= FewPassCount);
+			if (FewPassCount < FewPassLimit)
+			{
+				// Dropped out of the tile list before running out of passes, it must never come back
+				TestEqual(*FString::Printf(TEXT("Converged tile %d,%d samples"), TileX, TileY), ManyPassCount, FewPassCount);
+				NumConverged++;
+			}
+			if (FewPassCount > BaseSamples)
+			{
+				NumRefined++;
+			}
+		}
+	}
+
+	// Otherwise the checks above prove nothing
+	TestTrue(TEXT("Some tiles converged early"), NumConverged > 0);
+	TestTrue(TEXT("Some tiles were refined"), NumRefined > 0);
+	return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FRayTracingAdaptiveMatchesUniformTest, "ComputeShaders.RayTracing.Adaptive.MatchesUniform",
+	EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FRayTracingAdaptiveMatchesUniformTest::RunTest(const FString& Parameters)
+{
+	const FRayTracingSkyboxImage Skybox = ComputeShadersCommandletUtils::CreateCPUSkybox();
+	FRayTracingParams Params = CreateAdaptiveParams();
+	Params.Adaptive.MaxPasses = 7;
+	Params.Adaptive.MaxSamples = 32;
+
+	TArray<FLinearColor> AdaptiveImage;
+	const FRayTracingCPUStats AdaptiveStats = FRayTracingCPURenderer::RenderAdaptive(Params, Skybox, AdaptiveImage);
+
+	// Every pixel at the adaptive budget
+	Params.Adaptive.bEnabled = false;
+	Params.NumSamples = Params.Adaptive.MaxSamples;
+	TArray<FLinearColor> UniformImage;
+	const FRayTracingCPUStats UniformStats = FRayTracingCPURenderer::Render(Params, Skybox, UniformImage);
+
+	if (!TestEqual(TEXT("Image sizes"), AdaptiveImage.Num(), UniformImage.Num()))
+	{
+		return false;
+	}
+	TestTrue(TEXT("Adaptive traced fewer rays"), AdaptiveStats.NumRays < UniformStats.NumRays);
+
+	// Converged pixels are only within the noise threshold of their mean, so compare over the whole image
+	double AdaptiveSum = 0.0;
+	double UniformSum = 0.0;
+	double RelativeErrorSum = 0.0;
+	for (int32 PixelIndex = 0; PixelIndex < UniformImage.Num(); PixelIndex++)
+	{
+		const float AdaptiveLuminance = RayTracingAdaptive::GetLuminance(FVector(AdaptiveImage[PixelIndex]));
+		const float UniformLuminance = RayTracingAdaptive::GetLuminance(FVector(UniformImage[PixelIndex]));
+		AdaptiveSum += AdaptiveLuminance;
+		UniformSum += UniformLuminance;
+		// Same offset as GetPixelError, so almost black pixels don't dominate
+		RelativeErrorSum += FMath::Abs(AdaptiveLuminance - UniformLuminance) / (UniformLuminance + 0.01f);
+	}
+
+	const double MeanRelativeError = RelativeErrorSum / UniformImage.Num();
+	TestTrue(*FString::Printf(TEXT("Mean relative pixel error %g is within tolerance"), MeanRelativeError), MeanRelativeError < 0.05);
+	TestTrue(*FString::Printf(TEXT("Mean luminance %g matches %g"), AdaptiveSum / UniformImage.Num(), UniformSum / UniformImage.Num()),
+		FMath::Abs(AdaptiveSum - UniformSum) <= 0.01 * UniformSum);
+	return true;
+}
+
+#endif
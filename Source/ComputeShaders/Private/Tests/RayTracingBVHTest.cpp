@@ -0,0 +1,213 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "RayTracingBVH.h"
+
+#include "RayTracingTestUtils.h"
+#include "Misc/AutomationTest.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+namespace
+{
+	// Same closest hit as testing every sphere, returns the number of mismatches
+	int32 CompareWithBruteForce(FAutomationTestBase& Test, const FString& What, const FSphereBVH& BVH, TArrayView<const FVector4> Spheres, FRandomStream& Random, const float Extent, const int32 NumRays)
+	{
+		int32 NumMismatches = 0;
+		for (int32 i = 0; i < NumRays; i++)
+		{
+			const FRayTracingRay Ray = RayTracingTestUtils::CreateRandomRay(Random, Extent);
+			const FRayTracingHit Expected = RayTracingTestUtils::TraceBruteForce(Ray, Spheres);
+			FRayTracingHit Actual;
+			BVH.Trace(Ray, Actual);
+
+			// Each sphere is intersected with the same maths, only the order differs, so the distances match exactly
+			if (Expected.IsValid() != Actual.IsValid() || (Expected.IsValid() && Expected.Distance != Actual.Distance))
+			{
+				if (NumMismatches == 0)
+				{
+					Test.AddError(FString::Printf(TEXT("%s: ray %d from %s along %s hit at %g, brute force at %g"), *What, i,
+						*Ray.Origin.ToString(), *Ray.Direction.ToString(), Actual.Distance, Expected.Distance));
+				}
+				NumMismatches++;
+			}
+		}
+		Test.TestEqual(*FString::Printf(TEXT("%s mismatched rays"), *What), NumMismatches, 0);
+		return NumMismatches;
+	}
+
+	// The flattened layout traversal relies on. Miss links only point forwards, so every traversal terminates
+	void TestNodeLayout(FAutomationTestBase& Test, const FString& What, const FSphereBVH& BVH, const int32 MaxLeafSize)
+	{
+		const TArray<FSphereBVHNode>& Nodes = BVH.GetNodes();
+		const TArray<FVector4>& Spheres = BVH.GetSpheres();
+		const uint32 NumNodes = Nodes.Num();
+
+		Test.TestTrue(*FString::Printf(TEXT("%s root has no miss link"), *What), Nodes[0].MissIndex == BVH_INVALID_INDEX);
+
+		TArray<int32> SphereLeafCount;
+		SphereLeafCount.SetNumZeroed(Spheres.Num());
+		for (uint32 NodeIndex = 0; NodeIndex < NumNodes; NodeIndex++)
+		{
+			const FSphereBVHNode& Node = Nodes[NodeIndex];
+			const bool bValidMiss = Node.MissIndex == BVH_INVALID_INDEX || (Node.MissIndex > NodeIndex && Node.MissIndex < NumNodes);
+			if (!bValidMiss)
+			{
+				Test.AddError(FString::Printf(TEXT("%s node %u misses to %u"), *What, NodeIndex, Node.MissIndex));
+				continue;
+			}
+
+			if (Node.IsLeaf())
+			{
+				Test.TestTrue(*FString::Printf(TEXT("%s leaf %u size"), *What, NodeIndex), Node.GetPrimitiveCount() <= static_cast<uint32>(MaxLeafSize));
+				Test.TestTrue(*FString::Printf(TEXT("%s leaf %u misses to the next node"), *What, NodeIndex), Node.MissIndex == (NodeIndex + 1 < NumNodes ? NodeIndex + 1 : BVH_INVALID_INDEX));
+
+				const FBox Bounds(Node.BoundsMin, Node.BoundsMax);
+				for (uint32 i = Node.GetFirstPrimitive(); i < Node.GetFirstPrimitive() + Node.GetPrimitiveCount() && i < static_cast<uint32>(Spheres.Num()); i++)
+				{
+					const FVector Origin(Spheres[i].X, Spheres[i].Y, Spheres[i].Z);
+					const FBox SphereBounds(Origin - FVector(Spheres[i].W), Origin + FVector(Spheres[i].W));
+					Test.TestTrue(*FString::Printf(TEXT("%s leaf %u contains sphere %u"), *What, NodeIndex, i), Bounds.IsInsideOrOn(SphereBounds.Min) && Bounds.IsInsideOrOn(SphereBounds.Max));
+					SphereLeafCount[i]++;
+				}
+			}
+			else
+			{
+				// First child is the next node, the subtree ends where the node's own miss link goes
+				Test.TestTrue(*FString::Printf(TEXT("%s interior %u has children"), *What, NodeIndex), NodeIndex + 1 < NumNodes);
+			}
+		}
+
+		for (int32 i = 0; i < SphereLeafCount.Num(); i++)
+		{
+			if (SphereLeafCount[i] != 1)
+			{
+				Test.AddError(FString::Printf(TEXT("%s sphere %d is in %d leaves"), *What, i, SphereLeafCount[i]));
+			}
+		}
+	}
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FSphereBVHRandomScenesTest, "ComputeShaders.RayTracing.BVH.RandomScenes",
+	EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FSphereBVHRandomScenesTest::RunTest(const FString& Parameters)
+{
+	FRandomStream Random(1234);
+	const float Extent = 1000.f;
+	for (const int32 NumSpheres : { 2, 7, 64, 500 })
+	{
+		const TArray<FVector4> Spheres = RayTracingTestUtils::CreateRandomSpheres(Random, NumSpheres, Extent);
+		FSphereBVH BVH;
+		BVH.Build(Spheres);
+
+		const FString What = FString::Printf(TEXT("%d spheres"), NumSpheres);
+		TestEqual(*FString::Printf(TEXT("%s kept every sphere"), *What), BVH.GetSpheres().Num(), NumSpheres);
+		TestNodeLayout(*this, What, BVH, FSphereBVHBuildSettings().MaxLeafSize);
+		CompareWithBruteForce(*this, What, BVH, Spheres, Random, Extent, 2000);
+
+		const float SAHCost = BVH.ComputeSAHCost();
+		TestTrue(*FString::Printf(TEXT("%s SAH cost is positive and finite"), *What), SAHCost > 0.f && FMath::IsFinite(SAHCost));
+	}
+	return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FSphereBVHSingleSphereTest, "ComputeShaders.RayTracing.BVH.SingleSphere",
+	EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FSphereBVHSingleSphereTest::RunTest(const FString& Parameters)
+{
+	const TArray<FVector4> Spheres = { FVector4(0.f, 0.f, 100.f, 50.f) };
+	FSphereBVH BVH;
+	BVH.Build(Spheres);
+
+	TestEqual(TEXT("One node"), BVH.GetNodes().Num(), 1);
+	TestTrue(TEXT("The root is a leaf"), BVH.GetNodes()[0].IsLeaf());
+	TestNodeLayout(*this, TEXT("Single sphere"), BVH, 1);
+
+	FRayTracingHit Hit;
+	BVH.Trace(FRayTracingRay(FVector(-500.f, 0.f, 100.f), FVector(1.f, 0.f, 0.f)), Hit);
+	TestTrue(TEXT("Hits the sphere"), Hit.IsValid());
+	TestEqual(TEXT("Hit distance"), Hit.Distance, 450.f, KINDA_SMALL_NUMBER * 500.f);
+
+	FRayTracingHit Miss;
+	BVH.Trace(FRayTracingRay(FVector(-500.f, 0.f, 100.f), FVector(-1.f, 0.f, 0.f)), Miss);
+	TestFalse(TEXT("Misses facing away"), Miss.IsValid());
+
+	FRandomStream Random(42);
+	CompareWithBruteForce(*this, TEXT("Single sphere"), BVH, Spheres, Random, 200.f, 500);
+	return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FSphereBVHCoincidentCentroidsTest, "ComputeShaders.RayTracing.BVH.CoincidentCentroids",
+	EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FSphereBVHCoincidentCentroidsTest::RunTest(const FString& Parameters)
+{
+	// No centroid spread to bin, the build has to fall back to an even split to keep the leaves small
+	TArray<FVector4> Spheres;
+	for (int32 i = 0; i < 40; i++)
+	{
+		Spheres.Add(FVector4(10.f, 20.f, 300.f, 5.f + i * 3.f));
+	}
+
+	FSphereBVHBuildSettings Settings;
+	Settings.MaxLeafSize = 4;
+	FSphereBVH BVH;
+	BVH.Build(Spheres, Settings);
+
+	TestTrue(TEXT("Split into several leaves"), BVH.GetNodes().Num() >= Spheres.Num() / Settings.MaxLeafSize);
+	TestNodeLayout(*this, TEXT("Coincident centroids"), BVH, Settings.MaxLeafSize);
+
+	FRandomStream Random(7);
+	CompareWithBruteForce(*this, TEXT("Coincident centroids"), BVH, Spheres, Random, 300.f, 1000);
+	return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FSphereBVHRefitTest, "ComputeShaders.RayTracing.BVH.Refit",
+	EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FSphereBVHRefitTest::RunTest(const FString& Parameters)
+{
+	FRandomStream Random(99);
+	const float Extent = 1000.f;
+	TArray<FVector4> Spheres = RayTracingTestUtils::CreateRandomSpheres(Random, 200, Extent);
+	FSphereBVH BVH;
+	BVH.Build(Spheres);
+
+	// Move a few spheres a long way, the tree gets worse but has to stay correct
+	TArray<int32> Changed;
+	for (int32 i = 0; i < Spheres.Num(); i += 9)
+	{
+		const FVector Offset(Random.FRandRange(-Extent, Extent), Random.FRandRange(-Extent, Extent), Random.FRandRange(0.f, Extent));
+		Spheres[i] = FVector4(FVector(Spheres[i]) + Offset, Spheres[i].W);
+		Changed.Add(i);
+	}
+
+	TArray<int32> ChangedSpheres;
+	TArray<int32> ChangedNodes;
+	BVH.Refit(Changed, Spheres, ChangedSpheres, ChangedNodes);
+	TestEqual(TEXT("Every moved sphere is updated"), ChangedSpheres.Num(), Changed.Num());
+	TestTrue(TEXT("Nodes are updated"), ChangedNodes.Num() > 0);
+
+	TestNodeLayout(*this, TEXT("Refit"), BVH, FSphereBVHBuildSettings().MaxLeafSize);
+	CompareWithBruteForce(*this, TEXT("Refit"), BVH, Spheres, Random, Extent, 2000);
+	return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FSphereBVHEmptyTest, "ComputeShaders.RayTracing.BVH.Empty",
+	EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FSphereBVHEmptyTest::RunTest(const FString& Parameters)
+{
+	FSphereBVH BVH;
+	BVH.Build(TArray<FVector4>());
+	TestTrue(TEXT("No nodes"), BVH.IsEmpty());
+	TestEqual(TEXT("No SAH cost"), BVH.ComputeSAHCost(), 0.f);
+
+	FRayTracingHit Hit;
+	BVH.Trace(FRayTracingRay(FVector::ZeroVector, FVector(0.f, 0.f, 1.f)), Hit);
+	TestFalse(TEXT("Nothing to hit"), Hit.IsValid());
+	return true;
+}
+
+#endif
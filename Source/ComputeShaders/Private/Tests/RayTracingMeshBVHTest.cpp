@@ -0,0 +1,178 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "RayTracingMeshBVH.h"
+
+#include "ComputeShadersCommandletUtils.h"
+#include "RayTracingTestUtils.h"
+#include "Misc/AutomationTest.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+namespace
+{
+	// Triangles of up to a tenth of Extent anywhere in +-Extent above the ground plane
+	void CreateRandomTriangles(FRandomStream& Random, const int32 NumTriangles, const float Extent, TArray<FVector>& OutVertices, TArray<uint32>& OutIndices)
+	{
+		OutVertices.Reset(NumTriangles * 3);
+		OutIndices.Reset(NumTriangles * 3);
+		for (int32 i = 0; i < NumTriangles; i++)
+		{
+			const FVector Centre(Random.FRandRange(-Extent, Extent), Random.FRandRange(-Extent, Extent), Random.FRandRange(0.f, Extent));
+			for (int32 Corner = 0; Corner < 3; Corner++)
+			{
+				OutIndices.Add(static_cast<uint32>(OutVertices.Add(Centre + Random.GetUnitVector() * Random.FRandRange(1.f, Extent * 0.1f))));
+			}
+		}
+	}
+
+	FRayTracingHit TraceBruteForce(const FRayTracingRay& Ray, const TArray<FVector>& Vertices, const TArray<uint32>& Indices)
+	{
+		FRayTracingHit BestHit;
+		for (int32 i = 0; i + 2 < Indices.Num(); i += 3)
+		{
+			RayTracingCPU::IntersectTriangle(Ray, BestHit, Vertices[Indices[i]], Vertices[Indices[i + 1]], Vertices[Indices[i + 2]]);
+		}
+		return BestHit;
+	}
+
+	// Same closest hit as testing every triangle
+	void CompareWithBruteForce(FAutomationTestBase& Test, const FString& What, const FTriangleMeshBVH& BVH, const TArray<FVector>& Vertices, const TArray<uint32>& Indices, FRandomStream& Random, const float Extent, const int32 NumRays)
+	{
+		int32 NumMismatches = 0;
+		for (int32 i = 0; i < NumRays; i++)
+		{
+			const FRayTracingRay Ray = RayTracingTestUtils::CreateRandomRay(Random, Extent);
+			const FRayTracingHit Expected = TraceBruteForce(Ray, Vertices, Indices);
+			FRayTracingHit Actual;
+			BVH.Trace(Ray, Actual);
+
+			// Triangles sharing an edge or a plane can hit within rounding of each other, and the box test may cull the later one
+			const bool bMatch = Expected.IsValid() == Actual.IsValid()
+				&& (!Expected.IsValid() || FMath::IsNearlyEqual(Expected.Distance, Actual.Distance, 1e-5f * FMath::Max(1.f, Expected.Distance)));
+			if (!bMatch)
+			{
+				if (NumMismatches == 0)
+				{
+					Test.AddError(FString::Printf(TEXT("%s: ray %d from %s along %s hit at %g, brute force at %g"), *What, i,
+						*Ray.Origin.ToString(), *Ray.Direction.ToString(), Actual.Distance, Expected.Distance));
+				}
+				NumMismatches++;
+			}
+		}
+		Test.TestEqual(*FString::Printf(TEXT("%s mismatched rays"), *What), NumMismatches, 0);
+	}
+
+	// Dequantised boxes contain their triangles and their children, and every triangle is in exactly one leaf
+	void TestNodeBounds(FAutomationTestBase& Test, const FString& What, const FTriangleMeshBVH& BVH)
+	{
+		const TArray<FTriangleBVHNode>& Nodes = BVH.GetNodes();
+		const TArray<FVector>& Vertices = BVH.GetVertices();
+		const TArray<uint32>& Indices = BVH.GetIndices();
+		const uint32 NumNodes = Nodes.Num();
+
+		const auto Contains = [](const FBox& Outer, const FBox& Inner)
+		{
+			return Outer.IsInsideOrOn(Inner.Min) && Outer.IsInsideOrOn(Inner.Max);
+		};
+
+		TArray<int32> TriangleLeafCount;
+		TriangleLeafCount.SetNumZeroed(BVH.GetNumTriangles());
+		for (uint32 NodeIndex = 0; NodeIndex < NumNodes; NodeIndex++)
+		{
+			const FTriangleBVHNode& Node = Nodes[NodeIndex];
+			const FBox Bounds = BVH.GetNodeBounds(Node);
+			if (Node.IsLeaf())
+			{
+				const uint32 Last = FMath::Min(Node.GetFirstTriangle() + Node.GetTriangleCount(), static_cast<uint32>(TriangleLeafCount.Num()));
+				for (uint32 i = Node.GetFirstTriangle(); i < Last; i++)
+				{
+					FBox TriangleBounds(ForceInit);
+					TriangleBounds += Vertices[Indices[i * 3 + 0]];
+					TriangleBounds += Vertices[Indices[i * 3 + 1]];
+					TriangleBounds += Vertices[Indices[i * 3 + 2]];
+					Test.TestTrue(*FString::Printf(TEXT("%s leaf %u contains triangle %u"), *What, NodeIndex, i), Contains(Bounds, TriangleBounds));
+					TriangleLeafCount[i]++;
+				}
+				continue;
+			}
+
+			// The subtree runs up to the miss link, the second child is where the first one misses to
+			const uint32 SubtreeEnd = Node.GetMissIndex(NodeIndex);
+			if (NodeIndex + 1 >= SubtreeEnd || SubtreeEnd > NumNodes)
+			{
+				Test.AddError(FString::Printf(TEXT("%s interior %u has subtree [%u, %u)"), *What, NodeIndex, NodeIndex + 1, SubtreeEnd));
+				continue;
+			}
+			for (uint32 Child = NodeIndex + 1; Child < SubtreeEnd; Child = Nodes[Child].GetMissIndex(Child))
+			{
+				Test.TestTrue(*FString::Printf(TEXT("%s node %u contains child %u"), *What, NodeIndex, Child), Contains(Bounds, BVH.GetNodeBounds(Nodes[Child])));
+				if (Nodes[Child].GetMissIndex(Child) <= Child)
+				{
+					Test.AddError(FString::Printf(TEXT("%s node %u misses backwards"), *What, Child));
+					break;
+				}
+			}
+		}
+
+		for (int32 i = 0; i < TriangleLeafCount.Num(); i++)
+		{
+			if (TriangleLeafCount[i] != 1)
+			{
+				Test.AddError(FString::Printf(TEXT("%s triangle %d is in %d leaves"), *What, i, TriangleLeafCount[i]));
+			}
+		}
+	}
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FTriangleMeshBVHRandomTrianglesTest, "ComputeShaders.RayTracing.MeshBVH.RandomTriangles",
+	EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FTriangleMeshBVHRandomTrianglesTest::RunTest(const FString& Parameters)
+{
+	FRandomStream Random(4321);
+	const float Extent = 1000.f;
+	for (const int32 NumTriangles : { 1, 9, 100, 1000 })
+	{
+		TArray<FVector> Vertices;
+		TArray<uint32> Indices;
+		CreateRandomTriangles(Random, NumTriangles, Extent, Vertices, Indices);
+		FTriangleMeshBVH BVH;
+		BVH.Build(Vertices, Indices);
+
+		const FString What = FString::Printf(TEXT("%d triangles"), NumTriangles);
+		TestEqual(*FString::Printf(TEXT("%s kept every triangle"), *What), BVH.GetNumTriangles(), NumTriangles);
+		TestNodeBounds(*this, What, BVH);
+		CompareWithBruteForce(*this, What, BVH, Vertices, Indices, Random, Extent, 2000);
+	}
+	return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FTriangleMeshBVHHeightfieldTest, "ComputeShaders.RayTracing.MeshBVH.Heightfield",
+	EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FTriangleMeshBVHHeightfieldTest::RunTest(const FString& Parameters)
+{
+	// The benchmark mesh, connected triangles so rays land on shared edges
+	TArray<FVector> Vertices;
+	TArray<uint32> Indices;
+	ComputeShadersCommandletUtils::CreateMesh(2000, Vertices, Indices);
+	FTriangleMeshBVH BVH;
+	BVH.Build(Vertices, Indices);
+	TestNodeBounds(*this, TEXT("Heightfield"), BVH);
+
+	FRandomStream Random(17);
+	CompareWithBruteForce(*this, TEXT("Heightfield"), BVH, Vertices, Indices, Random, BVH.GetNodeBounds(BVH.GetNodes()[0]).GetExtent().GetMax(), 2000);
+
+	// Flat along Z, so the bounds have no quantisation steps on that axis
+	for (FVector& Vertex : Vertices)
+	{
+		Vertex.Z = 100.f;
+	}
+	BVH.Build(Vertices, Indices);
+	TestEqual(TEXT("Flat mesh has no Z scale"), BVH.GetBoundsScale().Z, 0.f);
+	TestNodeBounds(*this, TEXT("Flat"), BVH);
+	CompareWithBruteForce(*this, TEXT("Flat"), BVH, Vertices, Indices, Random, BVH.GetNodeBounds(BVH.GetNodes()[0]).GetExtent().GetMax(), 2000);
+	return true;
+}
+
+#endif
@@ -0,0 +1,95 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "RayTracingPackedScene.h"
+
+#include "RayTracingTestUtils.h"
+#include "Misc/AutomationTest.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+namespace
+{
+	FBox GetSphereBounds(const FVector4& Sphere)
+	{
+		return FBox(FVector(Sphere) - FVector(Sphere.W), FVector(Sphere) + FVector(Sphere.W));
+	}
+
+	// Packed spheres have to contain the real ones and packed nodes the packed spheres, or the GPU misses hits the CPU finds.
+	// Tolerance covers the float maths of unpacking
+	void TestPacking(FAutomationTestBase& Test, const FString& What, const TArray<FVector4>& InSpheres)
+	{
+		FSphereBVH BVH;
+		BVH.Build(InSpheres);
+		const TArray<FVector4>& Spheres = BVH.GetSpheres();
+		const TArray<FSphereBVHNode>& Nodes = BVH.GetNodes();
+		const FBox SceneBounds(Nodes[0].BoundsMin, Nodes[0].BoundsMax);
+		const FSphereBVHPacking Packing = FSphereBVHPacking::Create(SceneBounds);
+		Test.TestTrue(*FString::Printf(TEXT("%s packing contains the scene"), *What), Packing.Contains(SceneBounds));
+		const float Tolerance = SceneBounds.GetSize().GetMax() * 1.e-6f;
+
+		TArray<FVector4> PackedSpheres;
+		int32 NumBadSpheres = 0;
+		for (int32 i = 0; i < Spheres.Num(); i++)
+		{
+			const FVector4 Packed = Packing.UnpackSphere(Packing.PackSphere(Spheres[i]));
+			PackedSpheres.Add(Packed);
+			if (Packed.W <= 0.f || FVector::Dist(FVector(Packed), FVector(Spheres[i])) + Spheres[i].W > Packed.W + Tolerance)
+			{
+				if (NumBadSpheres == 0)
+				{
+					Test.AddError(FString::Printf(TEXT("%s: sphere %d %s packs to %s"), *What, i, *Spheres[i].ToString(), *Packed.ToString()));
+				}
+				NumBadSpheres++;
+			}
+		}
+		Test.TestEqual(*FString::Printf(TEXT("%s packed spheres not containing theirs"), *What), NumBadSpheres, 0);
+
+		int32 NumBadNodes = 0;
+		for (int32 NodeIndex = 0; NodeIndex < Nodes.Num(); NodeIndex++)
+		{
+			const FSphereBVHNode& Node = Nodes[NodeIndex];
+			const FBox Bounds = Packing.GetNodeBounds(Packing.PackNode(Node, NodeIndex, Nodes.Num())).ExpandBy(Tolerance);
+
+			bool bContains = Bounds.IsInsideOrOn(Node.BoundsMin) && Bounds.IsInsideOrOn(Node.BoundsMax);
+			for (uint32 i = Node.GetFirstPrimitive(); Node.IsLeaf() && i < Node.GetFirstPrimitive() + Node.GetPrimitiveCount(); i++)
+			{
+				const FBox SphereBounds = GetSphereBounds(PackedSpheres[i]);
+				bContains &= Bounds.IsInsideOrOn(SphereBounds.Min) && Bounds.IsInsideOrOn(SphereBounds.Max);
+			}
+
+			if (!bContains)
+			{
+				if (NumBadNodes == 0)
+				{
+					Test.AddError(FString::Printf(TEXT("%s: node %d packs to %s"), *What, NodeIndex, *Bounds.ToString()));
+				}
+				NumBadNodes++;
+			}
+		}
+		Test.TestEqual(*FString::Printf(TEXT("%s packed nodes not containing theirs"), *What), NumBadNodes, 0);
+	}
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FRayTracingPackedSceneContainsTest, "ComputeShaders.RayTracing.PackedScene.Contains",
+	EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FRayTracingPackedSceneContainsTest::RunTest(const FString& Parameters)
+{
+	FRandomStream Random(1234);
+	for (const int32 NumSpheres : { 1, 7, 64, 500 })
+	{
+		const float Extent = 1000.f;
+		TestPacking(*this, FString::Printf(TEXT("%d spheres"), NumSpheres), RayTracingTestUtils::CreateRandomSpheres(Random, NumSpheres, Extent));
+	}
+
+	// Far smaller than a step of the packing, they used to round to a radius of 0
+	TArray<FVector4> Spheres = RayTracingTestUtils::CreateRandomSpheres(Random, 100, 100000.f);
+	for (int32 i = 0; i < Spheres.Num(); i += 2)
+	{
+		Spheres[i].W = Random.FRandRange(0.01f, 1.f);
+	}
+	TestPacking(*this, TEXT("Tiny spheres"), Spheres);
+	return true;
+}
+
+#endif
@@ -0,0 +1,133 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#include "RayTracingSIMD.h"
+
+#include "ComputeShadersCommandletUtils.h"
+#include "RayTracingTestUtils.h"
+#include "Misc/AutomationTest.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+namespace
+{
+	bool HitsEqual(const int32 ExpectedIndex, const FRayTracingHit& Expected, const int32 ActualIndex, const FRayTracingHit& Actual)
+	{
+		return ExpectedIndex == ActualIndex && Expected.Distance == Actual.Distance && Expected.Position == Actual.Position && Expected.Normal == Actual.Normal;
+	}
+
+	// Every ray through the 8 wide and the 4 ray packet versions, both have to give exactly the scalar hit.
+	// StartDistance stands in for a closer hit found earlier (e.g. the mesh), INDEX_NONE is expected for spheres behind it
+	void CompareWithScalar(FAutomationTestBase& Test, const FString& What, const TArray<FVector4>& Spheres, const TArray<FRayTracingRay>& Rays, const float StartDistance)
+	{
+		FSphereSoA SpheresSoA;
+		SpheresSoA.Set(Spheres);
+
+		FRayTracingHit StartHit;
+		StartHit.Distance = StartDistance;
+
+		int32 NumMismatches = 0;
+		auto Check = [&Test, &What, &Rays, &NumMismatches](const TCHAR* Version, const int32 RayIndex, const int32 ExpectedIndex, const FRayTracingHit& Expected, const int32 ActualIndex, const FRayTracingHit& Actual)
+		{
+			if (!HitsEqual(ExpectedIndex, Expected, ActualIndex, Actual))
+			{
+				if (NumMismatches == 0)
+				{
+					Test.AddError(FString::Printf(TEXT("%s: %s ray %d along %s hit sphere %d at %g, scalar hit sphere %d at %g"), *What, Version, RayIndex,
+						*Rays[RayIndex].Direction.ToString(), ActualIndex, Actual.Distance, ExpectedIndex, Expected.Distance));
+				}
+				NumMismatches++;
+			}
+		};
+
+		for (int32 i = 0; i + 4 <= Rays.Num(); i += 4)
+		{
+			FRayTracingHit ScalarHits[4] = { StartHit, StartHit, StartHit, StartHit };
+			int32 ScalarIndices[4];
+			for (int32 Lane = 0; Lane < 4; Lane++)
+			{
+				ScalarIndices[Lane] = RayTracingSIMD::IntersectSpheresScalar(Rays[i + Lane], ScalarHits[Lane], Spheres);
+
+				FRayTracingHit Hit = StartHit;
+				const int32 Index = RayTracingSIMD::IntersectSpheres(Rays[i + Lane], Hit, SpheresSoA);
+				Check(TEXT("1 ray x 8"), i + Lane, ScalarIndices[Lane], ScalarHits[Lane], Index, Hit);
+			}
+
+			const FRayTracingRay PacketRays[4] = { Rays[i], Rays[i + 1], Rays[i + 2], Rays[i + 3] };
+			FRayTracingHit PacketHits[4] = { StartHit, StartHit, StartHit, StartHit };
+			int32 PacketIndices[4];
+			RayTracingSIMD::IntersectSpheresPacket4(PacketRays, PacketHits, SpheresSoA, PacketIndices);
+			for (int32 Lane = 0; Lane < 4; Lane++)
+			{
+				Check(TEXT("4 ray packet"), i + Lane, ScalarIndices[Lane], ScalarHits[Lane], PacketIndices[Lane], PacketHits[Lane]);
+			}
+		}
+		Test.TestEqual(*FString::Printf(TEXT("%s mismatched rays"), *What), NumMismatches, 0);
+	}
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FRayTracingSIMDMatchesScalarTest, "ComputeShaders.RayTracing.SIMD.MatchesScalar",
+	EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FRayTracingSIMDMatchesScalarTest::RunTest(const FString& Parameters)
+{
+	// Around the largest benchmark scene, so the small ones are missed by some rays too
+	FRandomStream Random(1234);
+	TArray<FRayTracingRay> Rays;
+	for (int32 i = 0; i < 2048; i++)
+	{
+		Rays.Add(RayTracingTestUtils::CreateRandomRay(Random, 5000.f));
+	}
+
+	// Counts that leave 0 to 7 spheres for the leftover loops. Same scenes as the benchmark
+	for (const int32 NumSpheres : { 0, 1, 3, 4, 5, 8, 11, 64, 1023 })
+	{
+		const TArray<FVector4> Spheres = ComputeShadersCommandletUtils::CreateSpheres(NumSpheres);
+		CompareWithScalar(*this, FString::Printf(TEXT("%d spheres"), NumSpheres), Spheres, Rays, TNumericLimits<float>::Max());
+		CompareWithScalar(*this, FString::Printf(TEXT("%d spheres behind an earlier hit"), NumSpheres), Spheres, Rays, 3000.f);
+	}
+	return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FRayTracingSIMDTiesTest, "ComputeShaders.RayTracing.SIMD.Ties",
+	EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FRayTracingSIMDTiesTest::RunTest(const FString& Parameters)
+{
+	// Every sphere is duplicated in another lane, another iteration and the leftovers, the first copy has to win
+	const TArray<FVector4> Unique = ComputeShadersCommandletUtils::CreateSpheres(16);
+	TArray<FVector4> Spheres;
+	for (int32 Copy = 0; Copy < 3; Copy++)
+	{
+		for (int32 i = 0; i < Unique.Num(); i++)
+		{
+			Spheres.Add(Unique[(i * 5 + Copy) % Unique.Num()]);
+		}
+	}
+	Spheres.Append(Unique.GetData(), 3);
+
+	TArray<FRayTracingRay> Rays;
+	for (const FVector4& Sphere : Unique)
+	{
+		// Straight at each sphere so every one of them is hit
+		const FVector Origin(0.f, 0.f, 1000.f);
+		Rays.Emplace(Origin, (FVector(Sphere) - Origin).GetSafeNormal());
+	}
+	CompareWithScalar(*this, TEXT("Duplicated spheres"), Spheres, Rays, TNumericLimits<float>::Max());
+
+	// The scalar loop keeps the first of equal distances, so the index is the first copy
+	FSphereSoA SpheresSoA;
+	SpheresSoA.Set(Spheres);
+	for (int32 i = 0; i < Rays.Num(); i++)
+	{
+		FRayTracingHit Hit;
+		const int32 Index = RayTracingSIMD::IntersectSpheres(Rays[i], Hit, SpheresSoA);
+		TestTrue(*FString::Printf(TEXT("Ray %d hits a sphere"), i), Index != INDEX_NONE);
+		if (Index != INDEX_NONE)
+		{
+			TestEqual(*FString::Printf(TEXT("Ray %d hits the first copy"), i), Spheres.IndexOfByKey(Spheres[Index]), Index);
+		}
+	}
+	return true;
+}
+
+#endif
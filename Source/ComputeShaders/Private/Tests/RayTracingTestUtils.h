@@ -0,0 +1,53 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "RayTracingCommon.h"
+#include "Math/RandomStream.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+// Scenes and rays shared by the ray tracing automation tests
+namespace RayTracingTestUtils
+{
+	// Spheres anywhere in +-Extent above the ground plane, radii up to a tenth of Extent
+	inline TArray<FVector4> CreateRandomSpheres(FRandomStream& Random, const int32 NumSpheres, const float Extent)
+	{
+		TArray<FVector4> Spheres;
+		Spheres.Reserve(NumSpheres);
+		for (int32 i = 0; i < NumSpheres; i++)
+		{
+			const FVector Origin = FVector(Random.FRandRange(-Extent, Extent), Random.FRandRange(-Extent, Extent), Random.FRandRange(0.f, Extent));
+			Spheres.Add(FVector4(Origin, Random.FRandRange(1.f, Extent * 0.1f)));
+		}
+		return Spheres;
+	}
+
+	inline FRayTracingRay CreateRandomRay(FRandomStream& Random, const float Extent)
+	{
+		// Starts anywhere around the scene, including inside spheres
+		const FVector Origin(Random.FRandRange(-2.f * Extent, 2.f * Extent), Random.FRandRange(-2.f * Extent, 2.f * Extent), Random.FRandRange(-Extent, 2.f * Extent));
+		FVector Direction = Random.GetUnitVector();
+		// Some axis aligned rays, they hit the divide by zero in the slab test
+		if (Random.FRand() < 0.1f)
+		{
+			Direction = FVector::ZeroVector;
+			Direction[Random.RandHelper(3)] = Random.FRand() < 0.5f ? -1.f : 1.f;
+		}
+		return FRayTracingRay(Origin, Direction);
+	}
+
+	inline FRayTracingHit TraceBruteForce(const FRayTracingRay& Ray, TArrayView<const FVector4> Spheres)
+	{
+		FRayTracingHit BestHit;
+		for (const FVector4& Sphere : Spheres)
+		{
+			RayTracingCPU::IntersectSphere(Ray, BestHit, Sphere);
+		}
+		return BestHit;
+	}
+}
+
+#endif
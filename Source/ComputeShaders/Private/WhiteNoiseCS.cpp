@@ -2,7 +2,10 @@
 
 #include "WhiteNoiseCS.h"
 
+#include "ComputePipeline.h"
+#include "ComputeShaderStats.h"
 #include "GlobalShader.h"
+#include "NoiseBatchService.h"
 #include "RenderGraphUtils.h"
 #include "RenderTargetPool.h"
 #include "ShaderHelpers.h"
@@ -16,13 +19,43 @@ public:
 	DECLARE_GLOBAL_SHADER(FWhiteNoiseCS);
 	SHADER_USE_PARAMETER_STRUCT(FWhiteNoiseCS, FGlobalShader);
 
+	// Renders one slice of OutputTextureArray per instance, the instance is the Z group
+	class FBatchedDim : SHADER_PERMUTATION_BOOL("BATCHED");
+	class FNoiseTypeDim : SHADER_PERMUTATION_ENUM_CLASS("NOISE_TYPE", ECoherentNoiseType);
+	class FNoiseFractalDim : SHADER_PERMUTATION_ENUM_CLASS("NOISE_FRACTAL", ECoherentNoiseFractal);
+	// Follows the output format, UNORM textures (R8) need a unorm UAV while float ones (R16F, R32F) convert on store
+	class FUnormOutputDim : SHADER_PERMUTATION_BOOL("UNORM_OUTPUT");
+	using FPermutationDomain = TShaderPermutationDomain<FBatchedDim, FNoiseTypeDim, FNoiseFractalDim, FUnormOutputDim>;
+
 	// Shader I/O
 	BEGIN_SHADER_PARAMETER_STRUCT(FParameters, )
 		SHADER_PARAMETER_RDG_TEXTURE_UAV(RWTexture2D<float>, OutputTexture)
+		SHADER_PARAMETER_RDG_TEXTURE_UAV(RWTexture2DArray<float>, OutputTextureArray)
+		SHADER_PARAMETER_RDG_BUFFER_SRV(StructuredBuffer<FNoiseInstance>, Instances)
 		SHADER_PARAMETER(FIntPoint, Dimensions)
-		SHADER_PARAMETER(uint32, TimeStamp)
+		SHADER_PARAMETER(uint32, Seed)
+		SHADER_PARAMETER(FIntPoint, RegionOffset)
+		SHADER_PARAMETER(float, Frequency)
+		SHADER_PARAMETER(uint32, NumOctaves)
+		SHADER_PARAMETER(float, Lacunarity)
+		SHADER_PARAMETER(float, Gain)
 	END_SHADER_PARAMETER_STRUCT()
 
+	static FPermutationDomain GetPermutationVector(const bool bBatched, const FCoherentNoiseSettings& Settings, const EPixelFormat Format)
+	{
+		FPermutationDomain PermutationVector;
+		PermutationVector.Set<FBatchedDim>(bBatched);
+		PermutationVector.Set<FNoiseTypeDim>(Settings.Type);
+		PermutationVector.Set<FNoiseFractalDim>(Settings.Fractal);
+		PermutationVector.Set<FUnormOutputDim>(IsUnormFormat(Format));
+		return PermutationVector;
+	}
+
+	static bool IsUnormFormat(const EPixelFormat Format)
+	{
+		return Format == PF_G8 || Format == PF_G16 || Format == PF_R8G8 || Format == PF_B8G8R8A8 || Format == PF_R8G8B8A8;
+	}
+
 	//Called by the engine to determine which permutations to compile for this shader
 	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters)
 	{
@@ -44,67 +77,240 @@ public:
 //                      Shader Class            Shader Virtual Path       HLSL main function name    Type
 IMPLEMENT_GLOBAL_SHADER(FWhiteNoiseCS, "/ComputeShaders/WhiteNoiseCS.usf",		"MainCS",			SF_Compute)
 
+DECLARE_CYCLE_STAT(TEXT("WhiteNoise AddPasses (RT)"), STAT_WhiteNoise_AddPasses, STATGROUP_ComputeShaders);
+DECLARE_GPU_STAT_NAMED(WhiteNoise, TEXT("White Noise"));
+
+void AddCoherentNoisePass(FRDGBuilder& GraphBuilder, FRDGTextureUAVRef OutputUAV, const FIntPoint& Size, const FCoherentNoiseSettings& Settings, const uint32 Seed, const FIntPoint& RegionOffset)
+{
+	FWhiteNoiseCS::FParameters* ShaderParameters = GraphBuilder.AllocParameters<FWhiteNoiseCS::FParameters>();
+	ShaderParameters->OutputTexture = OutputUAV;
+	ShaderParameters->Dimensions = Size;
+	ShaderParameters->Seed = Seed;
+	ShaderParameters->RegionOffset = RegionOffset;
+	ShaderParameters->Frequency = Settings.Frequency;
+	ShaderParameters->NumOctaves = Settings.GetNumOctaves();
+	ShaderParameters->Lacunarity = Settings.Lacunarity;
+	ShaderParameters->Gain = Settings.Gain;
+
+	const EPixelFormat Format = OutputUAV->Desc.Texture->Desc.Format;
+	RecordCompactFormatWrite(static_cast<int64>(Size.X) * Size.Y, Format, PF_R32_FLOAT);
+
+	const TShaderMapRef<FWhiteNoiseCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel), FWhiteNoiseCS::GetPermutationVector(false, Settings, Format));
+
+	// Utility to actually run ("Dispatch") the compute shader
+	FComputeShaderUtils::AddPass(
+		GraphBuilder,
+		RDG_EVENT_NAME("WhiteNoise Compute Shader"),
+		ComputeShader,
+		ShaderParameters,
+		FComputeShaderUtils::GetGroupCount(Size, NUM_THREADS_PER_GROUP_DIMENSION)
+	);
+}
+
+
+FWhiteNoiseCSManager::FWhiteNoiseCSManager():
+	Proxy(MakeShared<FWhiteNoiseCSProxy, ESPMode::ThreadSafe>())
+{
+	FNoiseBatchService::GameThread_Register(Proxy.ToSharedRef());
+}
+
+FWhiteNoiseCSManager::~FWhiteNoiseCSManager()
+{
+	// The service holds on to the proxy until the render thread gets to this, no need to wait.
+	// Moved so the game thread holds no reference once the command is queued
+	Proxy->SetRenderingEnabled(false);
+	FNoiseBatchService::GameThread_Unregister(MoveTemp(Proxy));
+}
 
 void FWhiteNoiseCSManager::BeginRendering()
 {
-	bEnableRendering = true;
+	Proxy->SetRenderingEnabled(true);
 }
 
 void FWhiteNoiseCSManager::EndRendering()
 {
-	bEnableRendering = false;
+	Proxy->SetRenderingEnabled(false);
 }
 
 void FWhiteNoiseCSManager::UpdateParameters(FWhiteNoiseCSParameters& DrawParameters)
 {
-	CachedParams = DrawParameters;
-	bCachedParamsAreValid = true;
+	Proxy->SetParameters(DrawParameters);
 }
 
-void FWhiteNoiseCSManager::Tick_RenderThread(FRHICommandListImmediate& RHICmdList) const
+bool FWhiteNoiseCSProxy::ShouldRender_RenderThread() const
 {
 	// Make sure we're running in the render thread
 	check(IsInRenderingThread());
 	
-	// Early out if invalid
-	if (!bEnableRendering || !bCachedParamsAreValid || !CachedParams.RenderTarget)
+	if (!bEnableRendering || !Parameters.HasValue() || !Parameters.Get().RenderTarget)
 	{
+		return false;
+	}
+
+	const FTextureRenderTargetResource* RenderTargetResource = Parameters.Get().RenderTarget->GetRenderTargetResource();
+	return RenderTargetResource && RenderTargetResource->TextureRHI.IsValid();
+}
+
+FRHITexture* FWhiteNoiseCSProxy::GetTargetTexture_RenderThread() const
+{
+	return Parameters.Get().RenderTarget->GetRenderTargetResource()->TextureRHI;
+}
+
+FIntPoint FWhiteNoiseCSProxy::GetOutputSize_RenderThread() const
+{
+	const FIntVector Size = GetTargetTexture_RenderThread()->GetSizeXYZ();
+	return FIntPoint(Size.X, Size.Y);
+}
+
+EPixelFormat FWhiteNoiseCSProxy::GetOutputFormat_RenderThread() const
+{
+	return GetTargetTexture_RenderThread()->GetFormat();
+}
+
+bool FWhiteNoiseCSProxy::UsesTileCache_RenderThread() const
+{
+	return Parameters.Get().bUseTileCache && FNoiseTileCache::IsEnabled();
+}
+
+void FWhiteNoiseCSProxy::ResetTileRequest_RenderThread()
+{
+	check(IsInRenderingThread());
+	LastTileRequest.Reset();
+	LastTileTarget = nullptr;
+}
+
+uint32 FWhiteNoiseCSProxy::GetRequestHash_RenderThread() const
+{
+	const FWhiteNoiseCSParameters& CachedParams = Parameters.Get();
+
+	// Same fields as the tile key, plus the target since a new render target starts out empty
+	const uint32 Seed = CoherentNoise::GetSeed(CachedParams.Seed, CachedParams.TimeStamp);
+	const FNoiseTileKey Request(CachedParams.Noise, Seed, CachedParams.RegionOffset, GetOutputSize_RenderThread(), GetOutputFormat_RenderThread());
+	const FRHITexture* TargetTextureRHI = GetTargetTexture_RenderThread();
+	return HashCombine(GetTypeHash(Request), HashCombine(PointerHash(TargetTextureRHI), GetTypeHash(UsesTileCache_RenderThread())));
+}
+
+FRDGTextureRef FWhiteNoiseCSProxy::RegisterRenderTarget_RenderThread(FRDGBuilder& GraphBuilder)
+{
+	return RegisterExternalRenderTarget(GraphBuilder, GetTargetTexture_RenderThread(), CachedOutputTarget, TEXT("WhiteNoiseRenderTarget"));
+}
+
+void FWhiteNoiseCSProxy::AddPasses_RenderThread(FRDGBuilder& GraphBuilder)
+{
+	check(ShouldRender_RenderThread());
+	SCOPE_CYCLE_COUNTER(STAT_WhiteNoise_AddPasses);
+	const FWhiteNoiseCSParameters& CachedParams = Parameters.Get();
+	const FIntPoint Size = GetOutputSize_RenderThread();
+	RDG_EVENT_SCOPE(GraphBuilder, "WhiteNoise %dx%d", Size.X, Size.Y);
+	RDG_GPU_STAT_SCOPE(GraphBuilder, WhiteNoise);
+
+	const uint32 Seed = CoherentNoise::GetSeed(CachedParams.Seed, CachedParams.TimeStamp);
+	if (UsesTileCache_RenderThread())
+	{
+		// The render target keeps what was copied last time, so there is nothing to do until the request changes
+		FRHITexture* TargetTextureRHI = GetTargetTexture_RenderThread();
+		const FNoiseTileKey Request(CachedParams.Noise, Seed, CachedParams.RegionOffset, Size, GetOutputFormat_RenderThread());
+		if (LastTileRequest.IsSet() && LastTileRequest.GetValue() == Request && LastTileTarget == TargetTextureRHI)
+		{
+			return;
+		}
+		LastTileRequest = Request;
+		LastTileTarget = TargetTextureRHI;
+
+		// Tiles are copied, so the render target doesn't need to support UAVs
+		FNoiseTileCache::Get().AddPasses(GraphBuilder, RegisterRenderTarget_RenderThread(GraphBuilder), CachedParams.Noise, Seed, CachedParams.RegionOffset);
 		return;
 	}
+	LastTileRequest.Reset();
+	LastTileTarget = nullptr;
+
+	// Writes straight into the render target if it allows UAVs, otherwise into a transient texture that is copied over
+	FComputePipeline Pipeline;
+	Pipeline.AddStage(TEXT("WhiteNoiseOutput"), [&CachedParams, Seed, Size](FRDGBuilder& StageGraphBuilder, FRDGTextureRef, const FRDGTextureRef Output)
+	{
+		AddCoherentNoisePass(StageGraphBuilder, StageGraphBuilder.CreateUAV(Output), Size, CachedParams.Noise, Seed, CachedParams.RegionOffset);
+	});
+	Pipeline.AddPasses(GraphBuilder, nullptr, RegisterRenderTarget_RenderThread(GraphBuilder));
+}
+
+void FWhiteNoiseCSProxy::AddBatchedPasses_RenderThread(FRDGBuilder& GraphBuilder, TArrayView<FWhiteNoiseCSProxy* const> Proxies)
+{
+	check(Proxies.Num() > 0);
+	SCOPE_CYCLE_COUNTER(STAT_WhiteNoise_AddPasses);
+
+	const FWhiteNoiseCSParameters& FirstParams = Proxies[0]->Parameters.Get();
+	const FIntPoint Size = Proxies[0]->GetOutputSize_RenderThread();
+	const EPixelFormat Format = Proxies[0]->GetOutputFormat_RenderThread();
 
-	FRDGBuilder GraphBuilder(RHICmdList);
+	RDG_EVENT_SCOPE(GraphBuilder, "WhiteNoise %dx%d (Batched x%d)", Size.X, Size.Y, Proxies.Num());
+	RDG_GPU_STAT_SCOPE(GraphBuilder, WhiteNoise);
 
-	// Create a RDG Texture
-	const FRDGTextureDesc RenderTargetDesc = FRDGTextureDesc::Create2D(
-		FIntPoint(1024,1024),
-		PF_R32_FLOAT,
+	// Gather the per instance parameters
+	TArray<FWhiteNoiseInstanceData> InstanceData;
+	InstanceData.Reserve(Proxies.Num());
+	for (const FWhiteNoiseCSProxy* Proxy : Proxies)
+	{
+		const FWhiteNoiseCSParameters& Params = Proxy->Parameters.Get();
+		check(Proxy->GetOutputSize_RenderThread() == Size);
+		check(Params.Noise.Type == FirstParams.Noise.Type && Params.Noise.Fractal == FirstParams.Noise.Fractal);
+
+		FWhiteNoiseInstanceData& Instance = InstanceData.AddZeroed_GetRef();
+		Instance.Seed = CoherentNoise::GetSeed(Params.Seed, Params.TimeStamp);
+		Instance.RegionOffset = Params.RegionOffset;
+		Instance.Frequency = Params.Noise.Frequency;
+		Instance.NumOctaves = Params.Noise.GetNumOctaves();
+		Instance.Lacunarity = Params.Noise.Lacunarity;
+		Instance.Gain = Params.Noise.Gain;
+	}
+
+	const FRDGBufferRef InstanceBuffer = CreateStructuredBuffer(
+		GraphBuilder,
+		TEXT("WhiteNoiseInstances"),
+		InstanceData.GetTypeSize(),
+		InstanceData.Num(),
+		InstanceData.GetData(),
+		InstanceData.Num() * InstanceData.GetTypeSize(),
+		ERDGInitialDataFlags::None
+	);
+
+	// One slice per instance, transient so the graph can reuse the memory
+	const FRDGTextureDesc ArrayDesc = FRDGTextureDesc::Create2DArray(
+		Size,
+		Format,
 		FClearValueBinding::Black,
-		TexCreate_RenderTargetable| TexCreate_ShaderResource | TexCreate_UAV
+		TexCreate_ShaderResource | TexCreate_UAV,
+		Proxies.Num()
 	);
-	FRDGTexture* RenderTargetTex = GraphBuilder.CreateTexture(RenderTargetDesc, TEXT("ComputeRenderTarget"));
+	const FRDGTextureRef ArrayTex = GraphBuilder.CreateTexture(ArrayDesc, TEXT("WhiteNoiseBatch"));
 
-	// Create a UAV
-	FRDGTextureUAV* RenderTargetUAV = GraphBuilder.CreateUAV(RenderTargetTex);
+	INC_DWORD_STAT_BY(STAT_ComputeShaders_TransientBufferBytes, InstanceData.Num() * InstanceData.GetTypeSize());
+	INC_DWORD_STAT_BY(STAT_ComputeShaders_TransientTextureBytes, Size.X * Size.Y * GPixelFormats[Format].BlockBytes * Proxies.Num());
+	RecordCompactFormatWrite(static_cast<int64>(Size.X) * Size.Y * Proxies.Num(), Format, PF_R32_FLOAT);
 
-	// Set shader parameters
 	FWhiteNoiseCS::FParameters* ShaderParameters = GraphBuilder.AllocParameters<FWhiteNoiseCS::FParameters>();
-	ShaderParameters->OutputTexture = RenderTargetUAV;
-	ShaderParameters->Dimensions = CachedParams.CachedRenderTargetSize;
-	ShaderParameters->TimeStamp = CachedParams.TimeStamp;
+	ShaderParameters->OutputTextureArray = GraphBuilder.CreateUAV(ArrayTex);
+	ShaderParameters->Instances = GraphBuilder.CreateSRV(InstanceBuffer);
+	ShaderParameters->Dimensions = Size;
 
-	const TShaderMapRef<FWhiteNoiseCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
-	const FIntVector GroupCount = CachedParams.GetGroupCount();
+	const TShaderMapRef<FWhiteNoiseCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel), FWhiteNoiseCS::GetPermutationVector(true, FirstParams.Noise, Format));
+	FIntVector GroupCount = FComputeShaderUtils::GetGroupCount(Size, NUM_THREADS_PER_GROUP_DIMENSION);
+	GroupCount.Z = Proxies.Num();
 
-	// Utility to actually run ("Dispatch") the compute shader
 	FComputeShaderUtils::AddPass(
 		GraphBuilder,
-		RDG_EVENT_NAME("WhiteNoise Compute Shader"),
+		RDG_EVENT_NAME("WhiteNoise Compute Shader (Batched x%d)", Proxies.Num()),
 		ComputeShader,
 		ShaderParameters,
 		GroupCount
 	);
 
-	AddReadbackTexturePass(GraphBuilder, TEXT("RenderTarget"), RenderTargetTex, CachedParams.RenderTarget->GetRenderTargetResource()->TextureRHI);
-
-	GraphBuilder.Execute();
+	// Copy each slice out to its render target
+	FRHICopyTextureInfo CopyInfo;
+	CopyInfo.Size = FIntVector(Size.X, Size.Y, 1);
+	CopyInfo.NumSlices = 1;
+	for (int32 Index = 0; Index < Proxies.Num(); Index++)
+	{
+		CopyInfo.SourceSliceIndex = Index;
+		AddCopyTexturePass(GraphBuilder, ArrayTex, Proxies[Index]->RegisterRenderTarget_RenderThread(GraphBuilder), CopyInfo);
+	}
 }
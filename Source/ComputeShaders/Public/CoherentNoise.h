@@ -0,0 +1,112 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "PixelFormat.h"
+#include "CoherentNoise.generated.h"
+
+// Basis function, a permutation of WhiteNoiseCS. Must match NOISE_TYPE_* in CoherentNoise.ush
+UENUM(BlueprintType)
+enum class ECoherentNoiseType : uint8
+{
+	// Independent value per cell, at Frequency 1 that is one per pixel
+	White,
+	Perlin,
+	Simplex,
+	// Distance to the nearest feature point, one point per cell
+	Worley,
+	MAX UMETA(Hidden)
+};
+
+// How the octaves are combined, a permutation of WhiteNoiseCS. Must match NOISE_FRACTAL_* in CoherentNoise.ush
+UENUM(BlueprintType)
+enum class ECoherentNoiseFractal : uint8
+{
+	// Single octave
+	None,
+	// Sum of octaves
+	FBm,
+	// Sum of squared inverted octaves, sharp crests where the basis crosses zero
+	Ridged,
+	MAX UMETA(Hidden)
+};
+
+// Texel format noise is stored in. Values are in [0, 1], so 8 bits is enough for most uses and 16 bit float keeps smooth gradients
+UENUM(BlueprintType)
+enum class ECoherentNoiseFormat : uint8
+{
+	// Whatever format the render target already has
+	Default,
+	R8,
+	R16F,
+	R32F
+};
+
+USTRUCT(BlueprintType)
+struct COMPUTESHADERS_API FCoherentNoiseSettings
+{
+	GENERATED_BODY()
+
+	static const int32 MaxOctaves = 8;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Noise")
+	ECoherentNoiseType Type = ECoherentNoiseType::White;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Noise")
+	ECoherentNoiseFractal Fractal = ECoherentNoiseFractal::None;
+
+	// Cells per pixel of the first octave
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Noise", meta = (ClampMin = "0"))
+	float Frequency = 1.f;
+
+	// Ignored without a fractal
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Noise", meta = (ClampMin = "1", ClampMax = "8"))
+	int32 Octaves = 4;
+
+	// Frequency multiplier between octaves
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Noise")
+	float Lacunarity = 2.f;
+
+	// Amplitude multiplier between octaves
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Noise")
+	float Gain = 0.5f;
+
+	int32 GetNumOctaves() const { return Fractal == ECoherentNoiseFractal::None ? 1 : FMath::Clamp(Octaves, 1, MaxOctaves); }
+};
+
+// CPU versions of the functions in CoherentNoise.ush, for sampling the same noise on the game thread or a server.
+// Values are in [0, 1], exactly what WhiteNoiseCS writes to the texture.
+// Seeds are the result of GetSeed, which is what the shader is given
+namespace CoherentNoise
+{
+	// Largest difference between these and the GPU. White noise is integer maths converted exactly so it matches bit for bit,
+	// the others can be a few ulps off since GPU compilers are free to fuse multiply-adds and approximate the division
+	constexpr float GPUTolerance = 1.0e-4f;
+
+	// PCG-style integer hash: the PCG LCG step followed by a xorshift-multiply output permutation.
+	// Fixed shifts instead of PCG's random rotation, which would need per lane variable shifts. Mirrors NoiseHash
+	COMPUTESHADERS_API uint32 Hash(uint32 Value);
+
+	// Seed for a Seed/TimeStamp pair, different for every TimeStamp including 0
+	COMPUTESHADERS_API uint32 GetSeed(uint32 Seed, uint32 TimeStamp);
+
+	// PF_Unknown for Default
+	COMPUTESHADERS_API EPixelFormat GetPixelFormat(ECoherentNoiseFormat Format);
+
+	// Largest difference between the GPU writing to Format and the CPU, GPUTolerance plus the rounding to the format
+	COMPUTESHADERS_API float GetFormatTolerance(EPixelFormat Format);
+
+	// Noise space position of the centre of a texel, the shader samples Pixel + RegionOffset
+	FORCEINLINE FVector2D GetTexelPosition(const int32 X, const int32 Y) { return FVector2D(static_cast<float>(X) + 0.5f, static_cast<float>(Y) + 0.5f); }
+
+	// Reference, one position at a time
+	COMPUTESHADERS_API float Evaluate(const FCoherentNoiseSettings& Settings, uint32 Seed, const FVector2D& Position);
+
+	// 4 positions per iteration with VectorRegister (SSE/NEON, scalar where neither is available). Bit identical to Evaluate
+	COMPUTESHADERS_API void EvaluateBatch(const FCoherentNoiseSettings& Settings, uint32 Seed, TArrayView<const FVector2D> Positions, TArrayView<float> OutValues);
+
+	// Size.X * Size.Y texels, row major, the same values WhiteNoiseCS writes for that RegionOffset. Rows are evaluated in parallel
+	COMPUTESHADERS_API void EvaluateRegion(const FCoherentNoiseSettings& Settings, uint32 Seed, const FIntPoint& RegionOffset, const FIntPoint& Size, TArray<float>& OutValues);
+}
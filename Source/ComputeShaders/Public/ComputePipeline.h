@@ -0,0 +1,42 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "RenderGraphBuilder.h"
+
+// A chain of compute stages (e.g. noise, blur, normal map, tonemap) added to a graph in one go. Each stage reads the previous
+// stage's output and writes its own. Intermediates are transient, so the graph aliases their memory, and the last stage writes
+// straight into the target when it allows UAVs, so adding a stage never adds a copy or a persistent allocation.
+// Render thread only, stages are called from AddPasses so they can capture by reference
+class COMPUTESHADERS_API FComputePipeline
+{
+public:
+	// Input is the previous stage's output, or the pipeline's input (which can be null) for the first stage.
+	// Every texel of Output must be written, it is never Input
+	using FAddStagePasses = TFunction<void(FRDGBuilder& GraphBuilder, FRDGTextureRef Input, FRDGTextureRef Output)>;
+
+	// Name is used for the output texture and event, so it has to be a literal. A zero Size or PF_Unknown Format keep the
+	// previous stage's, or the target's for a first stage without an input
+	FComputePipeline& AddStage(const TCHAR* Name, FAddStagePasses&& AddPasses, const FIntPoint& Size = FIntPoint::ZeroValue, EPixelFormat Format = PF_Unknown);
+
+	int32 NumStages() const { return Stages.Num(); }
+
+	// Adds every stage, the last one's output must match Target's size and format. Target has to be external, e.g. from
+	// RegisterExternalRenderTarget. If it can't be written by a compute shader the last stage writes a transient texture copied into it,
+	// or drawn into it when the target's format can't be stored through a UAV.
+	// Without any stages Input is copied into Target
+	void AddPasses(FRDGBuilder& GraphBuilder, FRDGTextureRef Input, FRDGTextureRef Target) const;
+
+private:
+	struct FStage
+	{
+		const TCHAR* Name;
+		FAddStagePasses AddPasses;
+		FIntPoint Size;
+		EPixelFormat Format;
+	};
+
+	TArray<FStage, TInlineAllocator<4>> Stages;
+};
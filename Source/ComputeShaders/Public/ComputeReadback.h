@@ -0,0 +1,95 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "ComputeShaders.h"
+#include "RenderGraphBuilder.h"
+#include "ShaderHelpers.h"
+#include "Async/Future.h"
+
+class FRHIGPUBufferReadback;
+class FRHIGPUTextureReadback;
+
+// Result of a texture readback, rows are tightly packed
+struct COMPUTESHADERS_API FComputeTextureReadbackData
+{
+	FIntPoint Size = FIntPoint::ZeroValue;
+	EPixelFormat Format = PF_Unknown;
+	TArray<uint8> Data;
+
+	// Converts the common render target formats, returns false if the format isn't supported
+	bool ToLinearColors(TArray<FLinearColor>& OutColors) const;
+};
+
+using FBufferReadbackCallback = TUniqueFunction<void(TArray<uint8>&&)>;
+using FTextureReadbackCallback = TUniqueFunction<void(FComputeTextureReadbackData&&)>;
+
+// Copies GPU resources back to the CPU without stalling.
+// Copies are queued into staging buffers as part of the graph and polled every render thread tick,
+// results are handed to the game thread once the GPU is done with them.
+// Everything except Shutdown is render thread only.
+class COMPUTESHADERS_API FComputeReadbackManager
+{
+public:
+	// Staging buffers of each kind kept around for reuse, anything above this is released once it completes
+	static const int32 MaxRetainedStaging = 8;
+
+	static FComputeReadbackManager& Get();
+
+	// Releases the staging buffers, pending readbacks are dropped. Called from the game thread on module shutdown
+	static void Shutdown();
+
+	// Buffer must be created with FRDGBufferDesc::CreateBufferDesc (readbacks copy from vertex buffers). NumBytes = 0 reads the whole buffer
+	TFuture<TArray<uint8>> EnqueueBufferReadback(FRDGBuilder& GraphBuilder, FRDGBufferRef Buffer, uint32 NumBytes = 0);
+	void EnqueueBufferReadback(FRDGBuilder& GraphBuilder, FRDGBufferRef Buffer, uint32 NumBytes, FBufferReadbackCallback&& OnComplete);
+
+	// Reads back mip 0 of a 2D texture
+	TFuture<FComputeTextureReadbackData> EnqueueTextureReadback(FRDGBuilder& GraphBuilder, FRDGTextureRef Texture);
+	void EnqueueTextureReadback(FRDGBuilder& GraphBuilder, FRDGTextureRef Texture, FTextureReadbackCallback&& OnComplete);
+
+	int32 GetNumPending() const { return PendingBuffers.Num() + PendingTextures.Num(); }
+	int32 GetNumRetainedStaging() const { return FreeBufferStaging.Num() + FreeTextureStaging.Num(); }
+
+private:
+	FComputeReadbackManager();
+	~FComputeReadbackManager();
+
+	void Tick_RenderThread(FRHICommandListImmediate& RHICmdList);
+
+	TUniquePtr<FRHIGPUBufferReadback> AllocateBufferStaging();
+	TUniquePtr<FRHIGPUTextureReadback> AllocateTextureStaging();
+
+	struct FPendingBufferReadback
+	{
+		TUniquePtr<FRHIGPUBufferReadback> Staging;
+		uint32 NumBytes = 0;
+		// Set by the graph once the copy has been queued
+		bool bCopyQueued = false;
+		FBufferReadbackCallback OnComplete;
+	};
+
+	struct FPendingTextureReadback
+	{
+		TUniquePtr<FRHIGPUTextureReadback> Staging;
+		FIntPoint Size = FIntPoint::ZeroValue;
+		EPixelFormat Format = PF_Unknown;
+		bool bCopyQueued = false;
+		FTextureReadbackCallback OnComplete;
+
+		uint32 GetNumBytes() const { return Size.X * Size.Y * GPixelFormats[Format].BlockBytes; }
+	};
+
+	// Owned separately so the graph can hold on to a pointer while the arrays grow
+	TArray<TUniquePtr<FPendingBufferReadback>> PendingBuffers;
+	TArray<TUniquePtr<FPendingTextureReadback>> PendingTextures;
+
+	// Small ring of staging buffers that are reused instead of being created for every readback
+	TArray<TUniquePtr<FRHIGPUBufferReadback>> FreeBufferStaging;
+	TArray<TUniquePtr<FRHIGPUTextureReadback>> FreeTextureStaging;
+
+	TUniquePtr<FRenderTickHelper> TickHelper;
+
+	static FComputeReadbackManager* Instance;
+};
@@ -0,0 +1,135 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "ComputeShaders.h"
+#include "ComputeShaderStats.h"
+#include "ShaderHelpers.h"
+#include "ComputeScheduler.generated.h"
+
+// Order jobs are given the frame's GPU budget in, lower priorities are deferred first
+UENUM(BlueprintType)
+enum class EComputeJobPriority : uint8
+{
+	Low,
+	Normal,
+	High,
+	// Never deferred, even over budget
+	Critical
+};
+
+// How a job wants to be scheduled
+struct COMPUTESHADERS_API FComputeJobDesc
+{
+	FName Name;
+	EComputeJobPriority Priority = EComputeJobPriority::Normal;
+	// Runs per second, 0 for every frame
+	float TargetRate = 0.f;
+	// GPU milliseconds of one run, replaced by the measured cost once timestamps come back
+	float EstimatedCostMs = 0.5f;
+	// Optional, gets the render thread and GPU time of every run. Must outlive the job
+	FComputeShaderTimingHistory* Timings = nullptr;
+};
+
+// Render thread callbacks of a job
+struct COMPUTESHADERS_API FComputeJob
+{
+	FComputeJobDesc Desc;
+
+	// Whether there is anything to render. OutInputHash must change whenever the passes would write something different,
+	// a job with the same hash as its last run is skipped
+	TFunction<bool(uint32& OutInputHash)> Prepare;
+
+	// Adds the job's passes to the frame's graph
+	TFunction<void(FRDGBuilder& GraphBuilder)> AddPasses;
+
+	// Optional, called once the graph has executed, so extracted resources are valid
+	TFunction<void()> PostExecute;
+};
+
+struct FComputeJobHandle
+{
+	uint32 Id = 0;
+
+	bool IsValid() const { return Id != 0; }
+};
+
+// Renders every registered compute job in one graph per frame, instead of each manager ticking and executing its own.
+// Due jobs are sorted by priority and packed under ComputeScheduler.BudgetMs of estimated GPU time, the rest are
+// deferred to the next frame. Costs are learned from GPU timestamps around each job's passes.
+// Everything is render thread only.
+class COMPUTESHADERS_API FComputeScheduler
+{
+public:
+	static FComputeScheduler& Get();
+
+	// Called from the game thread on module shutdown, after everything that registers jobs
+	static void Shutdown();
+
+	FComputeJobHandle RegisterJob(FComputeJob&& Job);
+
+	// Safe to call during shutdown, after the scheduler is gone, and with an invalid handle
+	static void UnregisterJob(FComputeJobHandle& Handle);
+
+	// Keeps the learned cost
+	void SetPriority(FComputeJobHandle Handle, EComputeJobPriority Priority, float TargetRate);
+
+	// Logs every job, for ComputeScheduler.List
+	void LogJobs() const;
+
+private:
+	FComputeScheduler();
+	~FComputeScheduler();
+
+	void Tick_RenderThread(FRHICommandListImmediate& RHICmdList);
+	void PollQueries();
+
+	// Timestamps take a few frames to come back, runs of a job past this many in flight aren't timed
+	static const int32 MaxQueriesInFlight = 4;
+
+	// Timestamps around one run of a job
+	struct FTimestampQueries
+	{
+		FRenderQueryRHIRef Start;
+		FRenderQueryRHIRef End;
+	};
+
+	struct FJobState
+	{
+		FComputeJob Job;
+		float CostMs = 0.f;
+		bool bCostMeasured = false;
+		// Nothing has been skipped as unchanged until the first run
+		bool bHasRun = false;
+		uint32 LastInputHash = 0;
+		// Seconds, FPlatformTime. Runs are due from here
+		double NextRunTime = 0.0;
+		// Frames in a row it was due but over budget
+		int32 NumDeferredFrames = 0;
+
+		int64 NumRuns = 0;
+		int64 NumDeferred = 0;
+		int64 NumSkipped = 0;
+
+		// Queries that have been read back are reused instead of creating new ones every run
+		TArray<FTimestampQueries, TInlineAllocator<MaxQueriesInFlight>> FreeQueries;
+		int32 NumQueriesInFlight = 0;
+	};
+
+	struct FPendingQuery
+	{
+		uint32 JobId;
+		uint32 FrameNumber;
+		FTimestampQueries Queries;
+	};
+
+	TMap<uint32, FJobState> Jobs;
+	uint32 NextJobId = 1;
+	TArray<FPendingQuery> PendingQueries;
+
+	TUniquePtr<FRenderTickHelper> TickHelper;
+
+	static FComputeScheduler* Instance;
+};
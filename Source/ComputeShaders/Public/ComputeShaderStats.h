@@ -0,0 +1,77 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "RHI.h"
+#include "Stats/Stats.h"
+#include "ProfilingDebugging/CsvProfiler.h"
+#include "ComputeShaderStats.generated.h"
+
+DECLARE_STATS_GROUP(TEXT("ComputeShaders"), STATGROUP_ComputeShaders, STATCAT_Advanced);
+
+// Persistent GPU resources (accumulation textures, scene buffers)
+DECLARE_MEMORY_STAT_EXTERN(TEXT("Persistent GPU Memory"), STAT_ComputeShaders_PersistentMemory, STATGROUP_ComputeShaders, COMPUTESHADERS_API);
+// Staging memory of readbacks that haven't completed yet
+DECLARE_MEMORY_STAT_EXTERN(TEXT("Readback Memory In Flight"), STAT_ComputeShaders_ReadbackMemory, STATGROUP_ComputeShaders, COMPUTESHADERS_API);
+// Per frame allocations made by the graphs
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Transient Texture Bytes"), STAT_ComputeShaders_TransientTextureBytes, STATGROUP_ComputeShaders, COMPUTESHADERS_API);
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Transient Buffer Bytes"), STAT_ComputeShaders_TransientBufferBytes, STATGROUP_ComputeShaders, COMPUTESHADERS_API);
+// Bytes per frame not written or uploaded thanks to compact formats, compared to full precision (R32F noise, RGBA32F ray tracing, float scene)
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Compact Format Bytes Saved"), STAT_ComputeShaders_CompactFormatBytesSaved, STATGROUP_ComputeShaders, COMPUTESHADERS_API);
+// Persistent GPU memory saved the same way
+DECLARE_MEMORY_STAT_EXTERN(TEXT("Compact Format Memory Saved"), STAT_ComputeShaders_CompactFormatMemorySaved, STATGROUP_ComputeShaders, COMPUTESHADERS_API);
+
+CSV_DECLARE_CATEGORY_MODULE_EXTERN(COMPUTESHADERS_API, ComputeShaders);
+
+// Adds Bytes to STAT_ComputeShaders_CompactFormatBytesSaved, clamped so large frames don't wrap the 32 bit counter
+COMPUTESHADERS_API void RecordCompactFormatBytesSaved(int64 Bytes);
+
+// Adds what writing NumTexels texels of Format instead of FullFormat saved to STAT_ComputeShaders_CompactFormatBytesSaved
+COMPUTESHADERS_API void RecordCompactFormatWrite(int64 NumTexels, EPixelFormat Format, EPixelFormat FullFormat);
+
+// Timings of one frame of a manager
+USTRUCT(BlueprintType)
+struct COMPUTESHADERS_API FComputeShaderFrameTiming
+{
+	GENERATED_BODY()
+
+	UPROPERTY(BlueprintReadOnly, Category = "ComputeShaders")
+	int32 FrameNumber = 0;
+
+	// Parameter gathering and CPU work on the game thread
+	UPROPERTY(BlueprintReadOnly, Category = "ComputeShaders")
+	float GameThreadMs = 0.f;
+
+	// Building and executing the graph
+	UPROPERTY(BlueprintReadOnly, Category = "ComputeShaders")
+	float RenderThreadMs = 0.f;
+
+	// Negative until the timestamps come back, or if the RHI doesn't support them
+	UPROPERTY(BlueprintReadOnly, Category = "ComputeShaders")
+	float GPUMs = -1.f;
+};
+
+// Last N frames of timings, written from the game and render threads.
+// GPU timings come from FComputeScheduler's timestamp queries, which are polled without waiting, so they show up a few frames late
+class COMPUTESHADERS_API FComputeShaderTimingHistory
+{
+public:
+	static const int32 MaxFrames = 64;
+
+	void RecordGameThread(uint32 FrameNumber, float Milliseconds);
+
+	// For work measured elsewhere, e.g. by FComputeScheduler
+	void RecordRenderThread(uint32 FrameNumber, float Milliseconds);
+	void RecordGPU(uint32 FrameNumber, float Milliseconds);
+
+	// Oldest first
+	TArray<FComputeShaderFrameTiming> GetTimings() const;
+
+private:
+	FComputeShaderFrameTiming& FindOrAddFrame(uint32 FrameNumber);
+
+	mutable FCriticalSection CriticalSection;
+	TArray<FComputeShaderFrameTiming> Frames;
+};
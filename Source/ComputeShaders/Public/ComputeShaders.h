@@ -5,7 +5,8 @@
 #include "Modules/ModuleInterface.h"
 #include "Modules/ModuleManager.h"
 
-#define NUM_THREADS_PER_GROUP_DIMENSION 32
+// 16x16 threads, 32x32 (1024 threads) is the hardware maximum and leaves little room for occupancy
+#define NUM_THREADS_PER_GROUP_DIMENSION 16
 
 DECLARE_LOG_CATEGORY_EXTERN(LogComputeShaders, Log, All);
 
@@ -21,6 +22,7 @@ public:
 #if !UE_BUILD_SHIPPING
 #include "Engine/Engine.h"
 #define print(text, ...) UE_LOG(LogComputeShaders, Log, TEXT(text), ##__VA_ARGS__)
+#define printv(text, ...) UE_LOG(LogComputeShaders, Verbose, TEXT(text), ##__VA_ARGS__)
 #define printw(text, ...) UE_LOG(LogComputeShaders, Warning, TEXT(text), ##__VA_ARGS__)
 #define printe(text, ...) UE_LOG(LogComputeShaders, Error, TEXT(text), ##__VA_ARGS__)
 #define printsc(key, text, ...) if (GEngine) GEngine->AddOnScreenDebugMessage(key, 6, FColor::Green, FString::Printf(TEXT(text), ##__VA_ARGS__));
@@ -28,6 +30,7 @@ public:
 #define printsce(key, text, ...) if (GEngine) GEngine->AddOnScreenDebugMessage(key, 6, FColor::Red, FString::Printf(TEXT(text), ##__VA_ARGS__).ToUpper(), true, FVector2D(3.f,3.f));
 #else
 #define print(text, ...)
+#define printv(text, ...)
 #define printw(text, ...)
 #define printe(text, ...)
 #define printsc(key, text, ...)
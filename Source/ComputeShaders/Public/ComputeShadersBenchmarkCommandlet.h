@@ -0,0 +1,27 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "Commandlets/Commandlet.h"
+#include "ComputeShadersBenchmarkCommandlet.generated.h"
+
+// Sweeps the ray tracing, triangle mesh and noise workloads and writes the timings to CSV and JSON.
+// Works with -nullrhi, only the CPU paths are timed then.
+//
+// UE4Editor-Cmd ShaderTesting -run=ComputeShadersBenchmark [-nullrhi]
+//   -Workloads=RayTracing,Mesh,Noise  -Resolutions=256,512  -Spheres=64,1024  -AASamples=1,4  -Bounces=2,8
+//   -Triangles=4096,65536  -NoiseResolutions=256,1024  -Instances=1,16  -Warmup=2  -Reps=5  -Output=<dir>  -SkipCPU  -SkipGPU
+//   -NoiseType=White|Perlin|Simplex|Worley  -NoiseFractal=None|FBm|Ridged  -NoiseFrequency=1  -NoiseOctaves=4
+//   -NoiseFormat=R32F|R16F|R8  -RayTracingFormat=RGBA16F|RGBA32F|R11G11B10  -PackedScene
+UCLASS()
+class COMPUTESHADERS_API UComputeShadersBenchmarkCommandlet : public UCommandlet
+{
+	GENERATED_BODY()
+
+public:
+	UComputeShadersBenchmarkCommandlet();
+
+	virtual int32 Main(const FString& Params) override;
+};
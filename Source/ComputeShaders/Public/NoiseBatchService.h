@@ -0,0 +1,72 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "CoherentNoise.h"
+#include "ComputeScheduler.h"
+#include "ComputeShaders.h"
+#include "ComputeShaderStats.h"
+#include "ShaderHelpers.h"
+
+class FWhiteNoiseCSProxy;
+
+// Managers with the same key can share a dispatch, the noise type and fractal pick the shader permutation
+struct FNoiseBatchKey
+{
+	FIntPoint Size;
+	EPixelFormat Format;
+	ECoherentNoiseType Type;
+	ECoherentNoiseFractal Fractal;
+
+	bool operator==(const FNoiseBatchKey& Other) const
+	{
+		return Size == Other.Size && Format == Other.Format && Type == Other.Type && Fractal == Other.Fractal;
+	}
+	friend uint32 GetTypeHash(const FNoiseBatchKey& Key)
+	{
+		const uint32 PermutationHash = GetTypeHash(static_cast<uint8>(Key.Type) | static_cast<uint8>(Key.Fractal) << 4);
+		return HashCombine(HashCombine(GetTypeHash(Key.Size), GetTypeHash(static_cast<uint8>(Key.Format))), PermutationHash);
+	}
+};
+
+// Renders every registered noise manager as one FComputeScheduler job, skipped while no request changes.
+// Managers sharing size, format and noise permutation are rendered in a single dispatch into a texture array,
+// a manager on its own keeps the direct path into its render target. Managers using FNoiseTileCache are rendered on their own.
+class COMPUTESHADERS_API FNoiseBatchService
+{
+public:
+	// Game thread. Neither waits for the render thread, the service keeps the proxy alive until it is unregistered there.
+	// Unregister takes the caller's reference, so the last one is always dropped on the render thread
+	static void GameThread_Register(const TSharedRef<FWhiteNoiseCSProxy, ESPMode::ThreadSafe>& Proxy);
+	static void GameThread_Unregister(TSharedPtr<FWhiteNoiseCSProxy, ESPMode::ThreadSafe> Proxy);
+
+	// Called from the game thread on module shutdown
+	static void Shutdown();
+
+	// Timings of the noise graph, shared by every manager since they are rendered together. Any thread
+	static TArray<FComputeShaderFrameTiming> GetFrameTimings() { return Timings.GetTimings(); }
+
+private:
+	FNoiseBatchService();
+	~FNoiseBatchService();
+
+	static FNoiseBatchService& Get_RenderThread();
+
+	// FComputeScheduler callbacks
+	bool Prepare_RenderThread(uint32& OutInputHash);
+	void AddPasses_RenderThread(FRDGBuilder& GraphBuilder);
+	void PostExecute_RenderThread();
+
+	// Render thread only
+	TArray<TSharedRef<FWhiteNoiseCSProxy, ESPMode::ThreadSafe>> Proxies;
+	// Reused every frame to avoid reallocating the groups
+	TMap<FNoiseBatchKey, TArray<FWhiteNoiseCSProxy*>> Batches;
+	TArray<FWhiteNoiseCSProxy*> CachedProxies;
+
+	FComputeJobHandle JobHandle;
+
+	static FNoiseBatchService* Instance;
+	static FComputeShaderTimingHistory Timings;
+};
@@ -0,0 +1,114 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "CoherentNoise.h"
+#include "ComputeShaders.h"
+#include "ShaderHelpers.h"
+
+// Everything that changes the contents of a tile
+struct FNoiseTileKey
+{
+	ECoherentNoiseType Type;
+	ECoherentNoiseFractal Fractal;
+	int32 NumOctaves;
+	float Frequency;
+	float Lacunarity;
+	float Gain;
+	// CoherentNoise::GetSeed of the seed and time stamp
+	uint32 Seed;
+	// Noise space position of the first texel
+	FIntPoint Origin;
+	FIntPoint Size;
+	EPixelFormat Format;
+
+	FNoiseTileKey(const FCoherentNoiseSettings& Settings, uint32 InSeed, const FIntPoint& InOrigin, const FIntPoint& InSize, EPixelFormat InFormat);
+
+	bool operator==(const FNoiseTileKey& Other) const
+	{
+		return Type == Other.Type && Fractal == Other.Fractal && NumOctaves == Other.NumOctaves
+			&& Frequency == Other.Frequency && Lacunarity == Other.Lacunarity && Gain == Other.Gain
+			&& Seed == Other.Seed && Origin == Other.Origin && Size == Other.Size && Format == Other.Format;
+	}
+	bool operator!=(const FNoiseTileKey& Other) const { return !(*this == Other); }
+
+	friend uint32 GetTypeHash(const FNoiseTileKey& Key)
+	{
+		uint32 Hash = GetTypeHash(static_cast<uint8>(Key.Type) | static_cast<uint8>(Key.Fractal) << 4);
+		Hash = HashCombine(Hash, GetTypeHash(Key.NumOctaves));
+		Hash = HashCombine(Hash, GetTypeHash(Key.Frequency));
+		Hash = HashCombine(Hash, GetTypeHash(Key.Lacunarity));
+		Hash = HashCombine(Hash, GetTypeHash(Key.Gain));
+		Hash = HashCombine(Hash, Key.Seed);
+		Hash = HashCombine(Hash, GetTypeHash(Key.Origin));
+		Hash = HashCombine(Hash, GetTypeHash(Key.Size));
+		return HashCombine(Hash, GetTypeHash(static_cast<uint8>(Key.Format)));
+	}
+};
+
+// Totals since startup
+struct COMPUTESHADERS_API FNoiseTileCacheStats
+{
+	int64 NumHits = 0;
+	int64 NumMisses = 0;
+	int64 NumEvictions = 0;
+	int32 NumResidentTiles = 0;
+	int64 ResidentBytes = 0;
+	int64 BudgetBytes = 0;
+
+	float GetHitRate() const { return NumHits + NumMisses > 0 ? static_cast<float>(NumHits) / (NumHits + NumMisses) : 0.f; }
+};
+
+// Generated noise kept in pooled textures so repeated or static requests don't dispatch again.
+// Requests are split into Noise.TileCache.TileSize tiles aligned in noise space, so overlapping regions share tiles,
+// and only the tiles that aren't resident are generated. The least recently used tiles are evicted once the
+// resident size goes over Noise.TileCache.BudgetMB. Everything except GetStats is render thread only.
+class COMPUTESHADERS_API FNoiseTileCache
+{
+public:
+	static FNoiseTileCache& Get();
+
+	// Releases every tile. Called from the game thread on module shutdown
+	static void Shutdown();
+
+	// Noise.TileCache.Enable, any thread
+	static bool IsEnabled();
+
+	// Copies Output->Desc.Extent texels of noise starting at RegionOffset into Output, generating the missing tiles first.
+	// Tiles have Output's format
+	void AddPasses(FRDGBuilder& GraphBuilder, FRDGTextureRef Output, const FCoherentNoiseSettings& Settings, uint32 Seed, const FIntPoint& RegionOffset);
+
+	// Evicts down to the budget. Only call once the graphs that used AddPasses have executed, new tiles are extracted then
+	void Trim();
+
+	// Any thread
+	static FNoiseTileCacheStats GetStats();
+
+private:
+	FNoiseTileCache() = default;
+	~FNoiseTileCache();
+
+	struct FTile
+	{
+		TRefCountPtr<IPooledRenderTarget> Texture;
+		int64 NumBytes = 0;
+		// Value of UseCounter when it was last used, lower is older
+		uint64 LastUsed = 0;
+		// The graph that generated it, until it has executed and Texture is set. Only compared against, never dereferenced
+		const FRDGBuilder* PendingGraph = nullptr;
+		FRDGTextureRef PendingTexture = nullptr;
+	};
+
+	void ReleaseTile(const FTile& Tile);
+
+	// Owned separately so the graph can hold on to the extraction target while the map grows
+	TMap<FNoiseTileKey, TUniquePtr<FTile>> Tiles;
+	uint64 UseCounter = 0;
+
+	static FNoiseTileCache* Instance;
+
+	static FCriticalSection StatsCriticalSection;
+	static FNoiseTileCacheStats Stats;
+};
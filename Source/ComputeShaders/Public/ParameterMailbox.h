@@ -0,0 +1,82 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "Templates/Atomic.h"
+
+// Hands parameter structs from the game thread (or any other writers) to one reader thread, usually the render thread.
+// Triple buffered: writers fill a spare slot and swap it in, the reader swaps the newest one out, so the reader never
+// waits or copies and always sees a whole struct. Values published between two Latch calls are dropped, only the latest is kept.
+// Writers are serialised with each other, which is uncontended with a single game thread writer
+template<typename T>
+class TParameterMailbox
+{
+public:
+	TParameterMailbox():
+		Middle(1),
+		Back(2),
+		Front(0),
+		bHasValue(false)
+	{}
+
+	// Any thread
+	void Publish(const T& Value)
+	{
+		FScopeLock Lock(&WriterCriticalSection);
+		Slots[Back] = Value;
+		// The swap publishes the slot, the reader gets it with the next Latch
+		Back = Middle.Exchange(Back | NewValueFlag) & IndexMask;
+	}
+	void Publish(T&& Value)
+	{
+		FScopeLock Lock(&WriterCriticalSection);
+		Slots[Back] = MoveTemp(Value);
+		Back = Middle.Exchange(Back | NewValueFlag) & IndexMask;
+	}
+
+	// Reader thread. Makes the latest published value current, returns false if nothing was published since the last call
+	bool Latch()
+	{
+		if ((Middle.Load(EMemoryOrder::Relaxed) & NewValueFlag) == 0)
+		{
+			return false;
+		}
+		Front = Middle.Exchange(Front) & IndexMask;
+		bHasValue = true;
+		return true;
+	}
+
+	// Reader thread. Whether anything has been latched yet
+	bool HasValue() const { return bHasValue; }
+
+	// Reader thread. The latched value, writers never touch it so it can be modified in place until the next Latch
+	const T& Get() const
+	{
+		check(bHasValue);
+		return Slots[Front];
+	}
+	T& Get()
+	{
+		check(bHasValue);
+		return Slots[Front];
+	}
+
+private:
+	static constexpr uint32 IndexMask = 3;
+	static constexpr uint32 NewValueFlag = 4;
+
+	T Slots[3];
+
+	// Slot index, plus NewValueFlag while it holds a value the reader hasn't latched
+	TAtomic<uint32> Middle;
+
+	// Writers only
+	uint32 Back;
+	FCriticalSection WriterCriticalSection;
+
+	// Reader only
+	uint32 Front;
+	bool bHasValue;
+};
@@ -0,0 +1,65 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "RenderGraphBuilder.h"
+#include "RayTracingAdaptive.generated.h"
+
+// Adaptive tiles are one 8x8 thread group, the GPU uses the Group8x8 shape
+#define RAY_TRACING_ADAPTIVE_TILE_SIZE 8
+
+USTRUCT(BlueprintType)
+struct COMPUTESHADERS_API FRayTracingAdaptiveSettings
+{
+	GENERATED_BODY()
+
+	// Render NumAASamples everywhere, then keep adding samples to the noisy tiles. One-shot renders only, ignored in progressive mode
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "RayTracing|Adaptive")
+	bool bEnabled = false;
+
+	// Samples added to each noisy tile per pass
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "RayTracing|Adaptive", meta = (ClampMin = 1))
+	int32 SamplesPerPass = 4;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "RayTracing|Adaptive", meta = (ClampMin = 0, ClampMax = 16))
+	int32 MaxPasses = 4;
+
+	// Per pixel budget, tiles at this count are done whatever their noise
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "RayTracing|Adaptive", meta = (ClampMin = 1))
+	int32 MaxSamples = 32;
+
+	// Relative standard error of a pixel's mean luminance. A tile is refined while any of its pixels is above this
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "RayTracing|Adaptive", meta = (ClampMin = 0))
+	float NoiseThreshold = 0.02f;
+};
+
+namespace RayTracingAdaptive
+{
+	// Variance needs at least two samples
+	inline int32 GetBaseSamples(const int32 NumSamples) { return FMath::Max(2, NumSamples); }
+
+	inline float GetLuminance(const FVector& Colour) { return FVector::DotProduct(Colour, FVector(0.2126f, 0.7152f, 0.0722f)); }
+
+	// Must match GetPixelError in RayTracingAdaptiveCS.usf
+	inline float GetPixelError(const float LuminanceSum, const float LuminanceSquaredSum, const float NumSamples)
+	{
+		const float Mean = LuminanceSum / NumSamples;
+		const float Variance = FMath::Max(LuminanceSquaredSum / NumSamples - Mean * Mean, 0.f);
+		// Offset so almost black pixels don't need thousands of samples
+		return FMath::Sqrt(Variance / NumSamples) / (Mean + 0.01f);
+	}
+}
+
+// Finds the tiles that still need samples. Appends the tile coordinates (X | Y << 16) to TileList and
+// returns the indirect dispatch arguments, one group per tile.
+// AdaptiveColor holds the colour sum and sample count, AdaptiveLuminance the luminance sum and sum of squares
+FRDGBufferRef AddBuildAdaptiveTileListPass(
+	FRDGBuilder& GraphBuilder,
+	FRDGTextureRef AdaptiveColor,
+	FRDGTextureRef AdaptiveLuminance,
+	const FIntPoint& Dimensions,
+	const FRayTracingAdaptiveSettings& Settings,
+	FRDGBufferRef TileList
+);
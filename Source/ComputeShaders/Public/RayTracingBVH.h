@@ -0,0 +1,89 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "RayTracingCommon.h"
+
+// Marks the end of traversal in FSphereBVHNode::MissIndex
+#define BVH_INVALID_INDEX 0xFFFFFFFF
+
+// Number of bits of FSphereBVHNode::PrimitiveData used for the primitive count
+#define BVH_PRIMITIVE_COUNT_BITS 4
+#define BVH_PRIMITIVE_COUNT_MASK ((1u << BVH_PRIMITIVE_COUNT_BITS) - 1)
+
+// Flattened BVH node, 32 bytes so two nodes fit in a 64 byte cache line.
+// Nodes are stored depth first, so the first child of an interior node is always the next node.
+// Must match FBVHNode in RayTracingCS.usf
+struct FSphereBVHNode
+{
+	FVector BoundsMin;
+	// Node to continue with if this node is missed (or is a leaf), BVH_INVALID_INDEX when traversal is done
+	uint32 MissIndex;
+	FVector BoundsMax;
+	// (FirstPrimitive << BVH_PRIMITIVE_COUNT_BITS) | PrimitiveCount, PrimitiveCount is 0 for interior nodes
+	uint32 PrimitiveData;
+
+	bool IsLeaf() const { return GetPrimitiveCount() > 0; }
+	uint32 GetPrimitiveCount() const { return PrimitiveData & BVH_PRIMITIVE_COUNT_MASK; }
+	uint32 GetFirstPrimitive() const { return PrimitiveData >> BVH_PRIMITIVE_COUNT_BITS; }
+};
+static_assert(sizeof(FSphereBVHNode) == 32, "FSphereBVHNode must match the shader side layout");
+
+struct FSphereBVHBuildSettings
+{
+	// Max spheres in a leaf, must fit in BVH_PRIMITIVE_COUNT_BITS
+	int32 MaxLeafSize = 4;
+	// Number of bins used to evaluate the surface area heuristic
+	int32 NumBins = 16;
+	// Relative cost of a box test compared to a sphere test
+	float TraversalCost = 1.f;
+};
+
+namespace RayTracingBVH
+{
+	// Binned SAH build over any kind of primitive, flattened depth first with miss links.
+	// Leaves reference ranges of OutPrimitiveOrder (indices into Bounds), OutRightChildren holds the second child of each interior node
+	COMPUTESHADERS_API void BuildNodes(TArrayView<const FBox> Bounds, const FSphereBVHBuildSettings& Settings, TArray<FSphereBVHNode>& OutNodes, TArray<int32>& OutPrimitiveOrder, TArray<int32>& OutRightChildren);
+}
+
+// Bounding volume hierarchy over the sphere buffer, built on the CPU with a binned SAH and flattened for stackless traversal.
+// The same traversal is implemented in RayTracingCS.usf so the CPU version can be used to validate the GPU.
+class COMPUTESHADERS_API FSphereBVH
+{
+public:
+	// Build from spheres packed as (Origin.xyz, Radius). Spheres are reordered into leaf order and can be read back with GetSpheres()
+	void Build(const TArray<FVector4>& InSpheres, const FSphereBVHBuildSettings& Settings = FSphereBVHBuildSettings());
+
+	void Reset();
+
+	// Moves/resizes spheres without changing the topology, only the leaves holding them and their ancestors are touched.
+	// Indices are into the array passed to Build, NewSpheres is indexed the same way.
+	// The leaf order positions of the updated spheres and the indices of the updated nodes are appended to the out arrays.
+	// The tree gets worse as spheres move away from where they were built, rebuild when that matters
+	void Refit(TArrayView<const int32> ChangedSpheres, TArrayView<const FVector4> NewSpheres, TArray<int32>& OutChangedSpheres, TArray<int32>& OutChangedNodes);
+
+	// Closest hit against the spheres only
+	void Trace(const FRayTracingRay& Ray, FRayTracingHit& BestHit) const;
+
+	// Surface area heuristic cost of the built tree, lower is better. Useful to compare build quality
+	float ComputeSAHCost(const float TraversalCost = 1.f) const;
+
+	const TArray<FSphereBVHNode>& GetNodes() const { return Nodes; }
+	const TArray<FVector4>& GetSpheres() const { return Spheres; }
+	bool IsEmpty() const { return Nodes.Num() == 0; }
+
+	// Index into the original sphere array for each sphere in GetSpheres()
+	const TArray<int32>& GetSphereIndices() const { return SphereIndices; }
+
+private:
+	TArray<FSphereBVHNode> Nodes;
+	TArray<FVector4> Spheres;
+	TArray<int32> SphereIndices;
+
+	// Refit data: parent of each node, position in leaf order of each original sphere and the leaf node holding each sphere (leaf order)
+	TArray<int32> ParentIndices;
+	TArray<int32> SpherePositions;
+	TArray<int32> LeafNodes;
+};
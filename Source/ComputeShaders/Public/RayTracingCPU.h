@@ -0,0 +1,77 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "RayTracingCommon.h"
+
+struct FRayTracingParams;
+class UTexture2D;
+class FSphereBVH;
+class FTriangleMeshBVH;
+
+// CPU copy of the equirectangular skybox, sampled the same way as SkyboxTexture in RayTracingCS.usf
+struct COMPUTESHADERS_API FRayTracingSkyboxImage
+{
+	FIntPoint Size = FIntPoint::ZeroValue;
+	TArray<FLinearColor> Pixels;
+
+	// Copies mip 0 of the texture, only uncompressed formats are supported
+	bool Initialize(UTexture2D* Texture);
+
+	bool IsValid() const { return Size.X > 0 && Size.Y > 0 && Pixels.Num() == Size.X * Size.Y; }
+
+	// Bilinear, wrapping in both directions (matches the SF_Bilinear, AM_Wrap sampler)
+	FLinearColor Sample(const FVector2D& UV) const;
+};
+
+struct COMPUTESHADERS_API FRayTracingCPUStats
+{
+	double RenderSeconds = 0.0;
+	int64 NumRays = 0;
+	int32 NumTiles = 0;
+	// Adaptive mode, tiles traced again summed over every refinement pass
+	int32 NumRefinedTiles = 0;
+
+	double GetRaysPerSecond() const { return RenderSeconds > 0.0 ? NumRays / RenderSeconds : 0.0; }
+};
+
+// First hit of the pixel centre ray, what the denoiser uses to find edges
+struct COMPUTESHADERS_API FRayTracingCPUGuides
+{
+	// Normal and hit distance, W is 0 for the sky
+	TArray<FVector4> NormalDepth;
+	TArray<FLinearColor> Albedo;
+};
+
+// Reference implementation of RayTracingCS.usf, renders tiles in parallel on the task graph.
+// Used when there is no GPU (e.g. -nullrhi) and to validate the shader output.
+class COMPUTESHADERS_API FRayTracingCPURenderer
+{
+public:
+	// Renders the whole image into OutImage (row major, TexSize.X * TexSize.Y)
+	static FRayTracingCPUStats Render(const FRayTracingParams& Params, const FRayTracingSkyboxImage& Skybox, TArray<FLinearColor>& OutImage, const int32 TileSize = 16);
+
+	// Traces every sample of a single pixel, returns the averaged colour. NumRays is incremented for every ray cast
+	static FLinearColor RenderPixel(const FRayTracingParams& Params, const FRayTracingSkyboxImage& Skybox, const FIntPoint& Pixel, int64& NumRays);
+
+	// Same tile scheduling as the adaptive GPU passes: base samples everywhere, then the tiles above the noise threshold again.
+	// OutSampleCounts, if given, gets the number of samples each pixel ended up with
+	static FRayTracingCPUStats RenderAdaptive(const FRayTracingParams& Params, const FRayTracingSkyboxImage& Skybox, TArray<FLinearColor>& OutImage, TArray<int32>* OutSampleCounts = nullptr);
+
+	// Mirrors the WRITE_GUIDES permutation
+	static void ComputeGuides(const FRayTracingParams& Params, const FRayTracingSkyboxImage& Skybox, FRayTracingCPUGuides& OutGuides);
+
+	// Mirrors CreateCameraRay
+	static FRayTracingRay CreateCameraRay(const FRayTracingParams& Params, const FVector2D& UV);
+
+	// Mirrors Trace, closest hit against the ground, spheres and MeshBVH (if not null)
+	static void Trace(const FRayTracingRay& Ray, FRayTracingHit& BestHit, const FSphereBVH& BVH, const FTriangleMeshBVH* MeshBVH);
+
+	// Mirrors TraceRay, up to MaxBounces reflections
+	static FVector TraceRay(FRayTracingRay Ray, const FSphereBVH& BVH, const FTriangleMeshBVH* MeshBVH, const FRayTracingSkyboxImage& Skybox, const int32 MaxBounces, int64& NumRays);
+
+	// Writes the image into a render target texture, call from the render thread
+	static void UploadToTexture_RenderThread(FRHICommandListImmediate& RHICmdList, FRHITexture* Texture, const FIntPoint& Size, const TArray<FLinearColor>& Image);
+};
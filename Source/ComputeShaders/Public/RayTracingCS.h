@@ -16,9 +16,62 @@ public:
 	DECLARE_GLOBAL_SHADER(FRayTracingCS);
 	SHADER_USE_PARAMETER_STRUCT(FRayTracingCS, FGlobalShader);
 
+	// Adds the samples to AccumulationTexture and outputs the running average
+	class FProgressiveDim : SHADER_PERMUTATION_BOOL("PROGRESSIVE");
+	// Bounce loop length, unrolled
+	class FMaxBouncesDim : SHADER_PERMUTATION_SPARSE_INT("MAX_BOUNCES", 1, 2, 4, 8);
+	// Samples per pixel known at compile time, 0 reads it from NumSamples
+	class FFixedAASamplesDim : SHADER_PERMUTATION_SPARSE_INT("FIXED_AA_SAMPLES", 0, 1, 4, 8);
+	// Index into GetGroupSize. Only 8x8 is compiled unless RayTracing.BenchmarkPermutations is set
+	class FGroupShapeDim : SHADER_PERMUTATION_RANGE_INT("GROUP_SHAPE", 0, 4);
+	// Accumulates into AdaptiveColor/AdaptiveLuminance, one group per tile. Never progressive, always 8x8 groups
+	class FAdaptiveDim : SHADER_PERMUTATION_BOOL("ADAPTIVE");
+	// Writes the first hit normal, depth and albedo for the denoiser
+	class FWriteGuidesDim : SHADER_PERMUTATION_BOOL("WRITE_GUIDES");
+	// Reads the camera from ViewBuffer[Z] and writes slice Z of OutputTextureArray. One-shot only, always 8x8 groups
+	class FMultiViewDim : SHADER_PERMUTATION_BOOL("MULTI_VIEW");
+	// Spheres and nodes are quantised into the scene bounds, see FSphereBVHPacking. Single view without guides only
+	class FPackedSceneDim : SHADER_PERMUTATION_BOOL("PACKED_SCENE");
+	using FPermutationDomain = TShaderPermutationDomain<FProgressiveDim, FMaxBouncesDim, FFixedAASamplesDim, FGroupShapeDim, FAdaptiveDim, FWriteGuidesDim, FMultiViewDim, FPackedSceneDim>;
+
+	static FIntPoint GetGroupSize(const int32 GroupShape)
+	{
+		switch (GroupShape)
+		{
+		case 0: return FIntPoint(8, 8);
+		case 1: return FIntPoint(16, 16);
+		case 2: return FIntPoint(32, 32);
+		case 3: return FIntPoint(8, 4);
+		default: checkNoEntry(); return FIntPoint(8, 8);
+		}
+	}
+
+	// Whether the group shapes other than 8x8 are compiled, for benchmark sweeps
+	static bool ShouldCompileBenchmarkPermutations();
+
+	// GroupShape if it was compiled for the frame, 8x8 (0) otherwise
+	static int32 GetPermutationGroupShape(const int32 GroupShape, const bool bWriteGuides, const bool bPackedScene)
+	{
+		return ShouldCompileBenchmarkPermutations() && !bWriteGuides && !bPackedScene ? GroupShape : 0;
+	}
+
+	// Largest supported bounce count not above MaxBounces
+	static int32 GetPermutationMaxBounces(const int32 MaxBounces)
+	{
+		return MaxBounces >= 8 ? 8 : MaxBounces >= 4 ? 4 : MaxBounces >= 2 ? 2 : 1;
+	}
+
+	// NumSamples if it has its own permutation, 0 otherwise
+	static int32 GetPermutationFixedAASamples(const int32 NumSamples)
+	{
+		return NumSamples == 1 || NumSamples == 4 || NumSamples == 8 ? NumSamples : 0;
+	}
+
 	// Shader I/O
 	BEGIN_SHADER_PARAMETER_STRUCT(FParameters, )
 		SHADER_PARAMETER_RDG_TEXTURE_UAV(RWTexture2D<float4>, OutputTexture)
+		SHADER_PARAMETER_RDG_BUFFER_SRV(StructuredBuffer<FRayTracingViewMatrices>, ViewBuffer)
+		SHADER_PARAMETER_RDG_TEXTURE_UAV(RWTexture2DArray<float4>, OutputTextureArray)
 		SHADER_PARAMETER_TEXTURE(Texture2D, SkyboxTexture)
 		SHADER_PARAMETER_SAMPLER(SamplerState, SkyboxTextureSampler)
 		SHADER_PARAMETER(FIntPoint, Dimensions)
@@ -26,12 +79,60 @@ public:
 		SHADER_PARAMETER(FMatrix, CameraInverseProjection)
 		SHADER_PARAMETER(FVector4, Colour)
 		SHADER_PARAMETER_RDG_BUFFER_SRV(StructuredBuffer<float4>, SphereBuffer)
-		SHADER_PARAMETER_RDG_BUFFER_UAV(RWStructuredBuffer<float2>, RandomBuffer)
+		SHADER_PARAMETER_RDG_BUFFER_SRV(StructuredBuffer<FBVHNode>, BVHNodeBuffer)
+		SHADER_PARAMETER_RDG_BUFFER_SRV(StructuredBuffer<uint2>, PackedSphereBuffer)
+		SHADER_PARAMETER_RDG_BUFFER_SRV(StructuredBuffer<FMeshBVHNode>, PackedBVHNodeBuffer)
+		SHADER_PARAMETER_RDG_BUFFER_SRV(StructuredBuffer<FMeshBVHNode>, MeshNodeBuffer)
+		SHADER_PARAMETER_RDG_BUFFER_SRV(StructuredBuffer<float3>, MeshVertexBuffer)
+		SHADER_PARAMETER_RDG_BUFFER_SRV(StructuredBuffer<uint>, MeshIndexBuffer)
+		SHADER_PARAMETER(FVector, MeshBoundsOrigin)
+		SHADER_PARAMETER(uint32, NumMeshNodes)
+		SHADER_PARAMETER(FVector, MeshBoundsScale)
+		SHADER_PARAMETER(FVector, SceneBoundsOrigin)
+		SHADER_PARAMETER(uint32, NumSphereNodes)
+		SHADER_PARAMETER(FVector, SceneBoundsScale)
+		SHADER_PARAMETER(float, SphereRadiusScale)
+		SHADER_PARAMETER_RDG_BUFFER_SRV(StructuredBuffer<float2>, SampleTable)
+		SHADER_PARAMETER(uint32, SampleTableMask)
+		SHADER_PARAMETER(uint32, FirstSample)
+		SHADER_PARAMETER(uint32, NumSamples)
+		SHADER_PARAMETER(uint32, bPerPixelRotation)
+		SHADER_PARAMETER_RDG_TEXTURE_UAV(RWTexture2D<float4>, AccumulationTexture)
+		SHADER_PARAMETER(uint32, PreviousSampleCount)
+		SHADER_PARAMETER(uint32, bCheckerboard)
+		SHADER_PARAMETER(uint32, CheckerboardParity)
+		SHADER_PARAMETER_RDG_BUFFER_SRV(StructuredBuffer<uint>, AdaptiveTileList)
+		SHADER_PARAMETER(uint32, bUseTileList)
+		SHADER_PARAMETER_RDG_TEXTURE_UAV(RWTexture2D<float4>, AdaptiveColor)
+		SHADER_PARAMETER_RDG_TEXTURE_UAV(RWTexture2D<float2>, AdaptiveLuminance)
+		RDG_BUFFER_ACCESS(IndirectArgs, ERHIAccess::IndirectArgs)
+		SHADER_PARAMETER_RDG_TEXTURE_UAV(RWTexture2D<float4>, GuideNormalDepth)
+		SHADER_PARAMETER_RDG_TEXTURE_UAV(RWTexture2D<float4>, GuideAlbedo)
 	END_SHADER_PARAMETER_STRUCT()
 
 	// Called by the engine to determine which permutations to compile for this shader
 	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters)
 	{
+		const FPermutationDomain PermutationVector(Parameters.PermutationId);
+		// Other group shapes only exist to be compared against 8x8 on the plain trace
+		if (PermutationVector.Get<FGroupShapeDim>() != 0 && (!ShouldCompileBenchmarkPermutations() || PermutationVector.Get<FAdaptiveDim>()
+			|| PermutationVector.Get<FWriteGuidesDim>() || PermutationVector.Get<FMultiViewDim>() || PermutationVector.Get<FPackedSceneDim>()))
+		{
+			return false;
+		}
+		if (PermutationVector.Get<FAdaptiveDim>() && PermutationVector.Get<FProgressiveDim>())
+		{
+			return false;
+		}
+		if (PermutationVector.Get<FMultiViewDim>() && (PermutationVector.Get<FProgressiveDim>() || PermutationVector.Get<FAdaptiveDim>()
+			|| PermutationVector.Get<FWriteGuidesDim>()))
+		{
+			return false;
+		}
+		if (PermutationVector.Get<FPackedSceneDim>() && (PermutationVector.Get<FMultiViewDim>() || PermutationVector.Get<FWriteGuidesDim>()))
+		{
+			return false;
+		}
 		return IsFeatureLevelSupported(Parameters.Platform, ERHIFeatureLevel::SM5);
 	}
 
@@ -40,9 +141,11 @@ public:
 	{
 		FGlobalShader::ModifyCompilationEnvironment(Parameters, OutEnvironment);
 
-		//We're using it here to add some preprocessor defines. That way we don't have to change both C++ and HLSL code when we change the value for NUM_THREADS_PER_GROUP_DIMENSION
-		OutEnvironment.SetDefine(TEXT("THREADGROUPSIZE_X"), NUM_THREADS_PER_GROUP_DIMENSION);
-		OutEnvironment.SetDefine(TEXT("THREADGROUPSIZE_Y"), NUM_THREADS_PER_GROUP_DIMENSION);
+		// The group size comes from the permutation so C++ and HLSL can't disagree
+		const FPermutationDomain PermutationVector(Parameters.PermutationId);
+		const FIntPoint GroupSize = GetGroupSize(PermutationVector.Get<FGroupShapeDim>());
+		OutEnvironment.SetDefine(TEXT("THREADGROUPSIZE_X"), GroupSize.X);
+		OutEnvironment.SetDefine(TEXT("THREADGROUPSIZE_Y"), GroupSize.Y);
 		OutEnvironment.SetDefine(TEXT("THREADGROUPSIZE_Z"), 1);
 	}
 };
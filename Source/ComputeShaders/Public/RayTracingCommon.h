@@ -0,0 +1,137 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+// CPU mirrors of the structures and intersection routines in RayTracingCS.usf.
+// Anything changed here must be changed in the shader too (and vice versa), otherwise the CPU paths stop matching the GPU.
+
+// Default number of bounces in TraceRay
+#define RAY_TRACING_MAX_BOUNCES 8
+
+struct FRayTracingRay
+{
+	FVector Origin;
+	FVector Direction;
+	FVector Energy;
+
+	FRayTracingRay() {}
+
+	FRayTracingRay(const FVector& InOrigin, const FVector& InDirection):
+		Origin(InOrigin),
+		Direction(InDirection),
+		Energy(1.f, 1.f, 1.f)
+	{}
+};
+
+struct FRayTracingHit
+{
+	FVector Position;
+	float Distance;
+	FVector Normal;
+
+	FRayTracingHit():
+		Position(ForceInitToZero),
+		Distance(TNumericLimits<float>::Max()),
+		Normal(ForceInitToZero)
+	{}
+
+	bool IsValid() const { return Distance < TNumericLimits<float>::Max(); }
+};
+
+namespace RayTracingCPU
+{
+	FORCEINLINE void IntersectGroundPlane(const FRayTracingRay& Ray, FRayTracingHit& BestHit)
+	{
+		const float t = -Ray.Origin.Z / Ray.Direction.Z;
+		if (t > 0.f && t < BestHit.Distance)
+		{
+			BestHit.Distance = t;
+			BestHit.Position = Ray.Origin + t * Ray.Direction;
+			BestHit.Normal = FVector(0.f, 0.f, 1.f);
+		}
+	}
+
+	// Sphere packed as (Origin.xyz, Radius), same as the SphereBuffer
+	FORCEINLINE void IntersectSphere(const FRayTracingRay& Ray, FRayTracingHit& BestHit, const FVector4& Sphere)
+	{
+		// https://en.wikipedia.org/wiki/Line-sphere_intersection
+		const FVector Origin(Sphere.X, Sphere.Y, Sphere.Z);
+		const FVector Delta = Ray.Origin - Origin;
+		const float B = -FVector::DotProduct(Ray.Direction, Delta);
+		const float Discriminant = B*B - FVector::DotProduct(Delta, Delta) + Sphere.W*Sphere.W;
+		if (Discriminant < 0.f)
+		{
+			return;
+		}
+
+		const float SqrtD = FMath::Sqrt(Discriminant);
+		// Pick positive solution closest to camera
+		const float t = B - SqrtD > 0.f ? B - SqrtD : B + SqrtD;
+		if (t > 0.f && t < BestHit.Distance)
+		{
+			BestHit.Distance = t;
+			BestHit.Position = Ray.Origin + t * Ray.Direction;
+			BestHit.Normal = (BestHit.Position - Origin).GetSafeNormal();
+		}
+	}
+
+	// Moller-Trumbore, two sided so the normal always faces the ray
+	FORCEINLINE void IntersectTriangle(const FRayTracingRay& Ray, FRayTracingHit& BestHit, const FVector& V0, const FVector& V1, const FVector& V2)
+	{
+		const FVector Edge1 = V1 - V0;
+		const FVector Edge2 = V2 - V0;
+		const FVector P = FVector::CrossProduct(Ray.Direction, Edge2);
+		const float Determinant = FVector::DotProduct(Edge1, P);
+		if (FMath::Abs(Determinant) < 1e-8f)
+		{
+			return;
+		}
+
+		const float InvDeterminant = 1.f / Determinant;
+		const FVector T = Ray.Origin - V0;
+		const float U = FVector::DotProduct(T, P) * InvDeterminant;
+		if (U < 0.f || U > 1.f)
+		{
+			return;
+		}
+
+		const FVector Q = FVector::CrossProduct(T, Edge1);
+		const float V = FVector::DotProduct(Ray.Direction, Q) * InvDeterminant;
+		if (V < 0.f || U + V > 1.f)
+		{
+			return;
+		}
+
+		const float t = FVector::DotProduct(Edge2, Q) * InvDeterminant;
+		if (t > 0.f && t < BestHit.Distance)
+		{
+			const FVector Normal = FVector::CrossProduct(Edge1, Edge2).GetSafeNormal();
+			BestHit.Distance = t;
+			BestHit.Position = Ray.Origin + t * Ray.Direction;
+			BestHit.Normal = FVector::DotProduct(Normal, Ray.Direction) > 0.f ? -Normal : Normal;
+		}
+	}
+
+	// Slab test, returns true if the box is hit closer than MaxDistance
+	FORCEINLINE bool IntersectBox(const FVector& Origin, const FVector& InvDirection, const FVector& BoundsMin, const FVector& BoundsMax, const float MaxDistance)
+	{
+		const FVector T0 = (BoundsMin - Origin) * InvDirection;
+		const FVector T1 = (BoundsMax - Origin) * InvDirection;
+		const float TNear = FMath::Max3(FMath::Min(T0.X, T1.X), FMath::Min(T0.Y, T1.Y), FMath::Min(T0.Z, T1.Z));
+		const float TFar = FMath::Min3(FMath::Max(T0.X, T1.X), FMath::Max(T0.Y, T1.Y), FMath::Max(T0.Z, T1.Z));
+		return TNear <= TFar && TFar > 0.f && TNear < MaxDistance;
+	}
+
+	FORCEINLINE FVector SafeInverse(const FVector& Direction)
+	{
+		// Avoid 0 * inf = NaN in the slab test for axis aligned rays
+		const float Epsilon = 1e-20f;
+		return FVector(
+			1.f / (FMath::Abs(Direction.X) > Epsilon ? Direction.X : FMath::Sign(Direction.X + Epsilon) * Epsilon),
+			1.f / (FMath::Abs(Direction.Y) > Epsilon ? Direction.Y : FMath::Sign(Direction.Y + Epsilon) * Epsilon),
+			1.f / (FMath::Abs(Direction.Z) > Epsilon ? Direction.Z : FMath::Sign(Direction.Z + Epsilon) * Epsilon)
+		);
+	}
+}
@@ -0,0 +1,102 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "RenderGraphBuilder.h"
+#include "RayTracingDenoise.generated.h"
+
+// Edge avoiding a-trous wavelet filter (Dammertz et al. 2010), guided by the first hit normal, depth and albedo
+USTRUCT(BlueprintType)
+struct COMPUTESHADERS_API FRayTracingDenoiseSettings
+{
+	GENERATED_BODY()
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "RayTracing|Denoise")
+	bool bEnabled = false;
+
+	// Each iteration doubles the filter footprint, 5 covers about 125 pixels
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "RayTracing|Denoise", meta = (ClampMin = 1, ClampMax = 8))
+	int32 Iterations = 4;
+
+	// Larger blurs across colour differences more, halved every iteration
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "RayTracing|Denoise", meta = (ClampMin = 0.0001))
+	float ColourSigma = 0.5f;
+
+	// Exponent on the normal dot product, larger keeps sharper creases
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "RayTracing|Denoise", meta = (ClampMin = 0))
+	float NormalPower = 64.f;
+
+	// Relative depth difference allowed between neighbours
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "RayTracing|Denoise", meta = (ClampMin = 0.0001))
+	float DepthSigma = 0.05f;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "RayTracing|Denoise", meta = (ClampMin = 0.0001))
+	float AlbedoSigma = 0.1f;
+};
+
+namespace RayTracingDenoise
+{
+	// B3 spline
+	static const float KernelWeights[3] = { 3.f / 8.f, 1.f / 4.f, 1.f / 16.f };
+
+	// Edge stopping weight between the centre pixel P and a neighbour Q, must match GetEdgeWeight in RayTracingDenoiseCS.usf.
+	// NormalDepth has the first hit normal and distance, W <= 0 is the sky
+	inline float GetEdgeWeight(
+		const FRayTracingDenoiseSettings& Settings,
+		const float ColourPhi,
+		const FLinearColor& ColourP, const FLinearColor& ColourQ,
+		const FVector4& NormalDepthP, const FVector4& NormalDepthQ,
+		const FLinearColor& AlbedoP, const FLinearColor& AlbedoQ)
+	{
+		const bool bSkyP = NormalDepthP.W <= 0.f;
+		const bool bSkyQ = NormalDepthQ.W <= 0.f;
+		if (bSkyP != bSkyQ)
+		{
+			return 0.f;
+		}
+
+		auto DistanceSquared = [](const FLinearColor& A, const FLinearColor& B)
+		{
+			return FMath::Square(A.R - B.R) + FMath::Square(A.G - B.G) + FMath::Square(A.B - B.B);
+		};
+
+		const float ColourWeight = FMath::Exp(-DistanceSquared(ColourP, ColourQ) / ColourPhi);
+		const float AlbedoWeight = FMath::Exp(-DistanceSquared(AlbedoP, AlbedoQ) / Settings.AlbedoSigma);
+		if (bSkyP)
+		{
+			return ColourWeight * AlbedoWeight;
+		}
+
+		const float NormalDot = FMath::Max(0.f, NormalDepthP.X * NormalDepthQ.X + NormalDepthP.Y * NormalDepthQ.Y + NormalDepthP.Z * NormalDepthQ.Z);
+		const float NormalWeight = FMath::Pow(NormalDot, Settings.NormalPower);
+		const float DepthWeight = FMath::Exp(-FMath::Abs(NormalDepthP.W - NormalDepthQ.W) / (Settings.DepthSigma * NormalDepthP.W + 0.001f));
+		return ColourWeight * AlbedoWeight * NormalWeight * DepthWeight;
+	}
+
+	// Colour sigma for an iteration, coarser levels only smooth what is left
+	inline float GetColourPhi(const FRayTracingDenoiseSettings& Settings, const int32 Iteration)
+	{
+		return Settings.ColourSigma * FMath::Pow(2.f, -static_cast<float>(Iteration));
+	}
+
+	// Multithreaded CPU version of AddRayTracingDenoisePasses, filters Colour in place
+	COMPUTESHADERS_API void Denoise(
+		const FIntPoint& Size,
+		TArray<FLinearColor>& Colour,
+		const TArray<FVector4>& NormalDepth,
+		const TArray<FLinearColor>& Albedo,
+		const FRayTracingDenoiseSettings& Settings
+	);
+}
+
+// Filters Colour with Settings.Iterations passes (at least one) into Output, which has Colour's size and format
+void AddRayTracingDenoisePasses(
+	FRDGBuilder& GraphBuilder,
+	FRDGTextureRef Colour,
+	FRDGTextureRef NormalDepth,
+	FRDGTextureRef Albedo,
+	const FRayTracingDenoiseSettings& Settings,
+	FRDGTextureRef Output
+);
@@ -0,0 +1,64 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "RayTracingCS.h"
+#include "RayTracingPackedScene.h"
+#include "RenderGraphBuilder.h"
+#include "RendererInterface.h"
+
+struct FRayTracingParams;
+
+// Render thread resources kept between frames
+struct COMPUTESHADERS_API FRayTracingGPUState
+{
+	// Running sum for progressive mode
+	TRefCountPtr<IPooledRenderTarget> AccumulationTexture;
+	// The render target wrapped for the graph, owned by the render target
+	TRefCountPtr<IPooledRenderTarget> OutputTarget;
+	// Scene, only the changes are uploaded each frame
+	TRefCountPtr<FRDGPooledBuffer> SphereBuffer;
+	TRefCountPtr<FRDGPooledBuffer> BVHNodeBuffer;
+	// Set from the last full upload, the scatters use the same packing
+	FSphereBVHPacking ScenePacking;
+	// Triangle meshes, replaced whenever they change. Hold a placeholder element when there are no triangles
+	TRefCountPtr<FRDGPooledBuffer> MeshNodeBuffer;
+	TRefCountPtr<FRDGPooledBuffer> MeshVertexBuffer;
+	TRefCountPtr<FRDGPooledBuffer> MeshIndexBuffer;
+	uint32 NumMeshNodes = 0;
+	FVector MeshBoundsOrigin = FVector::ZeroVector;
+	FVector MeshBoundsScale = FVector::ZeroVector;
+	// Anti-aliasing sample table, only uploaded when the sequence changes
+	TRefCountPtr<FRDGPooledBuffer> SampleTable;
+	int32 SampleTableSequence = INDEX_NONE;
+
+	void Release();
+
+	// Keeps STAT_ComputeShaders_PersistentMemory and STAT_ComputeShaders_CompactFormatMemorySaved in sync with the resources above
+	void UpdateMemoryStats();
+
+private:
+	int64 TrackedMemory = 0;
+	int64 TrackedSavedMemory = 0;
+};
+
+// Dispatches RayTracingCS, everything here is render thread only
+class COMPUTESHADERS_API FRayTracingGPURenderer
+{
+public:
+	// Builds and executes a graph for one frame
+	static void Render_RenderThread(FRHICommandListImmediate& RHICmdList, const FRayTracingParams& FrameParams, FRayTracingGPUState& State);
+
+	// Uploads the scene changes, traces and copies the result into the render target.
+	// Returns false if nothing was traced (missing resources), the scene is still updated
+	static bool AddPasses(FRDGBuilder& GraphBuilder, const FRayTracingParams& FrameParams, FRayTracingGPUState& State);
+
+private:
+	// Base samples on every tile, then refinement passes over the noisy tiles with indirect dispatches
+	static void AddAdaptivePasses(FRDGBuilder& GraphBuilder, const FRayTracingParams& FrameParams, FRayTracingCS::FParameters* BaseParameters, FRayTracingCS::FPermutationDomain PermutationVector);
+
+	// Every view in one dispatch (view index in Z), then a single copy into the texture array
+	static void AddMultiViewPasses(FRDGBuilder& GraphBuilder, const FRayTracingParams& FrameParams, FRayTracingCS::FParameters* PassParameters, FRayTracingCS::FPermutationDomain PermutationVector);
+};
@@ -4,31 +4,181 @@
 
 #include "CoreMinimal.h"
 
+#include "ComputeScheduler.h"
 #include "ComputeShaders.h"
+#include "ComputeShaderStats.h"
+#include "ParameterMailbox.h"
+#include "RayTracingAdaptive.h"
+#include "RayTracingDenoise.h"
+#include "RayTracingBVH.h"
+#include "RayTracingCPU.h"
+#include "RayTracingMeshBVH.h"
+#include "RayTracingPackedScene.h"
+#include "RayTracingGPU.h"
+#include "RayTracingReconstruct.h"
+#include "RayTracingSampling.h"
+#include "RendererInterface.h"
 #include "GameFramework/Actor.h"
 #include "RayTracingManager.generated.h"
 
 class UTextureRenderTarget2D;
+class UTextureRenderTarget2DArray;
 class UCameraComponent;
+class URayTracingSceneSubsystem;
+class URayTracingSphereComponent;
+class FTexture;
+class FTextureRenderTargetResource;
+struct FMinimalViewInfo;
 
+// Changes to the GPU copy of the scene, sent with the frame that needs them
+struct FRayTracingSceneUpload
+{
+	// Replace the whole buffers with Spheres and Nodes, otherwise only the listed elements are scattered
+	bool bFullUpload = false;
+	TArray<uint32> SphereIndices;
+	TArray<FVector4> Spheres;
+	TArray<uint32> NodeIndices;
+	TArray<FSphereBVHNode> Nodes;
+	int32 NumSpheres = 0;
+	int32 NumNodes = 0;
+	// Bounds the render thread packs the spheres and nodes in, invalid for full precision.
+	// Always comes with a full upload when it changes
+	FSphereBVHPacking Packing;
+
+	// Meshes are never scattered, the whole mesh goes up when it changes. Mesh is null when there are no triangles
+	bool bMeshUpload = false;
+	TSharedPtr<const FTriangleMeshBVH, ESPMode::ThreadSafe> Mesh;
+
+	// Sends the whole BVH
+	void SetFull(const FSphereBVH& BVH);
+
+	// Adds the changes of a later frame, for a frame that was replaced before it reached the GPU
+	void Append(FRayTracingSceneUpload&& Newer);
+
+	// Whether there is anything to send, the counts alone don't change without a full upload
+	bool HasChanges() const { return bFullUpload || SphereIndices.Num() > 0 || NodeIndices.Num() > 0 || bMeshUpload; }
+
+	// Drops the changes once they are on the GPU, keeps the counts
+	void ClearChanges();
+};
+
+// One camera of a multi-view render, layout matches FRayTracingView in RayTracingCS.usf
+struct FRayTracingViewMatrices
+{
+	FMatrix CameraToWorld;
+	FMatrix CameraInverseProjection;
+
+	static FRayTracingViewMatrices Create(const FMinimalViewInfo& ViewInfo, const FIntPoint& Size);
+};
+
+// Everything needed to render a frame, published to the render thread every frame
 struct FRayTracingParams
 {
 	FMatrix CameraToWorldMat;
 	FMatrix CameraInverseProjection;
+	// Traced size, smaller than OutputSize (the render target) with a reduced resolution mode
 	FIntPoint TexSize;
+	FIntPoint OutputSize;
 	EPixelFormat PixelFormat;
-	TArray<FVector4> SphereBuffer;
+	FLinearColor Colour;
+	// Holds the spheres in the order they are uploaded. Game thread only, the render thread gets SceneUpload instead
+	TSharedPtr<const FSphereBVH, ESPMode::ThreadSafe> SphereBVH;
+	// Triangles of every URayTracingMeshComponent, null without any. Same as SphereBVH, the render thread gets SceneUpload
+	TSharedPtr<const FTriangleMeshBVH, ESPMode::ThreadSafe> MeshBVH;
+	FRayTracingSceneUpload SceneUpload;
+	// Anti-aliasing samples this frame, read from the sequence table starting at FirstSample
+	ERayTracingSampleSequence SampleSequence = ERayTracingSampleSequence::Sobol;
+	uint32 FirstSample = 0;
+	int32 NumSamples = 1;
+	// Offsets every pixel's samples differently, see FRayTracingSampleTables::GetPixelRotation
+	bool bPerPixelRotation = true;
+	// Progressive mode adds this frame's samples to the accumulation texture
+	bool bProgressive = false;
+	// Number of samples already in the accumulation texture, 0 starts a new accumulation
+	uint32 PreviousSampleCount = 0;
+	// Multi-view renders every camera in one dispatch into the slices of a texture array (RenderTargetResource).
+	// Empty for the single view in CameraToWorldMat
+	TArray<FRayTracingViewMatrices> Views;
+	// Only trace pixels where (X + Y) & 1 == CheckerboardParity, the rest are reconstructed. GPU only
+	bool bCheckerboard = false;
+	uint32 CheckerboardParity = 0;
+	FRayTracingAdaptiveSettings Adaptive;
+	FRayTracingDenoiseSettings Denoise;
+	int32 MaxBounces = RAY_TRACING_MAX_BOUNCES;
+	// Threads per group, follows the shader permutation. Falls back to 8x8 where the shape isn't compiled
+	FIntPoint GroupSize = FIntPoint(8, 8);
+	int32 GroupShape = 0;
+
+	// Render thread resources
+	FTexture* SkyboxResource = nullptr;
+	FTextureRenderTargetResource* RenderTargetResource = nullptr;
+
+	bool IsMultiView() const { return Views.Num() > 0; }
+	bool UseAdaptiveSampling() const { return Adaptive.bEnabled && !bProgressive && !bCheckerboard && !IsMultiView(); }
+
+	// Sets OutputSize, TexSize and the camera matrices from a camera view
+	void SetCamera(const FMinimalViewInfo& ViewInfo, const FIntPoint& InOutputSize, ERayTracingResolutionMode ResolutionMode = ERayTracingResolutionMode::Full);
 	
-	FIntVector GetGroupCount() const
+	FIntVector GetGroupCount() const { return GetGroupCount(GroupSize); }
+	FIntVector GetGroupCount(const FIntPoint& InGroupSize) const
 	{
+		// Checkerboard threads cover every other pixel of a row
+		const int32 TraceWidth = bCheckerboard ? FMath::DivideAndRoundUp(TexSize.X, 2) : TexSize.X;
 		return FIntVector(
-			FMath::DivideAndRoundUp(TexSize.X, NUM_THREADS_PER_GROUP_DIMENSION),
-			FMath::DivideAndRoundUp(TexSize.Y, NUM_THREADS_PER_GROUP_DIMENSION),
+			FMath::DivideAndRoundUp(TraceWidth, InGroupSize.X),
+			FMath::DivideAndRoundUp(TexSize.Y, InGroupSize.Y),
 			1
 		);
 	}
 };
 
+// A GPU frame handed from ARayTracingManager to the render thread
+struct FRayTracingQueuedFrame
+{
+	// SceneUpload is empty, scene changes go through render commands so none are lost when frames are dropped
+	FRayTracingParams Params;
+	// Increases with every frame, so the job doesn't trace the same one twice
+	uint32 FrameIndex = 0;
+	// The last scene upload sent before this frame, it isn't traced until that has reached the render thread
+	uint32 SceneUploadSerial = 0;
+	// Increases with every frame that starts a new accumulation. A frame carrying on from a dropped one starts over
+	uint32 AccumulationEpoch = 0;
+};
+
+UENUM(BlueprintType)
+enum class ERayTracingBackend : uint8
+{
+	// Compute shader, falls back to the CPU when running without an RHI (-nullrhi)
+	GPU,
+	// Multithreaded reference implementation of the compute shader
+	CPU
+};
+
+// Compute shader thread group size. Smaller groups usually give better occupancy, the best one depends on the GPU.
+// Order must match FRayTracingCS::GetGroupSize
+UENUM(BlueprintType)
+enum class ERayTracingThreadGroupShape : uint8
+{
+	Group8x8 UMETA(DisplayName = "8x8"),
+	Group16x16 UMETA(DisplayName = "16x16"),
+	Group32x32 UMETA(DisplayName = "32x32"),
+	Group8x4 UMETA(DisplayName = "8x4")
+};
+
+// Texel format the image is rendered in. GPU backend only, the accumulation and denoise guide
+// textures stay at full precision so only the displayed image loses bits
+UENUM(BlueprintType)
+enum class ERayTracingOutputFormat : uint8
+{
+	// Keep the render target's own format
+	Default,
+	RGBA32F,
+	// Half the bytes of RGBA32F
+	RGBA16F,
+	// A quarter of the bytes of RGBA32F, no alpha and no negative values
+	R11G11B10
+};
+
 UCLASS(ClassGroup=(RayTracing))
 class COMPUTESHADERS_API ARayTracingManager : public AActor
 {
@@ -42,6 +192,14 @@ public:
 
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = RayTracing)
 	int32 NumAASamples;
+
+	// Low discrepancy sequences need far fewer samples than Random for the same quality
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = RayTracing)
+	ERayTracingSampleSequence SampleSequence;
+
+	// Rotate the sequence per pixel, trades aliasing for high frequency noise
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = RayTracing)
+	bool bPerPixelRotation;
 	
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = RayTracing)
 	UTexture2D* SkyboxTexture;
@@ -49,16 +207,208 @@ public:
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = RayTracing)
 	UTextureRenderTarget2D* RenderTarget;
 
+	// The RenderTarget asset is never changed. If it has another format the image goes to a transient render target
+	// created on BeginPlay instead, see GetOutputRenderTarget
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = RayTracing)
+	ERayTracingOutputFormat OutputFormat;
+
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = RayTracing)
 	UCameraComponent* Camera;
 
+	// Renders Camera into slice 0 and ExtraViews[i] into slice i + 1 in a single dispatch, instead of RenderTarget.
+	// GPU only, progressive, adaptive, denoise and reduced resolution modes are ignored
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "RayTracing|MultiView")
+	UTextureRenderTarget2DArray* MultiViewRenderTarget;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "RayTracing|MultiView")
+	TArray<UCameraComponent*> ExtraViews;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = RayTracing)
+	ERayTracingBackend Backend;
+
+	// Reflections per ray. The GPU uses a compiled in count, rounded down to 1, 2, 4 or 8
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = RayTracing, meta = (ClampMin = 1, ClampMax = 8))
+	int32 MaxBounces;
+
+	// Only 8x8 is compiled unless RayTracing.BenchmarkPermutations is set, and the denoiser and bPackedScene always use it
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = RayTracing, AdvancedDisplay)
+	ERayTracingThreadGroupShape ThreadGroupShape;
+
+	// Upload spheres and sphere BVH nodes as 16 bit integers relative to the scene bounds, half the size of each.
+	// Positions and radii lose precision to about a 65535th of the scene bounds. GPU backend only, ignored with multi-view or the denoiser
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = RayTracing, AdvancedDisplay)
+	bool bPackedScene;
+
+	// Trace fewer pixels and reconstruct the render target from them. Checkerboard is GPU only and
+	// works best with bProgressive, where the skipped pixels come from the previous frame's samples
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = RayTracing)
+	ERayTracingResolutionMode ResolutionMode;
+
+	// Render a few samples every frame and average them over time, instead of rendering NumAASamples once
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "RayTracing|Progressive")
+	bool bProgressive;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "RayTracing|Progressive", meta = (EditCondition = "bProgressive", ClampMin = 1))
+	int32 SamplesPerFrame;
+
+	// Stop rendering once this many samples have been accumulated, 0 to never stop
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "RayTracing|Progressive", meta = (EditCondition = "bProgressive", ClampMin = 0))
+	int32 MaxAccumulatedSamples;
+
+	// Spend more samples on noisy tiles, NumAASamples becomes the base count
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "RayTracing|Adaptive")
+	FRayTracingAdaptiveSettings Adaptive;
+
+	// Filters the displayed image, 1-4 samples plus denoising is meant to replace brute force sample counts for previews
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "RayTracing|Denoise")
+	FRayTracingDenoiseSettings Denoise;
+
+	// How FComputeScheduler treats the GPU frames when it's over ComputeScheduler.BudgetMs. GPU backend only
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "RayTracing|Scheduling")
+	EComputeJobPriority Priority;
+
+	// GPU frames per second, 0 for every frame. Frames in between are dropped, their scene changes go with the next one that runs
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "RayTracing|Scheduling", meta = (ClampMin = 0))
+	float UpdateRate;
+
+	// PF_Unknown for Default
+	static EPixelFormat GetPixelFormat(ERayTracingOutputFormat Format);
+
 	virtual void BeginPlay() override;
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+	virtual void Tick(float DeltaSeconds) override;
+	virtual void BeginDestroy() override;
+	virtual bool IsReadyForFinishDestroy() override;
+
+	// Throw away the accumulated samples, this happens automatically when the camera, spheres or skybox change
+	UFUNCTION(BlueprintCallable, Category = "RayTracing|Progressive")
+	void ResetAccumulation() { bResetRequested = true; }
+
+	// Samples sent to the GPU. It can have traced fewer if the scheduler dropped frames
+	UFUNCTION(BlueprintPure, Category = "RayTracing|Progressive")
+	int32 GetAccumulatedSamples() const { return AccumulatedSamples; }
+
+	// Throughput of the last CPU render, 0 if the CPU backend hasn't run
+	UFUNCTION(BlueprintPure, Category = RayTracing)
+	float GetCPURaysPerSecond() const { return LastCPUStats.GetRaysPerSecond(); }
+
+	const FRayTracingCPUStats& GetLastCPUStats() const { return LastCPUStats; }
+
+	// What the image is written to, RenderTarget or the transient render target in OutputFormat
+	UFUNCTION(BlueprintPure, Category = RayTracing)
+	UTextureRenderTarget2D* GetOutputRenderTarget() const { return TransientRenderTarget ? TransientRenderTarget : RenderTarget; }
+
+	// Timings of the last frames, oldest first. GPU timings arrive a few frames late
+	UFUNCTION(BlueprintPure, Category = RayTracing)
+	TArray<FComputeShaderFrameTiming> GetFrameTimings() const { return Timings.GetTimings(); }
+
+	// Result of the last CPU render at the traced size (Params.TexSize), row major
+	const TArray<FLinearColor>& GetCPUImage() const { return CPUImage; }
 	
 private:
 	void Render();
+
+	// Gathers the camera and scene, returns true if anything changed since the last call
+	bool UpdateParams();
+
+	// Rebuilds or refits the BVH from the pending scene changes, returns true if anything changed
+	bool UpdateScene();
+	void HandleSpheresChanged(bool bLayoutChanged, TArrayView<const int32> ChangedSpheres);
+
+	// Rebuilds the mesh BVH if any mesh changed, returns true if the traced triangles changed
+	bool UpdateMeshes(URayTracingSceneSubsystem* Scene);
+	void HandleMeshesChanged() { bMeshRebuildPending = true; }
+
+	// Adds sphere components to the old "Sphere" named static mesh actors, for levels made before URayTracingSphereComponent
+	void RegisterLegacySpheres();
+
+	// Moves the pending GPU scene changes into Upload
+	void BuildSceneUpload(FRayTracingSceneUpload& Upload);
+
+	bool ShouldUseCPUBackend() const;
+	// bPackedScene where the shader has a packed permutation
+	bool ShouldPackScene() const;
+	void Render_CPU();
 	
 	FRayTracingParams Params;
 
-	// Render run from RenderThread
-	void Execute_RenderThread(FRHICommandListImmediate& RHICmdList);
+	// Scene state, updated from URayTracingSceneSubsystem
+	TSharedPtr<FSphereBVH, ESPMode::ThreadSafe> SceneBVH;
+	FDelegateHandle SpheresChangedHandle;
+	bool bSceneRebuildPending;
+	TSet<int32> PendingChangedSpheres;
+
+	// Meshes are rebuilt whenever one changes, they are meant for static level geometry
+	TSharedPtr<FTriangleMeshBVH, ESPMode::ThreadSafe> SceneMeshBVH;
+	FDelegateHandle MeshesChangedHandle;
+	bool bMeshRebuildPending;
+
+	// GPU scene changes not sent yet, kept until the next GPU frame. Leaf order sphere indices and node indices
+	bool bGPUFullUploadPending;
+	TSet<int32> PendingGPUSpheres;
+	TSet<int32> PendingGPUNodes;
+	bool bGPUMeshUploadPending;
+	// Bounds the packed spheres are quantised in, only replaced when the scene grows out of it
+	FSphereBVHPacking ScenePacking;
+
+	TWeakObjectPtr<UTexture2D> RenderedSkyboxTexture;
+
+	// Created on BeginPlay when RenderTarget isn't in OutputFormat
+	UPROPERTY(Transient)
+	UTextureRenderTarget2D* TransientRenderTarget;
+
+	// Added by RegisterLegacySpheres
+	UPROPERTY(Transient)
+	TArray<URayTracingSphereComponent*> LegacySphereComponents;
+
+	// Progressive state
+	int32 AccumulatedSamples;
+	bool bResetRequested;
+
+	// CPU backend state
+	FRayTracingSkyboxImage CPUSkybox;
+	TWeakObjectPtr<UTexture2D> CPUSkyboxSource;
+	TArray<FLinearColor> CPUImage;
+	TArray<FLinearColor> CPUAccumulation;
+	FRayTracingCPUStats LastCPUStats;
+
+	// Game thread side of the GPU frames
+	uint32 NumPublishedFrames = 0;
+	uint32 SceneUploadSerial = 0;
+	uint32 AccumulationEpoch = 0;
+	// Last values given to the scheduler
+	EComputeJobPriority SentPriority;
+	float SentUpdateRate;
+
+	// The latest GPU frame from the game thread, latched when the scheduler prepares the job. Frames in between are dropped
+	TParameterMailbox<FRayTracingQueuedFrame> Frames;
+
+	// Render thread state
+	FRayTracingGPUState GPUState;
+	FRenderCommandFence ReleaseFence;
+	FComputeJobHandle JobHandle;
+	// Scene changes that haven't been traced yet, merged from every upload sent since
+	FRayTracingSceneUpload PendingSceneUpload;
+	uint32 AppliedSceneUploadSerial = 0;
+	uint32 TracedFrameIndex = 0;
+	// What the GPU has actually traced, the game thread's counts are ahead when frames are dropped
+	uint32 GPUAccumulatedSamples = 0;
+	uint32 GPUCheckerboardParity = 0;
+	uint32 GPUAccumulationEpoch = 0;
+	// Render thread only, whether the last AddPasses_RenderThread traced. The scene changes are kept for the next frame otherwise
+	bool bTracedSceneUpload = false;
+
+	// Written from both threads
+	FComputeShaderTimingHistory Timings;
+	// Set by the render thread when it has changes to scatter but no buffers to scatter them into
+	FThreadSafeBool bGPUFullUploadRequested;
+
+	// Render thread, merges the scene changes into the ones waiting for the next traced frame
+	void QueueSceneUpload_RenderThread(FRayTracingSceneUpload&& Upload, uint32 Serial);
+
+	// FComputeScheduler callbacks. Latches the newest frame, traces it, then drops the traced scene changes once the graph has executed.
+	// Changes of a frame that wasn't traced are kept and sent again with the next one
+	bool Prepare_RenderThread(uint32& OutInputHash);
+	void AddPasses_RenderThread(FRDGBuilder& GraphBuilder);
+	void PostExecute_RenderThread();
 };
@@ -0,0 +1,99 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "RayTracingBVH.h"
+#include "RayTracingCommon.h"
+
+// Set in FTriangleBVHNode::Data for leaves
+#define MESH_BVH_LEAF_FLAG 0x80000000u
+
+// Quantised BVH node, 16 bytes (half an FSphereBVHNode) so four fit in a cache line.
+// Bounds are 16 bit offsets into the mesh bounds, rounded outwards so the quantised box always contains the real one.
+// Nodes are depth first like FSphereBVH. The miss link of a leaf is always the next node, so leaves keep their triangles there instead.
+// Must match FMeshBVHNode in RayTracingCS.usf, which reads it as a uint4
+struct FTriangleBVHNode
+{
+	uint16 QuantisedMin[3];
+	uint16 QuantisedMax[3];
+	// Leaf: MESH_BVH_LEAF_FLAG | (FirstTriangle << BVH_PRIMITIVE_COUNT_BITS) | TriangleCount.
+	// Interior: the miss index, the number of nodes when traversal is done
+	uint32 Data;
+
+	bool IsLeaf() const { return (Data & MESH_BVH_LEAF_FLAG) != 0; }
+	uint32 GetTriangleCount() const { return Data & BVH_PRIMITIVE_COUNT_MASK; }
+	uint32 GetFirstTriangle() const { return (Data & ~MESH_BVH_LEAF_FLAG) >> BVH_PRIMITIVE_COUNT_BITS; }
+	uint32 GetMissIndex(const uint32 NodeIndex) const { return IsLeaf() ? NodeIndex + 1 : Data; }
+};
+static_assert(sizeof(FTriangleBVHNode) == 16, "FTriangleBVHNode must match the shader side layout");
+
+// Sizes of the GPU representation, to see how big a scene can get
+struct COMPUTESHADERS_API FTriangleMeshStats
+{
+	int32 NumTriangles = 0;
+	int32 NumVertices = 0;
+	int32 NumNodes = 0;
+	int64 NodeBytes = 0;
+	int64 VertexBytes = 0;
+	int64 IndexBytes = 0;
+	float SAHCost = 0.f;
+
+	int64 GetTotalBytes() const { return NodeBytes + VertexBytes + IndexBytes; }
+	float GetBytesPerTriangle() const { return NumTriangles > 0 ? static_cast<float>(GetTotalBytes()) / NumTriangles : 0.f; }
+};
+
+// Work done by FTriangleMeshBVH::Trace, summed over any number of rays
+struct COMPUTESHADERS_API FTriangleMeshTraversalStats
+{
+	int64 NumRays = 0;
+	int64 NodesVisited = 0;
+	int64 TrianglesTested = 0;
+
+	float GetNodesPerRay() const { return NumRays > 0 ? static_cast<float>(NodesVisited) / NumRays : 0.f; }
+	float GetTrianglesPerRay() const { return NumRays > 0 ? static_cast<float>(TrianglesTested) / NumRays : 0.f; }
+};
+
+// Static triangle geometry for the ray tracer: an indexed vertex buffer and a quantised BVH over the triangles.
+// Built on the CPU with the same binned SAH as FSphereBVH, the traversal is mirrored by TraceMeshBVH in RayTracingCS.usf
+class COMPUTESHADERS_API FTriangleMeshBVH
+{
+public:
+	// Indices are 3 per triangle into Vertices, degenerate triangles are dropped.
+	// Triangles are reordered into leaf order, the vertices are kept as they are
+	void Build(const TArray<FVector>& InVertices, const TArray<uint32>& InIndices, const FSphereBVHBuildSettings& Settings = FSphereBVHBuildSettings());
+
+	void Reset();
+
+	// Closest hit against the triangles only. Stats, if given, is incremented with the work done
+	void Trace(const FRayTracingRay& Ray, FRayTracingHit& BestHit, FTriangleMeshTraversalStats* Stats = nullptr) const;
+
+	// Same as FSphereBVH::ComputeSAHCost, on the quantised boxes so it includes the cost of the looser bounds
+	float ComputeSAHCost(const float TraversalCost = 1.f) const;
+
+	FTriangleMeshStats GetStats() const;
+
+	// Undoes the quantisation, the box is never smaller than the triangles in it
+	FBox GetNodeBounds(const FTriangleBVHNode& Node) const;
+
+	const TArray<FTriangleBVHNode>& GetNodes() const { return Nodes; }
+	const TArray<FVector>& GetVertices() const { return Vertices; }
+	// 3 per triangle, in leaf order
+	const TArray<uint32>& GetIndices() const { return Indices; }
+	int32 GetNumTriangles() const { return Indices.Num() / 3; }
+	bool IsEmpty() const { return Nodes.Num() == 0; }
+
+	// Dequantisation: Bounds = BoundsOrigin + Quantised * BoundsScale
+	const FVector& GetBoundsOrigin() const { return BoundsOrigin; }
+	const FVector& GetBoundsScale() const { return BoundsScale; }
+
+private:
+	void Quantise(const FBox& Box, FTriangleBVHNode& OutNode) const;
+
+	TArray<FTriangleBVHNode> Nodes;
+	TArray<FVector> Vertices;
+	TArray<uint32> Indices;
+	FVector BoundsOrigin = FVector::ZeroVector;
+	FVector BoundsScale = FVector::ZeroVector;
+};
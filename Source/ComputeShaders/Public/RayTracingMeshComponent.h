@@ -0,0 +1,53 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "Components/SceneComponent.h"
+#include "RayTracingMeshComponent.generated.h"
+
+class UStaticMesh;
+
+// Adds the triangles of a static mesh to the ray traced scene. Attach it to a static mesh component to trace that mesh, or set StaticMesh.
+// Meshes are treated as static level geometry: moving or changing one rebuilds the triangles of every mesh in the scene.
+// Cooked builds need Allow CPU Access on the mesh, otherwise there are no vertices to read
+UCLASS(ClassGroup=(RayTracing), meta=(BlueprintSpawnableComponent))
+class COMPUTESHADERS_API URayTracingMeshComponent : public USceneComponent
+{
+	GENERATED_BODY()
+
+public:
+	URayTracingMeshComponent();
+
+	// Mesh to trace, the attach parent's mesh is used when this isn't set
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = RayTracing)
+	UStaticMesh* StaticMesh;
+
+	UFUNCTION(BlueprintCallable, Category = RayTracing)
+	void SetStaticMesh(UStaticMesh* NewMesh);
+
+	// StaticMesh, or the attach parent's mesh
+	UStaticMesh* GetTracedMesh() const;
+
+	// Appends the LOD 0 triangles in world space, indices are offset by the vertices already in OutVertices.
+	// Returns false if there is no mesh or its vertices aren't available on the CPU
+	bool GetTriangles(TArray<FVector>& OutVertices, TArray<uint32>& OutIndices) const;
+
+protected:
+	virtual void OnRegister() override;
+	virtual void OnUnregister() override;
+	virtual void OnUpdateTransform(EUpdateTransformFlags UpdateTransformFlags, ETeleportType Teleport) override;
+
+#if WITH_EDITOR
+	virtual void PostEditChangeProperty(FPropertyChangedEvent& PropertyChangedEvent) override;
+#endif
+
+private:
+	void MarkSceneDirty();
+
+	friend class URayTracingSceneSubsystem;
+
+	// Slot in URayTracingSceneSubsystem, INDEX_NONE when not in the scene
+	int32 SceneIndex;
+};
@@ -0,0 +1,45 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "RayTracingBVH.h"
+#include "RayTracingMeshBVH.h"
+
+// Sphere as 16 bit offsets into the scene bounds, 8 bytes instead of a 16 byte FVector4.
+// Must match UnpackSphere in RayTracingCS.usf, which reads it as a uint2
+struct FPackedSphere
+{
+	uint16 Origin[3];
+	uint16 Radius;
+};
+static_assert(sizeof(FPackedSphere) == 8, "FPackedSphere must match the shader side layout");
+
+// Bounds the GPU copy of the sphere BVH is quantised in, for ARayTracingManager::bPackedScene.
+// Sphere origins round to the nearest step and radii up so the packed sphere contains the real one. Nodes become
+// FTriangleBVHNodes (16 bytes instead of 32) rounded outwards, padded so they still contain the packed spheres
+struct COMPUTESHADERS_API FSphereBVHPacking
+{
+	FVector Origin = FVector::ZeroVector;
+	// World units per step on each axis
+	FVector Scale = FVector::ZeroVector;
+	// World units per step of a radius, the largest axis so any sphere inside the bounds fits
+	float RadiusScale = 0.f;
+
+	bool IsValid() const { return RadiusScale > 0.f; }
+
+	// Bounds around the scene with room for the spheres to move before they need new ones
+	static FSphereBVHPacking Create(const FBox& SceneBounds);
+
+	// Whether everything in Box can be packed without clamping
+	bool Contains(const FBox& Box) const;
+
+	FPackedSphere PackSphere(const FVector4& Sphere) const;
+	FVector4 UnpackSphere(const FPackedSphere& Sphere) const;
+
+	// Same layout as FTriangleMeshBVH, leaves keep their spheres in Data and miss to the next node
+	FTriangleBVHNode PackNode(const FSphereBVHNode& Node, uint32 NodeIndex, uint32 NumNodes) const;
+	// Undoes the quantisation like UnpackNodeBounds in RayTracingCS.usf
+	FBox GetNodeBounds(const FTriangleBVHNode& Node) const;
+};
@@ -0,0 +1,48 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "RenderGraphBuilder.h"
+#include "RayTracingReconstruct.generated.h"
+
+// How many pixels RayTracingCS traces, the rest are reconstructed
+UENUM(BlueprintType)
+enum class ERayTracingResolutionMode : uint8
+{
+	Full,
+	// Half width and height, a quarter of the rays, bilinear upscale
+	Half,
+	// Quarter width and height, a sixteenth of the rays
+	Quarter,
+	// Every other pixel, alternating each frame. Half the rays, the other half comes from the accumulation or the neighbours
+	Checkerboard
+};
+
+namespace RayTracingReconstruct
+{
+	// Size RayTracingCS renders at for an output size
+	inline FIntPoint GetTraceSize(const FIntPoint& OutputSize, const ERayTracingResolutionMode Mode)
+	{
+		switch (Mode)
+		{
+		case ERayTracingResolutionMode::Half:
+			return FIntPoint(FMath::DivideAndRoundUp(OutputSize.X, 2), FMath::DivideAndRoundUp(OutputSize.Y, 2));
+		case ERayTracingResolutionMode::Quarter:
+			return FIntPoint(FMath::DivideAndRoundUp(OutputSize.X, 4), FMath::DivideAndRoundUp(OutputSize.Y, 4));
+		default:
+			return OutputSize;
+		}
+	}
+
+	// Bilinear resample, CPU version of AddUpscalePass
+	COMPUTESHADERS_API void Upscale(const FIntPoint& InputSize, const TArray<FLinearColor>& Input, const FIntPoint& OutputSize, TArray<FLinearColor>& Output);
+}
+
+// Fills the pixels RayTracingCS skipped this frame, the ones where (X + Y) & 1 != Parity.
+// With an accumulation texture pixels that have samples use their average, otherwise the four traced neighbours are averaged
+void AddCheckerboardFillPass(FRDGBuilder& GraphBuilder, FRDGTextureRef Output, FRDGTextureRef Accumulation, uint32 Parity);
+
+// Bilinear upscale into Output, which has Input's format
+void AddUpscalePass(FRDGBuilder& GraphBuilder, FRDGTextureRef Input, FRDGTextureRef Output);
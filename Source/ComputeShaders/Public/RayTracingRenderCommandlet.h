@@ -0,0 +1,30 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "Commandlets/Commandlet.h"
+#include "RayTracingRenderCommandlet.generated.h"
+
+// Renders an image sequence along a camera path without a level, on the GPU or the CPU backend with -nullrhi.
+// Frames are encoded by a pool of threads while the next ones render, at most QueueDepth frames wait in memory.
+//
+// UE4Editor-Cmd ShaderTesting -run=RayTracingRender [-nullrhi]
+//   -Sequence=<json>  -Output=<dir>  -Format=EXR|PNG  -Width=1280  -Height=720  -Samples=64  -SamplesPerPass=16
+//   -Bounces=4  -Denoise  -CPU  -EncoderThreads=2  -QueueDepth=4
+//   Without -Sequence:  -Spheres=64  -Frames=120 orbits a generated scene
+//
+// Sequence file:
+//   { "Spheres": [[X, Y, Z, Radius], ...],
+//     "Frames": [{ "Location": [X, Y, Z], "Rotation": [Pitch, Yaw, Roll], "FOV": 90 }, ...] }
+UCLASS()
+class COMPUTESHADERS_API URayTracingRenderCommandlet : public UCommandlet
+{
+	GENERATED_BODY()
+
+public:
+	URayTracingRenderCommandlet();
+
+	virtual int32 Main(const FString& Params) override;
+};
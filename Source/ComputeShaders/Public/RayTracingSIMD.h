@@ -0,0 +1,39 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "RayTracingCommon.h"
+
+// Spheres stored as separate component arrays so 4 of them can be loaded into a vector register at once
+struct COMPUTESHADERS_API FSphereSoA
+{
+	TArray<float> X;
+	TArray<float> Y;
+	TArray<float> Z;
+	TArray<float> Radius;
+
+	// Spheres packed as (Origin.xyz, Radius), same as the SphereBuffer
+	void Set(const TArray<FVector4>& Spheres);
+	void Add(const FVector4& Sphere);
+	void Reset();
+
+	int32 Num() const { return X.Num(); }
+	FVector4 Get(const int32 Index) const { return FVector4(X[Index], Y[Index], Z[Index], Radius[Index]); }
+};
+
+// Batched versions of RayTracingCPU::IntersectSphere using VectorRegister (SSE/NEON, scalar where neither is available).
+// Results match the scalar version: same nearest hit, first sphere wins ties, normal computed the same way.
+// All of them return the index of the sphere that was hit, INDEX_NONE if BestHit wasn't improved
+namespace RayTracingSIMD
+{
+	// Reference, one ray against one sphere at a time
+	COMPUTESHADERS_API int32 IntersectSpheresScalar(const FRayTracingRay& Ray, FRayTracingHit& BestHit, const TArray<FVector4>& Spheres);
+
+	// One ray against 8 spheres per iteration
+	COMPUTESHADERS_API int32 IntersectSpheres(const FRayTracingRay& Ray, FRayTracingHit& BestHit, const FSphereSoA& Spheres);
+
+	// 4 rays against one sphere per iteration, for coherent rays (e.g. a 2x2 pixel quad)
+	COMPUTESHADERS_API void IntersectSpheresPacket4(const FRayTracingRay (&Rays)[4], FRayTracingHit (&BestHits)[4], const FSphereSoA& Spheres, int32 (&OutIndices)[4]);
+}
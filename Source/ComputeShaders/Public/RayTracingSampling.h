@@ -0,0 +1,55 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "RayTracingSampling.generated.h"
+
+// Where the anti-aliasing sub-pixel offsets come from
+UENUM(BlueprintType)
+enum class ERayTracingSampleSequence : uint8
+{
+	// Fixed seed white noise, clumps and converges slowest
+	Random,
+	// Bases 2 and 3
+	Halton,
+	// First two Sobol dimensions, a (0,2)-sequence so every power of two prefix is stratified
+	Sobol,
+	// Roberts' R2, good at any sample count
+	R2
+};
+
+// Precomputed sample sequences, shared by the CPU and GPU backends.
+// The tables are built once on first use and never change, so the GPU copy only needs uploading when the sequence changes
+class COMPUTESHADERS_API FRayTracingSampleTables
+{
+public:
+	// Power of two so the shader can wrap with a mask. Sample indices past this repeat
+	static const int32 TableSize = 4096;
+
+	// Offsets in [0,1), any thread
+	static const TArray<FVector2D>& Get(ERayTracingSampleSequence Sequence);
+
+	// Cranley-Patterson rotation, decorrelates neighbouring pixels so the error looks like noise instead of aliasing.
+	// Interleaved gradient noise, must match GetPixelRotation in RayTracingCS.usf
+	static FVector2D GetPixelRotation(const FIntPoint& Pixel)
+	{
+		return FVector2D(
+			InterleavedGradientNoise(FVector2D(Pixel.X, Pixel.Y)),
+			InterleavedGradientNoise(FVector2D(Pixel.X + 113.f, Pixel.Y + 127.f))
+		);
+	}
+
+	static FVector2D GetSample(const TArray<FVector2D>& Table, const uint32 Index, const FVector2D& Rotation)
+	{
+		const FVector2D Sample = Table[Index & (TableSize - 1)] + Rotation;
+		return FVector2D(FMath::Frac(Sample.X), FMath::Frac(Sample.Y));
+	}
+
+private:
+	static float InterleavedGradientNoise(const FVector2D& Pixel)
+	{
+		return FMath::Frac(52.9829189f * FMath::Frac(0.06711056f * Pixel.X + 0.00583715f * Pixel.Y));
+	}
+};
@@ -0,0 +1,68 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "Subsystems/WorldSubsystem.h"
+#include "RayTracingSceneSubsystem.generated.h"
+
+class URayTracingSphereComponent;
+class URayTracingMeshComponent;
+
+// bLayoutChanged: spheres were added or removed, indices are no longer valid and everything has to be rebuilt.
+// Otherwise ChangedSpheres holds the indices (into GetSpheres) of the spheres that moved or changed size
+DECLARE_MULTICAST_DELEGATE_TwoParams(FOnRayTracingSpheresChanged, bool /*bLayoutChanged*/, TArrayView<const int32> /*ChangedSpheres*/);
+
+// A mesh was added, removed or moved. Meshes are static geometry, listeners rebuild all of them
+DECLARE_MULTICAST_DELEGATE(FOnRayTracingMeshesChanged);
+
+// Spheres registered by URayTracingSphereComponent, kept packed so they can be sent to the ray tracer as is.
+// Components mark themselves dirty when they change, so updating the scene only costs the number of changes.
+// Also tracks URayTracingMeshComponents, whose triangles are gathered when something asks for them
+UCLASS()
+class COMPUTESHADERS_API URayTracingSceneSubsystem : public UWorldSubsystem
+{
+	GENERATED_BODY()
+
+public:
+	void AddSphere(URayTracingSphereComponent* Component);
+	void RemoveSphere(URayTracingSphereComponent* Component);
+	void MarkSphereDirty(URayTracingSphereComponent* Component);
+
+	void AddMesh(URayTracingMeshComponent* Component);
+	void RemoveMesh(URayTracingMeshComponent* Component);
+	void MarkMeshDirty(URayTracingMeshComponent* Component);
+
+	// Sends the changes since the last flush to OnSpheresChanged and OnMeshesChanged, does nothing if nothing changed
+	void FlushChanges();
+
+	// World space triangles of every mesh, 3 indices per triangle
+	void GatherTriangles(TArray<FVector>& OutVertices, TArray<uint32>& OutIndices) const;
+	int32 GetNumMeshes() const { return MeshComponents.Num(); }
+
+	// Packed as (Origin.xyz, Radius)
+	const TArray<FVector4>& GetSpheres() const { return Spheres; }
+	int32 GetNumSpheres() const { return Spheres.Num(); }
+
+	FOnRayTracingSpheresChanged& OnSpheresChanged() { return SpheresChangedDelegate; }
+	FOnRayTracingMeshesChanged& OnMeshesChanged() { return MeshesChangedDelegate; }
+
+private:
+	void ClearDirtySpheres();
+
+	// Not UPROPERTYs, components always remove themselves when unregistered
+	TArray<URayTracingSphereComponent*> Components;
+	TArray<FVector4> Spheres;
+
+	// Changed since the last flush, DirtyFlags stops spheres being added twice
+	TArray<int32> DirtySpheres;
+	TBitArray<> DirtyFlags;
+	bool bLayoutChanged = false;
+
+	TArray<URayTracingMeshComponent*> MeshComponents;
+	bool bMeshesChanged = false;
+
+	FOnRayTracingSpheresChanged SpheresChangedDelegate;
+	FOnRayTracingMeshesChanged MeshesChangedDelegate;
+};
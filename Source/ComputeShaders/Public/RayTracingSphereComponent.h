@@ -0,0 +1,46 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "Components/SceneComponent.h"
+#include "RayTracingSphereComponent.generated.h"
+
+// Adds a sphere to the ray traced scene. Attach it to whatever should be traced as a sphere,
+// moving or scaling it only updates its own entry in the scene
+UCLASS(ClassGroup=(RayTracing), meta=(BlueprintSpawnableComponent))
+class COMPUTESHADERS_API URayTracingSphereComponent : public USceneComponent
+{
+	GENERATED_BODY()
+
+public:
+	URayTracingSphereComponent();
+
+	// Radius before the component scale (Z) is applied, the default matches the engine sphere mesh
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = RayTracing, meta = (ClampMin = 0))
+	float Radius;
+
+	UFUNCTION(BlueprintCallable, Category = RayTracing)
+	void SetRadius(float NewRadius);
+
+	// Packed as (Origin.xyz, Radius)
+	FVector4 GetSphere() const;
+
+protected:
+	virtual void OnRegister() override;
+	virtual void OnUnregister() override;
+	virtual void OnUpdateTransform(EUpdateTransformFlags UpdateTransformFlags, ETeleportType Teleport) override;
+
+#if WITH_EDITOR
+	virtual void PostEditChangeProperty(FPropertyChangedEvent& PropertyChangedEvent) override;
+#endif
+
+private:
+	void MarkSceneDirty();
+
+	friend class URayTracingSceneSubsystem;
+
+	// Slot in URayTracingSceneSubsystem, INDEX_NONE when not in the scene
+	int32 SceneIndex;
+};
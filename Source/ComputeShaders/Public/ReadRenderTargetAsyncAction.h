@@ -0,0 +1,40 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "Kismet/BlueprintAsyncActionBase.h"
+#include "ReadRenderTargetAsyncAction.generated.h"
+
+class UTextureRenderTarget2D;
+struct FComputeTextureReadbackData;
+
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_TwoParams(FRenderTargetReadbackDelegate, const TArray<FLinearColor>&, Pixels, FIntPoint, Size);
+
+// Latent Blueprint node reading a render target back through FComputeReadbackManager, the frame never waits on it
+UCLASS()
+class COMPUTESHADERS_API UReadRenderTargetAsyncAction : public UBlueprintAsyncActionBase
+{
+	GENERATED_BODY()
+
+public:
+	// Pixels are row major, single channel formats are returned in the red channel
+	UFUNCTION(BlueprintCallable, Category = "ComputeShaders", meta = (BlueprintInternalUseOnly = "true", WorldContext = "WorldContextObject"))
+	static UReadRenderTargetAsyncAction* ReadRenderTargetAsync(UObject* WorldContextObject, UTextureRenderTarget2D* RenderTarget);
+
+	UPROPERTY(BlueprintAssignable)
+	FRenderTargetReadbackDelegate OnCompleted;
+
+	UPROPERTY(BlueprintAssignable)
+	FRenderTargetReadbackDelegate OnFailed;
+
+	virtual void Activate() override;
+
+private:
+	void HandleReadback(FComputeTextureReadbackData&& Data);
+	void Fail();
+
+	UPROPERTY()
+	UTextureRenderTarget2D* RenderTarget;
+};
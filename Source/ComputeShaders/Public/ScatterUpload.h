@@ -0,0 +1,24 @@
+﻿// Copyright Ben Sutherland 2021. All rights reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include "RenderGraphBuilder.h"
+
+// Writes Data[i] over element Indices[i] of DestBuffer with a single dispatch, instead of re-uploading the whole buffer.
+// Elements must be 8, 16 or 32 bytes, Data holds Indices.Num() elements and is copied
+void AddScatterUploadPass(FRDGBuilder& GraphBuilder, FRDGBufferRef DestBuffer, TArrayView<const uint32> Indices, const void* Data, uint32 BytesPerElement);
+
+// Keeps a structured buffer on the GPU between frames.
+// With FullData the buffer is (re)created with NumElements elements, otherwise only ChangedIndices are scattered into the existing buffer
+FRDGBufferRef UpdatePersistentStructuredBuffer(
+	FRDGBuilder& GraphBuilder,
+	TRefCountPtr<FRDGPooledBuffer>& PooledBuffer,
+	const TCHAR* Name,
+	uint32 BytesPerElement,
+	uint32 NumElements,
+	const void* FullData,
+	TArrayView<const uint32> ChangedIndices = TArrayView<const uint32>(),
+	const void* ChangedData = nullptr
+);
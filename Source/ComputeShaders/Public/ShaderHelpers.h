@@ -3,11 +3,28 @@
 
 #pragma once
 
+#include "RenderGraphBuilder.h"
+#include "RendererInterface.h"
+
 // Helper function to copy a texture back from the GPU
 void AddReadbackTexturePass(FRDGBuilder& GraphBuilder, const TCHAR* Name, const FRDGTextureRef SrcTexture, FTextureRHIRef DestTextureRHI, const FRHICopyTextureInfo& CopyInfo = FRHICopyTextureInfo());
 
-// Helper function to copy a StructuredBuffer back from the GPU
-void AddReadbackStructuredBufferPass(FRDGBuilder& GraphBuilder, const FRDGBufferRef SrcBuffer, void* DestBufferPtr, const uint32 BufferSize);
+// Copies Input into Output when their formats differ, e.g. into a render target that can't take a UAV. Same size only
+void AddConvertTexturePass(FRDGBuilder& GraphBuilder, FRDGTextureRef Input, FRDGTextureRef Output);
+
+// Whether every SM5 RHI can store to the format through a typed UAV. Others, e.g. PF_B8G8R8A8, are optional
+bool IsTypedUAVStoreFormat(EPixelFormat Format);
+
+// Whether compute shaders can write straight into the texture, it has to have a UAV and a typed UAV store format
+bool IsUAVCompatible(const FRHITexture* TextureRHI);
+
+// Registers an RHI texture (e.g. a render target's) with the graph so passes can write to it directly.
+// CachedPooledTexture keeps the wrapper around between frames, it is only recreated when the texture changes
+FRDGTextureRef RegisterExternalRenderTarget(FRDGBuilder& GraphBuilder, FRHITexture* TextureRHI, TRefCountPtr<IPooledRenderTarget>& CachedPooledTexture, const TCHAR* Name);
+
+// Reuses PooledTexture if it matches Desc, otherwise creates a new texture that is extracted into PooledTexture when the graph executes.
+// bOutCreated is set when the contents are new (undefined)
+FRDGTextureRef FindOrCreatePooledTexture(FRDGBuilder& GraphBuilder, const FRDGTextureDesc& Desc, TRefCountPtr<IPooledRenderTarget>& PooledTexture, const TCHAR* Name, bool* bOutCreated = nullptr);
 
  	
 DECLARE_DELEGATE_OneParam(FRenderTickDelegate, FRHICommandListImmediate&)
@@ -20,10 +37,12 @@ public:
 		FTickableObjectRenderThread(false, bInHighFrequency)
 	{}
 
-	// Register from Game Thread
+	// Register from Game Thread. Doesn't wait for the render thread, so the helper must outlive the enqueued command
 	void GameThread_Register();
-	// Unregister from Game Thread
+	// Unregister from Game Thread. Doesn't wait either, use GameThread_Release to destroy the helper as well
 	void GameThread_Unregister();
+	// Unregisters and deletes the helper on the render thread, after any tick already queued
+	static void GameThread_Release(TUniquePtr<FRenderTickHelper>&& Helper);
 
 	virtual void Tick(const float DeltaTime) override
 	{
@@ -3,7 +3,10 @@
 #pragma once
 
 #include "CoreMinimal.h"
+#include "CoherentNoise.h"
 #include "ComputeShaders.h"
+#include "NoiseTileCache.h"
+#include "ParameterMailbox.h"
 #include "Engine/TextureRenderTarget2D.h"
 #include "ShaderHelpers.h"
 
@@ -12,6 +15,12 @@ struct FWhiteNoiseCSParameters
 	UTextureRenderTarget2D* RenderTarget;
 	FIntPoint CachedRenderTargetSize;
 	uint32 TimeStamp;
+	uint32 Seed;
+	// Offset of the generated region in noise space, in pixels
+	FIntPoint RegionOffset;
+	FCoherentNoiseSettings Noise;
+	// Serve the noise from FNoiseTileCache, for noise that stays the same between frames. Animated noise misses every frame
+	bool bUseTileCache;
 
 	FWhiteNoiseCSParameters() { }
 
@@ -20,7 +29,10 @@ struct FWhiteNoiseCSParameters
 		CachedRenderTargetSize(
 			RenderTarget ? FIntPoint(RenderTarget->SizeX, RenderTarget->SizeY) : FIntPoint::ZeroValue
 		),
-		TimeStamp(0)
+		TimeStamp(0),
+		Seed(0),
+		RegionOffset(FIntPoint::ZeroValue),
+		bUseTileCache(true)
 	{}
 
 	FIntVector GetGroupCount() const
@@ -33,21 +45,87 @@ struct FWhiteNoiseCSParameters
 	}
 };
 
+// Per instance data for batched dispatches, must match FNoiseInstance in WhiteNoiseCS.usf
+struct FWhiteNoiseInstanceData
+{
+	// CoherentNoise::GetSeed of the seed and time stamp
+	uint32 Seed;
+	FIntPoint RegionOffset;
+	float Frequency;
+	uint32 NumOctaves;
+	float Lacunarity;
+	float Gain;
+	uint32 Padding;
+};
+
+// Writes Size texels of noise, starting at RegionOffset in noise space, into OutputUAV. Seed is CoherentNoise::GetSeed of the seed and time stamp.
+// The same values CoherentNoise::EvaluateRegion gives, within CoherentNoise::GPUTolerance
+COMPUTESHADERS_API void AddCoherentNoisePass(FRDGBuilder& GraphBuilder, FRDGTextureUAVRef OutputUAV, const FIntPoint& Size, const FCoherentNoiseSettings& Settings, uint32 Seed, const FIntPoint& RegionOffset);
+
+// Render thread side of a FWhiteNoiseCSManager. Shared with FNoiseBatchService so the manager can go away without waiting
+// for the render thread, the last reference is always released on the render thread
+class COMPUTESHADERS_API FWhiteNoiseCSProxy
+{
+public:
+	// Any thread
+	void SetRenderingEnabled(bool bEnabled) { bEnableRendering = bEnabled; }
+	void SetParameters(const FWhiteNoiseCSParameters& DrawParameters) { Parameters.Publish(DrawParameters); }
+
+	// Picks up the latest parameters, the rest of the frame sees the same ones. Render thread only
+	void LatchParameters_RenderThread() { Parameters.Latch(); }
+
+	// Whether there is anything to render this frame, render thread only
+	bool ShouldRender_RenderThread() const;
+
+	// Size and format of the render target and the noise permutation, the batching key. Only valid if ShouldRender_RenderThread.
+	// Read from the RHI texture, CachedRenderTargetSize is stale for a frame or two after a resize
+	FIntPoint GetOutputSize_RenderThread() const;
+	EPixelFormat GetOutputFormat_RenderThread() const;
+	const FCoherentNoiseSettings& GetNoiseSettings_RenderThread() const { return Parameters.Get().Noise; }
+
+	// Whether AddPasses_RenderThread goes through the tile cache, such proxies aren't batched
+	bool UsesTileCache_RenderThread() const;
+
+	// Forgets the last tile cache request, so the next AddPasses_RenderThread copies the tiles again even if nothing changed
+	void ResetTileRequest_RenderThread();
+
+	// Changes whenever the output would. Only valid if ShouldRender_RenderThread
+	uint32 GetRequestHash_RenderThread() const;
+
+	// Dispatches the compute shader for a single proxy, straight into its render target
+	void AddPasses_RenderThread(FRDGBuilder& GraphBuilder);
+
+	// Dispatches the compute shader once for all the proxies, which must share size, format and noise permutation, then copies each slice to its render target
+	static void AddBatchedPasses_RenderThread(FRDGBuilder& GraphBuilder, TArrayView<FWhiteNoiseCSProxy* const> Proxies);
+
+private:
+	// Render thread only, only valid if ShouldRender_RenderThread
+	FRHITexture* GetTargetTexture_RenderThread() const;
+
+	// Registers the render target with the graph, render thread only
+	FRDGTextureRef RegisterRenderTarget_RenderThread(FRDGBuilder& GraphBuilder);
+
+	// Written from any thread, read on the render thread once latched
+	TParameterMailbox<FWhiteNoiseCSParameters> Parameters;
+
+	// Whether the shader should execute each frame
+	FThreadSafeBool bEnableRendering;
+
+	// Render thread only. The render target wrapped for the graph
+	TRefCountPtr<IPooledRenderTarget> CachedOutputTarget;
+
+	// Render thread only. The last request served from the tile cache and where it went, the same request again is skipped
+	TOptional<FNoiseTileKey> LastTileRequest;
+	FTextureRHIRef LastTileTarget;
+};
+
+// Rendered by FNoiseBatchService, which batches every manager with the same size and format into one dispatch.
+// Creating and destroying one only queues render commands, it never waits for the render thread
 class COMPUTESHADERS_API FWhiteNoiseCSManager
 {
 public:
-	FWhiteNoiseCSManager():
-		TickHelper(new FRenderTickHelper(false)),
-		bCachedParamsAreValid(false)
-	{
-		TickHelper->TickImplementation.BindRaw(this, &FWhiteNoiseCSManager::Tick_RenderThread);
-		TickHelper->GameThread_Register();
-	}
-	~FWhiteNoiseCSManager()
-	{
-		TickHelper->TickImplementation.Unbind();
-		TickHelper->GameThread_Unregister();
-	}
+	FWhiteNoiseCSManager();
+	~FWhiteNoiseCSManager();
 	
 	// Call this when you want to start executing the compute shader. The shader will be dispatched once per frame.
 	void BeginRendering();
@@ -57,19 +135,8 @@ public:
 
 	// Call this whenever you have new parameters, on any thread
 	void UpdateParameters(FWhiteNoiseCSParameters& DrawParameters);
-
-	// Called on the render thread to dispatch compute shader
-	void Tick_RenderThread(FRHICommandListImmediate& RHICmdList) const;
 	
 private:
-	TUniquePtr<FRenderTickHelper> TickHelper;
-
-	// Cached Shader Manager Parameters
-	FWhiteNoiseCSParameters CachedParams;
-
-	// Whether we have cached parameters to pass to the shader or not
-	FThreadSafeBool bCachedParamsAreValid;
-
-	// Whether the shader should execute each frame
-	FThreadSafeBool bEnableRendering;
+	// Only null once the destructor has handed it to the render thread
+	TSharedPtr<FWhiteNoiseCSProxy, ESPMode::ThreadSafe> Proxy;
 };
\ No newline at end of file
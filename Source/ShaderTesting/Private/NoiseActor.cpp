@@ -3,6 +3,7 @@
 
 #include "NoiseActor.h"
 
+#include "NoiseBatchService.h"
 #include "WhiteNoiseCS.h"
 
 // Sets default values
@@ -15,6 +16,10 @@ ANoiseActor::ANoiseActor():
 	StaticMesh = CreateDefaultSubobject<UStaticMeshComponent>(TEXT("Static Mesh"));
 	RootComponent = StaticMesh;
 	
+	Seed = 0;
+	OutputFormat = ECoherentNoiseFormat::Default;
+	TransientRenderTarget = nullptr;
+	bAnimate = true;
 	TimeStamp = 0;
 }
 
@@ -23,10 +28,22 @@ void ANoiseActor::BeginPlay()
 {
 	Super::BeginPlay();
 
+	// The asset is never changed, a different OutputFormat is rendered into a transient render target that the material shows instead
+	TransientRenderTarget = nullptr;
+	const EPixelFormat PixelFormat = CoherentNoise::GetPixelFormat(OutputFormat);
+	if (RenderTarget && PixelFormat != PF_Unknown && RenderTarget->GetFormat() != PixelFormat)
+	{
+		TransientRenderTarget = NewObject<UTextureRenderTarget2D>(this, NAME_None, RF_Transient);
+		TransientRenderTarget->bCanCreateUAV = true;
+		TransientRenderTarget->ClearColor = RenderTarget->ClearColor;
+		TransientRenderTarget->InitCustomFormat(RenderTarget->SizeX, RenderTarget->SizeY, PixelFormat, true);
+		TransientRenderTarget->UpdateResourceImmediate(true);
+	}
+
 	WhiteNoiseManager->BeginRendering();
 	
 	UMaterialInstanceDynamic* MID = StaticMesh->CreateAndSetMaterialInstanceDynamic(0);
-	MID->SetTextureParameterValue("InputTexture", RenderTarget);
+	MID->SetTextureParameterValue("InputTexture", GetOutputRenderTarget());
 }
 
 void ANoiseActor::BeginDestroy()
@@ -42,14 +59,25 @@ void ANoiseActor::Tick(float DeltaTime)
 	Super::Tick(DeltaTime);
 
 	//Update parameters
-	FWhiteNoiseCSParameters Parameters(RenderTarget);
+	FWhiteNoiseCSParameters Parameters(GetOutputRenderTarget());
 	Parameters.TimeStamp = TimeStamp;
+	Parameters.Seed = Seed;
+	Parameters.Noise = NoiseSettings;
+	// Static noise is generated once and kept in the tile cache
+	Parameters.bUseTileCache = !bAnimate;
 	WhiteNoiseManager->UpdateParameters(Parameters);
 	
-	TimeStamp++;
-	if (TimeStamp > 100000)
+	if (bAnimate)
 	{
-		TimeStamp = 0;
+		TimeStamp++;
+		if (TimeStamp > 100000)
+		{
+			TimeStamp = 0;
+		}
 	}
 }
 
+TArray<FComputeShaderFrameTiming> ANoiseActor::GetNoiseFrameTimings() const
+{
+	return FNoiseBatchService::GetFrameTimings();
+}
@@ -4,6 +4,7 @@
 
 #include "CoreMinimal.h"
 
+#include "ComputeShaderStats.h"
 #include "WhiteNoiseCS.h"
 #include "GameFramework/Actor.h"
 #include "NoiseActor.generated.h"
@@ -23,11 +24,39 @@ public:
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = ShaderDemo)
 	class UTextureRenderTarget2D* RenderTarget;
 
+	// Basis, fractal and frequency of the generated noise
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = ShaderDemo)
+	FCoherentNoiseSettings NoiseSettings;
+
+	// Texel format the noise is rendered in. R8 writes a quarter of the bytes of R32F, R16F half.
+	// If RenderTarget has another format the noise goes to a transient render target created on BeginPlay instead
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = ShaderDemo)
+	ECoherentNoiseFormat OutputFormat;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = ShaderDemo)
+	int32 Seed;
+
+	// New noise every frame, otherwise it only changes with the settings
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = ShaderDemo)
+	bool bAnimate;
+
 	TUniquePtr<FWhiteNoiseCSManager> WhiteNoiseManager;
 	
 	uint32 TimeStamp;
+
+	// What the noise is written to, RenderTarget or the transient render target in OutputFormat
+	UFUNCTION(BlueprintPure, Category = ShaderDemo)
+	class UTextureRenderTarget2D* GetOutputRenderTarget() const { return TransientRenderTarget ? TransientRenderTarget : RenderTarget; }
+
+	// Timings of the noise graph this actor is rendered in, shared with every other noise actor
+	UFUNCTION(BlueprintPure, Category = ShaderDemo)
+	TArray<FComputeShaderFrameTiming> GetNoiseFrameTimings() const;
 	
 protected:
+	// Created on BeginPlay when RenderTarget isn't in OutputFormat
+	UPROPERTY(Transient)
+	class UTextureRenderTarget2D* TransientRenderTarget;
+
 	// Called when the game starts or when spawned
 	virtual void BeginPlay() override;
 